@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Linux native AIO (io_submit) binding for O_DIRECT devices on kernels
+   without a usable io_uring. Like uring_stubs.c this uses the system calls
+   directly rather than libaio. Requests are queued by the prep_* functions,
+   passed to the kernel in a single io_submit and completions are signalled on
+   an eventfd via IOCB_FLAG_RESFD. */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <linux/aio_abi.h>
+#define HAVE_LINUX_AIO
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <limits.h>
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 16 /* never used */
+#endif
+
+#ifdef HAVE_LINUX_AIO
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+#include <caml/unixsupport.h>
+
+#ifdef HAVE_LINUX_AIO
+
+/* Every iocb carries one of these as its aio_data. It keeps the iovec alive
+   until the kernel has finished with it and records the OCaml id. */
+struct aio_req {
+  intnat id;
+  struct iocb iocb;
+  struct iovec iovec[];
+};
+
+struct aio {
+  aio_context_t ctx;
+  int event_fd;
+  int nr_events;
+  /* requests queued by prep_* but not yet accepted by io_submit */
+  struct iocb **queued;
+  int nr_queued;
+  /* requests io_submit rejected, reported by the next reap */
+  struct aio_req **failed;
+  int *failed_errno;
+  int nr_failed;
+  struct io_event *events;
+};
+
+#define Aio_val(v) (*((struct aio **) Data_custom_val(v)))
+
+static void aio_release(struct aio *a)
+{
+  int i;
+  if (a->ctx) syscall(__NR_io_destroy, a->ctx);
+  a->ctx = 0;
+  for (i = 0; i < a->nr_queued; i++)
+    free((struct aio_req *)(uintptr_t)a->queued[i]->aio_data);
+  a->nr_queued = 0;
+  for (i = 0; i < a->nr_failed; i++)
+    free(a->failed[i]);
+  a->nr_failed = 0;
+}
+
+static void aio_finalize(value v)
+{
+  struct aio *a = Aio_val(v);
+  if (a) {
+    aio_release(a);
+    free(a->queued);
+    free(a->failed);
+    free(a->failed_errno);
+    free(a->events);
+    free(a);
+  }
+}
+
+static struct custom_operations aio_ops = {
+  "org.mirage.block.unix.aio",
+  aio_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+static struct aio *aio_of_value(value v)
+{
+  struct aio *a = Aio_val(v);
+  if (a->ctx == 0) unix_error(EBADF, "io_submit", Nothing);
+  return a;
+}
+
+static value aio_prep_rw(int opcode, value ctx, value fd, value val_list, value offset, value id)
+{
+  CAMLparam5(ctx, fd, val_list, offset, id);
+  CAMLlocal5(next, head, val_buf, val_ofs, val_len);
+  struct aio *a = aio_of_value(ctx);
+  struct aio_req *req;
+  int i, n = 0;
+  if (a->nr_queued == a->nr_events) CAMLreturn(Val_false);
+  for (next = val_list; next != Val_emptylist; next = Field(next, 1))
+    n++;
+  /* Only copy up to IOV_MAX; the caller resubmits the remainder */
+  if (n > IOV_MAX)
+    n = IOV_MAX;
+  req = calloc(1, sizeof(struct aio_req) + n * sizeof(struct iovec));
+  if (req == NULL) caml_raise_out_of_memory();
+  req->id = Long_val(id);
+  next = val_list;
+  for (i = 0; i < n; i++) {
+    head = Field(next, 0);
+    val_buf = Field(head, 0);
+    val_ofs = Field(head, 1);
+    val_len = Field(head, 2);
+    req->iovec[i].iov_base = (char*)Caml_ba_data_val(val_buf) + Long_val(val_ofs);
+    req->iovec[i].iov_len = Long_val(val_len);
+    next = Field(next, 1);
+  }
+  req->iocb.aio_data = (uint64_t)(uintptr_t)req;
+  req->iocb.aio_lio_opcode = opcode;
+  req->iocb.aio_fildes = Int_val(fd);
+  req->iocb.aio_buf = (uint64_t)(uintptr_t)req->iovec;
+  req->iocb.aio_nbytes = n;
+  req->iocb.aio_offset = Int64_val(offset);
+  req->iocb.aio_flags = IOCB_FLAG_RESFD;
+  req->iocb.aio_resfd = a->event_fd;
+  a->queued[a->nr_queued++] = &req->iocb;
+  CAMLreturn(Val_true);
+}
+
+#endif /* HAVE_LINUX_AIO */
+
+CAMLprim value mirage_block_unix_aio_create(value nr_events)
+{
+  CAMLparam1(nr_events);
+  CAMLlocal1(result);
+#ifdef HAVE_LINUX_AIO
+  struct aio *a = calloc(1, sizeof(struct aio));
+  int n = Int_val(nr_events);
+  if (a == NULL) caml_raise_out_of_memory();
+  a->nr_events = n;
+  a->event_fd = -1;
+  a->queued = calloc(n, sizeof(struct iocb *));
+  a->failed = calloc(n, sizeof(struct aio_req *));
+  a->failed_errno = calloc(n, sizeof(int));
+  a->events = calloc(n, sizeof(struct io_event));
+  if (!a->queued || !a->failed || !a->failed_errno || !a->events) {
+    free(a->queued);
+    free(a->failed);
+    free(a->failed_errno);
+    free(a->events);
+    free(a);
+    caml_raise_out_of_memory();
+  }
+  if (syscall(__NR_io_setup, n, &a->ctx) == -1) {
+    int errno_copy = errno;
+    a->ctx = 0;
+    free(a->queued);
+    free(a->failed);
+    free(a->failed_errno);
+    free(a->events);
+    free(a);
+    unix_error(errno_copy, "io_setup", Nothing);
+  }
+  result = caml_alloc_custom(&aio_ops, sizeof(struct aio *), 0, 1);
+  Aio_val(result) = a;
+  CAMLreturn(result);
+#else
+  unix_error(ENOSYS, "io_setup", Nothing);
+#endif
+}
+
+CAMLprim value mirage_block_unix_aio_eventfd(value ctx)
+{
+  CAMLparam1(ctx);
+#ifdef HAVE_LINUX_AIO
+  struct aio *a = aio_of_value(ctx);
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1) uerror("eventfd", Nothing);
+  a->event_fd = fd;
+  CAMLreturn(Val_int(fd));
+#else
+  caml_failwith("Linux AIO is not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_aio_close(value ctx)
+{
+  CAMLparam1(ctx);
+#ifdef HAVE_LINUX_AIO
+  aio_release(Aio_val(ctx));
+#endif
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value mirage_block_unix_aio_prep_readv(value ctx, value fd, value val_list, value offset, value id)
+{
+#ifdef HAVE_LINUX_AIO
+  return aio_prep_rw(IOCB_CMD_PREADV, ctx, fd, val_list, offset, id);
+#else
+  caml_failwith("Linux AIO is not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_aio_prep_writev(value ctx, value fd, value val_list, value offset, value id)
+{
+#ifdef HAVE_LINUX_AIO
+  return aio_prep_rw(IOCB_CMD_PWRITEV, ctx, fd, val_list, offset, id);
+#else
+  caml_failwith("Linux AIO is not supported on this platform");
+#endif
+}
+
+/* Drop every iocb which hasn't been passed to io_submit, storing up to
+   (Array.length ids) of their ids in [ids] */
+CAMLprim value mirage_block_unix_aio_withdraw(value ctx, value ids)
+{
+  CAMLparam2(ctx, ids);
+#ifdef HAVE_LINUX_AIO
+  struct aio *a = aio_of_value(ctx);
+  mlsize_t max = Wosize_val(ids);
+  mlsize_t n = 0;
+  int i;
+  for (i = 0; i < a->nr_queued; i++) {
+    struct aio_req *req = (struct aio_req *)(uintptr_t)a->queued[i]->aio_data;
+    if (n < max) Store_field(ids, n++, Val_long(req->id));
+    free(req);
+  }
+  a->nr_queued = 0;
+  CAMLreturn(Val_long(n));
+#else
+  caml_failwith("Linux AIO is not supported on this platform");
+#endif
+}
+
+/* Pass every queued iocb to the kernel. io_submit stops at the first iocb it
+   rejects: that request is moved to the failed list and the eventfd is
+   signalled so the error is delivered by the next reap. */
+CAMLprim value mirage_block_unix_aio_submit(value ctx)
+{
+  CAMLparam1(ctx);
+#ifdef HAVE_LINUX_AIO
+  struct aio *a = aio_of_value(ctx);
+  int submitted = 0;
+  int ret;
+  uint64_t one = 1;
+  while (submitted < a->nr_queued) {
+    ret = syscall(__NR_io_submit, a->ctx, a->nr_queued - submitted, a->queued + submitted);
+    if (ret == -1) {
+      if (errno == EAGAIN || errno == EINTR) break;
+      a->failed[a->nr_failed] = (struct aio_req *)(uintptr_t)a->queued[submitted]->aio_data;
+      a->failed_errno[a->nr_failed] = errno;
+      a->nr_failed++;
+      submitted++;
+      if (write(a->event_fd, &one, sizeof(one)) == -1) { /* already signalled */ }
+    } else {
+      submitted += ret;
+    }
+  }
+  memmove(a->queued, a->queued + submitted, (a->nr_queued - submitted) * sizeof(struct iocb *));
+  a->nr_queued -= submitted;
+  CAMLreturn(Val_int(submitted));
+#else
+  caml_failwith("Linux AIO is not supported on this platform");
+#endif
+}
+
+/* Copy up to (Array.length results / 2) completions into [results] as
+   (id, result) pairs where a negative result is -errno. Never blocks. */
+CAMLprim value mirage_block_unix_aio_reap(value ctx, value results)
+{
+  CAMLparam2(ctx, results);
+#ifdef HAVE_LINUX_AIO
+  struct aio *a = aio_of_value(ctx);
+  long max = Wosize_val(results) / 2;
+  long n = 0, got, i;
+  struct timespec zero = { 0, 0 };
+  struct aio_req *req;
+  while (a->nr_failed > 0 && n < max) {
+    a->nr_failed--;
+    req = a->failed[a->nr_failed];
+    Store_field(results, 2 * n, Val_long(req->id));
+    Store_field(results, 2 * n + 1, Val_int(-a->failed_errno[a->nr_failed]));
+    free(req);
+    n++;
+  }
+  if (n < max) {
+    if (max - n > a->nr_events) got = a->nr_events; else got = max - n;
+    got = syscall(__NR_io_getevents, a->ctx, 0, got, a->events, &zero);
+    /* On error leave the events in the kernel for the next reap */
+    if (got == -1) got = 0;
+    for (i = 0; i < got; i++) {
+      req = (struct aio_req *)(uintptr_t)a->events[i].data;
+      Store_field(results, 2 * n, Val_long(req->id));
+      Store_field(results, 2 * n + 1, Val_long(a->events[i].res));
+      free(req);
+      n++;
+    }
+  }
+  CAMLreturn(Val_long(n));
+#else
+  caml_failwith("Linux AIO is not supported on this platform");
+#endif
+}
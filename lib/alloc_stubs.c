@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Page-aligned bigarrays for O_DIRECT I/O. Cstruct.create makes no promise
+   about alignment, so buffers which the library reads into itself are
+   allocated here instead. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+CAMLprim value mirage_block_unix_alloc_aligned(value val_align, value val_len)
+{
+  CAMLparam2(val_align, val_len);
+  CAMLlocal1(result);
+  size_t align = Long_val(val_align);
+  intnat len = Long_val(val_len);
+#ifdef _WIN32
+  /* There is no O_DIRECT on Win32 and memory from _aligned_malloc cannot be
+     released by free(), so let the runtime allocate it. */
+  (void)align;
+  result = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, len);
+#else
+  void *data = NULL;
+  if (posix_memalign(&data, align, len == 0 ? 1 : len) != 0)
+    caml_raise_out_of_memory();
+  result = caml_ba_alloc_dims(CAML_BA_UINT8 | CAML_BA_C_LAYOUT | CAML_BA_MANAGED, 1, data, len);
+#endif
+  CAMLreturn(result);
+}
@@ -21,6 +21,7 @@
 #endif
 
 #include <fcntl.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
@@ -32,6 +33,8 @@
 #include <caml/callback.h>
 #include <caml/bigarray.h>
 
+#include "lwt_unix.h"
+
 #ifdef __linux__
 #include <linux/fs.h>
 
@@ -77,7 +80,9 @@ int blkgetsize(int fd, uint64_t *psize)
 
 int blkgetsectorsize(int fd, int *size)
 {
-  int ret = ioctl(fd, DKIOCGETBLOCKSIZE, &size);
+  uint32_t blocksize = 0;
+  int ret = ioctl(fd, DKIOCGETBLOCKSIZE, &blocksize);
+  *size = (int)blocksize;
   return ret;
 }
 
@@ -92,7 +97,9 @@ int blkgetsize(int fd, uint64_t *psize)
 
 int blkgetsectorsize(int fd, int *size)
 {
-  int ret = ioctl(fd, DIOCGSECTORSIZE, &size);
+  u_int sectorsize = 0;
+  int ret = ioctl(fd, DIOCGSECTORSIZE, &sectorsize);
+  *size = (int)sectorsize;
   return ret;
 }
 
@@ -114,6 +121,7 @@ int blkgetsectorsize(int fd, int *size)
 
 /* ocaml/ocaml/unixsupport.c */
 extern void uerror(char *cmdname, value cmdarg);
+extern void unix_error(int errcode, char *cmdname, value cmdarg);
 #define Nothing ((value) 0)
 
 CAMLprim value stub_blkgetsize(value fd){
@@ -134,19 +142,53 @@ CAMLprim value stub_blkgetsize(value fd){
   CAMLreturn(result);
 }
 
-CAMLprim value stub_blkgetsectorsize(value fd){
-  CAMLparam1(fd);
-  CAMLlocal1(result);
-  int size;
-  int c_fd = Int_val(fd); /* safe only because Unix.file_descr = int */
-  int success = -1;
-
-  enter_blocking_section();
-  if (blkgetsectorsize(c_fd, &size) == 0)
-    success = 0;
-  leave_blocking_section();
+struct job_size {
+  struct lwt_unix_job job;
+  int fd;
+  uint64_t size;
+  int errno_copy;
+  const char *error_fn;
+};
+
+/* The current size of a file or block device, which may have changed
+   since it was opened */
+static void worker_size(struct job_size *job)
+{
+  struct stat st;
+  job->errno_copy = 0;
+  if (fstat(job->fd, &st) == -1) {
+    job->errno_copy = errno;
+    job->error_fn = "fstat";
+  } else if (S_ISBLK(st.st_mode)) {
+    if (blkgetsize(job->fd, &job->size) == -1) {
+      job->errno_copy = errno;
+      job->error_fn = "BLKGETSIZE";
+    }
+  } else {
+    job->size = st.st_size;
+  }
+}
 
-  if (success == -1) uerror("blkgetsectorsize", Nothing);
+static value result_size(struct job_size *job)
+{
+  CAMLparam0();
+  CAMLlocal1(result);
+  int errno_copy = job->errno_copy;
+  const char *error_fn = job->error_fn;
+  uint64_t size = job->size;
+  lwt_unix_free_job(&job->job);
+  if (errno_copy != 0) unix_error(errno_copy, (char *)error_fn, Nothing);
+  result = caml_copy_int64(size);
+  CAMLreturn(result);
+}
 
-  CAMLreturn(Val_int(size));
+CAMLprim value mirage_block_unix_size_job(value fd)
+{
+  CAMLparam1(fd);
+  LWT_UNIX_INIT_JOB(job, size, 0);
+  job->fd = Int_val(fd);
+  job->size = 0;
+  job->errno_copy = 0;
+  job->error_fn = "";
+  CAMLreturn(lwt_unix_alloc_job(&(job->job)));
 }
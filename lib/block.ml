@@ -39,25 +39,55 @@ module Log = (val Logs.src_log src : Logs.LOG)
 let is_win32 = Sys.os_type = "Win32"
 
 module Raw = struct
-  external openfile_unbuffered: string -> bool -> int -> Unix.file_descr = "stub_openfile_direct"
   let openfile_buffered name rw perm =
     Unix.openfile name [ if rw then Unix.O_RDWR else Unix.O_RDONLY ] perm
 
+  type kind = File | Device | Other
+
+  (* A file opened, locked and probed by [open_job], see odirect_stubs.c *)
+  type opened = {
+    fd: Unix.file_descr;
+    read_write: bool;
+    kind: kind;
+    size_bytes: int64;
+    sector_size: int; (* of a device *)
+    physical_block_size: int; (* of a device, 0 if it doesn't say *)
+    optimal_io_size: int; (* 0 if nothing says *)
+    discard_granularity: int;
+  }
+
+  external open_job: string -> bool (* buffered *) -> bool (* lock *) -> opened Lwt_unix.job = "mirage_block_unix_open_job"
+
   external blkgetsize: Unix.file_descr -> int64 = "stub_blkgetsize"
-  external blkgetsectorsize: Unix.file_descr -> int = "stub_blkgetsectorsize"
 
   external lseek_data : Unix.file_descr -> int64 -> int64 = "stub_lseek_data_64"
 
   external lseek_hole : Unix.file_descr -> int64 -> int64 = "stub_lseek_hole_64"
 
-  type buffer = (char, Bigarray.int8_unsigned_elt, Bigarray.c_layout) Bigarray.Array1.t
-  external writev_job: Unix.file_descr -> (buffer * int * int) list -> int Lwt_unix.job = "mirage_block_unix_writev_job"
-  external readv_job: Unix.file_descr -> (buffer * int * int) list -> int Lwt_unix.job = "mirage_block_unix_readv_job"
+  (* Thread pool jobs store the clock when the worker thread starts and
+     finishes the system call here, if it has 2 elements *)
+  type times = (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t
 
-  external iov_len: unit -> int = "mirage_block_unix_get_iov_len"
+  let no_times : times = Bigarray.Array1.create Bigarray.int64 Bigarray.c_layout 0
+
+  (* A Cstruct.t is a { buffer; off; len } record, which has the same
+     representation as the (buffer, off, len) tuples the C stubs read, so the
+     buffer list is passed without copying it into an iovec list first. *)
+  external pwritev_job: Unix.file_descr -> Cstruct.t list -> int64 -> times -> int Lwt_unix.job = "mirage_block_unix_pwritev_job"
+  external preadv_job: Unix.file_descr -> Cstruct.t list -> int64 -> times -> int Lwt_unix.job = "mirage_block_unix_preadv_job"
 
   external chsize_job: Unix.file_descr -> int64 -> unit Lwt_unix.job = "mirage_block_unix_chsize_job"
 
+  external alloc_aligned: int -> int -> Cstruct.buffer = "mirage_block_unix_alloc_aligned"
+
+  external write_zeroes_job: Unix.file_descr -> int64 -> int64 -> bool -> unit Lwt_unix.job = "mirage_block_unix_write_zeroes_job"
+
+  (* Reserves space without changing the file size, see discard_stubs.c *)
+  external preallocate_job: Unix.file_descr -> int64 -> int64 -> unit Lwt_unix.job = "mirage_block_unix_preallocate_job"
+
+  (* The current size of a file or device, see blkgetsize_stubs.c *)
+  external size_job: Unix.file_descr -> int64 Lwt_unix.job = "mirage_block_unix_size_job"
+
   external flock: Unix.file_descr -> bool (* ex *) -> bool (* nb *) -> unit   = "stub_flock"
 end
 
@@ -85,24 +115,155 @@ module Config = struct
     | Some `ToDrive -> "drive"
     | Some `ToOS -> "os"
 
+  type engine = [
+    | `Threads
+    | `Uring
+    | `Aio
+    | `Workers
+  ]
+
+  let engine_of_string = function
+    | "uring" -> `Uring
+    | "aio" -> `Aio
+    | "workers" -> `Workers
+    | _ -> `Threads
+
+  let string_of_engine = function
+    | `Threads -> "threads"
+    | `Uring -> "uring"
+    | `Aio -> "aio"
+    | `Workers -> "workers"
+
+  type flush_method = [
+    | `Fsync
+    | `Fdatasync
+    | `Sync_file_range
+  ]
+
+  let flush_method_of_string = function
+    | "fdatasync" -> `Fdatasync
+    | "sync_file_range" -> `Sync_file_range
+    | _ -> `Fsync
+
+  let string_of_flush_method = function
+    | `Fsync -> "fsync"
+    | `Fdatasync -> "fdatasync"
+    | `Sync_file_range -> "sync_file_range"
+
+  type detect_zeroes = [
+    | `Off
+    | `On
+    | `Unmap
+  ]
+
+  let detect_zeroes_of_string = function
+    | "on" -> `On
+    | "unmap" -> `Unmap
+    | _ -> `Off
+
+  let string_of_detect_zeroes = function
+    | `Off -> "off"
+    | `On -> "on"
+    | `Unmap -> "unmap"
+
   type t = {
     buffered: bool;
     sync: sync_behaviour option;
     path: string;
     lock: bool;
     prefered_sector_size : int option;
+    engine: engine;
+    queue_depth: int option;
+    merge: bool;
+    readahead: int option;
+    cache: int option;
+    cache_writeback: bool;
+    flush_method: flush_method;
+    extent_map: int option;
+    mmap: bool;
+    workers: int;
+    cpus: int list;
+    numa_node: int option;
+    detect_zeroes: detect_zeroes;
+    dedup_stats: int option;
+    checksums: string option;
+    checksum_verify: int;
+    checksum_block: int option;
+    preallocate: int option;
+    iops_read: int option;
+    iops_write: int option;
+    bps_read: int option;
+    bps_write: int option;
+    throttle_burst: int;
+    throttle_group: string option;
   }
 
   let create ?(buffered = true) ?(sync = Some `ToOS) ?(lock = false)
-      ?(prefered_sector_size = None) path =
-    { buffered; sync; path; lock; prefered_sector_size }
+      ?(prefered_sector_size = None) ?(engine = `Threads) ?(queue_depth = None)
+      ?(merge = true) ?(readahead = None) ?(cache = None) ?(cache_writeback = false)
+      ?(flush_method = `Fsync) ?(extent_map = None) ?(mmap = false) ?(workers = 4)
+      ?(cpus = []) ?(numa_node = None) ?(detect_zeroes = `Off) ?(dedup_stats = None)
+      ?(checksums = None) ?(checksum_verify = 100) ?(checksum_block = None) ?(preallocate = None)
+      ?(iops_read = None) ?(iops_write = None) ?(bps_read = None) ?(bps_write = None)
+      ?(throttle_burst = 1) ?(throttle_group = None) path =
+    { buffered; sync; path; lock; prefered_sector_size; engine; queue_depth; merge;
+      readahead; cache; cache_writeback; flush_method; extent_map; mmap; workers; cpus;
+      numa_node; detect_zeroes; dedup_stats; checksums; checksum_verify; checksum_block; preallocate;
+      iops_read; iops_write; bps_read; bps_write; throttle_burst; throttle_group }
 
   let to_string t =
     let query = [
       "buffered", [ if t.buffered then "1" else "0" ];
       "sync",     [ string_of_sync t.sync ];
       "lock",     [ if t.lock then "1" else "0" ];
-    ] in
+      "engine",   [ string_of_engine t.engine ];
+      "merge",    [ if t.merge then "1" else "0" ];
+      "cache_writeback", [ if t.cache_writeback then "1" else "0" ];
+      "flush",    [ string_of_flush_method t.flush_method ];
+      "mmap",     [ if t.mmap then "1" else "0" ];
+      "workers",  [ string_of_int t.workers ];
+      "detect_zeroes", [ string_of_detect_zeroes t.detect_zeroes ];
+      "checksum_verify", [ string_of_int t.checksum_verify ];
+      "throttle_burst", [ string_of_int t.throttle_burst ];
+    ] @ (match t.queue_depth with
+      | None -> []
+      | Some n -> [ "queue_depth", [ string_of_int n ] ]
+    ) @ (match t.readahead with
+      | None -> []
+      | Some n -> [ "readahead", [ string_of_int n ] ]
+    ) @ (match t.cache with
+      | None -> []
+      | Some n -> [ "cache", [ string_of_int n ] ]
+    ) @ (match t.extent_map with
+      | None -> []
+      | Some n -> [ "extent_map", [ string_of_int n ] ]
+    ) @ (match t.cpus with
+      | [] -> []
+      | cpus -> [ "cpus", [ Block_workers.string_of_cpus cpus ] ]
+    ) @ (match t.numa_node with
+      | None -> []
+      | Some n -> [ "numa_node", [ string_of_int n ] ]
+    ) @ (match t.dedup_stats with
+      | None -> []
+      | Some n -> [ "dedup_stats", [ string_of_int n ] ]
+    ) @ (match t.checksums with
+      | None -> []
+      | Some path -> [ "checksums", [ path ] ]
+    ) @ (match t.checksum_block with
+      | None -> []
+      | Some n -> [ "checksum_block", [ string_of_int n ] ]
+    ) @ (match t.preallocate with
+      | None -> []
+      | Some n -> [ "preallocate", [ string_of_int n ] ]
+    ) @ (List.concat (List.map (fun (key, limit) -> match limit with
+        | None -> []
+        | Some n -> [ key, [ string_of_int n ] ]
+      ) [ "iops_read", t.iops_read; "iops_write", t.iops_write;
+          "bps_read", t.bps_read; "bps_write", t.bps_write ])
+    ) @ (match t.throttle_group with
+      | None -> []
+      | Some name -> [ "throttle_group", [ name ] ]
+    ) in
     let u = Uri.make ~scheme:"file" ~path:t.path ~query () in
     Uri.to_string u
 
@@ -117,12 +278,208 @@ module Config = struct
       let prefered_sector_size =
         try Some (int_of_string @@ List.hd @@ List.assoc "prefered_sector_size" query) with Not_found -> None
       in
+      let engine   = try engine_of_string @@ List.hd @@ List.assoc "engine" query with Not_found -> `Threads in
+      let queue_depth =
+        try Some (int_of_string @@ List.hd @@ List.assoc "queue_depth" query) with Not_found | Failure _ -> None
+      in
+      let merge    = try List.assoc "merge" query = [ "1" ] with Not_found -> true in
+      let readahead =
+        try Some (int_of_string @@ List.hd @@ List.assoc "readahead" query) with Not_found | Failure _ -> None
+      in
+      let cache =
+        try Some (int_of_string @@ List.hd @@ List.assoc "cache" query) with Not_found | Failure _ -> None
+      in
+      let cache_writeback = try List.assoc "cache_writeback" query = [ "1" ] with Not_found -> false in
+      let flush_method = try flush_method_of_string @@ List.hd @@ List.assoc "flush" query with Not_found -> `Fsync in
+      let extent_map =
+        try Some (int_of_string @@ List.hd @@ List.assoc "extent_map" query) with Not_found | Failure _ -> None
+      in
+      let mmap     = try List.assoc "mmap" query = [ "1" ] with Not_found -> false in
+      let workers  =
+        try int_of_string @@ List.hd @@ List.assoc "workers" query with Not_found | Failure _ -> 4
+      in
+      let cpus =
+        try Block_workers.cpus_of_string @@ List.hd @@ List.assoc "cpus" query with Not_found | Failure _ -> []
+      in
+      let numa_node =
+        try Some (int_of_string @@ List.hd @@ List.assoc "numa_node" query) with Not_found | Failure _ -> None
+      in
+      let detect_zeroes =
+        try detect_zeroes_of_string @@ List.hd @@ List.assoc "detect_zeroes" query with Not_found -> `Off
+      in
+      let dedup_stats =
+        try Some (int_of_string @@ List.hd @@ List.assoc "dedup_stats" query) with Not_found | Failure _ -> None
+      in
+      let checksums = try Some (List.hd @@ List.assoc "checksums" query) with Not_found | Failure _ -> None in
+      let checksum_verify =
+        try int_of_string @@ List.hd @@ List.assoc "checksum_verify" query with Not_found | Failure _ -> 100
+      in
+      let checksum_block =
+        try Some (int_of_string @@ List.hd @@ List.assoc "checksum_block" query) with Not_found | Failure _ -> None
+      in
+      let preallocate =
+        try Some (int_of_string @@ List.hd @@ List.assoc "preallocate" query) with Not_found | Failure _ -> None
+      in
+      let limit key =
+        try Some (int_of_string @@ List.hd @@ List.assoc key query) with Not_found | Failure _ -> None in
+      let iops_read = limit "iops_read" and iops_write = limit "iops_write" in
+      let bps_read = limit "bps_read" and bps_write = limit "bps_write" in
+      let throttle_burst =
+        try int_of_string @@ List.hd @@ List.assoc "throttle_burst" query with Not_found | Failure _ -> 1
+      in
+      let throttle_group = try Some (List.hd @@ List.assoc "throttle_group" query) with Not_found | Failure _ -> None in
       let path = Uri.(pct_decode @@ path u) in
-      Ok { buffered; sync; path; lock; prefered_sector_size }
+      Ok { buffered; sync; path; lock; prefered_sector_size; engine; queue_depth; merge;
+           readahead; cache; cache_writeback; flush_method; extent_map; mmap; workers; cpus;
+           numa_node; detect_zeroes; dedup_stats; checksums; checksum_verify; checksum_block; preallocate;
+           iops_read; iops_write; bps_read; bps_write; throttle_burst; throttle_group }
+    | _ ->
+      Error (`Msg "Config.to_string expected a string of the form file://<path>?sync=(none|os|drive)&buffered=(0|1)&lock=(0|1)&engine=(threads|uring|aio|workers)&queue_depth=<n>&merge=(0|1)&readahead=<bytes>&cache=<bytes>&cache_writeback=(0|1)&flush=(fsync|fdatasync|sync_file_range)&extent_map=<bytes>&mmap=(0|1)&workers=<n>&cpus=<list>&numa_node=<n>&detect_zeroes=(off|on|unmap)&dedup_stats=<bytes>&checksums=<path>&checksum_verify=<percent>&checksum_block=<bytes>&preallocate=<bytes>&iops_read=<n>&iops_write=<n>&bps_read=<bytes>&bps_write=<bytes>&throttle_burst=<seconds>&throttle_group=<name>")
+end
+
+(* When [queue_depth] is set, reads and writes wait in separate queues and at
+   most [depth] are passed to the engine at once. Reads are dispatched first
+   but a waiting write is never passed over more than [max_reads_in_a_row]
+   times. With [merge], a request is sent together with the requests queued
+   behind it which continue exactly where it ends, as one vectored request.
+   As with a real disk, overlapping requests in flight at the same time
+   complete in no particular order. *)
+module Scheduler = struct
+  type request = {
+    offset: int64;
+    length: int;
+    buffers: Cstruct.t list;
+    perform: int64 -> Cstruct.t list -> unit Lwt.t;
+    wakener: unit Lwt.u;
+  }
+
+  type t = {
+    depth: int;
+    merge: bool;
+    reads: request Queue.t;
+    writes: request Queue.t;
+    mutable in_flight: int;
+    mutable reads_in_a_row: int;
+  }
+
+  let max_reads_in_a_row = 4
+
+  let max_merge_bytes = 1 lsl 20
+
+  let create ~depth ~merge = {
+    depth = max 1 depth; merge; reads = Queue.create (); writes = Queue.create ();
+    in_flight = 0; reads_in_a_row = 0;
+  }
+
+  let next_queue t =
+    match Queue.is_empty t.reads, Queue.is_empty t.writes with
+    | true, true -> None
+    | false, true ->
+      t.reads_in_a_row <- 0;
+      Some t.reads
+    | true, false ->
+      t.reads_in_a_row <- 0;
+      Some t.writes
+    | false, false ->
+      if t.reads_in_a_row >= max_reads_in_a_row then begin
+        t.reads_in_a_row <- 0;
+        Some t.writes
+      end else begin
+        t.reads_in_a_row <- t.reads_in_a_row + 1;
+        Some t.reads
+      end
+
+  (* The head of [q] followed by any requests which can be merged with it *)
+  let take t q =
+    let first = Queue.pop q in
+    let rec loop acc length =
+      if not t.merge || Queue.is_empty q then List.rev acc else begin
+        let next = Queue.peek q in
+        if next.offset = Int64.(add first.offset (of_int length))
+        && length + next.length <= max_merge_bytes then begin
+          ignore (Queue.pop q);
+          loop (next :: acc) (length + next.length)
+        end else List.rev acc
+      end in
+    loop [ first ] first.length
+
+  let rec dispatch t =
+    if t.in_flight < t.depth then match next_queue t with
+      | None -> ()
+      | Some q ->
+        let batch = take t q in
+        let first = List.hd batch in
+        let buffers = List.concat (List.map (fun r -> r.buffers) batch) in
+        t.in_flight <- t.in_flight + 1;
+        Lwt.async (fun () ->
+          Lwt.try_bind
+            (fun () -> first.perform first.offset buffers)
+            (fun () ->
+              List.iter (fun r -> Lwt.wakeup_later r.wakener ()) batch;
+              Lwt.return_unit)
+            (fun e ->
+              List.iter (fun r -> Lwt.wakeup_later_exn r.wakener e) batch;
+              Lwt.return_unit)
+          >|= fun () ->
+          t.in_flight <- t.in_flight - 1;
+          dispatch t
+        );
+        dispatch t
+
+  let submit t op perform offset buffers =
+    let th, wakener = Lwt.wait () in
+    let length = List.fold_left (fun acc b -> acc + Cstruct.len b) 0 buffers in
+    let q = match op with `Read -> t.reads | `Write -> t.writes in
+    Queue.push { offset; length; buffers; perform; wakener } q;
+    dispatch t;
+    th
+end
+
+(* Group commit: a flush which arrives while another is in flight cannot
+   share it, because the barrier may have started before the caller's writes
+   completed. Instead it waits for the next barrier, which is shared by every
+   flush that arrives in the meantime. *)
+module Group_commit = struct
+  type t = {
+    mutable in_flight: unit Lwt.t option;
+    mutable next: unit Lwt.t option;
+  }
+
+  let create () = { in_flight = None; next = None }
+
+  let rec flush t barrier =
+    match t.in_flight with
+    | Some current when Lwt.state current = Lwt.Sleep ->
+      begin match t.next with
+        | Some next -> next
+        | None ->
+          let next =
+            Lwt.catch (fun () -> current) (fun _ -> Lwt.return_unit)
+            >>= fun () ->
+            t.next <- None;
+            flush t barrier in
+          t.next <- Some next;
+          next
+      end
     | _ ->
-      Error (`Msg "Config.to_string expected a string of the form file://<path>?sync=(none|os|drive)&buffered=(0|1)&lock=(0|1)")
+      let th = Lwt.apply barrier () in
+      t.in_flight <- Some th;
+      th
 end
 
+(* How requests reach the kernel *)
+type engine =
+  | Threads (* one Lwt_unix job on the shared thread pool per request *)
+  | Uring of Block_uring.t
+  | Aio of Block_aio.t (* reads and writes only *)
+  | Workers of Block_workers.t (* the device's own threads *)
+
+type geometry = {
+  physical_block_size: int;
+  optimal_io_size: int;
+  discard_granularity: int;
+}
+
 type t = {
   mutable fd: Lwt_unix.file_descr option;
   mutable seek_offset: int64;
@@ -130,9 +487,30 @@ type t = {
      unnecessarily, speeding up sequential read and write *)
   m: Lwt_mutex.t;
   mutable info: Mirage_block.info;
-  size_bytes: int64; (* used to handle the last sector, if the file isn't a multiple *)
+  mutable size_bytes: int64; (* used to handle the last sector, if the file isn't a multiple *)
+  resizing: Lwt_mutex.t; (* serialises [resize] and [refresh_size] *)
+  mutable requests: int; (* in progress, see [with_request] *)
+  mutable shrink_to: int64 option; (* sectors, while a shrink waits or runs *)
+  gate: unit Lwt_condition.t; (* signalled when [requests] or [shrink_to] changes *)
+  mutable allocated: int64; (* bytes reserved by [preallocate] *)
+  mutable preallocate: int option; (* cleared if the filesystem can't *)
   config: Config.t;
   use_fsync_after_write: bool;
+  engine: engine;
+  scheduler: Scheduler.t option; (* None means requests go straight to the engine *)
+  readahead: Block_readahead.t option;
+  cache: Block_cache.t option;
+  flusher: Group_commit.t;
+  extent_map: Block_extents.t option;
+  discards: Block_discard.t;
+  mapping: Block_mmap.t option; (* reads are copies from here if set *)
+  stats: Block_stats.t;
+  mutable trace: Block_trace.t option;
+  fingerprints: (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t option;
+  (* recent sector fingerprints, for [dedup_stats] *)
+  checksums: Block_checksum.t option;
+  geometry: geometry;
+  throttle: Block_throttle.t option; (* reads and writes wait here first *)
 }
 
 let to_config x = x.config
@@ -141,82 +519,195 @@ let (>>*=) m f = m >>= function
   | Ok x -> f x
   | Error x -> Lwt.return (Error x)
 
-let stat _filename fd =
-  Rresult.R.trap_exn Unix.LargeFile.fstat fd |> Rresult.R.error_exn_trap_to_msg |> Lwt.return
-
 let blkgetsize _filename fd =
   Rresult.R.trap_exn Raw.blkgetsize fd |> Rresult.R.error_exn_trap_to_msg
 
-let blkgetsectorsize fd =
-  Rresult.R.trap_exn Raw.blkgetsectorsize fd |> Rresult.R.error_exn_trap_to_msg
-
-let get_file_size filename fd =
-  stat filename fd >>*= fun st ->
-  match st.Unix.LargeFile.st_kind with
-  | Unix.S_REG -> Lwt.return @@ Ok st.Unix.LargeFile.st_size
-  | Unix.S_BLK -> Lwt.return @@ blkgetsize () fd
-  | _ ->
-    Log.err (fun f -> f "get_file_size %s: entity is neither a file nor a block device" filename);
-    Lwt.return @@ Error
-      (`Msg
-         (Printf.sprintf "get_file_size %s: neither a file nor a block device" filename))
-
-let get_sector_size ?(prefered_sector_size = 512) filename fd =
-  stat filename fd >>*= fun st ->
-  match st.Unix.LargeFile.st_kind with
-  | Unix.S_REG -> Lwt.return @@ Ok prefered_sector_size
-  | Unix.S_BLK -> Lwt.return @@ blkgetsectorsize fd
-  | _ ->
-    Log.err (fun f -> f "get_sector_size %s: entity is neither a file nor a block device" filename);
-    Lwt.return @@ Error
-      (`Msg
-         (Printf.sprintf "get_sector_size %s: neither a file nor a block device" filename))
-
-let of_config ({ Config.buffered; path; lock; sync = _; prefered_sector_size } as config) =
-  let openfile, use_fsync_after_write = match buffered, is_win32 with
-    | true, _ -> Raw.openfile_buffered, false
-    | false, false -> Raw.openfile_unbuffered, false
-    | false, true ->
-      (* We can't use O_DIRECT or F_NOCACHE on Win32, so for now
-         we will use `fsync` after every write. *)
-      Raw.openfile_buffered, true in
-  (* first try read/write and then fall back to read/only *)
-  try
-    let fd, read_write =
+(* Open [path], read/write if possible, take the lock and probe its size and
+   geometry. This is one job on the thread pool, except on Win32 where the
+   file is opened synchronously and has no geometry. *)
+let open_file path ~buffered ~lock =
+  if not is_win32 then Lwt_unix.run_job (Raw.open_job path buffered lock)
+  else Lwt.wrap (fun () ->
+      (* We can't use O_DIRECT or F_NOCACHE on Win32 *)
+      let fd, read_write =
+        try Raw.openfile_buffered path true 0o0, true
+        with _ -> Raw.openfile_buffered path false 0o0, false in
       try
-        openfile path true 0o0, true
-      with _ ->
-        openfile path false 0o0, false in
-    (* Acquire an exclusive lock if in read/write mode, otherwise a shared lock *)
-    if lock then Raw.flock fd read_write true;
-
-    get_file_size path fd >>= function
-    | Error (`Msg e) ->
-      Unix.close fd;
-      fail_with e
-    | Error _ -> fail_with "mirage-block-unix:of_config: unknown error"
-    | Ok size_bytes ->
-      get_sector_size ?prefered_sector_size path fd >>= function
-      | Error (`Msg e) ->
+        if lock then Raw.flock fd read_write true;
+        let st = Unix.LargeFile.fstat fd in
+        { Raw.fd; read_write;
+          kind = if st.Unix.LargeFile.st_kind = Unix.S_REG then Raw.File else Raw.Other;
+          size_bytes = st.Unix.LargeFile.st_size; sector_size = 0; physical_block_size = 0;
+          optimal_io_size = 0; discard_granularity = 0 }
+      with e ->
         Unix.close fd;
-        fail_with e
-      | Error _ -> fail_with "mirage-block-unix:of_config: unknown error"
-      | Ok sector_size ->
-        (* If the file length is not sector-aligned, we would like to represent the
-           last bytes as a sector with zero-padding. Unfortunately on Linux with
-           O_DIRECT `read` will fail with EINVAL. *)
-        let size_sectors = Int64.(div (add size_bytes (of_int (sector_size-1))) (of_int sector_size)) in
-        if Int64.(mul size_sectors (of_int sector_size)) > size_bytes && not(buffered)
-        then Log.warn (fun f -> f "Length not sector aligned: O_DIRECT will fail with EINVAL on some platforms");
-        let fd = Lwt_unix.of_unix_file_descr fd in
-        let m = Lwt_mutex.create () in
-        let seek_offset = 0L in
-        return ({ fd = Some fd; seek_offset; m;
-                  info = { Mirage_block.sector_size; size_sectors; read_write };
-                  size_bytes; config; use_fsync_after_write })
-  with _ ->
-    Log.err (fun f -> f "connect %s: failed to open file" path);
-    fail_with (Printf.sprintf "connect %s: failed to open file" path)
+        raise e)
+
+(* The CPUs of [numa_node] if it is set, otherwise [cpus] *)
+let worker_cpus path cpus = function
+  | None -> cpus
+  | Some node ->
+    begin
+      try Block_workers.numa_node_cpus node
+      with e ->
+        Log.warn (fun f -> f "connect %s: NUMA node %d unavailable (%s), using cpus" path node (Printexc.to_string e));
+        cpus
+    end
+
+let engine_of_config path buffered ~workers ~cpus = function
+  | `Threads -> Threads
+  | `Workers ->
+    begin
+      try Workers (Block_workers.create ~threads:workers ~cpus ())
+      with e ->
+        Log.warn (fun f -> f "connect %s: worker threads unavailable (%s), falling back to threads" path (Printexc.to_string e));
+        Threads
+    end
+  | `Uring ->
+    begin
+      try Uring (Block_uring.create ())
+      with e ->
+        Log.warn (fun f -> f "connect %s: io_uring unavailable (%s), falling back to threads" path (Printexc.to_string e));
+        Threads
+    end
+  | `Aio when buffered ->
+    (* io_submit blocks until the I/O has completed unless the file was
+       opened with O_DIRECT, which would stall the Lwt main loop *)
+    Log.warn (fun f -> f "connect %s: Linux AIO requires buffered=false, falling back to threads" path);
+    Threads
+  | `Aio ->
+    begin
+      try Aio (Block_aio.create ())
+      with e ->
+        Log.warn (fun f -> f "connect %s: Linux AIO unavailable (%s), falling back to threads" path (Printexc.to_string e));
+        Threads
+    end
+
+let of_config ({ Config.buffered; path; lock; sync; prefered_sector_size; engine;
+                 queue_depth; merge; readahead; cache; cache_writeback; flush_method;
+                 extent_map; mmap; workers; cpus; numa_node; dedup_stats; checksums;
+                 checksum_verify; checksum_block; preallocate; iops_read; iops_write; bps_read;
+                 bps_write; throttle_burst; throttle_group; _ } as config) =
+  (* We can't use O_DIRECT or F_NOCACHE on Win32, so for now
+     we will use `fsync` after every write. *)
+  let use_fsync_after_write = is_win32 && not buffered in
+  Lwt.catch
+    (fun () -> open_file path ~buffered ~lock)
+    (fun e ->
+       Log.err (fun f -> f "connect %s: failed to open file: %s" path (Printexc.to_string e));
+       fail_with (Printf.sprintf "connect %s: failed to open file" path))
+  >>= fun opened ->
+  let fd = opened.Raw.fd and read_write = opened.Raw.read_write in
+  match opened.Raw.kind with
+  | Raw.Other ->
+    Log.err (fun f -> f "connect %s: entity is neither a file nor a block device" path);
+    Unix.close fd;
+    fail_with (Printf.sprintf "connect %s: neither a file nor a block device" path)
+  | Raw.File | Raw.Device as kind ->
+    let size_bytes = opened.Raw.size_bytes in
+    let sector_size = match kind, prefered_sector_size with
+      | Raw.Device, _ -> opened.Raw.sector_size
+      | _, Some s -> s
+      | _, None -> 512 in
+    (* If the file length is not sector-aligned, we would like to represent the
+       last bytes as a sector with zero-padding. Unfortunately on Linux with
+       O_DIRECT `read` will fail with EINVAL. *)
+    let size_sectors = Int64.(div (add size_bytes (of_int (sector_size-1))) (of_int sector_size)) in
+    if Int64.(mul size_sectors (of_int sector_size)) > size_bytes && not(buffered)
+    then Log.warn (fun f -> f "Length not sector aligned: O_DIRECT will fail with EINVAL on some platforms");
+    let geometry = {
+      physical_block_size = max sector_size opened.Raw.physical_block_size;
+      optimal_io_size = opened.Raw.optimal_io_size;
+      discard_granularity = opened.Raw.discard_granularity;
+    } in
+    let discards =
+      let g = geometry.discard_granularity in
+      Block_discard.create ~granularity:(if g = 0 then 0 else max g sector_size) in
+    let mapping =
+      if not mmap || is_win32 then None
+      else if read_write then begin
+        Log.warn (fun f -> f "connect %s: mmap is only used for read-only files" path);
+        None
+      end else begin
+        try Some (Block_mmap.create fd size_bytes)
+        with e ->
+          Log.warn (fun f -> f "connect %s: not using mmap (%s)" path (Printexc.to_string e));
+          None
+      end in
+    let fd = Lwt_unix.of_unix_file_descr fd in
+    ( match checksums with
+      | None -> Lwt.return None
+      | Some checksums ->
+        Lwt.catch
+          (fun () ->
+             let block = match checksum_block with
+               | Some b -> b
+               | None -> max Block_checksum.default_block geometry.physical_block_size in
+             Block_checksum.connect ~verify:checksum_verify ~block ~sector_size checksums size_sectors
+             >|= fun c -> Some c)
+          (fun e ->
+             Log.err (fun f -> f "connect %s: failed to open the checksums %s: %s"
+                         path checksums (Printexc.to_string e));
+             Lwt_unix.close fd
+             >>= fun () ->
+             fail_with (Printf.sprintf "connect %s: failed to open the checksums %s" path checksums)) )
+    >>= fun checksums ->
+    let m = Lwt_mutex.create () in
+    let seek_offset = 0L in
+    let engine =
+      engine_of_config path buffered ~workers ~cpus:(worker_cpus path cpus numa_node) engine in
+    let scheduler = match queue_depth with
+      | None -> None
+      | Some depth -> Some (Scheduler.create ~depth ~merge) in
+    let readahead = match readahead with
+      | None -> None
+      | Some _ when is_win32 -> None
+      | Some max_window -> Some (Block_readahead.create ~buffered ~sector_size max_window) in
+    let cache = match cache with
+      | None -> None
+      | Some _ when is_win32 -> None
+      | Some bytes ->
+        (* Holding writes back is only allowed if we never promised to
+           put them on the disk *)
+        if cache_writeback && sync <> None
+        then Log.warn (fun f -> f "connect %s: cache_writeback requires sync=none, writing through" path);
+        let writeback = cache_writeback && sync = None in
+        Some (Block_cache.create ~sector_size ~writeback bytes) in
+    if flush_method = `Sync_file_range && sync = Some `ToDrive
+    then Log.warn (fun f -> f "connect %s: sync_file_range does not flush the drive, using fdatasync" path);
+    let extent_map = match extent_map with
+      | None -> None
+      | Some _ when is_win32 -> None
+      | Some chunk ->
+        (* whole sectors, so extents can be reported in sectors *)
+        let chunk = max sector_size (chunk / sector_size * sector_size) in
+        Some (Block_extents.create ~chunk Int64.(mul size_sectors (of_int sector_size))) in
+    let fingerprints = match dedup_stats with
+      | None -> None
+      | Some bytes ->
+        let a = Bigarray.Array1.create Bigarray.int64 Bigarray.c_layout (max 1 (bytes / 8)) in
+        Bigarray.Array1.fill a 0L;
+        Some a in
+    let throttle =
+      let rate = function None -> 0 | Some n -> max 0 n in
+      let limits = { Block_throttle.iops_read = rate iops_read; iops_write = rate iops_write;
+                     bps_read = rate bps_read; bps_write = rate bps_write; burst = throttle_burst } in
+      match throttle_group with
+      | Some name ->
+        let group = Block_throttle.group name limits in
+        if Block_throttle.limits group <> limits && limits <> { Block_throttle.unlimited with burst = throttle_burst }
+        then Log.warn (fun f -> f "connect %s: throttle group %s already exists, using its limits" path name);
+        Some group
+      | None when { limits with Block_throttle.burst = 1 } = Block_throttle.unlimited -> None
+      | None -> Some (Block_throttle.create limits) in
+    return ({ fd = Some fd; seek_offset; m;
+              info = { Mirage_block.sector_size; size_sectors; read_write };
+              size_bytes; resizing = Lwt_mutex.create (); allocated = size_bytes; preallocate;
+              requests = 0; shrink_to = None; gate = Lwt_condition.create ();
+              config; use_fsync_after_write; engine; scheduler;
+              readahead; cache; flusher = Group_commit.create (); extent_map;
+              discards; mapping; stats = Block_stats.create (); trace = None; fingerprints;
+              checksums; geometry; throttle })
 
 (* prefix which signals we want to use buffered I/O *)
 let buffered_prefix = "buffered:"
@@ -225,62 +716,176 @@ let is_prefix ~prefix x =
   let prefix' = String.length prefix and x' = String.length x in
   x' >= prefix' && (String.sub x 0 prefix' = prefix)
 
-let connect ?buffered ?sync ?lock ?prefered_sector_size name =
+let connect ?buffered ?sync ?lock ?prefered_sector_size ?engine ?queue_depth ?merge ?readahead
+    ?cache ?cache_writeback ?flush_method ?extent_map ?mmap ?workers ?cpus ?numa_node
+    ?detect_zeroes ?dedup_stats ?checksums ?checksum_verify ?checksum_block ?preallocate
+    ?iops_read ?iops_write ?bps_read ?bps_write ?throttle_burst ?throttle_group name =
   let legacy_buffered = is_prefix ~prefix:buffered_prefix name in
   (* Keep support for the legacy buffered: prefix until version 3.x.y *)
   let buffered = if legacy_buffered then Some true else buffered in
-  let config = Config.create ?buffered ?sync ?lock ?prefered_sector_size name in
+  let config = Config.create ?buffered ?sync ?lock ?prefered_sector_size ?engine ?queue_depth ?merge ?readahead
+      ?cache ?cache_writeback ?flush_method ?extent_map ?mmap ?workers ?cpus ?numa_node
+      ?detect_zeroes ?dedup_stats ?checksums ?checksum_verify ?checksum_block ?preallocate
+      ?iops_read ?iops_write ?bps_read ?bps_write ?throttle_burst ?throttle_group name in
   of_config config
 
-let disconnect t = match t.fd with
-  | Some fd ->
-    Lwt_unix.close fd >>= fun () ->
-    t.fd <- None;
-    return ()
-  | None ->
-    return ()
-
 let get_info x = return x.info
 
+let stats x = Block_stats.snapshot x.stats
+
+let geometry x = x.geometry
+
+let set_trace x trace = x.trace <- trace
+
+let create_pool ?(sectors = 8) x count =
+  let alignment = max 4096 x.info.sector_size in
+  let pool = Block_pool.create ~alignment ~buffer_size:(sectors * x.info.sector_size) count in
+  ( match x.engine with
+    | Uring ring ->
+      begin
+        try Block_uring.register_buffer ring (Block_pool.slab pool)
+        with e ->
+          Log.info (fun f -> f "create_pool %s: not using fixed buffers (%s)" x.config.Config.path (Printexc.to_string e))
+      end
+    | Threads | Aio _ | Workers _ -> () );
+  pool
+
 let really_read fd = Lwt_cstruct.complete (Lwt_cstruct.read fd)
 let really_write fd = Lwt_cstruct.complete (Lwt_cstruct.write fd)
 
 open Mirage_block
 
+let fatalf fmt = Printf.ksprintf (fun s ->
+    Log.err (fun f -> f "%s" s);
+    return (Error (`Msg s))
+  ) fmt
+
+let describe_buffers buffers =
+  if buffers = []
+  then ""
+  else "with buffers of length [ " ^ (String.concat ", " (List.map (fun b -> string_of_int @@ Cstruct.len b) buffers)) ^ " ]"
+
+let error_of_exn t op offset buffers = function
+  | End_of_file ->
+    fatalf "%s: End_of_file at file %s offset %Ld %s" op t.config.Config.path offset (describe_buffers buffers)
+  | Unix.Unix_error(code, fn, arg) ->
+    fatalf "%s: %s in %s '%s' at file %s offset %Ld %s" op (Unix.error_message code) fn arg t.config.Config.path offset (describe_buffers buffers)
+  | e ->
+    fatalf "%s: %s at file %s offset %Ld %s" op (Printexc.to_string e) t.config.Config.path offset (describe_buffers buffers)
+
+(* Requests which have already completed, such as cache hits, return
+   without installing an exception handler *)
 let lwt_wrap_exn t op offset ?(buffers=[]) f =
-  let fatalf fmt = Printf.ksprintf (fun s ->
-      Log.err (fun f -> f "%s" s);
-      return (Error (`Msg s))
-    ) fmt in
-  let describe_buffers buffers =
-    if buffers = []
-    then ""
-    else "with buffers of length [ " ^ (String.concat ", " (List.map (fun b -> string_of_int @@ Cstruct.len b) buffers)) ^ " ]" in
-  (* Buffer must be a multiple of sectors in length *)
-  Lwt_list.fold_left_s (fun acc b -> match acc with
-    | Error e -> Lwt.return (Error e)
-    | Ok () ->
-      let len = Cstruct.len b in
-      if len mod t.info.sector_size <> 0
-      then fatalf "%s: buffer length (%d) is not a multiple of sector_size (%d) for file %s" op len t.info.sector_size t.config.Config.path
-      else Lwt.return (Ok ())
-  ) (Ok ()) buffers
-  >>*= fun () ->
-  Lwt.catch f
-    (function
-      | End_of_file ->
-        fatalf "%s: End_of_file at file %s offset %Ld %s" op t.config.Config.path offset (describe_buffers buffers)
-      | Unix.Unix_error(code, fn, arg) ->
-        fatalf "%s: %s in %s '%s' at file %s offset %Ld %s" op (Unix.error_message code) fn arg t.config.Config.path offset (describe_buffers buffers)
-      | e ->
-        fatalf "%s: %s at file %s offset %Ld %s" op (Printexc.to_string e) t.config.Config.path offset (describe_buffers buffers)
-    )
+  match f () with
+  | exception e -> error_of_exn t op offset buffers e
+  | p ->
+    begin match Lwt.state p with
+      | Lwt.Return _ -> p
+      | Lwt.Fail e -> error_of_exn t op offset buffers e
+      | Lwt.Sleep -> Lwt.catch (fun () -> p) (error_of_exn t op offset buffers)
+    end
+
+(* The total length of [buffers], or -1 if one of them is not a whole number
+   of sectors. This is on every request's path, so it neither allocates nor
+   builds an error: see [invalid_buffers] for that. *)
+let rec buffers_length sector_size acc = function
+  | [] -> acc
+  | b :: bs ->
+    let len = Cstruct.len b in
+    if len mod sector_size <> 0 then -1 else buffers_length sector_size (acc + len) bs
+
+let invalid_buffers t op buffers =
+  let b = List.find (fun b -> Cstruct.len b mod t.info.sector_size <> 0) buffers in
+  fatalf "%s: buffer length (%d) is not a multiple of sector_size (%d) for file %s"
+    op (Cstruct.len b) t.info.sector_size t.config.Config.path
 
 let seek_already_locked x fd offset =
   if x.seek_offset <> offset then begin
+    Block_stats.seek x.stats ~hit:false;
     x.seek_offset <- offset;
     Lwt_unix.LargeFile.lseek fd offset Unix.SEEK_SET
-  end else Lwt.return offset
+  end else begin
+    Block_stats.seek x.stats ~hit:true;
+    Lwt.return offset
+  end
+
+(* The span [name] of a request, if [x] is traced. Like the statistics
+   these bracket [lwt_wrap_exn], which never fails. *)
+let trace_start x name offset length = match x.trace with
+  | None -> -1
+  | Some trace -> Block_trace.start trace name offset length
+
+let trace_finish x name id r = match x.trace with
+  | Some trace when id >= 0 -> Block_trace.stop trace name id; r
+  | _ -> r
+
+(* A kernel queue request [f ()] for [buffers] as a job span *)
+let traced_job x offset buffers f = match x.trace with
+  | None -> f ()
+  | Some trace ->
+    let id = Block_trace.start trace "job" offset (List.fold_left (fun acc b -> acc + Cstruct.len b) 0 buffers) in
+    Lwt.finalize f (fun () -> Block_trace.stop trace "job" id; Lwt.return_unit)
+
+(* [x.m] with the time spent waiting for it recorded *)
+let with_lock x f =
+  let start = Block_stats.now () in
+  match x.trace with
+  | None ->
+    Lwt_mutex.with_lock x.m (fun () -> Block_stats.locked x.stats start; f ())
+  | Some trace ->
+    let id = Block_trace.start trace "lock" 0L 0 in
+    Lwt_mutex.with_lock x.m (fun () ->
+        Block_stats.locked x.stats start;
+        Block_trace.stop trace "lock" id;
+        f ())
+
+(* [Lwt_unix.run_job (job times)] with the time spent in the worker thread
+   traced inside the job's span *)
+let run_job x offset buffers job = match x.trace with
+  | None -> Lwt_unix.run_job (job Raw.no_times)
+  | Some trace ->
+    let times = Bigarray.Array1.create Bigarray.int64 Bigarray.c_layout 2 in
+    Bigarray.Array1.fill times 0L;
+    let id = Block_trace.start trace "job" offset (List.fold_left (fun acc b -> acc + Cstruct.len b) 0 buffers) in
+    Lwt.finalize (fun () -> Lwt_unix.run_job (job times))
+      (fun () ->
+         Block_trace.span trace "worker" id (Int64.to_int times.{0}) (Int64.to_int times.{1});
+         Block_trace.stop trace "job" id;
+         Lwt.return_unit)
+
+(* Requests hold the device shared and a shrink holds it exclusively, so
+   nothing is in flight when the file is truncated: a write which landed
+   afterwards would grow it again. While a shrink waits or runs, new
+   requests wait for it, except those reaching beyond the size it will
+   leave, which fail. [upto] is the sector after the request. *)
+let end_request x =
+  x.requests <- x.requests - 1;
+  if x.requests = 0 && x.shrink_to <> None then Lwt_condition.broadcast x.gate ()
+
+let rec with_request x ~upto f = match x.shrink_to with
+  | Some size when upto > size ->
+    Log.err (fun m -> m "request beyond sector %Ld of %s, which is being shrunk" size x.config.Config.path);
+    Lwt.fail End_of_file
+  | Some _ ->
+    Lwt_condition.wait x.gate
+    >>= fun () ->
+    with_request x ~upto f
+  | None ->
+    x.requests <- x.requests + 1;
+    match f () with
+    | exception e -> end_request x; Lwt.fail e
+    | p ->
+      ( match Lwt.state p with
+        | Lwt.Sleep -> Lwt.on_termination p (fun () -> end_request x)
+        | Lwt.Return _ | Lwt.Fail _ -> end_request x );
+      p
+
+(* [f ()] is a system call or a kernel queue request *)
+let on_device x f =
+  let start = Block_stats.now () in
+  f () >|= fun r ->
+  Block_stats.device x.stats start;
+  r
 
 module Cstructs = struct
   (** A list of buffers, like a Unix iovec *)
@@ -306,79 +911,252 @@ module Cstructs = struct
       if y' > x
       then Cstruct.shift y x :: ys
       else shift ys (x - y')
-
-  let to_iovec ts =
-    List.map (fun t -> t.Cstruct.buffer, t.Cstruct.off, t.Cstruct.len) ts
 end
 
-let iov_len = Raw.iov_len ()
+(* Positional I/O leaves the fd's seek offset alone, so unlike the Win32 path
+   below these do not need [x.m] or [seek_already_locked] and any number of
+   requests may be in flight on the same device. A thread pool job transfers
+   the whole buffer list in one round trip, resuming after short transfers in
+   the worker thread. io_uring and AIO requests are capped at IOV_MAX buffers,
+   so we loop until everything has been transferred or we reach end-of-file. *)
+let submit_preadv x fd offset buffers = match x.engine with
+  | Threads -> run_job x offset buffers (Raw.preadv_job fd buffers offset)
+  | Uring ring -> traced_job x offset buffers (fun () -> Block_uring.readv ring fd offset buffers)
+  | Aio ctx -> traced_job x offset buffers (fun () -> Block_aio.readv ctx fd offset buffers)
+  | Workers w -> traced_job x offset buffers (fun () -> Block_workers.readv w fd offset buffers)
 
-let split_list xs maxlen =
-  let rec loop (acc, l, n) xs =
-    if n = maxlen
-    then loop ((List.rev l) :: acc, [], 0) xs
-    else match xs with
-    | [] -> List.rev ((List.rev l) :: acc)
-    | x :: xs -> loop (acc, x :: l, n + 1) xs in
-  loop ([], [], 0) xs
+let submit_pwritev x fd offset buffers = match x.engine with
+  | Threads -> run_job x offset buffers (Raw.pwritev_job fd buffers offset)
+  | Uring ring -> traced_job x offset buffers (fun () -> Block_uring.writev ring fd offset buffers)
+  | Aio ctx -> traced_job x offset buffers (fun () -> Block_aio.writev ctx fd offset buffers)
+  | Workers w -> traced_job x offset buffers (fun () -> Block_workers.writev w fd offset buffers)
 
-let read x sector_start buffers =
+let preadv x fd offset buffers =
+  let fd = Lwt_unix.unix_file_descr fd in
+  let rec loop offset remaining len =
+    if len = 0 then Lwt.return_unit else begin
+      on_device x (fun () -> submit_preadv x fd offset remaining)
+      >>= fun n ->
+      if n = 0 then begin
+        if offset >= x.size_bytes then begin
+          (* we've had to round up size_sectors to include all the data.
+             Data missing from the file is read as zeroes. *)
+          List.iter (fun b -> Cstruct.memset b 0) remaining;
+          Lwt.return_unit
+        end else Lwt.fail End_of_file
+      end else if n = len then Lwt.return_unit
+      else loop Int64.(add offset (of_int n)) (Cstructs.shift remaining n) (len - n)
+    end in
+  loop offset buffers (Cstructs.len buffers)
+
+let pwritev x fd offset buffers =
+  let fd = Lwt_unix.unix_file_descr fd in
+  let rec loop offset remaining len =
+    if len = 0 then Lwt.return_unit else begin
+      on_device x (fun () -> submit_pwritev x fd offset remaining)
+      >>= fun n ->
+      if n = 0
+      then Lwt.fail End_of_file
+      else if n = len then Lwt.return_unit
+      else loop Int64.(add offset (of_int n)) (Cstructs.shift remaining n) (len - n)
+    end in
+  loop offset buffers (Cstructs.len buffers)
+
+let schedule x op perform offset buffers = match x.scheduler with
+  | None -> perform offset buffers
+  | Some s -> Scheduler.submit s op perform offset buffers
+
+external fadvise_willneed_job: Unix.file_descr -> int64 -> int64 -> unit Lwt_unix.job = "mirage_block_unix_fadvise_willneed_job"
+
+let read_ahead x fd offset buffers = match x.readahead with
+  | None -> schedule x `Read (preadv x fd) offset buffers
+  | Some r ->
+    let limit = Int64.(mul x.info.size_sectors (of_int x.info.sector_size)) in
+    let advise offset length =
+      Lwt_unix.run_job (fadvise_willneed_job (Lwt_unix.unix_file_descr fd) offset length) in
+    Block_readahead.read r ~fetch:(schedule x `Read (preadv x fd)) ~advise ~limit offset buffers
+
+let invalidate_readahead x offset length = match x.readahead with
+  | None -> ()
+  | Some r -> Block_readahead.invalidate r offset length
+
+let write_uncached x fd offset buffers = match x.readahead with
+  | None -> schedule x `Write (pwritev x fd) offset buffers
+  | Some r ->
+    let length = Int64.of_int (Cstructs.len buffers) in
+    Block_readahead.invalidate r offset length;
+    Lwt.finalize
+      (fun () -> schedule x `Write (pwritev x fd) offset buffers)
+      (fun () -> Block_readahead.invalidate r offset length; Lwt.return_unit)
+
+let write_through x fd offset buffers = match x.extent_map with
+  | None -> write_uncached x fd offset buffers
+  | Some m ->
+    Block_extents.write m offset (Int64.of_int (Cstructs.len buffers))
+      (fun () -> write_uncached x fd offset buffers)
+
+let read_cached x fd offset buffers = match x.mapping, x.cache with
+  | Some m, _ -> Block_mmap.read m offset buffers; Lwt.return_unit
+  | None, None -> read_ahead x fd offset buffers
+  | None, Some c -> Block_cache.read c ~fetch:(read_ahead x fd) ~store:(write_through x fd) offset buffers
+
+let write_cached x fd offset buffers = match x.cache with
+  | None -> write_through x fd offset buffers
+  | Some c -> Block_cache.write c ~store:(write_through x fd) offset buffers
+
+let flush_cache x fd = match x.cache with
+  | None -> Lwt.return_unit
+  | Some c -> Block_cache.flush c ~store:(write_through x fd)
+
+(* A read or write is never overtaken by an earlier discard of the same
+   sectors which is still queued *)
+let after_discards x fd offset len buffers f =
+  Block_discard.wait x.discards offset (Int64.of_int len)
+  >>= fun () ->
+  f x fd offset buffers
+
+(* Zero [length] bytes at [offset] without transferring buffers, freeing the
+   space if [unmap]. Returns false if the filesystem or device can't. *)
+let zero_range x fd offset length unmap =
+  invalidate_readahead x offset length;
+  ( match x.cache with
+    | None -> ()
+    | Some c -> Block_cache.invalidate c offset length );
+  let zero () = Lwt_unix.run_job (Raw.write_zeroes_job (Lwt_unix.unix_file_descr fd) offset length unmap) in
+  Lwt.catch
+    (fun () ->
+       ( match x.extent_map with
+         | None -> zero ()
+         | Some m when unmap -> Block_extents.discard m offset length zero
+         | Some m -> Block_extents.write m offset length zero )
+       >|= fun () -> true)
+    (function
+      | Unix.Unix_error(code, fn, _) ->
+        (* not every filesystem or device can do it *)
+        Log.debug (fun f -> f "write_zeroes %s: %s in %s, writing zeroes"
+                      x.config.Config.path (Unix.error_message code) fn);
+        Lwt.return false
+      | e -> Lwt.fail e)
+  >|= fun zeroed ->
+  invalidate_readahead x offset length;
+  zeroed
+
+external zero_run: Cstruct.buffer -> int -> int -> int -> bool -> int = "mirage_block_unix_zero_run" [@@noalloc]
+external dedup_scan: (int64, Bigarray.int64_elt, Bigarray.c_layout) Bigarray.Array1.t ->
+  Cstruct.buffer -> int -> int -> int -> int = "mirage_block_unix_dedup_scan" [@@noalloc]
+
+(* Shorter runs of zeroes are written with the data around them, since a
+   separate request would cost more than it saves *)
+let min_zero_run = 65536
+
+(* [zero_runs granule buffers] splits [buffers] into runs of [`Data] and
+   [`Zero] buffers, in order, or returns None if no run of zero [granule]s
+   is long enough to be worth zeroing separately *)
+let zero_runs granule buffers =
+  let add acc zero b = match acc with
+    | (z, bs) :: rest when z = zero -> (z, b :: bs) :: rest
+    | _ -> (zero, [ b ]) :: acc in
+  let rec scan acc zero b =
+    if Cstruct.len b = 0 then acc else begin
+      let n = zero_run b.Cstruct.buffer b.Cstruct.off (Cstruct.len b) granule zero in
+      let acc = if n = 0 then acc else add acc zero (Cstruct.sub b 0 n) in
+      scan acc (not zero) (Cstruct.shift b n)
+    end in
+  let runs = List.fold_left (fun acc b -> scan acc true b) [] buffers in
+  let long (zero, bs) = zero && Cstructs.len bs >= min_zero_run in
+  if not (List.exists long runs) then None
+  else Some (List.fold_left (fun acc ((_, bs) as run) ->
+      let kind = if long run then `Zero else `Data in
+      match kind, acc with
+      | `Data, (`Data, later) :: rest -> (`Data, List.rev_append bs later) :: rest
+      | kind, _ -> (kind, List.rev bs) :: acc
+    ) [] runs)
+
+(* Writes are fingerprinted for [dedup_stats] and with [detect_zeroes] long
+   runs of zeroes are zeroed or unmapped instead of transferred *)
+let write_filtered x fd offset buffers =
+  ( match x.fingerprints with
+    | None -> ()
+    | Some table ->
+      let ss = x.info.sector_size in
+      let duplicates = List.fold_left (fun acc b ->
+          acc + dedup_scan table b.Cstruct.buffer b.Cstruct.off (Cstruct.len b) ss
+        ) 0 buffers in
+      Block_stats.blocks x.stats ~hashed:(Cstructs.len buffers / ss) ~duplicates );
+  match x.config.Config.detect_zeroes with
+  | `Off -> write_cached x fd offset buffers
+  | (`On | `Unmap) as mode ->
+    match zero_runs x.info.sector_size buffers with
+    | None -> write_cached x fd offset buffers
+    | Some runs ->
+      let rec issue acc offset = function
+        | [] -> acc
+        | (kind, bs) :: rest ->
+          let length = Cstructs.len bs in
+          let r = match kind with
+            | `Data -> write_cached x fd offset bs
+            | `Zero ->
+              zero_range x fd offset (Int64.of_int length) (mode = `Unmap)
+              >>= fun zeroed ->
+              if zeroed then begin
+                Block_stats.zeroes x.stats length;
+                Lwt.return_unit
+              end else write_cached x fd offset bs in
+          issue (r :: acc) (Int64.add offset (Int64.of_int length)) rest in
+      Lwt.join (issue [] offset runs)
+
+let read_unverified x sector_start buffers =
+  let len = buffers_length x.info.sector_size 0 buffers in
+  if len < 0 then invalid_buffers x "read" buffers else
   let offset = Int64.(mul sector_start (of_int x.info.sector_size)) in
+  let start = Block_stats.start x.stats in
+  let span = trace_start x "read" offset len in
+  let upto = Int64.(add sector_start (of_int ((len + x.info.sector_size - 1) / x.info.sector_size))) in
   lwt_wrap_exn x "read" offset ~buffers
     (fun () ->
+      with_request x ~upto @@ fun () ->
       match x.fd with
       | None ->
         return (Error `Disconnected)
       | Some fd ->
-        let len = Cstructs.len buffers in
         let len_sectors = (len + x.info.sector_size - 1) / x.info.sector_size in
         if Int64.(add sector_start (of_int len_sectors) > x.info.size_sectors) then begin
           Log.err (fun f -> f "read beyond end of file: sector_start (%Ld) + len (%d) > size_sectors (%Ld)"
                       sector_start len_sectors x.info.size_sectors);
           fail End_of_file
+        end else if not is_win32 then begin
+          ( if Block_discard.idle x.discards
+            then read_cached x fd offset buffers
+            else after_discards x fd offset len buffers read_cached )
+          >>= fun () ->
+          Lwt.return (Ok ())
         end else begin
-          Lwt_mutex.with_lock x.m
+          with_lock x
             (fun () ->
               seek_already_locked x fd offset >>= fun _ ->
               Lwt.catch
                 (fun () ->
-                  ( if is_win32 || List.length buffers = 1 then begin
-                      let rec loop = function
-                        | [] -> Lwt.return_unit
-                        | b :: bs ->
-                          let virtual_zeroes = Int64.(sub (add offset (of_int (Cstruct.len b))) x.size_bytes) in
-                          ( if virtual_zeroes <= 0L
-                            then really_read fd b
-                            else begin
-                              (* we've had to round up size_sectors to include all the data.
-                                 We expect End_of_file but ensure that the data missing from the
-                                 file is full of zeroes. *)
-                              Cstruct.memset b 0;
-                              Lwt.catch
-                                (fun () -> really_read fd b)
-                                (function
-                                  | End_of_file -> Lwt.return_unit
-                                  | e -> Lwt.fail e)
-                            end )
-                          >>= fun () ->
-                          x.seek_offset <- Int64.(add x.seek_offset (of_int (Cstruct.len b)));
-                          loop bs in
-                      loop buffers
-                    end else begin
-                      Lwt_list.iter_s (fun buffers ->
-                        let rec loop remaining =
-                          if Cstructs.len remaining = 0 then Lwt.return_unit else begin
-                            let iovec = Cstructs.to_iovec remaining in
-                            Lwt_unix.run_job (Raw.readv_job (Lwt_unix.unix_file_descr fd) iovec)
-                            >>= fun n ->
-                            loop (Cstructs.shift remaining n)
-                          end in
-                        loop buffers
-                      ) (split_list buffers iov_len)
+                  let rec loop = function
+                    | [] -> Lwt.return_unit
+                    | b :: bs ->
+                      let virtual_zeroes = Int64.(sub (add offset (of_int (Cstruct.len b))) x.size_bytes) in
+                      ( if virtual_zeroes <= 0L
+                        then really_read fd b
+                        else begin
+                          (* we've had to round up size_sectors to include all the data.
+                             We expect End_of_file but ensure that the data missing from the
+                             file is full of zeroes. *)
+                          Cstruct.memset b 0;
+                          Lwt.catch
+                            (fun () -> really_read fd b)
+                            (function
+                              | End_of_file -> Lwt.return_unit
+                              | e -> Lwt.fail e)
+                        end )
                       >>= fun () ->
-                      x.seek_offset <- Int64.add x.seek_offset (Int64.of_int len);
-                      Lwt.return_unit
-                    end )
+                      x.seek_offset <- Int64.(add x.seek_offset (of_int (Cstruct.len b)));
+                      loop bs in
+                  loop buffers
                 ) (fun e ->
                   x.seek_offset <- -1L; (* actual file pointer is undefined now *)
                   Lwt.fail e
@@ -388,30 +1166,141 @@ let read x sector_start buffers =
             )
         end
     )
+  >|= Block_stats.finish x.stats `Read len start
+  >|= trace_finish x "read" span
 
-let write x sector_start buffers =
+let checksum_error x op bad =
+  let sectors = String.concat ", " (List.map Int64.to_string bad) in
+  Log.err (fun f -> f "%s %s: checksum mismatch in sectors %s" op x.config.Config.path sectors);
+  Error (`Msg (Printf.sprintf "%s %s: checksum mismatch in sectors %s" op x.config.Config.path sectors))
+
+(* A request which is held back by the rate limits starts once it is
+   admitted; the wait is recorded separately from its latency *)
+let throttled x op buffers f = match x.throttle with
+  | None -> f ()
+  | Some t ->
+    let start = Block_stats.now () in
+    let p = Block_throttle.admit t op (Cstructs.len buffers) in
+    match Lwt.state p with
+    | Lwt.Return () -> f ()
+    | _ ->
+      p >>= fun () ->
+      Block_stats.throttled x.stats start;
+      f ()
+
+(* A share of reads are checked against the checksums recorded when the
+   sectors were written. The checksums are copied first, since a write to
+   the same sectors which completes during the read records new ones. *)
+let read_checked x sector_start buffers = match x.checksums with
+  | Some c when Block_checksum.sample c ->
+    let n = Cstructs.len buffers / x.info.sector_size in
+    let expected = Block_checksum.expected c sector_start n in
+    read_unverified x sector_start buffers
+    >|= (function
+        | Ok () ->
+          ( match Block_checksum.mismatches c ~expected sector_start buffers with
+            | [] -> Ok ()
+            | bad -> checksum_error x "read" bad )
+        | Error e -> Error e)
+  | _ -> read_unverified x sector_start buffers
+
+let read x sector_start buffers =
+  throttled x `Read buffers (fun () -> read_checked x sector_start buffers)
+
+let scrub_buffer_size = 1 lsl 20
+
+let scrub x = match x.checksums with
+  | None -> Lwt.return (Ok [])
+  | Some c ->
+    let ss = x.info.sector_size in
+    (* whole blocks, so none straddles two reads *)
+    let block = Block_checksum.block_size c in
+    let pool = Block_pool.create ~alignment:(max 4096 ss) ~buffer_size:(max block (scrub_buffer_size / block * block)) 1 in
+    Block_pool.with_buffer pool
+      (fun buf ->
+         let per_read = Int64.of_int (Cstruct.len buf / ss) in
+         let rec loop acc sector =
+           if sector >= x.info.size_sectors then Lwt.return (Ok (List.concat (List.rev acc))) else begin
+             let n = Int64.to_int (min per_read (Int64.sub x.info.size_sectors sector)) in
+             let b = Cstruct.sub buf 0 (n * ss) in
+             let expected = Block_checksum.expected c sector n in
+             read_unverified x sector [ b ]
+             >>= function
+             | Error e -> Lwt.return (Error e)
+             | Ok () ->
+               let bad = Block_checksum.mismatches c ~expected sector [ b ] in
+               if bad <> [] then Log.err (fun f -> f "scrub %s: checksum mismatch in %d blocks from %Ld"
+                                              x.config.Config.path (List.length bad) sector);
+               Block_checksum.learn c sector [ b ];
+               loop (bad :: acc) (Int64.add sector (Int64.of_int n))
+           end in
+         loop [] 0L)
+
+let read_view x sector_start n =
+  match x.fd, x.mapping with
+  | None, _ -> return (Error `Disconnected)
+  | Some _, None -> return (Error `Unimplemented)
+  | Some _, Some m ->
+    let offset = Int64.(mul sector_start (of_int x.info.sector_size)) in
+    if n < 0 || Int64.(add sector_start (of_int n) > x.info.size_sectors) then begin
+      Log.err (fun f -> f "read_view beyond end of file: sector_start (%Ld) + len (%d) > size_sectors (%Ld)"
+                  sector_start n x.info.size_sectors);
+      lwt_wrap_exn x "read_view" offset (fun () -> fail End_of_file)
+    end else begin
+      return (Ok (Block_mmap.view m offset (n * x.info.sector_size)))
+    end
+
+(* The checksums of a write are accepted by reads while it is in flight,
+   since they may see its data before it completes *)
+let with_sums sums f = match sums with
+  | None -> f ()
+  | Some (c, sums) ->
+    let w = Block_checksum.submit c sums in
+    Lwt.try_bind f
+      (fun () -> Block_checksum.complete c w ~ok:true; Lwt.return_unit)
+      (fun e -> Block_checksum.complete c w ~ok:false; Lwt.fail e)
+
+let write_unthrottled x sector_start buffers =
+  let len = buffers_length x.info.sector_size 0 buffers in
+  if len < 0 then invalid_buffers x "write" buffers else
   let offset = Int64.(mul sector_start (of_int x.info.sector_size)) in
+  let start = Block_stats.start x.stats in
+  let span = trace_start x "write" offset len in
+  (* computed before the buffers are handed to the kernel *)
+  let sums = match x.checksums with
+    | None -> None
+    | Some c -> Some (c, Block_checksum.sums c sector_start buffers) in
+  let upto = Int64.(add sector_start (of_int (len / x.info.sector_size))) in
   lwt_wrap_exn x "write" offset ~buffers
     (fun () ->
+      with_request x ~upto @@ fun () ->
       match x with
       | { fd = None; _ } ->
         return (Error `Disconnected)
       | { info = { read_write = false; _ }; _ } ->
         return (Error `Is_read_only)
       | { fd = Some fd; _ } ->
-        let len = Cstructs.len buffers in
         let len_sectors = (len + x.info.sector_size - 1) / x.info.sector_size in
         if Int64.(add sector_start (of_int len_sectors) > x.info.size_sectors) then begin
           Log.err (fun f -> f "write beyond end of file: sector_start (%Ld) + len (%d) > size_sectors (%Ld)"
                       sector_start len_sectors x.info.size_sectors);
           fail End_of_file
+        end else if not is_win32 then begin
+          with_sums sums
+            (fun () ->
+              if Block_discard.idle x.discards
+              then write_filtered x fd offset buffers
+              else after_discards x fd offset len buffers write_filtered)
+          >>= fun () ->
+          Lwt.return (Ok ())
         end else begin
-          Lwt_mutex.with_lock x.m
+          with_sums sums
             (fun () ->
-              seek_already_locked x fd offset >>= fun _ ->
-              Lwt.catch
+              with_lock x
                 (fun () ->
-                  ( if is_win32 || List.length buffers = 1 then begin
+                  seek_already_locked x fd offset >>= fun _ ->
+                  Lwt.catch
+                    (fun () ->
                       let rec loop = function
                         | [] -> Lwt.return_unit
                         | b :: bs ->
@@ -420,74 +1309,234 @@ let write x sector_start buffers =
                           x.seek_offset <- Int64.(add x.seek_offset (of_int (Cstruct.len b)));
                           loop bs in
                       loop buffers
-                    end else begin
-                      Lwt_list.iter_s (fun buffers ->
-                        let rec loop remaining =
-                          if Cstructs.len remaining = 0 then Lwt.return_unit else begin
-                            let iovec = Cstructs.to_iovec remaining in
-                            Lwt_unix.run_job (Raw.writev_job (Lwt_unix.unix_file_descr fd) iovec)
-                            >>= fun n ->
-                            loop (Cstructs.shift remaining n)
-                          end in
-                        loop buffers
-                      ) (split_list buffers iov_len)
-                      >>= fun () ->
-                      x.seek_offset <- Int64.add x.seek_offset (Int64.of_int len);
-                      Lwt.return_unit
-                    end )
-                ) (fun e ->
-                  x.seek_offset <- -1L; (* actual file pointer is undefined now *)
-                  Lwt.fail e;
+                    ) (fun e ->
+                      x.seek_offset <- -1L; (* actual file pointer is undefined now *)
+                      Lwt.fail e;
+                    )
                 )
               >>= fun () ->
-              ( if x.use_fsync_after_write then Lwt_unix.fsync fd else Lwt.return () )
-              >>= fun () ->
-              Lwt.return (Ok ())
-            )
+              (* Concurrent writers share one fsync *)
+              if x.use_fsync_after_write
+              then Group_commit.flush x.flusher (fun () -> Lwt_unix.fsync fd)
+              else Lwt.return ())
+          >>= fun () ->
+          Lwt.return (Ok ())
         end
     )
+  >|= Block_stats.finish x.stats `Write len start
+  >|= trace_finish x "write" span
+
+let write x sector_start buffers =
+  throttled x `Write buffers (fun () -> write_unthrottled x sector_start buffers)
+
+let disconnect t = match t.fd with
+  | Some fd ->
+    (* Unwritten data is lost if it cannot be written now *)
+    Lwt.catch (fun () -> flush_cache t fd)
+      (fun e ->
+        Log.err (fun f -> f "disconnect %s: failed to write back the cache: %s" t.config.Config.path (Printexc.to_string e));
+        Lwt.return_unit)
+    >>= fun () ->
+    ( match t.engine with
+      | Threads -> Lwt.return_unit
+      | Uring ring -> Block_uring.close ring
+      | Aio ctx -> Block_aio.close ctx
+      | Workers w -> Block_workers.close w )
+    >>= fun () ->
+    ( match t.checksums with
+      | None -> Lwt.return_unit
+      | Some c ->
+        Lwt.catch (fun () -> Block_checksum.close c)
+          (fun e ->
+             Log.err (fun f -> f "disconnect %s: failed to write the checksums: %s" t.config.Config.path (Printexc.to_string e));
+             Lwt.return_unit) )
+    >>= fun () ->
+    Lwt_unix.close fd >>= fun () ->
+    t.fd <- None;
+    return ()
+  | None ->
+    return ()
+
+(* The bookkeeping which follows the size of the file *)
+let set_size t size_bytes size_sectors =
+  t.size_bytes <- size_bytes;
+  t.info <- { t.info with size_sectors };
+  ( match t.extent_map with
+    | None -> ()
+    | Some m -> Block_extents.resize m size_bytes );
+  ( match t.checksums with
+    | None -> ()
+    | Some c -> Block_checksum.resize c size_sectors )
+
+(* Reserve space up to [size] rounded up to a whole chunk, so a device which
+   grows a little at a time is laid out in large extents. This is advisory:
+   if the filesystem can't, we stop trying. *)
+let preallocate t fd size = match t.preallocate with
+  | Some chunk when chunk > 0 && size > t.allocated ->
+    let chunk = Int64.of_int chunk in
+    let target = Int64.(mul (div (add size (pred chunk)) chunk) chunk) in
+    Lwt.catch
+      (fun () ->
+         Lwt_unix.run_job (Raw.preallocate_job (Lwt_unix.unix_file_descr fd) t.allocated Int64.(sub target t.allocated))
+         >|= fun () ->
+         t.allocated <- target)
+      (fun e ->
+         Log.warn (fun f -> f "resize %s: not preallocating (%s)" t.config.Config.path (Printexc.to_string e));
+         t.preallocate <- None;
+         Lwt.return_unit)
+  | _ -> Lwt.return_unit
 
+let truncate t fd size = match t.engine with
+  | Workers w -> Block_workers.ftruncate w (Lwt_unix.unix_file_descr fd) size
+  | Threads | Uring _ | Aio _ -> ftruncate fd size
+
+(* Growing leaves every existing sector where it is, so requests carry on
+   while the file is extended and the new sectors become visible once it
+   has been. Shrinking waits for the requests in flight to drain, holding
+   new ones back, and drops what is cached beyond the new end. *)
 let resize t new_size_sectors =
   let new_size_bytes = Int64.(mul new_size_sectors (of_int t.info.sector_size)) in
-  match t.fd with
-  | None -> return (Error `Disconnected)
-  | Some fd ->
+  match t.fd, t.checksums with
+  | None, _ -> return (Error `Disconnected)
+  | Some _, Some c when new_size_sectors > Block_checksum.max_sectors c ->
+    fatalf "resize %s: %Ld sectors are too many for checksum blocks of %d bytes"
+      t.config.Config.path new_size_sectors (Block_checksum.block_size c)
+  | Some fd, _ ->
     lwt_wrap_exn t "ftruncate" new_size_bytes
         (fun () ->
-           Lwt_mutex.with_lock t.m
+           Lwt_mutex.with_lock t.resizing
              (fun () ->
-                ftruncate fd new_size_bytes
-                >>= fun () ->
-                t.info <- { t.info with size_sectors = new_size_sectors };
-                return (Ok ())
+                if new_size_sectors >= t.info.size_sectors then begin
+                  preallocate t fd new_size_bytes
+                  >>= fun () ->
+                  truncate t fd new_size_bytes
+                  >>= fun () ->
+                  ( match t.readahead with
+                    | None -> ()
+                    | Some r -> Block_readahead.invalidate_all r );
+                  set_size t new_size_bytes new_size_sectors;
+                  return (Ok ())
+                end else begin
+                  t.shrink_to <- Some new_size_sectors;
+                  let rec drain () =
+                    if t.requests = 0 then Lwt.return_unit
+                    else Lwt_condition.wait t.gate >>= drain in
+                  Lwt.finalize
+                    (fun () ->
+                       drain ()
+                       >>= fun () ->
+                       with_lock t
+                         (fun () ->
+                            flush_cache t fd
+                            >>= fun () ->
+                            truncate t fd new_size_bytes
+                            >>= fun () ->
+                            t.allocated <- new_size_bytes;
+                            ( match t.readahead with
+                              | None -> ()
+                              | Some r -> Block_readahead.invalidate_all r );
+                            ( match t.cache with
+                              | None -> ()
+                              | Some c -> Block_cache.invalidate_all c );
+                            set_size t new_size_bytes new_size_sectors;
+                            return (Ok ())
+                         ))
+                    (fun () ->
+                       t.shrink_to <- None;
+                       Lwt_condition.broadcast t.gate ();
+                       Lwt.return_unit)
+                end
              )
         )
 
-external flush_job: Unix.file_descr -> bool -> unit Lwt_unix.job = "mirage_block_unix_flush_job"
+let refresh_size t =
+  match t.fd with
+  | None -> return (Error `Disconnected)
+  | Some fd ->
+    lwt_wrap_exn t "refresh_size" 0L
+      (fun () ->
+         Lwt_mutex.with_lock t.resizing
+           (fun () ->
+              Lwt_unix.run_job (Raw.size_job (Lwt_unix.unix_file_descr fd))
+              >>= fun size_bytes ->
+              let sector_size = Int64.of_int t.info.sector_size in
+              let size_sectors = Int64.(div (add size_bytes (pred sector_size)) sector_size) in
+              if size_sectors < t.info.size_sectors then begin
+                Log.warn (fun f -> f "refresh_size %s: the device has shrunk to %Ld sectors, keeping %Ld"
+                             t.config.Config.path size_sectors t.info.size_sectors)
+              end else if size_bytes > t.size_bytes then begin
+                let too_many = match t.checksums with
+                  | Some c -> size_sectors > Block_checksum.max_sectors c
+                  | None -> false in
+                if t.mapping <> None
+                then Log.warn (fun f -> f "refresh_size %s: the device has grown but is mapped, keeping %Ld sectors"
+                                  t.config.Config.path t.info.size_sectors)
+                else if too_many
+                then Log.warn (fun f -> f "refresh_size %s: the device has grown too large for its checksums, keeping %Ld sectors"
+                                  t.config.Config.path t.info.size_sectors)
+                else begin
+                  ( match t.readahead with
+                    | None -> ()
+                    | Some r -> Block_readahead.invalidate_all r );
+                  t.allocated <- max t.allocated size_bytes;
+                  set_size t size_bytes size_sectors
+                end
+              end;
+              return (Ok t.info.size_sectors)))
+
+external flush_job: Unix.file_descr -> bool -> int -> Raw.times -> unit Lwt_unix.job = "mirage_block_unix_flush_job"
+
+let barrier t fd sync =
+  let fd = Lwt_unix.unix_file_descr fd in
+  let flush_method = match sync, t.config.Config.flush_method with
+    | `ToDrive, `Sync_file_range -> `Fdatasync
+    | _, m -> m in
+  on_device t (fun () ->
+      match flush_method, t.engine with
+      | `Fsync, Uring ring ->
+        traced_job t 0L [] (fun () -> Block_uring.fsync ring fd ~datasync:false)
+      | `Fdatasync, Uring ring ->
+        traced_job t 0L [] (fun () -> Block_uring.fsync ring fd ~datasync:true)
+      | flush_method, Workers w ->
+        traced_job t 0L [] (fun () ->
+            Block_workers.fsync w fd ~ask_drive_to_flush:(sync = `ToDrive) ~flush_method)
+      | _, _ ->
+        let m = match flush_method with `Fsync -> 0 | `Fdatasync -> 1 | `Sync_file_range -> 2 in
+        run_job t 0L [] (flush_job fd (sync = `ToDrive) m))
 
 let flush t =
   match t.fd with
   | None -> return (Error `Disconnected)
   | Some fd ->
+    let start = Block_stats.start t.stats in
+    let span = trace_start t "flush" 0L 0 in
     lwt_wrap_exn t "fsync" 0L
       (fun () ->
+         flush_cache t fd
+         >>= fun () ->
          ( match t.config.Config.sync with
            | None -> Lwt.return_unit
-           | Some `ToOS -> Lwt_unix.run_job (flush_job (Lwt_unix.unix_file_descr fd) false)
-           | Some `ToDrive -> Lwt_unix.run_job (flush_job (Lwt_unix.unix_file_descr fd) true)
+           | Some sync -> Group_commit.flush t.flusher (fun () -> barrier t fd sync)
          )
          >>= fun () ->
+         ( match t.checksums with
+           | None -> Lwt.return_unit
+           | Some c -> Block_checksum.flush c )
+         >>= fun () ->
          return (Ok ())
       )
+    >|= Block_stats.finish t.stats `Flush 0 start
+    >|= trace_finish t "flush" span
 
 let seek_mapped t from =
   match t.fd with
   | None -> return (Error `Disconnected)
   | Some fd ->
     let offset = Int64.(mul from (of_int t.info.sector_size)) in
+    let start = Block_stats.start t.stats in
     lwt_wrap_exn t "seek_mapped" offset
       (fun () ->
-         Lwt_mutex.with_lock t.m
+         with_lock t
            (fun () ->
               let fd = Lwt_unix.unix_file_descr fd in
               let offset = Raw.lseek_data fd offset in
@@ -495,15 +1544,17 @@ let seek_mapped t from =
               return (Ok Int64.(div offset (of_int t.info.sector_size)))
            )
       )
+    >|= Block_stats.finish t.stats `Seek 0 start
 
 let seek_unmapped t from =
   match t.fd with
   | None -> return (Error `Disconnected)
   | Some fd ->
     let offset = Int64.(mul from (of_int t.info.sector_size)) in
+    let start = Block_stats.start t.stats in
     lwt_wrap_exn t "seek_unmapped" offset
       (fun () ->
-         Lwt_mutex.with_lock t.m
+         with_lock t
            (fun () ->
               let fd = Lwt_unix.unix_file_descr fd in
               let offset = Raw.lseek_hole fd offset in
@@ -511,6 +1562,86 @@ let seek_unmapped t from =
               return (Ok Int64.(div offset (of_int t.info.sector_size)))
            )
       )
+    >|= Block_stats.finish t.stats `Seek 0 start
+
+external extents_job: Unix.file_descr -> int64 -> int64 -> (int64 * int64) list Lwt_unix.job = "mirage_block_unix_extents_job"
+
+(* [data] is in order and within [offset, offset + length) *)
+let fill_holes offset length data =
+  let stop = Int64.add offset length in
+  let rec loop acc pos = function
+    | [] ->
+      List.rev (if pos < stop then (pos, Int64.sub stop pos, `Hole) :: acc else acc)
+    | (o, l) :: rest ->
+      let acc = if o > pos then (pos, Int64.sub o pos, `Hole) :: acc else acc in
+      loop ((o, l, `Data) :: acc) (Int64.add o l) rest in
+  loop [] offset data
+
+(* Data is rounded out to whole sectors, joining extents which then touch *)
+let data_sectors sector_size data =
+  let ss = Int64.of_int sector_size in
+  List.rev @@ List.fold_left (fun acc (o, l) ->
+      let start = Int64.div o ss and stop = Int64.(div (add (add o l) (pred ss)) ss) in
+      match acc with
+      | (o', l') :: acc' when Int64.add o' l' >= start ->
+        (o', Int64.sub (max stop (Int64.add o' l')) o') :: acc'
+      | _ -> (start, Int64.sub stop start) :: acc
+    ) [] data
+
+let extents t ~from ~len =
+  match t.fd with
+  | None -> return (Error `Disconnected)
+  | Some fd ->
+    let len = max 0L (min len (Int64.sub t.info.size_sectors from)) in
+    let ss = Int64.of_int t.info.sector_size in
+    let offset = Int64.mul from ss and length = Int64.mul len ss in
+    if len = 0L then return (Ok [])
+    else if is_win32 then return (Ok [ from, len, `Data ])
+    else lwt_wrap_exn t "extents" offset
+      (fun () ->
+         let fetch offset length =
+           Lwt_unix.run_job (extents_job (Lwt_unix.unix_file_descr fd) offset length) in
+         ( match t.extent_map with
+           | None -> fetch offset length
+           | Some m ->
+             Block_extents.extents m ~fetch offset length
+             >|= fun extents ->
+             List.fold_right (fun (o, l, k) acc -> if k = `Data then (o, l) :: acc else acc) extents [] )
+         >>= fun data ->
+         return (Ok (fill_holes from len (data_sectors t.info.sector_size data)))
+      )
+
+(* Zeroes which can't be written by the kernel are written from views of
+   one shared, aligned buffer, [zero_buffers] at a time *)
+let zero_buffer_size = 1 lsl 20
+let zero_buffers = 8
+
+let zero_buffer = lazy (
+  let b = Cstruct.of_bigarray (Raw.alloc_aligned 4096 zero_buffer_size) in
+  Cstruct.memset b 0;
+  b
+)
+
+(* Views of the zero buffer covering [length] bytes, up to [zero_buffers] *)
+let zero_views length =
+  let zero = Lazy.force zero_buffer in
+  let rec loop acc remaining i =
+    if remaining = 0 || i = 0 then acc else begin
+      let k = min remaining zero_buffer_size in
+      loop (Cstruct.sub zero 0 k :: acc) (remaining - k) (i - 1)
+    end in
+  loop [] length zero_buffers
+
+let max_zero_write = Int64.of_int (zero_buffers * zero_buffer_size)
+
+(* Below the caches, for parts of a discard *)
+let rec pwrite_zeroes x fd offset length =
+  if length <= 0L then Lwt.return_unit else begin
+    let n = Int64.to_int (min length max_zero_write) in
+    pwritev x fd offset (zero_views n)
+    >>= fun () ->
+    pwrite_zeroes x fd (Int64.add offset (Int64.of_int n)) (Int64.sub length (Int64.of_int n))
+  end
 
 external discard_job: Unix.file_descr -> int64 -> int64 -> unit Lwt_unix.job = "mirage_block_unix_discard_job"
 
@@ -522,12 +1653,212 @@ let discard t sector n =
     if is_win32
     then return (Error `Unimplemented)
     else if n = 0L then Lwt.return (Ok ())
-    else lwt_wrap_exn t "discard" sector
-      (fun () ->
-        let fd = Lwt_unix.unix_file_descr fd in
-        let offset = Int64.(mul sector (of_int t.info.sector_size)) in
-        let n = Int64.(mul n (of_int t.info.sector_size)) in
-        Lwt_unix.run_job (discard_job fd offset n)
-        >>= fun () ->
-        Lwt.return (Ok ())
-      )
+    else begin
+      let start = Block_stats.start t.stats in
+      let offset = Int64.(mul sector (of_int t.info.sector_size)) in
+      let span = trace_start t "discard" offset
+          (Int64.to_int (Int64.mul n (Int64.of_int t.info.sector_size))) in
+      lwt_wrap_exn t "discard" offset
+        (fun () ->
+          with_request t ~upto:(Int64.add sector n) @@ fun () ->
+          let unix_fd = Lwt_unix.unix_file_descr fd in
+          let n = Int64.(mul n (of_int t.info.sector_size)) in
+          invalidate_readahead t offset n;
+          ( match t.cache with
+            | None -> ()
+            | Some c -> Block_cache.invalidate c offset n );
+          let punch offset n = match t.engine with
+            | Threads | Aio _ -> Lwt_unix.run_job (discard_job unix_fd offset n)
+            | Uring ring -> Block_uring.discard ring unix_fd offset n
+            | Workers w -> Block_workers.discard w unix_fd offset n in
+          (* the unaligned ends of a merged range *)
+          let zero offset n =
+            Lwt.catch
+              (fun () -> Lwt_unix.run_job (Raw.write_zeroes_job unix_fd offset n false))
+              (function
+                | Unix.Unix_error(_, _, _) -> pwrite_zeroes t fd offset n
+                | e -> Lwt.fail e) in
+          let punch () = Block_discard.discard t.discards ~punch ~zero offset n in
+          ( match t.extent_map with
+            | None -> punch ()
+            | Some m -> Block_extents.discard m offset n punch )
+          >>= fun () ->
+          invalidate_readahead t offset n;
+          (* BLKDISCARD doesn't promise what the sectors read back as *)
+          ( match t.checksums with
+            | None -> ()
+            | Some c -> Block_checksum.forget c sector (Int64.div n (Int64.of_int t.info.sector_size)) );
+          Lwt.return (Ok ())
+        )
+      >|= Block_stats.finish t.stats `Discard (Int64.to_int (Int64.mul n (Int64.of_int t.info.sector_size))) start
+      >|= trace_finish t "discard" span
+    end
+
+let ( >>|= ) m f = m >>= function
+  | Error e -> Lwt.return (Error e)
+  | Ok x -> f x
+
+let rec write_zero_buffers t sector n =
+  if n = 0L then Lwt.return (Ok ()) else begin
+    let ss = Int64.of_int t.info.sector_size in
+    let count = min n (Int64.div max_zero_write ss) in
+    write t sector (zero_views (Int64.to_int (Int64.mul count ss)))
+    >>|= fun () ->
+    write_zero_buffers t (Int64.add sector count) (Int64.sub n count)
+  end
+
+let write_zeroes ?(unmap = false) t sector n =
+  match t with
+  | { fd = None; _ } -> return (Error `Disconnected)
+  | { info = { read_write = false; _ }; _ } -> return (Error `Is_read_only)
+  | { fd = Some fd; _ } ->
+    let offset = Int64.(mul sector (of_int t.info.sector_size)) in
+    let n' = Int64.(mul n (of_int t.info.sector_size)) in
+    if n = 0L then Lwt.return (Ok ())
+    else if Int64.add sector n > t.info.size_sectors then begin
+      Log.err (fun f -> f "write_zeroes beyond end of file: sector_start (%Ld) + len (%Ld) > size_sectors (%Ld)"
+                  sector n t.info.size_sectors);
+      lwt_wrap_exn t "write_zeroes" offset (fun () -> fail End_of_file)
+    end else if is_win32 then write_zero_buffers t sector n
+    else begin
+      lwt_wrap_exn t "write_zeroes" offset
+        (fun () ->
+           with_request t ~upto:(Int64.add sector n) (fun () -> zero_range t fd offset n' unmap)
+           >>= fun zeroed ->
+           ( if zeroed then Lwt.return (Ok ()) else write_zero_buffers t sector n )
+           >|= fun r ->
+           ( match r, t.checksums with
+             | Ok (), Some c -> Block_checksum.zeroed c sector n
+             | _, _ -> () );
+           r
+        )
+    end
+
+external copy_range_job: Unix.file_descr -> Unix.file_descr -> int64 -> int64 -> int64 -> int64 Lwt_unix.job = "mirage_block_unix_copy_range_job"
+
+(* The fallback copies [copy_buffers] buffers of [copy_buffer_size] bytes
+   concurrently, so reads of one overlap writes of another *)
+let copy_buffer_size = 1 lsl 20
+let copy_buffers = 4
+
+(* Each kernel copy is at most this long, so a job doesn't hold one of the
+   Lwt_unix threads for minutes *)
+let max_kernel_copy = Int64.shift_left 1L 30
+
+let rec iter_s f = function
+  | [] -> Lwt.return (Ok ())
+  | x :: xs -> f x >>|= fun () -> iter_s f xs
+
+(* Copy [n] sectors from [sector] in [src] to the same place in [dst] through
+   user space *)
+let copy_through_buffers ~src ~dst pool sector n =
+  let ss = src.info.sector_size in
+  let chunk = Int64.of_int (Block_pool.buffer_size pool / ss) in
+  let stop = Int64.add sector n in
+  let next = ref sector in
+  let rec worker () =
+    if !next >= stop then Lwt.return (Ok ()) else begin
+      let sector = !next in
+      let count = min chunk (Int64.sub stop sector) in
+      next := Int64.add sector count;
+      Block_pool.with_buffer pool
+        (fun buf ->
+           let buf = Cstruct.sub buf 0 (Int64.to_int count * ss) in
+           ( read src sector [ buf ]
+             >|= function
+             | Error e -> Error (e :> write_error)
+             | Ok () -> Ok () )
+           >>|= fun () ->
+           write dst sector [ buf ])
+      >>|= worker
+    end in
+  let rec workers acc i = if i = 0 then acc else workers (worker () :: acc) (i - 1) in
+  Lwt_list.fold_left_s (fun acc w ->
+      w >|= fun r -> match acc with Error _ -> acc | Ok () -> r
+    ) (Ok ()) (workers [] copy_buffers)
+
+(* Like [write_through] for data which the kernel put there *)
+let copied_by_kernel x offset length f =
+  invalidate_readahead x offset length;
+  ( match x.checksums with
+    | None -> ()
+    | Some c ->
+      let ss = Int64.of_int x.info.sector_size in
+      Block_checksum.forget c (Int64.div offset ss) (Int64.div length ss) );
+  ( match x.cache with
+    | None -> ()
+    | Some c -> Block_cache.invalidate c offset length );
+  ( match x.extent_map with
+    | None -> f ()
+    | Some m -> Block_extents.write m offset length f )
+  >|= fun copied ->
+  invalidate_readahead x offset length;
+  copied
+
+let copy ~src ~dst =
+  match src.fd, dst.fd with
+  | None, _ | _, None -> return (Error `Disconnected)
+  | Some _, Some _ when not dst.info.read_write -> return (Error `Is_read_only)
+  | Some src_fd, Some dst_fd ->
+    let ss = src.info.sector_size in
+    let size = Int64.(mul src.info.size_sectors (of_int ss)) in
+    if src.info.sector_size <> dst.info.sector_size
+    then fatalf "copy: %s and %s have different sector sizes" src.config.Config.path dst.config.Config.path
+    else if Int64.(mul dst.info.size_sectors (of_int ss)) < size
+    then fatalf "copy: %s is smaller than %s" dst.config.Config.path src.config.Config.path
+    else begin
+      (* Only allocated if the kernel can't do it all *)
+      let pool = lazy (create_pool ~sectors:(copy_buffer_size / ss) src copy_buffers) in
+      let kernel = ref (not is_win32) in
+      let rec copy_data sector n =
+        if n = 0L then Lwt.return (Ok ())
+        else if not !kernel then copy_through_buffers ~src ~dst (Lazy.force pool) sector n
+        else begin
+          let offset = Int64.(mul sector (of_int ss)) in
+          (* the kernel copies what is in the file; the rest of the last
+             sector is zeroes *)
+          let length = min (min (Int64.mul n (Int64.of_int ss)) max_kernel_copy) (Int64.sub src.size_bytes offset) in
+          if length <= 0L then copy_through_buffers ~src ~dst (Lazy.force pool) sector n
+          else begin
+            Lwt.catch
+              (fun () ->
+                 let upto = Int64.add sector n in
+                 let both f = if src == dst then with_request src ~upto f
+                   else with_request src ~upto (fun () -> with_request dst ~upto f) in
+                 both (fun () ->
+                     copied_by_kernel dst offset length
+                       (fun () ->
+                          Lwt_unix.run_job (copy_range_job (Lwt_unix.unix_file_descr src_fd)
+                                              (Lwt_unix.unix_file_descr dst_fd) offset offset length))))
+              (function
+                | Unix.Unix_error(e, _, _) ->
+                  Log.info (fun f -> f "copy %s to %s: copying through user space (%s)"
+                               src.config.Config.path dst.config.Config.path (Unix.error_message e));
+                  kernel := false;
+                  Lwt.return 0L
+                | e -> Lwt.fail e)
+            >>= fun copied ->
+            (* a partial sector is copied again through user space, which
+               pads it with zeroes *)
+            let sectors = Int64.div copied (Int64.of_int ss) in
+            if sectors = 0L then kernel := false;
+            copy_data (Int64.add sector sectors) (Int64.sub n sectors)
+          end
+        end in
+      lwt_wrap_exn src "copy" 0L
+        (fun () ->
+           (* The kernel reads and writes the files, not the caches *)
+           flush_cache src src_fd
+           >>= fun () ->
+           flush_cache dst dst_fd
+           >>= fun () ->
+           extents src ~from:0L ~len:src.info.size_sectors
+           >>= function
+           | Error e -> Lwt.return (Error (e :> write_error))
+           | Ok extents ->
+             iter_s (function
+                 | sector, n, `Data -> copy_data sector n
+                 | sector, n, `Hole -> write_zeroes ~unmap:true dst sector n
+               ) extents
+        )
+    end
@@ -17,7 +17,11 @@
 
 (** Block device on top of {!Lwt_unix} *)
 
-include Mirage_block.S
+type error = [ Mirage_block.error | `Msg of string ]
+
+type write_error = [ Mirage_block.write_error | `Msg of string ]
+
+include Mirage_block.S with type error := error and type write_error := write_error
 
 (** {2 Low-level convenience functions} *)
 
@@ -42,6 +46,37 @@ module Config: sig
 
   val string_of_sync: sync_behaviour option -> string
 
+  type engine = [
+    | `Threads (** one Lwt_unix job on the shared thread pool per request *)
+    | `Uring (** Linux io_uring, batching submissions from the same Lwt iteration *)
+    | `Aio (** Linux native AIO for reads and writes, requires [buffered = false] *)
+    | `Workers
+    (** threads owned by the device rather than the shared Lwt_unix pool, so
+        a slow device does not delay others. See {!Block_workers} *)
+  ]
+
+  val string_of_engine: engine -> string
+
+  type flush_method = [
+    | `Fsync (** flush data and metadata, the default *)
+    | `Fdatasync (** skip metadata which is not needed to read the data back *)
+    | `Sync_file_range
+    (** Linux only: write back dirty pages without flushing metadata or the
+        drive's cache. Only safe for fully allocated files on storage without
+        a volatile write cache; with [sync = Some `ToDrive] [`Fdatasync] is
+        used instead *)
+  ]
+
+  val string_of_flush_method: flush_method -> string
+
+  type detect_zeroes = [
+    | `Off (** write every buffer, the default *)
+    | `On (** zero long runs of zeroes in place, leaving them allocated *)
+    | `Unmap (** punch holes for long runs of zeroes *)
+  ]
+
+  val string_of_detect_zeroes: detect_zeroes -> string
+
   type t = {
     buffered: bool; (** true if I/O hits the OS disk caches, false if "direct" *)
     sync: sync_behaviour option;
@@ -49,6 +84,79 @@ module Config: sig
     lock: bool; (** true if the file should be locked preventing concurrent modification *)
     prefered_sector_size : int option;
         (** the size of sectors when it cannot be determined automatically *)
+    engine: engine;
+        (** how requests are submitted to the kernel. If the engine is not
+            available the device falls back to [`Threads] *)
+    queue_depth: int option;
+        (** the maximum number of reads and writes passed to the engine at
+            once; the rest wait in separate read and write queues with reads
+            served first. [None] passes every request on immediately *)
+    merge: bool;
+        (** true if queued requests for adjacent sectors should be sent as a
+            single vectored request. Only used with [queue_depth] *)
+    readahead: int option;
+        (** the largest window in bytes to prefetch ahead of sequential
+            reads, or [None] to read only what is asked for. Buffered
+            devices hint the kernel; unbuffered devices keep the window in
+            memory. See {!Block_readahead} *)
+    cache: int option;
+        (** the size in bytes of an in-process sector cache, or [None] for no
+            cache. See {!Block_cache} *)
+    cache_writeback: bool;
+        (** true if writes may stay in the cache until the next flush. Only
+            honoured with [sync = None]; otherwise the cache writes through *)
+    flush_method: flush_method;
+        (** the system call used by [flush]. Flushes which arrive while
+            another is in progress share the next one *)
+    extent_map: int option;
+        (** the granularity in bytes of an in-memory allocation map used by
+            [extents], or None to ask the filesystem every time *)
+    mmap: bool;
+        (** true if a read-only file should be memory-mapped, so that reads
+            are copies from the page cache without a trip through the
+            Lwt_unix thread pool *)
+    workers: int;
+        (** the number of threads started for [engine = `Workers] *)
+    cpus: int list;
+        (** the CPUs the workers may run on, or [[]] for any. Linux only *)
+    numa_node: int option;
+        (** if set, the workers run on the CPUs of this NUMA node instead of
+            [cpus]. Linux only *)
+    detect_zeroes: detect_zeroes;
+        (** whether writes are scanned for runs of zero sectors of at least
+            64 KiB, which are then zeroed like [write_zeroes] instead of
+            being transferred *)
+    dedup_stats: int option;
+        (** the size in bytes of a table of fingerprints of recently written
+            sectors, used to count duplicate sectors in {!stats}, or None to
+            not fingerprint writes *)
+    checksums: string option;
+        (** the path of a file holding a CRC32C of every block, or None.
+            Reads which don't match fail with [`Msg]. See {!Block_checksum} *)
+    checksum_verify: int;
+        (** the percentage of reads checked against the checksums; the rest
+            are left to {!scrub} *)
+    checksum_block: int option;
+        (** the number of bytes covered by each checksum, rounded up to a
+            power of two of at least a sector, or None for the larger of
+            4 KiB and the physical block size *)
+    preallocate: int option;
+        (** if set, {!resize} reserves space in chunks of this many bytes
+            ahead of the end of the file, so that a file which grows often
+            isn't fragmented. Ignored if the filesystem can't *)
+    iops_read: int option;
+        (** if set, at most this many reads are started per second, on
+            average. See {!Block_throttle} *)
+    iops_write: int option;
+    bps_read: int option;
+        (** if set, at most this many bytes are read per second, on average *)
+    bps_write: int option;
+    throttle_burst: int;
+        (** the number of seconds' worth of each limit which a device which
+            has been idle may use at once *)
+    throttle_group: string option;
+        (** if set, the limits are shared by every device connected with the
+            same group name in this process, and are those of the first *)
   }
   (** Configuration of a device *)
 
@@ -57,14 +165,50 @@ module Config: sig
     ?sync:sync_behaviour option ->
     ?lock:bool ->
     ?prefered_sector_size:int option ->
+    ?engine:engine ->
+    ?queue_depth:int option ->
+    ?merge:bool ->
+    ?readahead:int option ->
+    ?cache:int option ->
+    ?cache_writeback:bool ->
+    ?flush_method:flush_method ->
+    ?extent_map:int option ->
+    ?mmap:bool ->
+    ?workers:int ->
+    ?cpus:int list ->
+    ?numa_node:int option ->
+    ?detect_zeroes:detect_zeroes ->
+    ?dedup_stats:int option ->
+    ?checksums:string option ->
+    ?checksum_verify:int ->
+    ?checksum_block:int option ->
+    ?preallocate:int option ->
+    ?iops_read:int option ->
+    ?iops_write:int option ->
+    ?bps_read:int option ->
+    ?bps_write:int option ->
+    ?throttle_burst:int ->
+    ?throttle_group:string option ->
     string ->
     t
-  (** [create ?buffered ?sync ?lock path] constructs a configuration referencing
-      the file stored at [path]. *)
+  (** [create ?buffered ?sync ?lock ?engine ?queue_depth ?merge ?readahead
+      ?cache ?cache_writeback ?flush_method ?extent_map ?mmap ?workers ?cpus
+      ?numa_node ?detect_zeroes ?dedup_stats ?checksums ?checksum_verify
+      ?checksum_block ?preallocate ?iops_read ?iops_write ?bps_read ?bps_write
+      ?throttle_burst ?throttle_group path] constructs a configuration referencing the file stored
+      at [path]. *)
 
   val to_string: t -> string
   (** Marshal a config into a string of the form
-      file://<path>?sync=(0|1)&buffered=(0|1) *)
+      file://<path>?sync=(none|os|drive)&buffered=(0|1)&lock=(0|1)
+      &engine=(threads|uring|aio|workers)&queue_depth=<n>&merge=(0|1)&readahead=<bytes>
+      &cache=<bytes>&cache_writeback=(0|1)&flush=(fsync|fdatasync|sync_file_range)
+      &extent_map=<bytes>&mmap=(0|1)&workers=<n>&cpus=<list>&numa_node=<n>
+      &detect_zeroes=(off|on|unmap)&dedup_stats=<bytes>
+      &checksums=<path>&checksum_verify=<percent>&checksum_block=<bytes>
+      &preallocate=<bytes>&iops_read=<n>&iops_write=<n>&bps_read=<bytes>&bps_write=<bytes>
+      &throttle_burst=<seconds>&throttle_group=<name>
+      where a CPU list is in the format of {!Block_workers.cpus_of_string} *)
 
   val of_string: string -> (t, [`Msg of string ]) result
   (** Parse the result of a previous [to_string] invocation *)
@@ -75,6 +219,30 @@ val connect :
   ?sync:Config.sync_behaviour option ->
   ?lock:bool ->
   ?prefered_sector_size:int option ->
+  ?engine:Config.engine ->
+  ?queue_depth:int option ->
+  ?merge:bool ->
+  ?readahead:int option ->
+  ?cache:int option ->
+  ?cache_writeback:bool ->
+  ?flush_method:Config.flush_method ->
+  ?extent_map:int option ->
+  ?mmap:bool ->
+  ?workers:int ->
+  ?cpus:int list ->
+  ?numa_node:int option ->
+  ?detect_zeroes:Config.detect_zeroes ->
+  ?dedup_stats:int option ->
+  ?checksums:string option ->
+  ?checksum_verify:int ->
+  ?checksum_block:int option ->
+  ?preallocate:int option ->
+  ?iops_read:int option ->
+  ?iops_write:int option ->
+  ?bps_read:int option ->
+  ?bps_write:int option ->
+  ?throttle_burst:int ->
+  ?throttle_group:string option ->
   string ->
   t Lwt.t
 (** [connect ?buffered ?sync ?lock ?prefered_sector_size path] connects to a
@@ -83,12 +251,62 @@ val connect :
     choosen automatically for block devices, [prefered_sector_size] is used for
     regular files, the default value is [512]. These defaults can be changed by
     supplying the optional arguments [~buffered:false] and [~sync:false]
-    [~lock:true] *)
+    [~lock:true].
+
+    Opening, locking and probing the file are done by a single job on the
+    Lwt_unix thread pool, so a slow filesystem or drive doesn't block other
+    devices and many devices can connect at once. *)
+
+val stats : t -> Block_stats.snapshot
+(** [stats t] returns the request counts, bytes and latencies of [t] since
+    it was connected. See {!Block_stats.to_prometheus} to export them. *)
+
+type geometry = {
+  physical_block_size: int;
+  (** the unit the drive writes internally; writes of less than this are
+      read-modify-write. At least the sector size, and equal to it for
+      regular files. *)
+  optimal_io_size: int;
+  (** the request size the drive or filesystem prefers, or 0 if neither
+      says *)
+  discard_granularity: int;
+  (** the alignment discards are split at, or 0 if any range will do *)
+}
+
+val geometry : t -> geometry
+(** [geometry t] is what the drive said about itself when [t] was
+    connected *)
+
+val set_trace : t -> Block_trace.t option -> unit
+(** [set_trace t trace] records the stages of every subsequent request on
+    [t] in [trace], or stops tracing if [None]. Several devices may share a
+    trace. *)
+
+val create_pool : ?sectors:int -> t -> int -> Block_pool.t
+(** [create_pool ?sectors t count] allocates [count] reusable buffers of
+    [sectors] sectors each (8 by default), aligned for [O_DIRECT] on [t].
+    If [t] uses io_uring the buffers are registered with it, once per
+    device. *)
+
+val read_view : t -> int64 -> int -> (Cstruct.t, error) result Lwt.t
+(** [read_view t sector n] returns the [n] sectors starting at [sector] as a
+    view of the memory mapping, without copying, if [t] was connected with
+    [mmap] and is read-only. The view must not be written to. Otherwise
+    returns [`Unimplemented]. *)
 
 val resize : t -> int64 -> (unit, write_error) result Lwt.t
 (** [resize t new_size_sectors] attempts to resize the connected device
     to have the given number of sectors. If successful, subsequent calls
-    to [get_info] will reflect the new size. *)
+    to [get_info] will reflect the new size. Requests continue while the
+    device grows. Shrinking waits for the requests in flight to finish and
+    holds new ones back until it is done; new requests reaching beyond the
+    new size fail instead. *)
+
+val refresh_size : t -> (int64, error) result Lwt.t
+(** [refresh_size t] checks whether the file or block device has been grown
+    by someone else, such as a volume manager, and if so makes the new
+    sectors available. It returns the number of sectors. A device which has
+    shrunk, or which is memory mapped, keeps its old size. *)
 
 val flush : t -> (unit, write_error) result Lwt.t
 (** [flush t] flushes any buffers, if the file has been opened in buffered
@@ -103,6 +321,16 @@ val seek_mapped: t -> int64 -> (int64, error) result Lwt.t
     device which may have data in it (typically this is the next mapped
     region) *)
 
+val extents: t -> from:int64 -> len:int64 ->
+  ((int64 * int64 * [ `Data | `Hole ]) list, error) result Lwt.t
+(** [extents t ~from ~len] returns the [(start, length, kind)] extents, in
+    sectors, of the [len] sectors starting at [from], clipped to the device.
+    [`Hole] extents are guaranteed to read as zeroes and [`Data] extents may
+    have data in them. A whole range is mapped with a few system calls and
+    without disturbing sequential I/O, unlike {!seek_mapped} and
+    {!seek_unmapped}. With [extent_map] configured the answers are kept and
+    [`Data] is rounded out to the map's granularity. *)
+
 val discard: t -> int64 -> int64 -> (unit, write_error) result Lwt.t
 (** [discard sector n] signals that the [n] sectors starting at [sector]
     are no longer needed and the contents may be discarded.
@@ -110,6 +338,28 @@ val discard: t -> int64 -> int64 -> (unit, write_error) result Lwt.t
     Note the contents may not actually be irrecoverable: this is not a
     "secure erase". *)
 
+val write_zeroes: ?unmap:bool -> t -> int64 -> int64 -> (unit, write_error) result Lwt.t
+(** [write_zeroes ?unmap t sector n] sets the [n] sectors starting at
+    [sector] to zeroes without transferring buffers of zeroes where the
+    filesystem or device can do it ([FALLOC_FL_ZERO_RANGE] or [BLKZEROOUT]
+    on Linux). The sectors stay allocated unless [unmap] is set, in which
+    case a hole may be punched instead. Otherwise zeroes are written from a
+    shared buffer. *)
+
+val copy: src:t -> dst:t -> (unit, write_error) result Lwt.t
+(** [copy ~src ~dst] makes the start of [dst] identical to [src], which must
+    have the same sector size and be no larger. Only the data found by
+    {!extents} is copied; the holes are discarded from [dst]. Where the
+    filesystem allows, the data is cloned or copied by the kernel,
+    otherwise it goes through a few large buffers with several requests in
+    flight. [src] should not be written to during the copy. *)
+
+val scrub: t -> (int64 list, error) result Lwt.t
+(** [scrub t] reads the whole device and checks every block against its
+    checksum, if [t] was connected with [checksums], returning the first
+    sector of each block which doesn't match. Blocks whose checksums are
+    not known have them recorded. *)
+
 val to_config: t -> Config.t
 (** [to_config t] returns the configuration of a device *)
 
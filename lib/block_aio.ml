@@ -0,0 +1,57 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+module Raw = struct
+  type ctx
+
+  external create: int -> ctx = "mirage_block_unix_aio_create"
+  external eventfd: ctx -> Unix.file_descr = "mirage_block_unix_aio_eventfd"
+  external close: ctx -> unit = "mirage_block_unix_aio_close"
+
+  (* The prep_ functions return false if the queue is full. The buffers are
+     read by the C stubs as (buffer, off, len) blocks, see Block.Raw. *)
+  external prep_readv: ctx -> Unix.file_descr -> Cstruct.t list -> int64 -> int -> bool = "mirage_block_unix_aio_prep_readv"
+  external prep_writev: ctx -> Unix.file_descr -> Cstruct.t list -> int64 -> int -> bool = "mirage_block_unix_aio_prep_writev"
+
+  external submit: ctx -> int = "mirage_block_unix_aio_submit"
+  external reap: ctx -> int array -> int = "mirage_block_unix_aio_reap"
+  external withdraw: ctx -> int array -> int = "mirage_block_unix_aio_withdraw"
+end
+
+module Q = Block_ring.Make(struct
+  type ring = Raw.ctx
+  let submit = Raw.submit
+  let reap = Raw.reap
+  let withdraw = Raw.withdraw
+  let close = Raw.close
+end)
+
+type t = Q.t
+
+let create ?(entries = 128) () =
+  let ctx = Raw.create entries in
+  let eventfd =
+    try Raw.eventfd ctx
+    with e -> Raw.close ctx; raise e in
+  Q.create ~entries ctx eventfd
+
+let readv t fd offset buffers =
+  Q.enqueue t "io_submit preadv" buffers (Raw.prep_readv (Q.ring t) fd buffers offset)
+
+let writev t fd offset buffers =
+  Q.enqueue t "io_submit pwritev" buffers (Raw.prep_writev (Q.ring t) fd buffers offset)
+
+let close = Q.close
@@ -0,0 +1,40 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Linux native AIO ([io_submit]) engine used by {!Block} when configured
+    with [engine=aio]. This is only asynchronous for files opened with
+    [O_DIRECT]; flush and discard are not supported by the kernel interface
+    and remain thread pool jobs. *)
+
+type t
+(** An AIO context *)
+
+val create: ?entries:int -> unit -> t
+(** [create ?entries ()] creates a context with room for [entries] in-flight
+    requests.
+    @raise Unix.Unix_error if Linux AIO is not available *)
+
+val readv: t -> Unix.file_descr -> int64 -> Cstruct.t list -> int Lwt.t
+(** [readv t fd offset buffers] reads into [buffers] from [offset] and returns
+    the number of bytes read, which may be short *)
+
+val writev: t -> Unix.file_descr -> int64 -> Cstruct.t list -> int Lwt.t
+(** [writev t fd offset buffers] writes [buffers] at [offset] and returns
+    the number of bytes written, which may be short *)
+
+val close: t -> unit Lwt.t
+(** [close t] waits for in-flight requests to complete and then destroys
+    the context *)
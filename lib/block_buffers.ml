@@ -0,0 +1,80 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+let first_error results =
+  List.fold_left (fun acc r -> match acc, r with
+      | Error _, _ -> acc
+      | Ok (), r -> r
+    ) (Ok ()) results
+
+let lift (r: (unit, Block.error) result) : (unit, Block.write_error) result = match r with
+  | Ok () -> Ok ()
+  | Error e -> Error (e :> Block.write_error)
+
+let check op info sector buffers =
+  let ss = info.Mirage_block.sector_size in
+  match List.find (fun b -> Cstruct.len b mod ss <> 0) buffers with
+  | b -> Error (`Msg (Printf.sprintf "%s: buffer length (%d) is not a multiple of sector_size (%d)" op (Cstruct.len b) ss))
+  | exception Not_found ->
+    let n = Int64.of_int (List.fold_left (fun acc b -> acc + Cstruct.len b) 0 buffers / ss) in
+    if Int64.add sector n > info.Mirage_block.size_sectors
+    then Error (`Msg (Printf.sprintf "%s beyond end of device: sector_start (%Ld) + len (%Ld) > size_sectors (%Ld)"
+                     op sector n info.Mirage_block.size_sectors))
+    else Ok n
+
+let split buffers length =
+  let rec loop acc length = function
+    | bs when length = 0 -> List.rev acc, bs
+    | [] -> List.rev acc, []
+    | b :: bs when Cstruct.len b <= length -> loop (b :: acc) (length - Cstruct.len b) bs
+    | b :: bs -> List.rev (Cstruct.sub b 0 length :: acc), Cstruct.shift b length :: bs in
+  loop [] length buffers
+
+let sub buffers offset length =
+  let rec skip offset = function
+    | [] -> []
+    | b :: bs when offset >= Cstruct.len b -> skip (offset - Cstruct.len b) bs
+    | b :: bs -> take [] (Cstruct.shift b offset :: bs) length
+  and take acc bs length =
+    match bs with
+    | _ when length = 0 -> List.rev acc
+    | [] -> List.rev acc
+    | b :: _ when Cstruct.len b >= length -> List.rev (Cstruct.sub b 0 length :: acc)
+    | b :: bs -> take (b :: acc) bs (length - Cstruct.len b) in
+  skip offset buffers
+
+let rec blit_from dst off = function
+  | [] -> ()
+  | b :: bs ->
+    Cstruct.blit b 0 dst off (Cstruct.len b);
+    blit_from dst (off + Cstruct.len b) bs
+
+let rec blit_to src off = function
+  | [] -> ()
+  | b :: bs ->
+    Cstruct.blit src off b 0 (Cstruct.len b);
+    blit_to src (off + Cstruct.len b) bs
+
+let chunks ~sector_size ~chunk_sectors sector n buffers =
+  let rec loop acc sector n buffers =
+    if n = 0L then List.rev acc else begin
+      let chunk = Int64.div sector chunk_sectors in
+      let within = Int64.rem sector chunk_sectors in
+      let count = min n (Int64.sub chunk_sectors within) in
+      let these, rest = split buffers (Int64.to_int count * sector_size) in
+      loop ((chunk, within, count, these) :: acc) (Int64.add sector count) (Int64.sub n count) rest
+    end in
+  loop [] sector n buffers
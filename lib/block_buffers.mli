@@ -0,0 +1,51 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Checking, splitting and copying the buffer lists of requests, shared by
+    the devices built from {!Block} devices: {!Block_striped},
+    {!Block_tiered}, {!Block_overlay} and {!Block_compressed}. The buffers
+    are views: splitting them copies nothing. *)
+
+val first_error: (unit, 'e) result list -> (unit, 'e) result
+(** [first_error results] is the first error among [results], or [Ok ()] *)
+
+val lift: (unit, Block.error) result -> (unit, Block.write_error) result
+(** [lift r] is the result of a read as that of a write *)
+
+val check: string -> Mirage_block.info -> int64 -> Cstruct.t list -> (int64, [> `Msg of string ]) result
+(** [check op info sector buffers] returns the number of sectors in
+    [buffers], or an error if one of them isn't a whole number of sectors or
+    the request reaches beyond the end of the device *)
+
+val split: Cstruct.t list -> int -> Cstruct.t list * Cstruct.t list
+(** [split buffers length] returns [length] bytes of [buffers], and the
+    rest *)
+
+val sub: Cstruct.t list -> int -> int -> Cstruct.t list
+(** [sub buffers offset length] returns [length] bytes of [buffers]
+    starting [offset] bytes in *)
+
+val blit_from: Cstruct.t -> int -> Cstruct.t list -> unit
+(** [blit_from dst off buffers] copies [buffers] to [dst] from [off] *)
+
+val blit_to: Cstruct.t -> int -> Cstruct.t list -> unit
+(** [blit_to src off buffers] fills [buffers] from [src] starting at [off] *)
+
+val chunks: sector_size:int -> chunk_sectors:int64 -> int64 -> int64 -> Cstruct.t list ->
+  (int64 * int64 * int64 * Cstruct.t list) list
+(** [chunks ~sector_size ~chunk_sectors sector n buffers] splits the
+    request for [n] sectors from [sector] at the boundaries of chunks of
+    [chunk_sectors], as [(chunk, within, count, buffers)] in order *)
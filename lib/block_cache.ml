@@ -0,0 +1,342 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+external alloc_aligned: int -> int -> Cstruct.buffer = "mirage_block_unix_alloc_aligned"
+
+let page_size = 4096
+
+(* Segmented LRU: sectors enter the probationary segment and are promoted to
+   the protected segment when they are read again. A scan therefore only
+   ever displaces other sectors which have been seen once. *)
+type segment = Probation | Protected
+
+type node = {
+  key: int64; (* sector *)
+  slot: int;
+  data: Cstruct.t;
+  mutable dirty: bool;
+  mutable version: int; (* incremented on every write to a dirty node *)
+  mutable segment: segment;
+  mutable prev: node option; (* more recently used *)
+  mutable next: node option; (* less recently used *)
+}
+
+type lru = {
+  mutable head: node option;
+  mutable tail: node option;
+  mutable size: int;
+}
+
+type t = {
+  sector_size: int;
+  protected_capacity: int;
+  bypass: int; (* requests with more sectors than this are not cached *)
+  writeback: bool;
+  slab: Cstruct.t;
+  mutable free: int list;
+  table: (int64, node) Hashtbl.t;
+  probation: lru;
+  protected: lru;
+  writing: (int64, Cstruct.t) Hashtbl.t;
+  (* dirty sectors which have been evicted but may not be on the device yet *)
+  writeback_lock: Lwt_mutex.t;
+  (* write-back I/O is issued one batch at a time so that older data can
+     never overtake newer data for the same sector *)
+  mutable generation: int; (* incremented by every write and invalidation *)
+}
+
+let create ~sector_size ~writeback bytes =
+  let capacity = max 1 (bytes / sector_size) in
+  let slab = Cstruct.of_bigarray (alloc_aligned page_size (capacity * sector_size)) in
+  let rec slots acc i = if i < 0 then acc else slots (i :: acc) (i - 1) in
+  {
+    sector_size; protected_capacity = capacity * 4 / 5;
+    bypass = max 1 (capacity / 4); writeback; slab; free = slots [] (capacity - 1);
+    table = Hashtbl.create capacity;
+    probation = { head = None; tail = None; size = 0 };
+    protected = { head = None; tail = None; size = 0 };
+    writing = Hashtbl.create 16; writeback_lock = Lwt_mutex.create ();
+    generation = 0;
+  }
+
+let list t n = match n.segment with Probation -> t.probation | Protected -> t.protected
+
+let remove l n =
+  ( match n.prev with Some p -> p.next <- n.next | None -> l.head <- n.next );
+  ( match n.next with Some q -> q.prev <- n.prev | None -> l.tail <- n.prev );
+  n.prev <- None;
+  n.next <- None;
+  l.size <- l.size - 1
+
+let push_front l n =
+  n.prev <- None;
+  n.next <- l.head;
+  ( match l.head with Some h -> h.prev <- Some n | None -> l.tail <- Some n );
+  l.head <- Some n;
+  l.size <- l.size + 1
+
+let rec balance t =
+  if t.protected.size > t.protected_capacity then match t.protected.tail with
+    | None -> ()
+    | Some n ->
+      remove t.protected n;
+      n.segment <- Probation;
+      push_front t.probation n;
+      balance t
+
+let touch t n =
+  remove (list t n) n;
+  n.segment <- Protected;
+  push_front t.protected n;
+  balance t
+
+(* A copy of a dirty sector whose slot is about to be reused or which may
+   change while it is written out. These are the only allocations outside
+   the slab, and they last until the sector is on the device. *)
+let copy_of t data =
+  let c = Cstruct.of_bigarray (alloc_aligned page_size t.sector_size) in
+  Cstruct.blit data 0 c 0 t.sector_size;
+  c
+
+let drop t n =
+  remove (list t n) n;
+  Hashtbl.remove t.table n.key;
+  t.free <- n.slot :: t.free
+
+(* Make room for one more sector. A dirty victim is parked in [writing] and
+   returned so the caller can write it out. *)
+let evict t =
+  let victim = match t.probation.tail with
+    | Some n -> Some n
+    | None -> t.protected.tail in
+  match victim with
+  | None -> []
+  | Some n ->
+    drop t n;
+    if n.dirty then begin
+      let data = copy_of t n.data in
+      Hashtbl.replace t.writing n.key data;
+      [ n.key, data ]
+    end else []
+
+let insert t key data ~dirty =
+  match Hashtbl.find t.table key with
+  | n ->
+    Cstruct.blit data 0 n.data 0 t.sector_size;
+    if dirty then begin
+      n.dirty <- true;
+      n.version <- n.version + 1
+    end else n.dirty <- false;
+    []
+  | exception Not_found ->
+    let evicted = if t.free = [] then evict t else [] in
+    begin match t.free with
+      | [] -> evicted
+      | slot :: free ->
+        t.free <- free;
+        let n = {
+          key; slot; data = Cstruct.sub t.slab (slot * t.sector_size) t.sector_size;
+          dirty; version = 0; segment = Probation; prev = None; next = None;
+        } in
+        Cstruct.blit data 0 n.data 0 t.sector_size;
+        Hashtbl.replace t.table key n;
+        push_front t.probation n;
+        evicted
+    end
+
+let forget t key =
+  ( match Hashtbl.find t.table key with
+    | n -> drop t n
+    | exception Not_found -> () );
+  Hashtbl.remove t.writing key
+
+(* The sectors of a request as (sector, buffer) pairs *)
+let sectors t offset buffers =
+  let first = Int64.div offset (Int64.of_int t.sector_size) in
+  let _, acc = List.fold_left (fun (key, acc) b ->
+    let rec loop key acc off =
+      if off >= Cstruct.len b then key, acc
+      else loop (Int64.succ key) ((key, Cstruct.sub b off t.sector_size) :: acc) (off + t.sector_size) in
+    loop key acc 0
+  ) (first, []) buffers in
+  List.rev acc
+
+(* Write (sector, data) pairs as few vectored requests as possible *)
+let store_runs t ~store items =
+  let items = List.sort (fun (a, _) (b, _) -> compare a b) items in
+  let rec runs acc = function
+    | [] -> List.rev acc
+    | (key, data) :: rest ->
+      let rec extend last bufs = function
+        | (key', data') :: rest when key' = Int64.succ last -> extend key' (data' :: bufs) rest
+        | rest -> List.rev bufs, rest in
+      let bufs, rest = extend key [ data ] rest in
+      runs ((key, bufs) :: acc) rest in
+  Lwt_list.iter_p (fun (key, bufs) ->
+    store (Int64.mul key (Int64.of_int t.sector_size)) bufs
+  ) (runs [] items)
+
+(* Write evicted sectors unless something newer has replaced them *)
+let write_out t ~store evicted =
+  if evicted = [] then Lwt.return_unit
+  else Lwt_mutex.with_lock t.writeback_lock (fun () ->
+    let current = List.filter (fun (key, data) ->
+        match Hashtbl.find t.writing key with
+        | data' -> data' == data
+        | exception Not_found -> false
+      ) evicted in
+    Lwt.finalize
+      (fun () -> store_runs t ~store current)
+      (fun () ->
+        List.iter (fun (key, data) ->
+          match Hashtbl.find t.writing key with
+          | data' when data' == data -> Hashtbl.remove t.writing key
+          | _ | exception Not_found -> ()
+        ) current;
+        Lwt.return_unit)
+  )
+
+let read t ~fetch ~store offset buffers =
+  let sectors = sectors t offset buffers in
+  if List.for_all (fun (key, _) -> Hashtbl.mem t.table key) sectors then begin
+    List.iter (fun (key, b) ->
+      let n = Hashtbl.find t.table key in
+      Cstruct.blit n.data 0 b 0 t.sector_size;
+      touch t n
+    ) sectors;
+    Lwt.return_unit
+  end else begin
+    let generation = t.generation in
+    (* Dirty data may reach the device while we are reading, so keep a copy
+       of anything which is newer than the device now. *)
+    let pinned = List.fold_left (fun acc (key, _) ->
+        match Hashtbl.find t.table key with
+        | n when n.dirty -> (key, copy_of t n.data) :: acc
+        | _ -> acc
+        | exception Not_found ->
+          begin match Hashtbl.find t.writing key with
+            | data -> (key, data) :: acc
+            | exception Not_found -> acc
+          end
+      ) [] sectors in
+    fetch offset buffers
+    >>= fun () ->
+    let cacheable = List.length sectors <= t.bypass in
+    let evicted = List.fold_left (fun evicted (key, b) ->
+        match Hashtbl.find t.table key with
+        | n ->
+          Cstruct.blit n.data 0 b 0 t.sector_size;
+          touch t n;
+          evicted
+        | exception Not_found ->
+          match List.assoc key pinned with
+          | data ->
+            Cstruct.blit data 0 b 0 t.sector_size;
+            evicted
+          | exception Not_found ->
+            if cacheable && generation = t.generation && not (Hashtbl.mem t.writing key)
+            then insert t key b ~dirty:false @ evicted
+            else evicted
+      ) [] sectors in
+    write_out t ~store evicted
+  end
+
+let write t ~store offset buffers =
+  t.generation <- t.generation + 1;
+  let generation = t.generation in
+  let sectors = sectors t offset buffers in
+  let cacheable = List.length sectors <= t.bypass in
+  if t.writeback && cacheable then begin
+    let evicted = List.fold_left (fun evicted (key, b) ->
+        insert t key b ~dirty:true @ evicted
+      ) [] sectors in
+    write_out t ~store evicted
+  end else if t.writeback then begin
+    (* Too big to cache: write it straight to the device after any older
+       write-back of the same sectors *)
+    Lwt_mutex.with_lock t.writeback_lock (fun () ->
+      List.iter (fun (key, _) -> Hashtbl.remove t.writing key) sectors;
+      store offset buffers
+      >|= fun () ->
+      List.iter (fun (key, b) ->
+        match Hashtbl.find t.table key with
+        | n -> ignore (insert t n.key b ~dirty:false)
+        | exception Not_found -> ()
+      ) sectors
+    )
+  end else begin
+    Lwt.catch
+      (fun () -> store offset buffers)
+      (fun e ->
+        List.iter (fun (key, _) -> forget t key) sectors;
+        Lwt.fail e)
+    >|= fun () ->
+    (* If another write overlapped with ours we cannot know which reached
+       the device last. *)
+    if generation <> t.generation
+    then List.iter (fun (key, _) -> forget t key) sectors
+    else List.iter (fun (key, b) ->
+        if cacheable || Hashtbl.mem t.table key
+        then ignore (insert t key b ~dirty:false)
+      ) sectors
+  end
+
+let flush t ~store =
+  if not t.writeback then Lwt.return_unit
+  else Lwt_mutex.with_lock t.writeback_lock (fun () ->
+    let parked = Hashtbl.fold (fun key data acc -> (key, data) :: acc) t.writing [] in
+    store_runs t ~store parked
+    >>= fun () ->
+    List.iter (fun (key, data) ->
+      match Hashtbl.find t.writing key with
+      | data' when data' == data -> Hashtbl.remove t.writing key
+      | _ | exception Not_found -> ()
+    ) parked;
+    let dirty = Hashtbl.fold (fun _ n acc ->
+        if n.dirty then (n, n.version, copy_of t n.data) :: acc else acc
+      ) t.table [] in
+    store_runs t ~store (List.map (fun (n, _, data) -> n.key, data) dirty)
+    >|= fun () ->
+    List.iter (fun (n, version, _) ->
+      match Hashtbl.find t.table n.key with
+      | n' when n' == n && n.version = version -> n.dirty <- false
+      | _ | exception Not_found -> ()
+    ) dirty
+  )
+
+let invalidate t offset length =
+  t.generation <- t.generation + 1;
+  let first = Int64.div offset (Int64.of_int t.sector_size) in
+  let n = Int64.div length (Int64.of_int t.sector_size) in
+  if Int64.to_int n > Hashtbl.length t.table then begin
+    let last = Int64.add first n in
+    let keys = Hashtbl.fold (fun key _ acc -> key :: acc) t.table [] in
+    let parked = Hashtbl.fold (fun key _ acc -> key :: acc) t.writing [] in
+    List.iter (fun key -> if key >= first && key < last then forget t key) (keys @ parked)
+  end else begin
+    let rec loop i = if i < n then begin forget t (Int64.add first i); loop (Int64.succ i) end in
+    loop 0L
+  end
+
+let invalidate_all t =
+  t.generation <- t.generation + 1;
+  Hashtbl.iter (fun _ n -> t.free <- n.slot :: t.free) t.table;
+  Hashtbl.reset t.table;
+  Hashtbl.reset t.writing;
+  t.probation.head <- None; t.probation.tail <- None; t.probation.size <- 0;
+  t.protected.head <- None; t.protected.tail <- None; t.protected.size <- 0
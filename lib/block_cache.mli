@@ -0,0 +1,64 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** A bounded cache of sectors used by {!Block} when configured with
+    [cache=<bytes>], mainly so that [O_DIRECT] devices do not go to the disk
+    for every read of a hot metadata sector. The cached sectors live in one
+    slab which is allocated when the cache is created. The exception is
+    write-back: a dirty sector which is evicted, or which a read has to
+    keep while it goes to the device, is copied to a buffer of its own
+    until it has been written out.
+
+    Eviction uses a segmented LRU: a sector read for the first time is
+    probationary and is only protected once it is read again, so a
+    sequential scan cannot flush the working set. Requests larger than a
+    quarter of the cache bypass it.
+
+    Writes are written through unless [writeback] is set, in which case they
+    stay in the cache until they are evicted or {!flush} is called. *)
+
+type t
+
+val create: sector_size:int -> writeback:bool -> int -> t
+(** [create ~sector_size ~writeback bytes] creates a cache holding up to
+    [bytes] of data *)
+
+val read:
+  t ->
+  fetch:(int64 -> Cstruct.t list -> unit Lwt.t) ->
+  store:(int64 -> Cstruct.t list -> unit Lwt.t) ->
+  int64 -> Cstruct.t list -> unit Lwt.t
+(** [read t ~fetch ~store offset buffers] fills [buffers] from the cache,
+    calling [fetch] to read from the device if any sector is missing. Dirty
+    sectors evicted to make room are written with [store]. *)
+
+val write:
+  t ->
+  store:(int64 -> Cstruct.t list -> unit Lwt.t) ->
+  int64 -> Cstruct.t list -> unit Lwt.t
+(** [write t ~store offset buffers] writes [buffers] to the cache and, unless
+    the cache is write-back, to the device with [store] *)
+
+val flush: t -> store:(int64 -> Cstruct.t list -> unit Lwt.t) -> unit Lwt.t
+(** [flush t ~store] writes every dirty sector to the device *)
+
+val invalidate: t -> int64 -> int64 -> unit
+(** [invalidate t offset length] drops the sectors in the range, including
+    any unwritten data, for example after a discard *)
+
+val invalidate_all: t -> unit
+(** [invalidate_all t] drops everything. Call {!flush} first to keep dirty
+    data. *)
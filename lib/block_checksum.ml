@@ -0,0 +1,386 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+let src =
+  let src = Logs.Src.create "mirage-block-unix.checksum" ~doc:"Sector checksums for mirage-block-unix" in
+  Logs.Src.set_level src (Some Logs.Info);
+  src
+
+module Log = (val Logs.src_log src : Logs.LOG)
+
+external crc32c_sectors: Cstruct.buffer -> int -> int -> int -> Bytes.t -> int -> unit =
+  "mirage_block_unix_crc32c_sectors_byte" "mirage_block_unix_crc32c_sectors" [@@noalloc]
+external mismatch: Bytes.t -> Bytes.t -> Bytes.t -> int -> int -> int = "mirage_block_unix_checksum_mismatch" [@@noalloc]
+
+(* The file starts with a header page: the magic, the block size, the
+   number of blocks and whether it was closed cleanly, as 64-bit
+   big-endian numbers. The table follows with a little-endian CRC32C per
+   block, where 0 means the checksum is not known. *)
+let magic = "MBUCSUM1"
+let page = 4096
+let entry = 4
+
+(* The checksums of the whole blocks among [n] sectors from [sector] *)
+type sums = {
+  sector: int64;
+  n: int64;
+  first: int; (* block *)
+  crcs: Bytes.t;
+}
+
+type t = {
+  path: string;
+  fd: Lwt_unix.file_descr;
+  sector_size: int;
+  block: int; (* bytes, a multiple of [sector_size] *)
+  spb: int; (* sectors per block *)
+  mutable table: Bytes.t;
+  dirty: (int, unit) Hashtbl.t; (* pages of the table to write at the next flush *)
+  mutable resized: bool; (* the file and header need updating *)
+  percent: int; (* of reads which are verified *)
+  mutable reads: int;
+  zero_sum: Bytes.t; (* of a block of zeroes *)
+  writes: (int, sums) Hashtbl.t; (* in flight *)
+  mutable next_write: int;
+  lock: Lwt_mutex.t;
+  mutable scratch: Cstruct.t option; (* a block which straddles buffers is copied here *)
+}
+
+let blocks t = Bytes.length t.table / entry
+
+let block_size t = t.block
+
+(* The sectors past the last whole block have no checksum *)
+let table_bytes ~spb size_sectors =
+  let n = Int64.(mul (div size_sectors (of_int spb)) (of_int entry)) in
+  if n > Int64.of_int Sys.max_string_length
+  then failwith (Printf.sprintf "Block_checksum: %Ld sectors need a table of %Ld bytes; use larger blocks" size_sectors n)
+  else Int64.to_int n
+
+let rec really_write fd off buf pos len =
+  if len = 0 then Lwt.return_unit else begin
+    Lwt_unix.LargeFile.lseek fd off Unix.SEEK_SET
+    >>= fun _ ->
+    Lwt_unix.write fd buf pos len
+    >>= fun n ->
+    really_write fd (Int64.add off (Int64.of_int n)) buf (pos + n) (len - n)
+  end
+
+(* Reads stop early at the end of the file, leaving the rest of [buf] *)
+let rec read_upto fd off buf pos len =
+  if len = 0 then Lwt.return_unit else begin
+    Lwt_unix.LargeFile.lseek fd off Unix.SEEK_SET
+    >>= fun _ ->
+    Lwt_unix.read fd buf pos len
+    >>= function
+    | 0 -> Lwt.return_unit
+    | n -> read_upto fd (Int64.add off (Int64.of_int n)) buf (pos + n) (len - n)
+  end
+
+let header t ~clean =
+  let b = Cstruct.create page in
+  Cstruct.blit_from_string magic 0 b 0 (String.length magic);
+  Cstruct.BE.set_uint64 b 8 (Int64.of_int t.block);
+  Cstruct.BE.set_uint64 b 16 (Int64.of_int (blocks t));
+  Cstruct.BE.set_uint64 b 24 (if clean then 1L else 0L);
+  Cstruct.to_bytes b
+
+let write_header t ~clean =
+  let b = header t ~clean in
+  really_write t.fd 0L b 0 page
+
+let mark t pos len =
+  for p = pos / page to (pos + len - 1) / page do
+    Hashtbl.replace t.dirty p ()
+  done
+
+(* The first block wholly within [n] sectors from [sector] and the number
+   of them *)
+let spanned t sector n =
+  let spb = Int64.of_int t.spb in
+  let first = Int64.(div (add sector (pred spb)) spb) and last = Int64.(div (add sector n) spb) in
+  Int64.to_int first, max 0 (Int64.to_int (Int64.sub last first))
+
+(* [gather bufs skip dst] copies the bytes from [skip] in [bufs] to [dst] *)
+let rec gather bufs skip dst off =
+  if off < Cstruct.len dst then match bufs with
+    | [] -> ()
+    | b :: bs ->
+      let k = min (Cstruct.len b - skip) (Cstruct.len dst - off) in
+      Cstruct.blit b skip dst off k;
+      gather bs 0 dst (off + k)
+
+let rec drop bufs skip k = match bufs with
+  | [] -> [], 0
+  | b :: bs ->
+    let left = Cstruct.len b - skip in
+    if k < left then bufs, skip + k else drop bs 0 (k - left)
+
+let sums t sector buffers =
+  let n = Int64.of_int (Cstructs.len buffers / t.sector_size) in
+  let first, count = spanned t sector n in
+  let crcs = Bytes.create (count * entry) in
+  let rec loop bufs skip i =
+    if i < count then match bufs with
+      | [] -> ()
+      | b :: bs ->
+        let len = Cstruct.len b in
+        if skip >= len then loop bs (skip - len) i
+        else if len - skip >= t.block then begin
+          let whole = min ((len - skip) / t.block) (count - i) in
+          crc32c_sectors b.Cstruct.buffer (b.Cstruct.off + skip) (whole * t.block) t.block crcs (i * entry);
+          loop bufs (skip + whole * t.block) (i + whole)
+        end else begin
+          let scratch = match t.scratch with
+            | Some s -> s
+            | None -> let s = Cstruct.create t.block in t.scratch <- Some s; s in
+          gather bufs skip scratch 0;
+          crc32c_sectors scratch.Cstruct.buffer scratch.Cstruct.off t.block t.block crcs (i * entry);
+          let bufs, skip = drop bufs skip t.block in
+          loop bufs skip (i + 1)
+        end in
+  loop buffers (Int64.(to_int (sub (mul (of_int first) (of_int t.spb)) sector)) * t.sector_size) 0;
+  { sector; n; first; crcs }
+
+(* [fill t first last f] calls [f pos] for the entry of each block from
+   [first] to before [last] which is in the table *)
+let fill t first last f =
+  let first = max 0 first and last = min (blocks t) last in
+  if first < last then begin
+    let first = first * entry and last = last * entry in
+    let rec loop pos = if pos < last then (f pos; loop (pos + entry)) in
+    loop first;
+    mark t first (last - first)
+  end
+
+let unknown t pos = Bytes.fill t.table pos entry '\000'
+
+(* A block partly within the sectors has an unknown checksum *)
+let forget_edges t sector n =
+  if n > 0L then begin
+    let spb = Int64.of_int t.spb in
+    let edge s =
+      if Int64.rem s spb <> 0L then begin
+        let b = Int64.to_int (Int64.div s spb) in
+        fill t b (b + 1) (unknown t)
+      end in
+    edge sector;
+    edge (Int64.add sector n)
+  end
+
+let store t s =
+  let count = Bytes.length s.crcs / entry in
+  fill t s.first (s.first + count)
+    (fun pos -> Bytes.blit s.crcs (pos - s.first * entry) t.table pos entry);
+  forget_edges t s.sector s.n
+
+let expected t sector n =
+  let first, count = spanned t sector n in
+  let out = Bytes.make (count * entry) '\000' in
+  let last = min (blocks t) (first + count) in
+  if first < last then Bytes.blit t.table (first * entry) out 0 ((last - first) * entry);
+  out
+
+let same a apos b bpos =
+  Bytes.get a apos = Bytes.get b bpos && Bytes.get a (apos + 1) = Bytes.get b (bpos + 1)
+  && Bytes.get a (apos + 2) = Bytes.get b (bpos + 2) && Bytes.get a (apos + 3) = Bytes.get b (bpos + 3)
+
+(* [in_flight t b computed i] is true if a write in flight carries the
+   [i]th checksum of [computed], that of block [b]: the read may have seen
+   its data before it completed *)
+let in_flight t b computed i =
+  Hashtbl.fold (fun _ s found ->
+      found || begin
+        let j = b - s.first in
+        j >= 0 && j < Bytes.length s.crcs / entry && same s.crcs (j * entry) computed (i * entry)
+      end
+    ) t.writes false
+
+let mismatches t ~expected sector buffers =
+  let s = sums t sector buffers in
+  let n = min (Bytes.length s.crcs / entry) (blocks t - s.first) in
+  if n <= 0 || Bytes.length expected <> Bytes.length s.crcs then [] else begin
+    let computed = if n * entry = Bytes.length s.crcs then s.crcs else Bytes.sub s.crcs 0 (n * entry) in
+    let rec loop acc start =
+      let i = mismatch computed expected t.table (s.first * entry) start in
+      if i >= n then List.rev acc
+      else if in_flight t (s.first + i) computed i then loop acc (i + 1)
+      else loop (Int64.(mul (of_int (s.first + i)) (of_int t.spb)) :: acc) (i + 1) in
+    loop [] 0
+  end
+
+let is_unknown t pos =
+  Bytes.get t.table pos = '\000' && Bytes.get t.table (pos + 1) = '\000'
+  && Bytes.get t.table (pos + 2) = '\000' && Bytes.get t.table (pos + 3) = '\000'
+
+let learn t sector buffers =
+  let s = sums t sector buffers in
+  let count = Bytes.length s.crcs / entry in
+  let first = max 0 s.first and last = min (blocks t) (s.first + count) in
+  for b = first to last - 1 do
+    let pos = b * entry in
+    if is_unknown t pos then begin
+      Bytes.blit s.crcs ((b - s.first) * entry) t.table pos entry;
+      mark t pos entry
+    end
+  done
+
+let sample t =
+  let n = t.reads in
+  t.reads <- n + 1;
+  (n + 1) * t.percent / 100 > n * t.percent / 100
+
+let zeroed t sector n =
+  let first, count = spanned t sector n in
+  fill t first (first + count) (fun pos -> Bytes.blit t.zero_sum 0 t.table pos entry);
+  forget_edges t sector n
+
+let forget t sector n =
+  let spb = Int64.of_int t.spb in
+  let first = Int64.div sector spb and last = Int64.(div (add (add sector n) (pred spb)) spb) in
+  fill t (Int64.to_int first) (Int64.to_int last) (unknown t)
+
+let submit t s =
+  forget_edges t s.sector s.n;
+  let w = t.next_write in
+  t.next_write <- w + 1;
+  Hashtbl.replace t.writes w s;
+  w
+
+let complete t w ~ok = match Hashtbl.find_opt t.writes w with
+  | None -> ()
+  | Some s ->
+    Hashtbl.remove t.writes w;
+    if ok then store t s
+    else forget t s.sector s.n
+
+let max_sectors t = Int64.(mul (of_int (Sys.max_string_length / entry)) (of_int t.spb))
+
+let resize t size_sectors =
+  let table = Bytes.make (table_bytes ~spb:t.spb size_sectors) '\000' in
+  Bytes.blit t.table 0 table 0 (min (Bytes.length t.table) (Bytes.length table));
+  t.table <- table;
+  (* pages past the old end are zeroes when the file is extended *)
+  Hashtbl.filter_map_inplace (fun p () -> if p * page < Bytes.length table then Some () else None) t.dirty;
+  t.resized <- true
+
+let flush t =
+  Lwt_mutex.with_lock t.lock
+    (fun () ->
+       let pages = List.sort compare (Hashtbl.fold (fun p () acc -> p :: acc) t.dirty []) in
+       Hashtbl.reset t.dirty;
+       let resized = t.resized in
+       t.resized <- false;
+       let runs = List.fold_left (fun acc p -> match acc with
+           | (first, n) :: rest when first + n = p -> (first, n + 1) :: rest
+           | _ -> (p, 1) :: acc
+         ) [] pages in
+       let table_length = Bytes.length t.table in
+       Lwt.catch
+         (fun () ->
+            ( if resized then begin
+                Lwt_unix.LargeFile.ftruncate t.fd (Int64.of_int (page + table_length))
+                >>= fun () ->
+                write_header t ~clean:false
+              end else Lwt.return_unit )
+            >>= fun () ->
+            Lwt_list.iter_s (fun (first, n) ->
+                let pos = first * page in
+                let len = min (n * page) (table_length - pos) in
+                if len <= 0 then Lwt.return_unit
+                else really_write t.fd (Int64.of_int (page + pos)) t.table pos len
+              ) (List.rev runs)
+            >>= fun () ->
+            Lwt_unix.fsync t.fd)
+         (fun e ->
+            List.iter (fun p -> Hashtbl.replace t.dirty p ()) pages;
+            if resized then t.resized <- true;
+            Lwt.fail e)
+    )
+
+let default_block = 4096
+
+let connect ?(verify = 100) ?(block = default_block) ~sector_size path size_sectors =
+  (* a power of two, so blocks don't straddle the buffers of a scrub *)
+  let rec round b = if b >= block then b else round (2 * b) in
+  let block = round sector_size in
+  let spb = block / sector_size in
+  ( match table_bytes ~spb size_sectors with
+    | n -> Lwt.return n
+    | exception e -> Lwt.fail e )
+  >>= fun length ->
+  Lwt_unix.openfile path [ Unix.O_RDWR; Unix.O_CREAT ] 0o644
+  >>= fun fd ->
+  let zero_sum = Bytes.create entry in
+  crc32c_sectors (Cstruct.create block).Cstruct.buffer 0 block block zero_sum 0;
+  let t = {
+    path; fd; sector_size; block; spb;
+    table = Bytes.make length '\000';
+    dirty = Hashtbl.create 16; resized = true;
+    percent = max 0 (min 100 verify); reads = 0; zero_sum;
+    writes = Hashtbl.create 16; next_write = 0;
+    lock = Lwt_mutex.create (); scratch = None;
+  } in
+  Lwt.catch
+    (fun () ->
+       let h = Bytes.make page '\000' in
+       read_upto fd 0L h 0 page
+       >>= fun () ->
+       let h = Cstruct.of_bytes h in
+       let formatted = Cstruct.to_string (Cstruct.sub h 0 (String.length magic)) = magic in
+       let clean = Cstruct.BE.get_uint64 h 24 = 1L in
+       let stored = Cstruct.BE.get_uint64 h 16 in
+       Lwt_unix.LargeFile.fstat fd
+       >>= fun stats ->
+       ( if not formatted && stats.Unix.LargeFile.st_size > 0L then
+           Lwt.fail_with (Printf.sprintf "Block_checksum.connect: %s is not a checksum file" path)
+         else if not formatted then Lwt.return_unit
+         else if Cstruct.BE.get_uint64 h 8 <> Int64.of_int block then begin
+           Log.warn (fun f -> f "%s is for a different block size: forgetting the checksums" path);
+           Lwt.return_unit
+         end else if not clean then begin
+           (* Writes may have reached the device without their checksums or
+              the other way round *)
+           Log.warn (fun f -> f "%s was not closed cleanly: forgetting the checksums" path);
+           Lwt.return_unit
+         end else begin
+           let n = min (Int64.to_int stored * entry) length in
+           read_upto fd (Int64.of_int page) t.table 0 n
+         end )
+       >>= fun () ->
+       ( if formatted && clean && Cstruct.BE.get_uint64 h 8 = Int64.of_int block
+         then Lwt.return_unit
+         else Lwt_unix.LargeFile.ftruncate fd (Int64.of_int page) )
+       >>= fun () ->
+       (* Until it is closed cleanly the table may not match the device *)
+       flush t)
+    (fun e ->
+       Lwt_unix.close fd
+       >>= fun () ->
+       Lwt.fail e)
+  >|= fun () ->
+  t
+
+let close t =
+  flush t
+  >>= fun () ->
+  write_header t ~clean:true
+  >>= fun () ->
+  Lwt_unix.fsync t.fd
+  >>= fun () ->
+  Lwt_unix.close t.fd
@@ -0,0 +1,102 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** CRC32C checksums of blocks of sectors kept in a sidecar file, used by
+    {!Block} when configured with [checksums=<path>]. Writes record the
+    checksums of the blocks they cover, discards and resizes update them,
+    and a configurable share of reads is verified; {!Block.scrub} checks the
+    rest lazily. The checksums are computed with the CPU's CRC32C
+    instructions where it has them.
+
+    A block is a power of two of at least a sector, 4 KiB by default, so
+    the table takes a thousandth of the size of the device in memory. A
+    request which covers part of a block forgets its checksum, as do the
+    sectors past the last whole block, which are never checked.
+
+    The table is kept in memory and written back by {!flush}. If the file
+    was not closed cleanly every checksum is forgotten, since writes may
+    have reached the device without theirs; they are learnt again as the
+    blocks are written or scrubbed. *)
+
+type t
+
+type sums
+(** the checksums computed for a write *)
+
+val default_block: int
+(** the block size used unless [connect] is given one: 4 KiB *)
+
+val connect: ?verify:int -> ?block:int -> sector_size:int -> string -> int64 -> t Lwt.t
+(** [connect ?verify ?block ~sector_size path size_sectors] opens or creates
+    the checksum file at [path] for a device of [size_sectors] sectors.
+    [verify] is the percentage of reads checked (100 by default). [block]
+    is rounded up to a power of two of at least [sector_size].
+    @raise Failure if [path] is not a checksum file or the table would be
+    longer than [Sys.max_string_length] *)
+
+val block_size: t -> int
+(** [block_size t] is the number of bytes covered by each checksum *)
+
+val max_sectors: t -> int64
+(** [max_sectors t] is the size of the largest device the table can cover *)
+
+val sums: t -> int64 -> Cstruct.t list -> sums
+(** [sums t sector buffers] computes the checksums of the blocks wholly
+    within [buffers], to be written from [sector] *)
+
+val submit: t -> sums -> int
+(** [submit t sums] records that a write with checksums [sums] is in
+    flight, and returns a handle for {!complete}. Until then reads accept
+    its checksums as well. *)
+val complete: t -> int -> ok:bool -> unit
+(** [complete t w ~ok] records the checksums of the write [w] if it
+    succeeded, and forgets those of its sectors otherwise, since they may
+    have been partly written *)
+
+val sample: t -> bool
+(** [sample t] is true if the next read should be verified *)
+
+val expected: t -> int64 -> int -> Bytes.t
+(** [expected t sector n] copies the checksums of the blocks wholly within
+    [n] sectors, to be compared with the data once it has been read *)
+
+val mismatches: t -> expected:Bytes.t -> int64 -> Cstruct.t list -> int64 list
+(** [mismatches t ~expected sector buffers] returns the first sector of
+    each block read into [buffers] whose checksum matches neither
+    [expected], the current one nor that of a write in flight. Blocks
+    without a known checksum always match. *)
+
+val learn: t -> int64 -> Cstruct.t list -> unit
+(** [learn t sector buffers] records the checksums of the blocks which
+    don't have one *)
+
+val zeroed: t -> int64 -> int64 -> unit
+(** [zeroed t sector n] records that the sectors read as zeroes *)
+
+val forget: t -> int64 -> int64 -> unit
+(** [forget t sector n] records that the checksums of the blocks the
+    sectors are part of are not known *)
+
+val resize: t -> int64 -> unit
+(** [resize t size_sectors] changes the size of the device. New blocks
+    have no checksums.
+    @raise Failure if [size_sectors] is larger than [max_sectors t] *)
+
+val flush: t -> unit Lwt.t
+(** [flush t] writes the changed checksums to the file and flushes it *)
+
+val close: t -> unit Lwt.t
+(** [close t] flushes and closes the file, marking it as closed cleanly *)
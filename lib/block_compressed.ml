@@ -0,0 +1,581 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+let src =
+  let src = Logs.Src.create "mirage-block-unix.compressed" ~doc:"Compressed image files for mirage-block-unix" in
+  Logs.Src.set_level src (Some Logs.Info);
+  src
+
+module Log = (val Logs.src_log src : Logs.LOG)
+
+type error = Block.error
+let pp_error = Block.pp_error
+
+type write_error = Block.write_error
+let pp_write_error = Block.pp_write_error
+
+let ( >>|= ) m f = m >>= function
+  | Error e -> Lwt.return (Error e)
+  | Ok x -> f x
+
+external compress: Cstruct.buffer -> int -> int -> Cstruct.buffer -> int -> int -> int =
+  "mirage_block_unix_lz4_compress_byte" "mirage_block_unix_lz4_compress" [@@noalloc]
+external decompress: Cstruct.buffer -> int -> int -> Cstruct.buffer -> int -> int -> int =
+  "mirage_block_unix_lz4_decompress_byte" "mirage_block_unix_lz4_decompress" [@@noalloc]
+external zero_run: Cstruct.buffer -> int -> int -> int -> bool -> int = "mirage_block_unix_zero_run" [@@noalloc]
+
+(* The image starts with a header, followed by two copies of the index and
+   then the clusters. A cluster is stored compressed, or as it is if that
+   doesn't save a sector, padded to whole sectors. Clusters are never
+   overwritten: a changed cluster is appended, and the old copy is garbage
+   until {!compact} moves clusters from the end of the image into the gaps.
+   The index is written to the copy which the header doesn't name and then
+   the header is switched to it, so there is always a complete index. *)
+let magic = "MBULZ4C1"
+
+(* An index entry is the sector a cluster is stored at as a BE64, which is
+   zero if the cluster reads as zeroes, followed by its stored length in
+   bytes as a BE32 and 4 bytes of zero padding, which keep the entries
+   8-byte aligned and are ignored when the index is read *)
+let entry_size = 16
+
+type slot = {
+  mutable cluster: int; (* -1 if the slot is empty *)
+  data: Cstruct.t;
+  mutable modified: bool;
+}
+
+type t = {
+  device: Block.t;
+  info: Mirage_block.info;
+  cluster_size: int;
+  cluster_sectors: int64;
+  clusters: int;
+  header_sectors: int64;
+  index_sectors: int64; (* of each copy *)
+  data_start: int64;
+  header: Cstruct.t;
+  index: Cstruct.t;
+  where: int64 array;
+  stored: int array; (* the cluster's length if it isn't compressed *)
+  mutable current: int; (* the copy of the index the header names *)
+  mutable tail: int64; (* the sector after the last stored cluster *)
+  mutable capacity: int64; (* the size of the image in sectors *)
+  mutable live: int64; (* sectors holding current clusters *)
+  mutable changed: bool; (* the index has changed since it was written *)
+  mutable left: int64; (* garbage which the last compaction couldn't free *)
+  slots: slot array; (* decompressed clusters, direct-mapped *)
+  scratch: Cstruct.t; (* compressed data on its way to or from the image *)
+  lock: Lwt_mutex.t;
+  mutable closed: bool;
+}
+
+let get_info t = Lwt.return t.info
+
+let device t = t.device
+
+let path t = (Block.to_config t.device).Block.Config.path
+
+let sector_size t = t.info.Mirage_block.sector_size
+
+let stored_bytes t = Int64.mul t.live (Int64.of_int (sector_size t))
+
+(* Sectors between the index and the end of the last cluster which hold
+   nothing current *)
+let garbage t = Int64.(sub (sub t.tail t.data_start) t.live)
+
+let cluster_sector t c = Int64.mul (Int64.of_int c) t.cluster_sectors
+
+(* The last cluster is short if the device isn't a whole number of them *)
+let cluster_bytes t c =
+  Int64.to_int (min t.cluster_sectors (Int64.sub t.info.Mirage_block.size_sectors (cluster_sector t c)))
+  * sector_size t
+
+let stored_sectors t c =
+  if t.where.(c) = 0L then 0L
+  else Int64.of_int ((t.stored.(c) + sector_size t - 1) / sector_size t)
+
+let index_sector t copy = Int64.(add t.header_sectors (mul (of_int copy) t.index_sectors))
+
+let read_error : write_error -> error = function
+  | `Is_read_only -> `Msg "the compressed image is read-only"
+  | #error as e -> e
+
+(* {2 Metadata} *)
+
+let write_header t copy =
+  let b = t.header in
+  Cstruct.memset b 0;
+  Cstruct.blit_from_string magic 0 b 0 (String.length magic);
+  Cstruct.BE.set_uint64 b 8 (Int64.of_int t.cluster_size);
+  Cstruct.BE.set_uint64 b 16 t.info.Mirage_block.size_sectors;
+  Cstruct.BE.set_uint64 b 24 (Int64.of_int copy);
+  Block.write t.device 0L [ b ]
+
+(* The clusters must be durable before an index which refers to them, and
+   the index before the header which names it *)
+let write_index t =
+  let copy = 1 - t.current in
+  Cstruct.memset t.index 0;
+  Array.iteri (fun c where ->
+      Cstruct.BE.set_uint64 t.index (c * entry_size) where;
+      Cstruct.BE.set_uint32 t.index (c * entry_size + 8) (Int32.of_int t.stored.(c))
+    ) t.where;
+  t.changed <- false;
+  ( Block.write t.device (index_sector t copy) [ t.index ]
+    >>|= fun () ->
+    Block.flush t.device
+    >>|= fun () ->
+    write_header t copy
+    >>|= fun () ->
+    Block.flush t.device )
+  >|= function
+  | Ok () -> t.current <- copy; Ok ()
+  | Error e -> t.changed <- true; Error e
+
+let load t =
+  ( Block.read t.device (index_sector t t.current) [ t.index ] >|= Block_buffers.lift )
+  >|= function
+  | Error e -> Error e
+  | Ok () ->
+    let ss = sector_size t in
+    let rec check c =
+      if c = t.clusters then Ok () else begin
+        let where = Cstruct.BE.get_uint64 t.index (c * entry_size) in
+        let stored = Int32.to_int (Cstruct.BE.get_uint32 t.index (c * entry_size + 8)) in
+        let sectors = Int64.of_int ((stored + ss - 1) / ss) in
+        if where <> 0L && (where < t.data_start || stored <= 0 || stored > cluster_bytes t c
+                           || Int64.add where sectors > t.capacity)
+        then Error (`Msg (Printf.sprintf "%s: the index entry for cluster %d is corrupt" (path t) c))
+        else begin
+          t.where.(c) <- where;
+          t.stored.(c) <- stored;
+          t.live <- Int64.add t.live sectors;
+          t.tail <- max t.tail (Int64.add where sectors);
+          check (c + 1)
+        end
+      end in
+    check 0
+
+(* {2 Storing clusters} *)
+
+let set_zero t c =
+  if t.where.(c) <> 0L then begin
+    t.live <- Int64.sub t.live (stored_sectors t c);
+    t.where.(c) <- 0L;
+    t.stored.(c) <- 0;
+    t.changed <- true
+  end
+
+(* Make room for [n] more sectors after the last cluster, growing the image
+   by a quarter at a time so that appending isn't a resize per cluster *)
+let reserve t n =
+  let needed = Int64.add t.tail n in
+  if needed <= t.capacity then Lwt.return (Ok ()) else begin
+    let size = max needed (Int64.add t.capacity (Int64.div t.capacity 4L)) in
+    Block.resize t.device size
+    >|= function
+    | Ok () -> t.capacity <- size; Ok ()
+    | Error e -> Error e
+  end
+
+(* Store cluster [c] as the first [stored] bytes of [buf], which is padded
+   to whole sectors, after the last cluster *)
+let append t c buf stored =
+  let ss = sector_size t in
+  let n = Int64.of_int ((stored + ss - 1) / ss) in
+  reserve t n
+  >>|= fun () ->
+  let at = t.tail in
+  t.tail <- Int64.add at n;
+  Block.write t.device at [ Cstruct.sub buf 0 (Int64.to_int n * ss) ]
+  >>|= fun () ->
+  set_zero t c;
+  t.where.(c) <- at;
+  t.stored.(c) <- stored;
+  t.live <- Int64.add t.live n;
+  t.changed <- true;
+  Lwt.return (Ok ())
+
+let write_back t slot =
+  if not slot.modified then Lwt.return (Ok ()) else begin
+    let c = slot.cluster and ss = sector_size t in
+    let len = cluster_bytes t c and data = slot.data in
+    ( if zero_run data.Cstruct.buffer data.Cstruct.off len len true = len then begin
+        set_zero t c;
+        Lwt.return (Ok ())
+      end else begin
+        (* compressing is only worthwhile if it saves a sector *)
+        let n = compress data.Cstruct.buffer data.Cstruct.off len
+            t.scratch.Cstruct.buffer t.scratch.Cstruct.off (len - ss) in
+        if n = 0 then append t c data len else begin
+          let padded = (n + ss - 1) / ss * ss in
+          Cstruct.memset (Cstruct.sub t.scratch n (padded - n)) 0;
+          append t c t.scratch n
+        end
+      end )
+    >|= function
+    | Ok () -> slot.modified <- false; Ok ()
+    | Error e -> Error e
+  end
+
+let fill t slot c =
+  let len = cluster_bytes t c and ss = sector_size t in
+  slot.cluster <- -1;
+  ( if t.where.(c) = 0L then begin
+        Cstruct.memset (Cstruct.sub slot.data 0 len) 0;
+        Lwt.return (Ok ())
+      end else if t.stored.(c) = len then
+      Block.read t.device t.where.(c) [ Cstruct.sub slot.data 0 len ]
+    else begin
+      let stored = t.stored.(c) in
+      Block.read t.device t.where.(c) [ Cstruct.sub t.scratch 0 ((stored + ss - 1) / ss * ss) ]
+      >|= function
+      | Error e -> Error e
+      | Ok () ->
+        if decompress t.scratch.Cstruct.buffer t.scratch.Cstruct.off stored
+            slot.data.Cstruct.buffer slot.data.Cstruct.off len = len
+        then Ok ()
+        else Error (`Msg (Printf.sprintf "%s: cluster %d is corrupt" (path t) c))
+    end )
+  >|= function
+  | Ok () -> slot.cluster <- c; Ok ()
+  | Error e -> Error e
+
+(* The cache slot holding cluster [c], after writing back the cluster which
+   was there before. Unless [whole], when the caller is about to overwrite
+   all of it, the cluster is read in. *)
+let slot t c ~whole =
+  let s = t.slots.(c mod Array.length t.slots) in
+  if s.cluster = c then Lwt.return (Ok s) else begin
+    write_back t s
+    >>|= fun () ->
+    if whole then begin
+      s.cluster <- c;
+      Lwt.return (Ok s)
+    end else begin
+      ( fill t s c >|= Block_buffers.lift )
+      >>|= fun () ->
+      Lwt.return (Ok s)
+    end
+  end
+
+let write_back_all t =
+  Array.fold_left (fun acc s -> acc >>|= fun () -> write_back t s) (Lwt.return (Ok ())) t.slots
+
+let sync t =
+  write_back_all t
+  >>|= fun () ->
+  if t.changed then write_index t else Block.flush t.device
+
+(* {2 Compaction} *)
+
+(* Free space, as (start, length), indexed by length up to a cluster *)
+module Gaps = Set.Make(struct type t = int64 * int64 let compare = compare end)
+
+(* Move clusters from the end of the image into the gaps left by old copies
+   and then shrink the image. The index on disk is up to date first, so the
+   gaps are free in it, and clusters are only moved into gaps below them.
+   A cluster goes into the smallest gap it fits, to keep large gaps for
+   large clusters. *)
+let compact_locked t =
+  sync t
+  >>|= fun () ->
+  let max_sectors = Int64.to_int t.cluster_sectors in
+  let by_length = Array.make (max_sectors + 1) Gaps.empty in
+  let add_gap start length =
+    if length > 0L then begin
+      let i = Int64.to_int (min length t.cluster_sectors) in
+      by_length.(i) <- Gaps.add (start, length) by_length.(i)
+    end in
+  let placed = List.filter (fun c -> t.where.(c) <> 0L) (List.init t.clusters (fun c -> c)) in
+  let placed = List.sort (fun a b -> compare t.where.(a) t.where.(b)) placed in
+  ignore (List.fold_left (fun next c ->
+      add_gap next (Int64.sub t.where.(c) next);
+      Int64.add t.where.(c) (stored_sectors t c)
+    ) t.data_start placed);
+  (* the smallest gap below [before] with room for [n] sectors *)
+  let take n before =
+    let rec loop i =
+      if i > max_sectors then None else begin
+        match Gaps.min_elt_opt by_length.(i) with
+        | Some ((start, length) as gap) when start < before ->
+          by_length.(i) <- Gaps.remove gap by_length.(i);
+          add_gap (Int64.add start n) (Int64.sub length n);
+          Some start
+        | _ -> loop (i + 1)
+      end in
+    loop (Int64.to_int n) in
+  let ss = sector_size t in
+  let rec move = function
+    | [] -> Lwt.return (Ok ())
+    | c :: rest ->
+      let n = stored_sectors t c in
+      match take n t.where.(c) with
+      | None -> move rest
+      | Some at ->
+        let buf = Cstruct.sub t.scratch 0 (Int64.to_int n * ss) in
+        ( Block.read t.device t.where.(c) [ buf ] >|= Block_buffers.lift )
+        >>|= fun () ->
+        Block.write t.device at [ buf ]
+        >>|= fun () ->
+        t.where.(c) <- at;
+        t.changed <- true;
+        move rest in
+  move (List.rev placed)
+  >>|= fun () ->
+  ( if t.changed then write_index t else Lwt.return (Ok ()) )
+  >>|= fun () ->
+  let tail = Array.fold_left max t.data_start
+      (Array.mapi (fun c where -> Int64.add where (stored_sectors t c)) t.where) in
+  let before = t.capacity in
+  Block.resize t.device tail
+  >|= function
+  | Error e -> Error e
+  | Ok () ->
+    t.tail <- tail;
+    t.capacity <- tail;
+    t.left <- garbage t;
+    Log.info (fun f -> f "compacted %s from %Ld to %Ld sectors" (path t) before tail);
+    Ok ()
+
+(* Garbage is only worth collecting once there is more of it than data, and
+   twice as much as the last compaction left behind *)
+let wasteful t =
+  let garbage = garbage t in
+  garbage > t.live && garbage >= Int64.mul 16L t.cluster_sectors && garbage >= Int64.mul 2L t.left
+
+let compact t =
+  if t.closed then Lwt.return (Error `Disconnected)
+  else if not t.info.Mirage_block.read_write then Lwt.return (Error `Is_read_only)
+  else Lwt_mutex.with_lock t.lock (fun () -> compact_locked t)
+
+(* {2 Requests} *)
+
+(* The request split at cluster boundaries as [(cluster, within, count, buffers)] *)
+let pieces t sector n buffers =
+  List.map (fun (c, within, count, these) -> Int64.to_int c, within, count, these)
+    (Block_buffers.chunks ~sector_size:(sector_size t) ~chunk_sectors:t.cluster_sectors sector n buffers)
+
+let whole t c within count = within = 0L && Int64.to_int count * sector_size t = cluster_bytes t c
+
+(* Requests are handled one at a time, since they share the cache and the
+   space at the end of the image *)
+let read t sector buffers =
+  if t.closed then Lwt.return (Error `Disconnected) else
+  match Block_buffers.check "read" t.info sector buffers with
+  | Error e -> Lwt.return (Error e)
+  | Ok n ->
+    Lwt_mutex.with_lock t.lock (fun () ->
+        let ss = sector_size t in
+        let rec loop = function
+          | [] -> Lwt.return (Ok ())
+          | (c, within, _, these) :: rest ->
+            slot t c ~whole:false
+            >>= function
+            | Error e -> Lwt.return (Error (read_error e))
+            | Ok s ->
+              Block_buffers.blit_to s.data (Int64.to_int within * ss) these;
+              loop rest in
+        loop (pieces t sector n buffers))
+
+let write t sector buffers =
+  if t.closed then Lwt.return (Error `Disconnected)
+  else if not t.info.Mirage_block.read_write then Lwt.return (Error `Is_read_only) else
+  match Block_buffers.check "write" t.info sector buffers with
+  | Error e -> Lwt.return (Error e)
+  | Ok n ->
+    Lwt_mutex.with_lock t.lock (fun () ->
+        let ss = sector_size t in
+        let rec loop = function
+          | [] -> Lwt.return (Ok ())
+          | (c, within, count, these) :: rest ->
+            slot t c ~whole:(whole t c within count)
+            >>|= fun s ->
+            Block_buffers.blit_from s.data (Int64.to_int within * ss) these;
+            s.modified <- true;
+            loop rest in
+        loop (pieces t sector n buffers))
+
+(* Whole clusters are dropped from the index, so the space they used is
+   reclaimed by the next compaction *)
+let discard t sector n =
+  if t.closed then Lwt.return (Error `Disconnected)
+  else if not t.info.Mirage_block.read_write then Lwt.return (Error `Is_read_only)
+  else if Int64.add sector n > t.info.Mirage_block.size_sectors
+  then Lwt.return (Error (`Msg (Printf.sprintf "discard beyond end of device: sector_start (%Ld) + len (%Ld) > size_sectors (%Ld)"
+                                  sector n t.info.Mirage_block.size_sectors)))
+  else Lwt_mutex.with_lock t.lock (fun () ->
+      let ss = sector_size t in
+      let rec loop = function
+        | [] -> Lwt.return (Ok ())
+        | (c, within, count, _) :: rest when whole t c within count ->
+          let s = t.slots.(c mod Array.length t.slots) in
+          if s.cluster = c then begin
+            s.cluster <- -1;
+            s.modified <- false
+          end;
+          set_zero t c;
+          loop rest
+        | (c, within, count, _) :: rest ->
+          slot t c ~whole:false
+          >>|= fun s ->
+          Cstruct.memset (Cstruct.sub s.data (Int64.to_int within * ss) (Int64.to_int count * ss)) 0;
+          s.modified <- true;
+          loop rest in
+      loop (pieces t sector n []))
+
+let flush t =
+  if t.closed then Lwt.return (Error `Disconnected)
+  else if not t.info.Mirage_block.read_write then Lwt.return (Ok ())
+  else Lwt_mutex.with_lock t.lock (fun () ->
+      sync t
+      >>|= fun () ->
+      if wasteful t then compact_locked t else Lwt.return (Ok ()))
+
+(* {2 Connecting} *)
+
+let of_device ?cluster ?(cache = 16) ?size device =
+  Block.get_info device
+  >>= fun info ->
+  let ss = info.Mirage_block.sector_size in
+  let path = (Block.to_config device).Block.Config.path in
+  let failf fmt = Printf.ksprintf (fun s -> Lwt.fail_with ("Block_compressed.of_device: " ^ s)) fmt in
+  let or_fail what = function
+    | Ok x -> Lwt.return x
+    | Error e -> failf "%s %s: %s" what path (Fmt.to_to_string pp_write_error e) in
+  let header_sectors = Int64.of_int (max 1 (4096 / ss)) in
+  let alignment = max 4096 ss in
+  let header = Block_pool.create ~alignment ~buffer_size:(Int64.to_int header_sectors * ss) 1 in
+  let header = match Block_pool.alloc_now header with Some b -> b | None -> assert false in
+  ( if info.Mirage_block.size_sectors < header_sectors then Lwt.return None else begin
+      ( Block.read device 0L [ header ] >|= Block_buffers.lift )
+      >>= or_fail "reading the header of"
+      >|= fun () ->
+      if Cstruct.to_string (Cstruct.sub header 0 (String.length magic)) <> magic then None
+      else Some (Int64.to_int (Cstruct.BE.get_uint64 header 8), Cstruct.BE.get_uint64 header 16,
+                 Int64.to_int (Cstruct.BE.get_uint64 header 24))
+    end )
+  >>= fun formatted ->
+  let make cluster_size size_sectors current =
+    if cluster_size <= 0 || cluster_size mod ss <> 0
+    then failf "the cluster size (%d) is not a multiple of the sector size (%d)" cluster_size ss
+    else if cache < 1 then failf "the cache must hold at least one cluster"
+    else begin
+      let cluster_sectors = Int64.of_int (cluster_size / ss) in
+      let clusters = Int64.(to_int (div (add size_sectors (pred cluster_sectors)) cluster_sectors)) in
+      let index_sectors =
+        let n = Int64.of_int ((clusters * entry_size + ss - 1) / ss) in
+        Int64.(mul (max 1L (div (add n (pred header_sectors)) header_sectors)) header_sectors) in
+      let data_start = Int64.(add header_sectors (mul 2L index_sectors)) in
+      let index = Block_pool.create ~alignment ~buffer_size:(Int64.to_int index_sectors * ss) 1 in
+      let pool = Block_pool.create ~alignment ~buffer_size:cluster_size (cache + 1) in
+      let alloc pool = match Block_pool.alloc_now pool with Some b -> b | None -> assert false in
+      Lwt.return {
+        device;
+        info = { info with Mirage_block.size_sectors };
+        cluster_size; cluster_sectors; clusters; header_sectors; index_sectors; data_start;
+        header; index = alloc index;
+        where = Array.make clusters 0L; stored = Array.make clusters 0;
+        current; tail = data_start; capacity = info.Mirage_block.size_sectors;
+        live = 0L; changed = false; left = 0L;
+        slots = Array.init cache (fun _ -> { cluster = -1; data = alloc pool; modified = false });
+        scratch = alloc pool;
+        lock = Lwt_mutex.create (); closed = false;
+      }
+    end in
+  match formatted, size with
+  | Some (cluster_size, _, _), _ when cluster <> None && cluster <> Some cluster_size ->
+    failf "%s has clusters of %d bytes" path cluster_size
+  | Some (cluster_size, size_sectors, current), _ ->
+    if current <> 0 && current <> 1 then failf "%s has a corrupt header" path else begin
+      make cluster_size size_sectors current
+      >>= fun t ->
+      load t
+      >>= or_fail "loading the index of"
+      >|= fun () ->
+      t
+    end
+  | None, None -> failf "%s is not a compressed image; give a size to create one" path
+  | None, Some size ->
+    if not info.Mirage_block.read_write then failf "%s is read-only" path else begin
+      (* Don't overwrite something which isn't a compressed image by mistake *)
+      ( Block.extents device ~from:0L ~len:info.Mirage_block.size_sectors
+        >>= function
+        | Ok extents when List.exists (fun (_, _, kind) -> kind = `Data) extents ->
+          failf "%s is not empty" path
+        | Ok _ -> Lwt.return_unit
+        | Error e -> or_fail "mapping" (Block_buffers.lift (Error e)) )
+      >>= fun () ->
+      let size_sectors = Int64.(div (add size (of_int (ss - 1))) (of_int ss)) in
+      make (match cluster with Some c -> c | None -> 65536) size_sectors 1
+      >>= fun t ->
+      ( Block.resize device t.data_start
+        >>|= fun () ->
+        t.capacity <- t.data_start;
+        write_index t )
+      >>= or_fail "formatting"
+      >|= fun () ->
+      t
+    end
+
+let connect ?cluster ?cache ?size path =
+  Block.connect path
+  >>= fun device ->
+  of_device ?cluster ?cache ?size device
+
+let size_of_string s =
+  let n = String.length s in
+  if n = 0 then failwith "empty size";
+  let number, scale = match s.[n - 1] with
+    | 'k' | 'K' -> String.sub s 0 (n - 1), 1024L
+    | 'm' | 'M' -> String.sub s 0 (n - 1), 1048576L
+    | 'g' | 'G' -> String.sub s 0 (n - 1), 1073741824L
+    | 't' | 'T' -> String.sub s 0 (n - 1), 1099511627776L
+    | _ -> s, 1L in
+  Int64.mul (Int64.of_string number) scale
+
+let of_string x =
+  let u = Uri.of_string x in
+  let param key f = match Uri.get_query_param u key with
+    | None -> None
+    | Some s -> Some (f s) in
+  match param "cluster" (fun s -> Int64.to_int (size_of_string s)),
+        param "cluster_cache" int_of_string,
+        param "size" size_of_string with
+  | exception Failure _ -> Lwt.fail_with (Printf.sprintf "Block_compressed.of_string %s: bad cluster, cluster_cache or size" x)
+  | cluster, cache, size ->
+    match Block.Config.of_string x with
+    | Error (`Msg m) -> Lwt.fail_with m
+    | Ok config ->
+      Block.of_config config
+      >>= fun device ->
+      of_device ?cluster ?cache ?size device
+
+let disconnect t =
+  if t.closed then Lwt.return_unit else begin
+    ( if t.info.Mirage_block.read_write
+      then Lwt_mutex.with_lock t.lock (fun () -> sync t)
+      else Lwt.return (Ok ()) )
+    >>= fun r ->
+    t.closed <- true;
+    ( match r with
+      | Ok () -> ()
+      | Error e -> Log.err (fun f -> f "disconnecting %s: %a" (path t) pp_write_error e) );
+    Block.disconnect t.device
+  end
@@ -0,0 +1,70 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** A block device stored compressed in an image file, for images which
+    are mostly read. The device is divided into fixed-size clusters which
+    are compressed with LZ4 and stored one after another, so reading a
+    cluster reads only its compressed size from the disk. The offset of
+    every cluster is kept in memory, and recently used clusters are kept
+    decompressed in a small cache.
+
+    A changed cluster is held in the cache and appended to the image when
+    it is evicted, or at the next {!flush}, leaving the old copy as garbage
+    until {!compact} moves clusters into the gaps and shrinks the file.
+    {!flush} writes the index after the clusters it refers to, so after a
+    crash the device holds every write which was flushed. Requests are
+    handled one at a time. *)
+
+include Mirage_block.S
+  with type error = Block.error
+   and type write_error = Block.write_error
+
+val of_device: ?cluster:int -> ?cache:int -> ?size:int64 -> Block.t -> t Lwt.t
+(** [of_device ?cluster ?cache ?size device] opens the compressed image on
+    [device], caching up to [cache] (16 by default) decompressed clusters.
+    If [device] is empty and [size] is given, a new image of [size] bytes
+    with clusters of [cluster] bytes (64 KiB by default) is created on it.
+    Fails if [device] holds something else, or an image with a different
+    cluster size. *)
+
+val connect: ?cluster:int -> ?cache:int -> ?size:int64 -> string -> t Lwt.t
+(** [connect ?cluster ?cache ?size path] connects to [path] with
+    {!Block.connect} and opens it as {!of_device} *)
+
+val of_string: string -> t Lwt.t
+(** [of_string uri] opens an image described by a URI of the form
+    [file://<path>?cluster=<bytes>&cluster_cache=<clusters>&size=<bytes>&...].
+    Sizes may have a [k], [m], [g] or [t] suffix and every parameter is
+    optional; the rest of the query is the {!Block.Config} of the image
+    file. *)
+
+val device: t -> Block.t
+(** The image file *)
+
+val stored_bytes: t -> int64
+(** The space taken by the current copy of every cluster *)
+
+val flush: t -> (unit, write_error) result Lwt.t
+(** [flush t] appends the changed clusters and makes them durable, and
+    compacts the image if more than half of it is garbage *)
+
+val discard: t -> int64 -> int64 -> (unit, write_error) result Lwt.t
+(** [discard t sector n] makes the sectors read as zeroes. Whole clusters
+    stop taking space after the next {!compact}. *)
+
+val compact: t -> (unit, write_error) result Lwt.t
+(** [compact t] flushes, moves clusters from the end of the image into the
+    space left by old copies and then truncates it *)
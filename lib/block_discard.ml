@@ -0,0 +1,104 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+type request = {
+  offset: int64;
+  stop: int64;
+  wakener: unit Lwt.u;
+}
+
+type t = {
+  granularity: int64;
+  mutable queued: request list;
+  mutable in_progress: request list; (* the batch being sent *)
+  mutable scheduled: bool; (* a batch will start at the end of this iteration *)
+  mutable running: bool;
+  done_batch: unit Lwt_condition.t;
+}
+
+let create ~granularity = {
+  granularity = Int64.of_int (max 1 granularity); queued = []; in_progress = [];
+  scheduled = false; running = false; done_batch = Lwt_condition.create ();
+}
+
+let idle t = t.queued = [] && t.in_progress = []
+
+let overlaps offset stop r = r.offset < stop && offset < r.stop
+
+(* The disjoint ranges covered by a batch, in order *)
+let merge requests =
+  let sorted = List.sort (fun a b -> compare a.offset b.offset) requests in
+  List.rev @@ List.fold_left (fun acc r -> match acc with
+      | (offset, stop) :: acc' when r.offset <= stop -> (offset, max stop r.stop) :: acc'
+      | _ -> (r.offset, r.stop) :: acc
+    ) [] sorted
+
+let send t ~punch ~zero (offset, stop) =
+  let g = t.granularity in
+  let first = Int64.(mul (div (add offset (pred g)) g) g) in
+  let last = Int64.(mul (div stop g) g) in
+  if first >= last then zero offset (Int64.sub stop offset)
+  else Lwt.join [
+      (if first > offset then zero offset (Int64.sub first offset) else Lwt.return_unit);
+      punch first (Int64.sub last first);
+      (if stop > last then zero last (Int64.sub stop last) else Lwt.return_unit);
+    ]
+
+let rec run t ~punch ~zero =
+  let batch = t.queued in
+  t.queued <- [];
+  t.in_progress <- batch;
+  t.running <- true;
+  Lwt_list.map_p (fun range ->
+      Lwt.catch
+        (fun () -> send t ~punch ~zero range >|= fun () -> None)
+        (fun e -> Lwt.return (Some (range, e)))
+    ) (merge batch)
+  >>= fun results ->
+  let failed = List.fold_left (fun acc -> function None -> acc | Some f -> f :: acc) [] results in
+  List.iter (fun r ->
+      match List.find (fun ((offset, stop), _) -> overlaps offset stop r) failed with
+      | (_, e) -> Lwt.wakeup_later_exn r.wakener e
+      | exception Not_found -> Lwt.wakeup_later r.wakener ()
+    ) batch;
+  t.in_progress <- [];
+  t.running <- false;
+  Lwt_condition.broadcast t.done_batch ();
+  (* discards which arrived in the meantime make up the next batch *)
+  if t.queued <> [] then run t ~punch ~zero else Lwt.return_unit
+
+let discard t ~punch ~zero offset length =
+  if length <= 0L then Lwt.return_unit else begin
+    let th, wakener = Lwt.wait () in
+    t.queued <- { offset; stop = Int64.add offset length; wakener } :: t.queued;
+    if not (t.scheduled || t.running) then begin
+      t.scheduled <- true;
+      Lwt.async (fun () ->
+        Lwt.pause ()
+        >>= fun () ->
+        t.scheduled <- false;
+        run t ~punch ~zero)
+    end;
+    th
+  end
+
+let rec wait t offset length =
+  let stop = Int64.add offset length in
+  if List.exists (overlaps offset stop) t.queued || List.exists (overlaps offset stop) t.in_progress
+  then Lwt_condition.wait t.done_batch >>= fun () -> wait t offset length
+  else Lwt.return_unit
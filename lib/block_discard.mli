@@ -0,0 +1,49 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** The discard queue used by {!Block}. Discards which arrive during the same
+    iteration of the Lwt main loop, or while the previous batch is in
+    progress, are sorted and merged with any adjacent or overlapping ranges
+    and sent together. Each merged range is split at the device's discard
+    granularity: the aligned middle is punched and any unaligned head or tail
+    is zeroed instead. For a file, where punching a hole leaves zeroes, the
+    whole range reads as zeroes afterwards; a block device may return
+    anything from the punched part. *)
+
+type t
+
+val create: granularity:int -> t
+(** [create ~granularity] creates an empty queue for a device which
+    discards in multiples of [granularity] bytes ([0] or [1] if any range
+    will do) *)
+
+val discard:
+  t ->
+  punch:(int64 -> int64 -> unit Lwt.t) ->
+  zero:(int64 -> int64 -> unit Lwt.t) ->
+  int64 -> int64 -> unit Lwt.t
+(** [discard t ~punch ~zero offset length] queues the range and resolves
+    when the batch containing it has been sent with [punch offset length]
+    and [zero offset length]. Every call on a queue must pass the same
+    functions. *)
+
+val idle: t -> bool
+(** [idle t] is true if no discard is queued or in progress *)
+
+val wait: t -> int64 -> int64 -> unit Lwt.t
+(** [wait t offset length] resolves once no queued or in-progress discard
+    overlaps the range, so that a later read or write is not overtaken by
+    an earlier discard *)
@@ -0,0 +1,161 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+type kind = [ `Data | `Hole ]
+
+(* Two bits per chunk: if [known] is clear the chunk must be looked up,
+   otherwise [mapped] says whether it may contain data. Unknown chunks are
+   reported as data. *)
+type t = {
+  chunk: int64;
+  mutable size: int64;
+  mutable chunks: int;
+  mutable known: Bytes.t;
+  mutable mapped: Bytes.t;
+  mutable generation: int;
+  (* incremented by every write, discard and resize: holes found by a lookup
+     which overlapped one of these are not recorded *)
+}
+
+let get b i = Char.code (Bytes.unsafe_get b (i lsr 3)) land (1 lsl (i land 7)) <> 0
+
+let set b i v =
+  let c = Char.code (Bytes.get b (i lsr 3)) and m = 1 lsl (i land 7) in
+  Bytes.set b (i lsr 3) (Char.unsafe_chr (if v then c lor m else c land (lnot m)))
+
+let chunk_of t offset = Int64.(to_int (div offset t.chunk))
+
+let chunks_of t size = Int64.(to_int (div (add size (pred t.chunk)) t.chunk))
+
+let resize t size =
+  t.generation <- t.generation + 1;
+  let chunks = chunks_of t size in
+  let copy b =
+    let b' = Bytes.make ((chunks + 7) / 8) '\000' in
+    Bytes.blit b 0 b' 0 (min (Bytes.length b) (Bytes.length b'));
+    b' in
+  let known = copy t.known and mapped = copy t.mapped in
+  (* The old last chunk may have grown or shrunk, trailing bits of the last
+     byte are cleared so they are unknown if the device grows again *)
+  for i = max 0 (min t.chunks chunks - 1) to 8 * Bytes.length known - 1 do
+    set known i false;
+    set mapped i false
+  done;
+  t.size <- size;
+  t.chunks <- chunks;
+  t.known <- known;
+  t.mapped <- mapped
+
+let create ~chunk size =
+  if chunk <= 0 then invalid_arg "Block_extents.create: chunk must be positive";
+  let t = {
+    chunk = Int64.of_int chunk; size = 0L; chunks = 0; known = Bytes.empty;
+    mapped = Bytes.empty; generation = 0;
+  } in
+  resize t size;
+  t
+
+(* The chunks overlapping [offset, offset + length) *)
+let overlapping t offset length =
+  let first = chunk_of t offset in
+  let last = min (t.chunks - 1) (chunk_of t Int64.(pred (add offset length))) in
+  first, last
+
+let mark_mapped t offset length =
+  t.generation <- t.generation + 1;
+  if length > 0L then begin
+    let first, last = overlapping t offset length in
+    for i = first to last do
+      set t.known i true;
+      set t.mapped i true
+    done
+  end
+
+let write t offset length f =
+  mark_mapped t offset length;
+  Lwt.finalize f (fun () -> mark_mapped t offset length; Lwt.return_unit)
+
+let discard t offset length f =
+  t.generation <- t.generation + 1;
+  let generation = t.generation in
+  f ()
+  >|= fun result ->
+  if t.generation = generation && length > 0L then begin
+    let stop = Int64.add offset length in
+    (* a partial last chunk of the device is covered if the range reaches
+       the end *)
+    let first = chunk_of t Int64.(add offset (pred t.chunk)) in
+    let last = if stop >= t.size then t.chunks - 1 else chunk_of t stop - 1 in
+    for i = first to last do
+      set t.known i true;
+      set t.mapped i false
+    done
+  end;
+  result
+
+(* Record the result of looking up chunks [first, last] *)
+let record t first last data =
+  for i = first to last do
+    set t.known i true;
+    set t.mapped i false
+  done;
+  List.iter (fun (offset, length) ->
+      if length > 0L then begin
+        let first', last' = overlapping t offset length in
+        for i = max first first' to min last last' do
+          set t.mapped i true
+        done
+      end
+    ) data
+
+let extents t ~fetch offset length =
+  let stop = min t.size (Int64.add offset length) in
+  if offset < 0L || stop <= offset then Lwt.return [] else begin
+    let first, last = overlapping t offset (Int64.sub stop offset) in
+    let rec lookup i =
+      if i > last then Lwt.return_unit
+      else if get t.known i then lookup (i + 1)
+      else begin
+        let j = ref i in
+        while !j < last && not (get t.known (!j + 1)) do incr j done;
+        let j = !j in
+        let start = Int64.(mul (of_int i) t.chunk) in
+        let stop = min t.size Int64.(mul (of_int (j + 1)) t.chunk) in
+        let generation = t.generation in
+        fetch start (Int64.sub stop start)
+        >>= fun data ->
+        (* otherwise the chunks stay unknown and are reported as data *)
+        if t.generation = generation then record t i j data;
+        lookup (j + 1)
+      end in
+    lookup first
+    >|= fun () ->
+    let kind i = if get t.known i && not (get t.mapped i) then `Hole else `Data in
+    let extent i j k =
+      let start = max offset Int64.(mul (of_int i) t.chunk) in
+      let stop = min stop Int64.(mul (of_int (j + 1)) t.chunk) in
+      start, Int64.sub stop start, k in
+    let rec loop acc i =
+      if i > last then List.rev acc else begin
+        let k = kind i in
+        let j = ref i in
+        while !j < last && kind (!j + 1) = k do incr j done;
+        loop (extent i !j k :: acc) (!j + 1)
+      end in
+    loop [] first
+  end
@@ -0,0 +1,55 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** An in-memory allocation map used by {!Block} when configured with
+    [extent_map=<bytes>], so that walking a large sparse image does not ask
+    the filesystem about the same ranges again and again. The device is
+    divided into chunks of the configured size, each of which is unknown,
+    mapped or a hole. Unknown chunks are looked up on demand and writes,
+    discards and resizes keep the map up to date.
+
+    A chunk is only a hole if the filesystem reported no data anywhere in it,
+    so data extents are rounded out to whole chunks. *)
+
+type kind = [ `Data | `Hole ]
+
+type t
+
+val create: chunk:int -> int64 -> t
+(** [create ~chunk size] creates an empty map of a device of [size] bytes
+    with [chunk] bytes per entry *)
+
+val extents:
+  t ->
+  fetch:(int64 -> int64 -> (int64 * int64) list Lwt.t) ->
+  int64 -> int64 -> (int64 * int64 * kind) list Lwt.t
+(** [extents t ~fetch offset length] returns the extents of the range as
+    [(offset, length, kind)], in order and clipped to the device. [fetch
+    offset length] is called for ranges which are not known and returns the
+    [(offset, length)] of the data in the range, in order. *)
+
+val write: t -> int64 -> int64 -> (unit -> 'a Lwt.t) -> 'a Lwt.t
+(** [write t offset length f] runs [f ()], which writes the range, marking
+    the range as mapped before and after *)
+
+val discard: t -> int64 -> int64 -> (unit -> 'a Lwt.t) -> 'a Lwt.t
+(** [discard t offset length f] runs [f ()], which discards the range, and
+    then records the chunks entirely inside the range as holes, unless there
+    was a write in the meantime *)
+
+val resize: t -> int64 -> unit
+(** [resize t size] changes the size of the device. Chunks which have changed
+    size or are new become unknown. *)
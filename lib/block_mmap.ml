@@ -0,0 +1,86 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+external madvise: Cstruct.buffer -> int -> int -> int -> unit = "mirage_block_unix_madvise"
+
+type advice = Normal | Sequential | Random
+
+let int_of_advice = function Normal -> 0 | Sequential -> 1 | Random -> 2
+
+(* How many reads in a row of one kind change the advice *)
+let sequential_after = 2
+let random_after = 8
+
+type t = {
+  map: Cstruct.t;
+  mutable next: int64; (* where a sequential read would start *)
+  mutable sequential: int; (* reads in a row which were sequential *)
+  mutable random: int; (* or not *)
+  mutable advice: advice;
+}
+
+let create fd size =
+  let map =
+    if size = 0L then Cstruct.create 0
+    else
+      (* A private mapping, since a shared one needs the file open for
+         writing. Nothing writes to it so the pages are the page cache's. *)
+      Cstruct.of_bigarray @@ Bigarray.array1_of_genarray @@
+      Unix.map_file fd Bigarray.char Bigarray.c_layout false [| Int64.to_int size |] in
+  { map; next = 0L; sequential = 0; random = 0; advice = Normal }
+
+let advise t advice =
+  if t.advice <> advice then begin
+    t.advice <- advice;
+    madvise t.map.Cstruct.buffer t.map.Cstruct.off t.map.Cstruct.len (int_of_advice advice)
+  end
+
+let observe t offset length =
+  if offset = t.next then begin
+    t.sequential <- t.sequential + 1;
+    t.random <- 0;
+    if t.sequential >= sequential_after then advise t Sequential
+  end else begin
+    t.random <- t.random + 1;
+    t.sequential <- 0;
+    if t.random >= random_after then advise t Random
+  end;
+  t.next <- Int64.add offset (Int64.of_int length)
+
+let read t offset buffers =
+  let size = Cstruct.len t.map in
+  let rec loop offset = function
+    | [] -> offset
+    | b :: bs ->
+      let len = Cstruct.len b in
+      let available = max 0 (min len (size - offset)) in
+      if available > 0 then Cstruct.blit t.map offset b 0 available;
+      if available < len then Cstruct.memset (Cstruct.shift b available) 0;
+      loop (offset + len) bs in
+  let start = Int64.to_int offset in
+  let stop = loop start buffers in
+  observe t offset (stop - start)
+
+let view t offset length =
+  let start = Int64.to_int offset in
+  if start + length <= Cstruct.len t.map then begin
+    observe t offset length;
+    Cstruct.sub t.map start length
+  end else begin
+    let b = Cstruct.create length in
+    read t offset [ b ];
+    b
+  end
@@ -0,0 +1,40 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** A read-only memory mapping of a device, used by {!Block} when configured
+    with [mmap=1] and the file is opened read-only. A read is a copy from the
+    page cache on the calling thread instead of a job on the Lwt_unix thread
+    pool; a page which isn't cached blocks the main loop while the kernel
+    fetches it. The kernel is told whether reads are sequential or random
+    once either has been seen a few times in a row.
+
+    The file must not be truncated while it is mapped. *)
+
+type t
+
+val create: Unix.file_descr -> int64 -> t
+(** [create fd size] maps the first [size] bytes of [fd] *)
+
+val read: t -> int64 -> Cstruct.t list -> unit
+(** [read t offset buffers] copies from [offset] into [buffers]. Anything
+    after the end of the file, the rest of the last sector if the file isn't
+    a whole number of sectors, reads as zeroes. *)
+
+val view: t -> int64 -> int -> Cstruct.t
+(** [view t offset length] is [length] bytes of the mapping from [offset],
+    without copying. Past the end of the file it is a zero-filled copy
+    instead. The view stays valid for as long as it is reachable, even
+    after the device is disconnected. *)
@@ -0,0 +1,423 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+let src =
+  let src = Logs.Src.create "mirage-block-unix.overlay" ~doc:"Copy-on-write overlay device for mirage-block-unix" in
+  Logs.Src.set_level src (Some Logs.Info);
+  src
+
+module Log = (val Logs.src_log src : Logs.LOG)
+
+type error = Block.error
+let pp_error = Block.pp_error
+
+type write_error = Block.write_error
+let pp_write_error = Block.pp_write_error
+
+let ( >>|= ) m f = m >>= function
+  | Error e -> Lwt.return (Error e)
+  | Ok x -> f x
+
+(* The delta holds each written chunk at the same offset as on the base
+   device. After the last chunk comes a header sector followed by a bitmap
+   with one bit per chunk, set once the whole chunk is in the delta. *)
+let magic = "MBUOVLY1"
+
+type t = {
+  base: Block.t;
+  delta: Block.t;
+  info: Mirage_block.info;
+  chunk_sectors: int64;
+  chunks: int;
+  header_sector: int64; (* the first sector after the last chunk *)
+  written: Bytes.t; (* the bitmap as it will be after the next flush *)
+  bitmap: Cstruct.t; (* what the bitmap in the delta should contain *)
+  header: Cstruct.t;
+  changed: (int, unit) Hashtbl.t; (* bitmap sectors to write at the next flush *)
+  copying: (int, unit Lwt.t) Hashtbl.t; (* chunks which are being copied up *)
+  fill_pool: Block_pool.t;
+  flush_lock: Lwt_mutex.t;
+  mutable written_chunks: int;
+  mutable in_flight: int;
+  mutable exclusive: unit Lwt.t option; (* while committing or rolling back *)
+  idle: unit Lwt_condition.t;
+  mutable closed: bool;
+}
+
+let get_info t = Lwt.return t.info
+
+let devices t = t.base, t.delta
+
+let sector_size t = t.info.Mirage_block.sector_size
+
+let written_bytes t =
+  Int64.(mul (of_int t.written_chunks) (mul t.chunk_sectors (of_int (sector_size t))))
+
+let chunk_sector t chunk = Int64.mul (Int64.of_int chunk) t.chunk_sectors
+
+(* The last chunk is short if the device isn't a whole number of them *)
+let chunk_length t chunk =
+  min t.chunk_sectors (Int64.sub t.info.Mirage_block.size_sectors (chunk_sector t chunk))
+
+let is_written t chunk =
+  Char.code (Bytes.get t.written (chunk / 8)) land (1 lsl (chunk mod 8)) <> 0
+
+let set_written t chunk =
+  if not (is_written t chunk) then begin
+    let byte = chunk / 8 in
+    Bytes.set t.written byte (Char.chr (Char.code (Bytes.get t.written byte) lor (1 lsl (chunk mod 8))));
+    t.written_chunks <- t.written_chunks + 1;
+    Hashtbl.replace t.changed (byte / sector_size t) ()
+  end
+
+let clear_written t =
+  Bytes.fill t.written 0 (Bytes.length t.written) '\000';
+  t.written_chunks <- 0;
+  for sector = 0 to Cstruct.len t.bitmap / sector_size t - 1 do
+    Hashtbl.replace t.changed sector ()
+  done
+
+(* {2 Metadata} *)
+
+let write_header t =
+  let b = t.header in
+  Cstruct.memset b 0;
+  Cstruct.blit_from_string magic 0 b 0 (String.length magic);
+  Cstruct.BE.set_uint64 b 8 (Int64.mul t.chunk_sectors (Int64.of_int (sector_size t)));
+  Cstruct.BE.set_uint64 b 16 t.info.Mirage_block.size_sectors;
+  Block.write t.delta t.header_sector [ b ]
+
+(* Consecutive bitmap sectors are written together *)
+let write_bitmap t sectors =
+  let ss = sector_size t in
+  let runs = List.fold_left (fun acc sector -> match acc with
+      | (first, n) :: rest when first + n = sector -> (first, n + 1) :: rest
+      | _ -> (sector, 1) :: acc
+    ) [] sectors in
+  Lwt_list.map_s (fun (first, n) ->
+      Block.write t.delta (Int64.(add t.header_sector (of_int (1 + first))))
+        [ Cstruct.sub t.bitmap (first * ss) (n * ss) ]
+    ) (List.rev runs)
+  >|= Block_buffers.first_error
+
+(* Make the data written to the delta durable, then record the chunks which
+   now hold it in the bitmap. A chunk's bit reaches the disk only after all of
+   its data, so after a crash every chunk the bitmap refers to is complete.
+   The changed sectors are copied out first since requests which are still in
+   flight may set more bits. *)
+let flush t =
+  Lwt_mutex.with_lock t.flush_lock
+    (fun () ->
+       let sectors = List.sort compare (Hashtbl.fold (fun s () acc -> s :: acc) t.changed []) in
+       Hashtbl.reset t.changed;
+       let ss = sector_size t in
+       List.iter (fun s ->
+           let len = min ss (Bytes.length t.written - s * ss) in
+           Cstruct.blit_from_bytes t.written (s * ss) t.bitmap (s * ss) len
+         ) sectors;
+       ( Block.flush t.delta
+         >>|= fun () ->
+         if sectors = [] then Lwt.return (Ok ()) else begin
+           write_bitmap t sectors
+           >>|= fun () ->
+           Block.flush t.delta
+         end )
+       >|= function
+       | Ok () -> Ok ()
+       | Error e ->
+         List.iter (fun s -> Hashtbl.replace t.changed s ()) sectors;
+         Error e
+    )
+
+(* {2 Requests} *)
+
+(* Requests run concurrently with each other but not with {!commit} or
+   {!rollback} *)
+let rec request t f =
+  match t.exclusive with
+  | Some finished -> finished >>= fun () -> request t f
+  | None ->
+    t.in_flight <- t.in_flight + 1;
+    Lwt.finalize f
+      (fun () ->
+         t.in_flight <- t.in_flight - 1;
+         if t.in_flight = 0 then Lwt_condition.broadcast t.idle ();
+         Lwt.return_unit)
+
+let rec exclusively t f =
+  match t.exclusive with
+  | Some finished -> finished >>= fun () -> exclusively t f
+  | None ->
+    let finished, u = Lwt.wait () in
+    t.exclusive <- Some finished;
+    let rec drain () =
+      if t.in_flight = 0 then Lwt.return_unit
+      else Lwt_condition.wait t.idle >>= drain in
+    Lwt.finalize (fun () -> drain () >>= f)
+      (fun () ->
+         t.exclusive <- None;
+         Lwt.wakeup_later u ();
+         Lwt.return_unit)
+
+(* The request split at chunk boundaries as [(chunk, within, count, buffers)] *)
+let pieces t sector n buffers =
+  List.map (fun (c, within, count, these) -> Int64.to_int c, within, count, these)
+    (Block_buffers.chunks ~sector_size:(sector_size t) ~chunk_sectors:t.chunk_sectors sector n buffers)
+
+(* Copy [chunk] from the base to the delta, letting [f] modify it first *)
+let copy_up t chunk f =
+  Block_pool.with_buffer t.fill_pool
+    (fun buf ->
+       let buf = Cstruct.sub buf 0 (Int64.to_int (chunk_length t chunk) * sector_size t) in
+       ( Block.read t.base (chunk_sector t chunk) [ buf ] >|= Block_buffers.lift )
+       >>|= fun () ->
+       f buf;
+       Block.write t.delta (chunk_sector t chunk) [ buf ])
+
+(* Change [count] sectors of [chunk] from [within]. In a chunk which is in
+   the delta already, or which is changed entirely, [direct ()] changes the
+   sectors in the delta; otherwise the chunk is copied up with [f] applied.
+   Other writes to a chunk which isn't in the delta wait until it is. *)
+let rec modify t chunk within count ~direct f =
+  if is_written t chunk then direct () else begin
+    match Hashtbl.find t.copying chunk with
+    | finished ->
+      finished
+      >>= fun () ->
+      modify t chunk within count ~direct f
+    | exception Not_found ->
+      let finished, u = Lwt.wait () in
+      Hashtbl.replace t.copying chunk finished;
+      ( if within = 0L && count = chunk_length t chunk
+        then direct ()
+        else copy_up t chunk f )
+      >|= fun r ->
+      ( match r with Ok () -> set_written t chunk | Error _ -> () );
+      Hashtbl.remove t.copying chunk;
+      Lwt.wakeup_later u ();
+      r
+  end
+
+(* Consecutive pieces from the same device are read by one request *)
+let read t sector buffers =
+  match Block_buffers.check "read" t.info sector buffers with
+  | Error e -> Lwt.return (Error e)
+  | Ok n ->
+    request t (fun () ->
+        let runs = List.fold_left (fun acc (chunk, within, _, these) ->
+            let written = is_written t chunk in
+            match acc with
+            | (w, start, bs) :: rest when w = written -> (w, start, List.rev_append these bs) :: rest
+            | _ -> (written, Int64.add (chunk_sector t chunk) within, List.rev these) :: acc
+          ) [] (pieces t sector n buffers) in
+        Lwt_list.map_p (fun (written, start, bs) ->
+            Block.read (if written then t.delta else t.base) start (List.rev bs)
+          ) runs
+        >|= Block_buffers.first_error)
+
+let write t sector buffers =
+  match Block_buffers.check "write" t.info sector buffers with
+  | Error e -> Lwt.return (Error e)
+  | Ok n ->
+    request t (fun () ->
+        let ss = sector_size t in
+        Lwt_list.map_p (fun (chunk, within, count, these) ->
+            let sector = Int64.add (chunk_sector t chunk) within in
+            modify t chunk within count
+              ~direct:(fun () -> Block.write t.delta sector these)
+              (fun buf -> Block_buffers.blit_from buf (Int64.to_int within * ss) these)
+          ) (pieces t sector n buffers)
+        >|= Block_buffers.first_error)
+
+(* Discarded sectors read as zeroes, so they are discarded from the delta
+   rather than left to show the base *)
+let discard t sector n =
+  if Int64.add sector n > t.info.Mirage_block.size_sectors
+  then Lwt.return (Error (`Msg (Printf.sprintf "discard beyond end of device: sector_start (%Ld) + len (%Ld) > size_sectors (%Ld)"
+                                  sector n t.info.Mirage_block.size_sectors)))
+  else request t (fun () ->
+      let ss = sector_size t in
+      Lwt_list.map_p (fun (chunk, within, count, _) ->
+          let sector = Int64.add (chunk_sector t chunk) within in
+          modify t chunk within count
+            ~direct:(fun () -> Block.discard t.delta sector count)
+            (fun buf -> Cstruct.memset (Cstruct.sub buf (Int64.to_int within * ss) (Int64.to_int count * ss)) 0)
+        ) (pieces t sector n [])
+      >|= Block_buffers.first_error)
+
+(* {2 Committing and rolling back} *)
+
+(* Forget every chunk in the delta and free the space they used *)
+let reset t =
+  clear_written t;
+  flush t
+  >>|= fun () ->
+  Block.discard t.delta 0L t.header_sector
+  >|= function
+  | Ok () -> Ok ()
+  | Error e ->
+    (* the bitmap is clear so the data is never read again *)
+    Log.warn (fun f -> f "discarding the contents of %s: %a"
+                 (Block.to_config t.delta).Block.Config.path pp_write_error e);
+    Ok ()
+
+let commit t =
+  Block.get_info t.base
+  >>= fun base_info ->
+  if not base_info.Mirage_block.read_write then Lwt.return (Error `Is_read_only)
+  else exclusively t (fun () ->
+      let ss = sector_size t in
+      let chunks = List.filter (is_written t) (List.init t.chunks (fun i -> i)) in
+      Lwt_list.map_p (fun chunk ->
+          Block_pool.with_buffer t.fill_pool
+            (fun buf ->
+               let buf = Cstruct.sub buf 0 (Int64.to_int (chunk_length t chunk) * ss) in
+               ( Block.read t.delta (chunk_sector t chunk) [ buf ] >|= Block_buffers.lift )
+               >>|= fun () ->
+               Block.write t.base (chunk_sector t chunk) [ buf ])
+        ) chunks
+      >|= Block_buffers.first_error
+      >>|= fun () ->
+      (* the base must have the data before the delta stops referring to it *)
+      Block.flush t.base
+      >>|= fun () ->
+      reset t)
+
+let rollback t = exclusively t (fun () -> reset t)
+
+(* {2 Connecting} *)
+
+let load t =
+  Cstruct.blit_to_bytes t.bitmap 0 t.written 0 (Bytes.length t.written);
+  for chunk = 0 to t.chunks - 1 do
+    if is_written t chunk then t.written_chunks <- t.written_chunks + 1
+  done
+
+let of_devices ?(chunk = 65536) ?(reformat = false) ~base delta =
+  Block.get_info base
+  >>= fun base_info ->
+  Block.get_info delta
+  >>= fun delta_info ->
+  let path x = (Block.to_config x).Block.Config.path in
+  let ss = base_info.Mirage_block.sector_size in
+  let failf fmt = Printf.ksprintf (fun s -> Lwt.fail_with ("Block_overlay.of_devices: " ^ s)) fmt in
+  if delta_info.Mirage_block.sector_size <> ss
+  then failf "%s and %s have different sector sizes" (path base) (path delta)
+  else if not delta_info.Mirage_block.read_write
+  then failf "%s is read-only" (path delta)
+  else if chunk <= 0 || chunk mod ss <> 0
+  then failf "the chunk size (%d) is not a multiple of the sector size (%d)" chunk ss
+  else begin
+    let size_sectors = base_info.Mirage_block.size_sectors in
+    let chunk_sectors = Int64.of_int (chunk / ss) in
+    let chunks = Int64.(to_int (div (add size_sectors (pred chunk_sectors)) chunk_sectors)) in
+    let bitmap_bytes = (chunks + 7) / 8 in
+    let bitmap_sectors = max 1 ((bitmap_bytes + ss - 1) / ss) in
+    let header_sector = Int64.(mul (of_int chunks) chunk_sectors) in
+    let needed = Int64.(add header_sector (of_int (1 + bitmap_sectors))) in
+    let metadata = Block_pool.create ~alignment:(max 4096 ss) ~buffer_size:((1 + bitmap_sectors) * ss) 1 in
+    let metadata = match Block_pool.alloc_now metadata with Some b -> b | None -> assert false in
+    Cstruct.memset metadata 0;
+    let t = {
+      base; delta;
+      info = { base_info with Mirage_block.read_write = true };
+      chunk_sectors; chunks; header_sector;
+      written = Bytes.make bitmap_bytes '\000';
+      bitmap = Cstruct.shift metadata ss; header = Cstruct.sub metadata 0 ss;
+      changed = Hashtbl.create 16; copying = Hashtbl.create 16;
+      fill_pool = Block_pool.create ~alignment:(max 4096 ss) ~buffer_size:chunk 4;
+      flush_lock = Lwt_mutex.create ();
+      written_chunks = 0; in_flight = 0; exclusive = None;
+      idle = Lwt_condition.create (); closed = false;
+    } in
+    let or_fail what = function
+      | Ok x -> Lwt.return x
+      | Error e -> failf "%s %s: %s" what (path delta) (Fmt.to_to_string pp_write_error e) in
+    ( if delta_info.Mirage_block.size_sectors < needed then Lwt.return false else begin
+        ( Block.read delta header_sector [ t.header ] >|= Block_buffers.lift )
+        >>= or_fail "reading the header of"
+        >|= fun () ->
+        Cstruct.to_string (Cstruct.sub t.header 0 (String.length magic)) = magic
+      end )
+    >>= fun formatted ->
+    let matches =
+      Cstruct.BE.get_uint64 t.header 8 = Int64.of_int chunk
+      && Cstruct.BE.get_uint64 t.header 16 = size_sectors in
+    if formatted && matches && not reformat then begin
+      ( Block.read delta (Int64.succ header_sector) [ t.bitmap ] >|= Block_buffers.lift )
+      >>= or_fail "reading the bitmap of"
+      >|= fun () ->
+      load t;
+      t
+    end else if formatted && not reformat then
+      failf "%s was set up for a different base or chunk size; use ~reformat:true to discard it" (path delta)
+    else begin
+      (* Don't overwrite something which isn't a delta by mistake *)
+      ( if reformat then Lwt.return_unit else begin
+          Block.extents delta ~from:0L ~len:delta_info.Mirage_block.size_sectors
+          >>= function
+          | Ok extents when List.exists (fun (_, _, kind) -> kind = `Data) extents ->
+            failf "%s is not empty; use ~reformat:true to discard it" (path delta)
+          | Ok _ -> Lwt.return_unit
+          | Error e -> or_fail "mapping" (Block_buffers.lift (Error e))
+        end )
+      >>= fun () ->
+      ( if delta_info.Mirage_block.size_sectors < needed
+        then Block.resize delta needed
+        else Lwt.return (Ok ()) )
+      >>= or_fail "resizing"
+      >>= fun () ->
+      Cstruct.memset t.bitmap 0;
+      ( write_header t
+        >>|= fun () ->
+        write_bitmap t (List.init bitmap_sectors (fun i -> i))
+        >>|= fun () ->
+        Block.flush delta )
+      >>= or_fail "formatting"
+      >>= fun () ->
+      (* a reformatted delta may still hold the data of the old one *)
+      ( if reformat then Block.discard delta 0L header_sector else Lwt.return (Ok ()) )
+      >>= fun r ->
+      ( match r with
+        | Ok () -> ()
+        | Error e -> Log.warn (fun f -> f "discarding the old contents of %s: %a" (path delta) pp_write_error e) );
+      Lwt.return t
+    end
+  end
+
+let connect ?chunk ?reformat ~base delta =
+  (* The base is shared, and only written by {!commit} *)
+  Block.connect ~lock:false base
+  >>= fun base ->
+  Block.connect delta
+  >>= fun delta ->
+  of_devices ?chunk ?reformat ~base delta
+
+let disconnect t =
+  if t.closed then Lwt.return_unit else begin
+    t.closed <- true;
+    flush t
+    >>= fun r ->
+    ( match r with
+      | Ok () -> ()
+      | Error e ->
+        Log.err (fun f -> f "disconnecting %s: %a" (Block.to_config t.delta).Block.Config.path pp_write_error e) );
+    Block.disconnect t.delta
+    >>= fun () ->
+    Block.disconnect t.base
+  end
@@ -0,0 +1,70 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** A copy-on-write block device made of a read-only base {!Block} device
+    and a writable, sparse delta, so that many instances can share one base
+    image without copying it. The device is divided into fixed-size chunks:
+    a chunk is copied from the base into the delta the first time it is
+    written, and afterwards it is read from and written to the delta. Runs
+    of chunks which are in the same place are read with one vectored
+    request.
+
+    The delta has the same layout as the base, with a header and a bitmap
+    of the chunks it holds after the last chunk. {!flush} makes the data in
+    the delta durable before the bitmap refers to it, so after a crash the
+    device holds every write which was flushed. *)
+
+include Mirage_block.S
+  with type error = Block.error
+   and type write_error = Block.write_error
+
+val of_devices: ?chunk:int -> ?reformat:bool -> base:Block.t -> Block.t -> t Lwt.t
+(** [of_devices ?chunk ?reformat ~base delta] layers [delta] over [base],
+    which must have the same sector size. [base] is only read, except by
+    {!commit}. [delta] is grown to hold the metadata if necessary. If it
+    was used with the same base size and [chunk] (64 KiB by default)
+    before, its contents are kept. Fails if it was set up differently or
+    has data in it without having been set up, unless [reformat] is set,
+    in which case anything on it is discarded. *)
+
+val connect: ?chunk:int -> ?reformat:bool -> base:string -> string -> t Lwt.t
+(** [connect ?chunk ?reformat ~base delta] connects to both paths with
+    {!Block.connect} and combines them as {!of_devices}. The base is
+    connected without a lock so that it can be shared. *)
+
+val devices: t -> Block.t * Block.t
+(** The base and delta devices *)
+
+val written_bytes: t -> int64
+(** The amount of data held in the delta *)
+
+val flush: t -> (unit, write_error) result Lwt.t
+(** [flush t] makes the writes which have completed durable in the
+    delta *)
+
+val discard: t -> int64 -> int64 -> (unit, write_error) result Lwt.t
+(** [discard t sector n] makes the sectors read as zeroes, discarding them
+    from the delta *)
+
+val commit: t -> (unit, write_error) result Lwt.t
+(** [commit t] copies every chunk in the delta to the base, flushes the
+    base and then empties the delta. Requests wait until it has finished.
+    Returns [`Is_read_only] if the base was connected read-only. Nothing
+    else should be using the base at the same time. *)
+
+val rollback: t -> (unit, write_error) result Lwt.t
+(** [rollback t] empties the delta, so that the device reads the same as
+    the base again *)
@@ -0,0 +1,76 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+external alloc_aligned: int -> int -> Cstruct.buffer = "mirage_block_unix_alloc_aligned"
+
+type t = {
+  slab: Cstruct.buffer;
+  buffer_size: int;
+  views: Cstruct.t array; (* made once so that [alloc] does not allocate *)
+  free: int array; (* a stack of free indices *)
+  mutable nr_free: int;
+  in_use: bool array;
+  available: unit Lwt_condition.t;
+}
+
+let create ?(alignment = 4096) ~buffer_size count =
+  if buffer_size <= 0 || count <= 0
+  then invalid_arg (Printf.sprintf "Block_pool.create: %d buffers of %d bytes" count buffer_size);
+  let slab = alloc_aligned alignment (buffer_size * count) in
+  let whole = Cstruct.of_bigarray slab in
+  {
+    slab; buffer_size;
+    views = Array.init count (fun i -> Cstruct.sub whole (i * buffer_size) buffer_size);
+    free = Array.init count (fun i -> count - 1 - i); nr_free = count;
+    in_use = Array.make count false; available = Lwt_condition.create ();
+  }
+
+let buffer_size t = t.buffer_size
+
+let available t = t.nr_free
+
+let slab t = t.slab
+
+let owns t buf = buf.Cstruct.buffer == t.slab
+
+let take t =
+  t.nr_free <- t.nr_free - 1;
+  let i = t.free.(t.nr_free) in
+  t.in_use.(i) <- true;
+  t.views.(i)
+
+let alloc_now t = if t.nr_free = 0 then None else Some (take t)
+
+let rec alloc t =
+  if t.nr_free > 0 then Lwt.return (take t)
+  else Lwt_condition.wait t.available >>= fun () -> alloc t
+
+let free t buf =
+  let off = buf.Cstruct.off in
+  if not (owns t buf) || off mod t.buffer_size <> 0 || Cstruct.len buf <> t.buffer_size
+  then invalid_arg "Block_pool.free: not a buffer from this pool";
+  let i = off / t.buffer_size in
+  if not t.in_use.(i) then invalid_arg "Block_pool.free: buffer is already free";
+  t.in_use.(i) <- false;
+  t.free.(t.nr_free) <- i;
+  t.nr_free <- t.nr_free + 1;
+  Lwt_condition.signal t.available ()
+
+let with_buffer t f =
+  alloc t >>= fun buf ->
+  Lwt.finalize (fun () -> f buf) (fun () -> free t buf; Lwt.return_unit)
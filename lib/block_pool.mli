@@ -0,0 +1,55 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** A fixed set of equally sized, aligned buffers carved out of one slab,
+    for callers which would otherwise allocate a bigarray per request. The
+    buffers are suitable for [O_DIRECT] and, when the pool is created with
+    {!Block.create_pool} on a device using io_uring, the slab is registered
+    as a fixed buffer so requests using a single pool buffer skip the
+    kernel's page pinning. Nothing is allocated after {!create}. *)
+
+type t
+
+val create: ?alignment:int -> buffer_size:int -> int -> t
+(** [create ?alignment ~buffer_size count] allocates [count] buffers of
+    [buffer_size] bytes, each starting on a multiple of [alignment] (4096 by
+    default) if [buffer_size] is *)
+
+val buffer_size: t -> int
+(** The length of every buffer *)
+
+val available: t -> int
+(** The number of buffers which are currently free *)
+
+val alloc: t -> Cstruct.t Lwt.t
+(** [alloc t] takes a free buffer, waiting for one to be freed if necessary.
+    The contents are not cleared. *)
+
+val alloc_now: t -> Cstruct.t option
+(** [alloc_now t] takes a free buffer or returns [None] if there is none *)
+
+val free: t -> Cstruct.t -> unit
+(** [free t buf] returns [buf], exactly as returned by [alloc], to the pool.
+    @raise Invalid_argument if [buf] is not a buffer taken from [t] *)
+
+val with_buffer: t -> (Cstruct.t -> 'a Lwt.t) -> 'a Lwt.t
+(** [with_buffer t f] calls [f] with a buffer, freeing it afterwards *)
+
+val owns: t -> Cstruct.t -> bool
+(** [owns t buf] is true if [buf] is a view of [t]'s slab *)
+
+val slab: t -> Cstruct.buffer
+(** The memory backing every buffer *)
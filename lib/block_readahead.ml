@@ -0,0 +1,154 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+external alloc_aligned: int -> int -> Cstruct.buffer = "mirage_block_unix_alloc_aligned"
+
+let page_size = 4096
+
+(* The first window after a seek; it doubles every time the reader catches
+   up with a prefetch, up to the configured maximum. *)
+let initial_window = 128 * 1024
+
+type window = {
+  buffer: Cstruct.t;
+  mutable start: int64;
+  mutable length: int; (* 0 if the window holds nothing *)
+  mutable generation: int; (* changes whenever [start] or the contents do *)
+  mutable ready: bool Lwt.t; (* resolves to false if the fetch failed *)
+}
+
+type t = {
+  sector_size: int;
+  max_window: int;
+  mutable next: int64; (* where a sequential read would start *)
+  mutable window_size: int;
+  mutable advised_until: int64;
+  windows: window array; (* empty when buffered: the page cache is used instead *)
+  mutable generation: int;
+}
+
+let round_down sector_size x = x / sector_size * sector_size
+
+let create ~buffered ~sector_size max_window =
+  let max_window = max sector_size (round_down sector_size max_window) in
+  let windows =
+    if buffered then [||]
+    else Array.init 2 (fun _ -> {
+        buffer = Cstruct.of_bigarray (alloc_aligned page_size max_window);
+        start = 0L; length = 0; generation = 0; ready = Lwt.return false;
+      }) in
+  let window_size = max sector_size (round_down sector_size (min initial_window max_window)) in
+  { sector_size; max_window; next = -1L; window_size; advised_until = 0L;
+    windows; generation = 0 }
+
+let window_end w = Int64.(add w.start (of_int w.length))
+
+let next_generation t =
+  t.generation <- t.generation + 1;
+  t.generation
+
+let grow t = t.window_size <- min t.max_window (2 * t.window_size)
+
+let invalidate t offset length =
+  let end_ = Int64.add offset length in
+  Array.iter (fun (w: window) ->
+    if w.length > 0 && offset < window_end w && end_ > w.start then begin
+      w.generation <- next_generation t;
+      w.length <- 0
+    end
+  ) t.windows
+
+let invalidate_all t =
+  Array.iter (fun (w: window) ->
+    w.generation <- next_generation t;
+    w.length <- 0
+  ) t.windows;
+  t.next <- -1L
+
+(* Never refill a window while the kernel may still be writing into it *)
+let prefetch ?except t ~fetch ~limit start =
+  let covered = Array.exists (fun w -> w.length > 0 && w.start <= start && start < window_end w) t.windows in
+  let spare = List.filter (fun w ->
+      Lwt.state w.ready <> Lwt.Sleep
+      && (match except with Some e -> w != e | None -> true)
+    ) (Array.to_list t.windows) in
+  match covered, spare with
+  | true, _ | _, [] -> ()
+  | false, w :: _ ->
+    let length = round_down t.sector_size (Int64.to_int (min (Int64.of_int t.window_size) (Int64.sub limit start))) in
+    if length > 0 then begin
+      let generation = next_generation t in
+      w.generation <- generation;
+      w.start <- start;
+      w.length <- length;
+      w.ready <-
+        Lwt.catch
+          (fun () -> fetch start [ Cstruct.sub w.buffer 0 length ] >|= fun () -> w.generation = generation)
+          (fun _ ->
+            if w.generation = generation then w.length <- 0;
+            Lwt.return false);
+      grow t
+    end
+
+let find t offset length =
+  let end_ = Int64.(add offset (of_int length)) in
+  List.find_opt (fun w -> w.length > 0 && w.start <= offset && end_ <= window_end w) (Array.to_list t.windows)
+
+let copy w offset buffers =
+  ignore (List.fold_left (fun from b ->
+    Cstruct.blit w.buffer from b 0 (Cstruct.len b);
+    from + Cstruct.len b
+  ) (Int64.(to_int (sub offset w.start))) buffers)
+
+let read t ~fetch ~advise ~limit offset buffers =
+  let length = List.fold_left (fun acc b -> acc + Cstruct.len b) 0 buffers in
+  let end_ = Int64.(add offset (of_int length)) in
+  let sequential = offset = t.next in
+  t.next <- end_;
+  if not sequential then begin
+    t.window_size <- max t.sector_size (round_down t.sector_size (min initial_window t.max_window));
+    t.advised_until <- 0L
+  end;
+  if Array.length t.windows = 0 then begin
+    (* Stay half a window ahead of the reader *)
+    if sequential && Int64.(add end_ (of_int (t.window_size / 2))) > t.advised_until then begin
+      let from = max end_ t.advised_until in
+      let until = min limit Int64.(add end_ (of_int t.window_size)) in
+      if until > from then begin
+        t.advised_until <- until;
+        grow t;
+        Lwt.async (fun () ->
+          Lwt.catch (fun () -> advise from (Int64.sub until from)) (fun _ -> Lwt.return_unit))
+      end
+    end;
+    fetch offset buffers
+  end else match find t offset length with
+    | Some w ->
+      let generation = w.generation in
+      w.ready >>= fun ok ->
+      if ok && w.generation = generation then begin
+        copy w offset buffers;
+        (* Fetch the next window once the reader is half way through this one *)
+        if end_ > Int64.(add w.start (of_int (w.length / 2)))
+        then prefetch ~except:w t ~fetch ~limit (window_end w);
+        Lwt.return_unit
+      end else fetch offset buffers
+    | None ->
+      fetch offset buffers
+      >|= fun () ->
+      if sequential then prefetch t ~fetch ~limit end_
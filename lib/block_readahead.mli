@@ -0,0 +1,48 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Read-ahead for sequential streams used by {!Block} when configured with
+    [readahead=<bytes>]. A read which starts where the previous one ended
+    counts as sequential. For buffered devices the kernel is asked to start
+    reading the next window into the page cache; for [O_DIRECT] devices the
+    next window is read into one of two page-aligned buffers and later reads
+    are copied from there. The window starts small after every seek and
+    doubles up to the configured maximum while the stream continues. *)
+
+type t
+
+val create: buffered:bool -> sector_size:int -> int -> t
+(** [create ~buffered ~sector_size max_window] creates read-ahead state for a
+    device, prefetching at most [max_window] bytes at a time *)
+
+val read:
+  t ->
+  fetch:(int64 -> Cstruct.t list -> unit Lwt.t) ->
+  advise:(int64 -> int64 -> unit Lwt.t) ->
+  limit:int64 ->
+  int64 -> Cstruct.t list -> unit Lwt.t
+(** [read t ~fetch ~advise ~limit offset buffers] fills [buffers] with the data
+    at [offset], either from a prefetched window or by calling [fetch]. More
+    data may be prefetched with [fetch] or hinted with [advise offset length],
+    but never beyond [limit] *)
+
+val invalidate: t -> int64 -> int64 -> unit
+(** [invalidate t offset length] forgets anything prefetched from the range.
+    Writes call this both before and after they reach the device so that a
+    prefetch racing with the write is never used. *)
+
+val invalidate_all: t -> unit
+(** [invalidate_all t] forgets everything, for example after a resize *)
@@ -0,0 +1,199 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+external raise_errno: int -> string -> 'a = "mirage_block_unix_raise_errno"
+
+module type RING = sig
+  type ring
+  val submit: ring -> int
+  val reap: ring -> int array -> int
+  val withdraw: ring -> int array -> int
+  val close: ring -> unit
+end
+
+let next_generation ~entries g = if g >= max_int / entries - 1 then 0 else g + 1
+
+module Make(R: RING) = struct
+  (* In-flight requests live in a table of [entries] slots, so queueing and
+     completing one allocates nothing beyond its promise. A request's id is
+     its slot plus a multiple of [entries] which changes every time the slot
+     is reused, so a late completion for a request which has already been
+     failed is recognised and ignored. *)
+  type t = {
+    ring: R.ring;
+    eventfd: Lwt_unix.file_descr;
+    entries: int;
+    ids: int array; (* of the request in each slot, or -1 if it is free *)
+    wakers: int Lwt.u array;
+    names: string array; (* for errors *)
+    buffers: Cstruct.t list array;
+    (* the buffers are kept here so they stay alive until the kernel is done *)
+    free: int array; (* a stack of free slots *)
+    mutable nr_free: int;
+    mutable generation: int;
+    nobody: int Lwt.u; (* the waker of a free slot *)
+    mutable in_flight: int;
+    slot_free: unit Lwt_condition.t;
+    mutable submit_scheduled: bool;
+    mutable closed: bool;
+    mutable completions: unit Lwt.t;
+    results: int array;
+    withdrawn: int array;
+    counter: Bytes.t;
+  }
+
+  (* [release t slot] frees [slot] and returns the waker it held *)
+  let release t slot =
+    let u = t.wakers.(slot) in
+    t.ids.(slot) <- -1;
+    t.wakers.(slot) <- t.nobody;
+    t.buffers.(slot) <- [];
+    t.free.(t.nr_free) <- slot;
+    t.nr_free <- t.nr_free + 1;
+    t.in_flight <- t.in_flight - 1;
+    u
+
+  (* Fail the requests which the kernel refused to accept. Those it has
+     already accepted keep their slots and buffers until they complete. *)
+  let fail_queued t e =
+    let n = R.withdraw t.ring t.withdrawn in
+    let refused = ref [] in
+    for i = 0 to n - 1 do
+      let id = t.withdrawn.(i) in
+      let slot = id mod t.entries in
+      if id >= 0 && t.ids.(slot) = id then refused := release t slot :: !refused
+    done;
+    List.iter (fun u -> Lwt.wakeup_later_exn u e) !refused;
+    if n > 0 then Lwt_condition.broadcast t.slot_free ()
+
+  let submit_now t =
+    t.submit_scheduled <- false;
+    try ignore (R.submit t.ring)
+    with
+    | Unix.Unix_error((Unix.EINTR | Unix.EAGAIN | Unix.EBUSY), _, _) ->
+      (* the kernel is short of resources: keep the entries queued and try
+         again once some requests have completed *)
+      ()
+    | e ->
+      fail_queued t e
+
+  (* Everything queued during the current iteration of the Lwt main loop is
+     handed to the kernel together by a single system call. *)
+  let schedule_submit t =
+    if not t.submit_scheduled then begin
+      t.submit_scheduled <- true;
+      Lwt.async (fun () -> Lwt.pause () >|= fun () -> submit_now t)
+    end
+
+  let rec reap_all t =
+    let n = R.reap t.ring t.results in
+    for i = 0 to n - 1 do
+      let id = t.results.(2 * i) and res = t.results.(2 * i + 1) in
+      let slot = id mod t.entries in
+      if id >= 0 && t.ids.(slot) = id then begin
+        let name = t.names.(slot) in
+        let u = release t slot in
+        if res >= 0
+        then Lwt.wakeup_later u res
+        else Lwt.wakeup_later_exn u (try raise_errno (-res) name with e -> e)
+      end
+    done;
+    if n > 0 then begin
+      Lwt_condition.broadcast t.slot_free ();
+      (* anything left queued after an EAGAIN can go now *)
+      schedule_submit t
+    end;
+    if 2 * n = Array.length t.results then reap_all t
+
+  let rec complete t =
+    Lwt_unix.wait_read t.eventfd
+    >>= fun () ->
+    (* Reset the eventfd counter before reaping so that a completion which
+       arrives while we are reaping signals us again. *)
+    ( try ignore (Unix.read (Lwt_unix.unix_file_descr t.eventfd) t.counter 0 8)
+      with Unix.Unix_error((Unix.EAGAIN | Unix.EWOULDBLOCK), _, _) -> () );
+    reap_all t;
+    complete t
+
+  let create ~entries ring eventfd =
+    let nobody = snd (Lwt.wait ()) in
+    let t = {
+      ring; eventfd = Lwt_unix.of_unix_file_descr ~blocking:false eventfd;
+      entries; ids = Array.make entries (-1); wakers = Array.make entries nobody;
+      names = Array.make entries ""; buffers = Array.make entries [];
+      free = Array.init entries (fun i -> entries - 1 - i); nr_free = entries;
+      generation = 0; nobody; in_flight = 0;
+      slot_free = Lwt_condition.create (); submit_scheduled = false;
+      closed = false; completions = Lwt.return_unit;
+      results = Array.make (2 * entries) 0; withdrawn = Array.make entries 0;
+      counter = Bytes.create 8;
+    } in
+    t.completions <- complete t;
+    t
+
+  let ring t = t.ring
+
+  (* [in_flight] is never allowed to exceed [entries], so the ring can
+     always accept a completion. *)
+  let rec enqueue t name buffers prep =
+    if t.closed
+    then Lwt.fail (Unix.Unix_error(Unix.EBADF, name, ""))
+    else if t.in_flight >= t.entries then begin
+      Lwt_condition.wait t.slot_free
+      >>= fun () ->
+      enqueue t name buffers prep
+    end else begin
+      let slot = t.free.(t.nr_free - 1) in
+      let id = t.generation * t.entries + slot in
+      if not (prep id) then begin
+        submit_now t;
+        Lwt.pause ()
+        >>= fun () ->
+        enqueue t name buffers prep
+      end else begin
+        t.generation <- next_generation ~entries:t.entries t.generation;
+        t.nr_free <- t.nr_free - 1;
+        t.in_flight <- t.in_flight + 1;
+        let th, u = Lwt.wait () in
+        t.ids.(slot) <- id;
+        t.wakers.(slot) <- u;
+        t.names.(slot) <- name;
+        t.buffers.(slot) <- buffers;
+        schedule_submit t;
+        th
+      end
+    end
+
+  let close t =
+    if t.closed then Lwt.return_unit else begin
+      submit_now t;
+      let rec drain () =
+        if t.in_flight = 0 then Lwt.return_unit else begin
+          Lwt_condition.wait t.slot_free
+          >>= fun () ->
+          drain ()
+        end in
+      drain ()
+      >>= fun () ->
+      t.closed <- true;
+      Lwt.cancel t.completions;
+      Lwt_unix.close t.eventfd
+      >|= fun () ->
+      R.close t.ring
+    end
+end
@@ -0,0 +1,67 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Request tracking shared by the queued engines ({!Block_uring},
+    {!Block_aio} and {!Block_workers}). Requests are queued on a kernel ring, submitted together at
+    the end of the current Lwt main loop iteration and completed when the
+    kernel signals an eventfd. *)
+
+module type RING = sig
+  type ring
+
+  val submit: ring -> int
+  (** [submit ring] hands every queued request to the kernel and returns the
+      number accepted *)
+
+  val reap: ring -> int array -> int
+  (** [reap ring results] stores up to [Array.length results / 2] completions
+      as (id, result) pairs, where a negative result is [-errno], and
+      returns how many were stored *)
+
+  val withdraw: ring -> int array -> int
+  (** [withdraw ring ids] drops every queued request which the kernel
+      hasn't accepted, so it never will, storing up to [Array.length ids]
+      of their ids. It returns how many were stored. *)
+
+  val close: ring -> unit
+end
+
+val next_generation: entries:int -> int -> int
+(** [next_generation ~entries g] is the generation after [g] for a table of
+    [entries] slots. It wraps to 0 before a request id, which is the
+    generation times [entries] plus the slot, could overflow. *)
+
+module Make(R: RING): sig
+  type t
+
+  val create: entries:int -> R.ring -> Unix.file_descr -> t
+  (** [create ~entries ring eventfd] tracks requests on [ring], allowing at
+      most [entries] in flight, and reaps completions whenever [eventfd]
+      becomes readable *)
+
+  val ring: t -> R.ring
+
+  val enqueue: t -> string -> Cstruct.t list -> (int -> bool) -> int Lwt.t
+  (** [enqueue t name buffers prep] calls [prep id] to queue a request under
+      [id], retrying after a submission if it returns false. The result
+      resolves with the request's result; [name] is used for errors and
+      [buffers] are kept alive until completion. Nothing is allocated per
+      request apart from the result promise. *)
+
+  val close: t -> unit Lwt.t
+  (** [close t] waits for in-flight requests then closes the eventfd and
+      the ring *)
+end
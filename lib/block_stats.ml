@@ -0,0 +1,242 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+external now: unit -> int = "mirage_block_unix_now_ns" [@@noalloc]
+
+module Histogram = struct
+  (* Log-linear buckets as in HdrHistogram: values below [sub_count] have a
+     bucket each and every power of two above is split into [sub_count]
+     buckets, so a value is known to within about 3%. Values of 2^40 ns
+     (18 minutes) or more share the last bucket. *)
+  let sub_bits = 5
+  let sub_count = 1 lsl sub_bits
+  let max_bits = 40
+  let buckets = (max_bits - sub_bits + 1) * sub_count
+
+  type t = {
+    counts: int array;
+    mutable count: int;
+    mutable sum: int;
+    mutable max: int;
+  }
+
+  let create () = { counts = Array.make buckets 0; count = 0; sum = 0; max = 0 }
+
+  let copy t = { t with counts = Array.copy t.counts }
+
+  let rec msb v n = if v < 2 then n else msb (v lsr 1) (n + 1)
+
+  let index v =
+    let v = if v < 0 then 0 else min v (1 lsl max_bits - 1) in
+    if v < sub_count then v else begin
+      let shift = msb v 0 - sub_bits in
+      sub_count + shift * sub_count + (v lsr shift) - sub_count
+    end
+
+  (* The largest value which lands in bucket [i] *)
+  let highest i =
+    if i < sub_count then i else begin
+      let shift = i / sub_count - 1 in
+      ((sub_count + i mod sub_count) lsl shift) + (1 lsl shift) - 1
+    end
+
+  let record t ns =
+    let i = index ns in
+    t.counts.(i) <- t.counts.(i) + 1;
+    t.count <- t.count + 1;
+    t.sum <- t.sum + ns;
+    if ns > t.max then t.max <- ns
+
+  let count t = t.count
+
+  let sum t = t.sum
+
+  let maximum t = t.max
+
+  let mean t = if t.count = 0 then 0. else float_of_int t.sum /. float_of_int t.count
+
+  let percentile t p =
+    if t.count = 0 then 0 else begin
+      let target = max 1 (int_of_float (ceil (p /. 100. *. float_of_int t.count))) in
+      let rec loop i seen =
+        let seen = seen + t.counts.(i) in
+        if seen >= target || i = buckets - 1 then min t.max (highest i) else loop (i + 1) seen in
+      loop 0 0
+    end
+end
+
+type op = [ `Read | `Write | `Flush | `Discard | `Seek ]
+
+type op_stats = {
+  ops: int;
+  bytes: int64;
+  errors: int;
+  latency: Histogram.t;
+}
+
+type snapshot = {
+  read: op_stats;
+  write: op_stats;
+  flush: op_stats;
+  discard: op_stats;
+  seek: op_stats;
+  in_flight: int;
+  max_in_flight: int;
+  lock_wait: Histogram.t;
+  device: Histogram.t;
+  throttle_wait: Histogram.t;
+  seek_hits: int;
+  seek_misses: int;
+  zero_bytes: int64;
+  hashed_blocks: int;
+  duplicate_blocks: int;
+}
+
+type counters = {
+  mutable c_ops: int;
+  mutable c_bytes: int64;
+  mutable c_errors: int;
+  c_latency: Histogram.t;
+}
+
+type t = {
+  per_op: counters array; (* indexed by [op_index] *)
+  mutable current: int;
+  mutable highest: int;
+  t_lock_wait: Histogram.t;
+  t_device: Histogram.t;
+  t_throttle_wait: Histogram.t;
+  mutable hits: int;
+  mutable misses: int;
+  mutable zero_bytes_written: int64;
+  mutable hashed: int;
+  mutable duplicates: int;
+}
+
+let op_index = function
+  | `Read -> 0
+  | `Write -> 1
+  | `Flush -> 2
+  | `Discard -> 3
+  | `Seek -> 4
+
+let create () = {
+  per_op = Array.init 5 (fun _ ->
+      { c_ops = 0; c_bytes = 0L; c_errors = 0; c_latency = Histogram.create () });
+  current = 0; highest = 0;
+  t_lock_wait = Histogram.create (); t_device = Histogram.create ();
+  t_throttle_wait = Histogram.create ();
+  hits = 0; misses = 0;
+  zero_bytes_written = 0L; hashed = 0; duplicates = 0;
+}
+
+let start t =
+  t.current <- t.current + 1;
+  if t.current > t.highest then t.highest <- t.current;
+  now ()
+
+let finish t op bytes start r =
+  let c = t.per_op.(op_index op) in
+  t.current <- t.current - 1;
+  c.c_ops <- c.c_ops + 1;
+  Histogram.record c.c_latency (now () - start);
+  ( match r with
+    | Ok _ -> c.c_bytes <- Int64.add c.c_bytes (Int64.of_int bytes)
+    | Error _ -> c.c_errors <- c.c_errors + 1 );
+  r
+
+let locked t start = Histogram.record t.t_lock_wait (now () - start)
+
+let device t start = Histogram.record t.t_device (now () - start)
+
+let throttled t start = Histogram.record t.t_throttle_wait (now () - start)
+
+let seek t ~hit = if hit then t.hits <- t.hits + 1 else t.misses <- t.misses + 1
+
+let zeroes t bytes = t.zero_bytes_written <- Int64.add t.zero_bytes_written (Int64.of_int bytes)
+
+let blocks t ~hashed ~duplicates =
+  t.hashed <- t.hashed + hashed;
+  t.duplicates <- t.duplicates + duplicates
+
+let snapshot t =
+  let op o =
+    let c = t.per_op.(op_index o) in
+    { ops = c.c_ops; bytes = c.c_bytes; errors = c.c_errors; latency = Histogram.copy c.c_latency } in
+  {
+    read = op `Read; write = op `Write; flush = op `Flush; discard = op `Discard; seek = op `Seek;
+    in_flight = t.current; max_in_flight = t.highest;
+    lock_wait = Histogram.copy t.t_lock_wait; device = Histogram.copy t.t_device;
+    throttle_wait = Histogram.copy t.t_throttle_wait;
+    seek_hits = t.hits; seek_misses = t.misses;
+    zero_bytes = t.zero_bytes_written; hashed_blocks = t.hashed; duplicate_blocks = t.duplicates;
+  }
+
+let quantiles = [ 0.5; 0.9; 0.99; 0.999 ]
+
+let to_prometheus ?(labels = []) s =
+  let b = Buffer.create 4096 in
+  let escape v =
+    let e = Buffer.create (String.length v) in
+    String.iter (function
+        | '\\' -> Buffer.add_string e "\\\\"
+        | '"' -> Buffer.add_string e "\\\""
+        | '\n' -> Buffer.add_string e "\\n"
+        | c -> Buffer.add_char e c
+      ) v;
+    Buffer.contents e in
+  let label_string extra =
+    match labels @ extra with
+    | [] -> ""
+    | l -> "{" ^ String.concat "," (List.map (fun (k, v) -> Printf.sprintf "%s=\"%s\"" k (escape v)) l) ^ "}" in
+  let header name kind help =
+    Printf.bprintf b "# HELP %s %s\n# TYPE %s %s\n" name help name kind in
+  let sample name extra v = Printf.bprintf b "%s%s %s\n" name (label_string extra) v in
+  let seconds ns = Printf.sprintf "%.9f" (float_of_int ns /. 1e9) in
+  let summary name extra h =
+    List.iter (fun q ->
+        sample name (extra @ [ "quantile", string_of_float q ]) (seconds (Histogram.percentile h (q *. 100.)))
+      ) quantiles;
+    sample (name ^ "_sum") extra (seconds (Histogram.sum h));
+    sample (name ^ "_count") extra (string_of_int (Histogram.count h)) in
+  let ops = [ "read", s.read; "write", s.write; "flush", s.flush; "discard", s.discard; "seek", s.seek ] in
+  header "mirage_block_requests_total" "counter" "Requests completed";
+  List.iter (fun (name, o) -> sample "mirage_block_requests_total" [ "op", name ] (string_of_int o.ops)) ops;
+  header "mirage_block_bytes_total" "counter" "Bytes transferred by successful requests";
+  List.iter (fun (name, o) -> sample "mirage_block_bytes_total" [ "op", name ] (Int64.to_string o.bytes)) ops;
+  header "mirage_block_errors_total" "counter" "Requests which failed";
+  List.iter (fun (name, o) -> sample "mirage_block_errors_total" [ "op", name ] (string_of_int o.errors)) ops;
+  header "mirage_block_request_seconds" "summary" "Time from a request being made to its completion";
+  List.iter (fun (name, o) -> summary "mirage_block_request_seconds" [ "op", name ] o.latency) ops;
+  header "mirage_block_in_flight" "gauge" "Requests in progress";
+  sample "mirage_block_in_flight" [] (string_of_int s.in_flight);
+  header "mirage_block_in_flight_max" "gauge" "The most requests ever in progress at once";
+  sample "mirage_block_in_flight_max" [] (string_of_int s.max_in_flight);
+  header "mirage_block_lock_wait_seconds" "summary" "Time spent waiting for the device mutex";
+  summary "mirage_block_lock_wait_seconds" [] s.lock_wait;
+  header "mirage_block_device_seconds" "summary" "Time spent in system calls and kernel queues";
+  summary "mirage_block_device_seconds" [] s.device;
+  header "mirage_block_throttle_wait_seconds" "summary" "Time requests held back by the rate limits spent waiting";
+  summary "mirage_block_throttle_wait_seconds" [] s.throttle_wait;
+  header "mirage_block_seek_shadow_total" "counter" "Seeks avoided and made by the shadow seek offset";
+  sample "mirage_block_seek_shadow_total" [ "result", "hit" ] (string_of_int s.seek_hits);
+  sample "mirage_block_seek_shadow_total" [ "result", "miss" ] (string_of_int s.seek_misses);
+  header "mirage_block_zero_write_bytes_total" "counter" "Bytes of writes found to be zeroes and not transferred";
+  sample "mirage_block_zero_write_bytes_total" [] (Int64.to_string s.zero_bytes);
+  header "mirage_block_dedup_blocks_total" "counter" "Written blocks fingerprinted, by whether they were seen recently";
+  sample "mirage_block_dedup_blocks_total" [ "result", "unique" ] (string_of_int (s.hashed_blocks - s.duplicate_blocks));
+  sample "mirage_block_dedup_blocks_total" [ "result", "duplicate" ] (string_of_int s.duplicate_blocks);
+  Buffer.contents b
@@ -0,0 +1,122 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Request counters and latency histograms kept by every {!Block} device,
+    see {!Block.stats}. Recording costs two reads of a monotonic clock and
+    a few increments per request. *)
+
+val now: unit -> int
+(** The monotonic clock, in nanoseconds *)
+
+module Histogram: sig
+  type t
+  (** Durations in nanoseconds, in buckets which are about 3% wide, in the
+      style of HdrHistogram *)
+
+  val count: t -> int
+
+  val sum: t -> int
+  (** The total of every value recorded *)
+
+  val maximum: t -> int
+
+  val mean: t -> float
+
+  val percentile: t -> float -> int
+  (** [percentile t p] is the value which [p] percent of the values are at
+      or below, rounded up to the top of its bucket. [0] if [t] is empty. *)
+end
+
+type op = [ `Read | `Write | `Flush | `Discard | `Seek ]
+(** [`Seek] is {!Block.seek_mapped} and {!Block.seek_unmapped} *)
+
+type op_stats = {
+  ops: int; (** completed requests, including failures *)
+  bytes: int64; (** transferred by successful requests *)
+  errors: int;
+  latency: Histogram.t; (** from the call to its completion *)
+}
+
+type snapshot = {
+  read: op_stats;
+  write: op_stats;
+  flush: op_stats;
+  discard: op_stats;
+  seek: op_stats;
+  in_flight: int; (** requests in progress *)
+  max_in_flight: int; (** the most requests ever in progress at once *)
+  lock_wait: Histogram.t;
+  (** time spent waiting for the device mutex, which serialises seeks,
+      resizes and I/O on Win32 *)
+  device: Histogram.t;
+  (** time spent in each system call or kernel queue request making a
+      read, write or flush, excluding time waiting in {!Block}'s own
+      queues and caches *)
+  throttle_wait: Histogram.t;
+  (** time reads and writes which were held back by the rate limits spent
+      waiting, which is not part of their latency. Requests which weren't
+      held back aren't counted *)
+  seek_hits: int; (** I/O where the shadow seek offset avoided a seek *)
+  seek_misses: int;
+  zero_bytes: int64;
+  (** written as zeroes or holes instead of transferring buffers, with
+      [detect_zeroes] configured *)
+  hashed_blocks: int; (** sectors fingerprinted, with [dedup_stats] configured *)
+  duplicate_blocks: int;
+  (** fingerprinted sectors with the same contents as one written recently.
+      A lower bound, since only the most recent fingerprints are kept *)
+}
+(** A copy of the statistics at one point in time *)
+
+val to_prometheus: ?labels:(string * string) list -> snapshot -> string
+(** [to_prometheus ?labels s] formats [s] in the Prometheus text
+    exposition format, adding [labels] (for example the device path) to
+    every sample. Latencies are summaries with the 50th, 90th, 99th and
+    99.9th percentiles. *)
+
+(** {2 Recording}
+
+    Used by {!Block} *)
+
+type t
+
+val create: unit -> t
+
+val start: t -> int
+(** [start t] counts a request as in progress and returns the time *)
+
+val finish: t -> op -> int -> int -> ('a, 'b) result -> ('a, 'b) result
+(** [finish t op bytes start result] records a request started at [start]
+    which transferred [bytes] if [result] is [Ok], and returns [result] *)
+
+val locked: t -> int -> unit
+(** [locked t start] records a wait for the mutex which started at [start] *)
+
+val device: t -> int -> unit
+(** [device t start] records a system call which started at [start] *)
+
+val throttled: t -> int -> unit
+(** [throttled t start] records a request held back by the rate limits
+    from [start] until now *)
+
+val seek: t -> hit:bool -> unit
+
+val zeroes: t -> int -> unit
+(** [zeroes t bytes] records a range which was zeroed instead of written *)
+
+val blocks: t -> hashed:int -> duplicates:int -> unit
+
+val snapshot: t -> snapshot
@@ -0,0 +1,180 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+type error = Block.error
+let pp_error = Block.pp_error
+
+type write_error = Block.write_error
+let pp_write_error = Block.pp_write_error
+
+type layout =
+  | Concat of int64 array (* the first sector of each device *)
+  | Stripe of int64 (* sectors per unit *)
+
+type t = {
+  devices: Block.t array;
+  layout: layout;
+  info: Mirage_block.info;
+}
+
+let devices t = Array.to_list t.devices
+
+let get_info t = Lwt.return t.info
+
+let of_devices ?stripe devices =
+  match devices with
+  | [] -> Lwt.fail_with "Block_striped.of_devices: no devices"
+  | first :: _ ->
+    Lwt_list.map_s Block.get_info devices
+    >>= fun infos ->
+    let sector_size = (List.hd infos).Mirage_block.sector_size in
+    let read_write = List.for_all (fun i -> i.Mirage_block.read_write) infos in
+    if List.exists (fun i -> i.Mirage_block.sector_size <> sector_size) infos
+    then Lwt.fail_with (Printf.sprintf "Block_striped.of_devices: %s and the other devices have different sector sizes"
+                          (Block.to_config first).Block.Config.path)
+    else match stripe with
+      | None ->
+        let starts = Array.make (List.length infos) 0L in
+        let size_sectors = List.fold_left (fun (i, start) info ->
+            starts.(i) <- start;
+            i + 1, Int64.add start info.Mirage_block.size_sectors
+          ) (0, 0L) infos |> snd in
+        Lwt.return { devices = Array.of_list devices; layout = Concat starts;
+                     info = { Mirage_block.sector_size; size_sectors; read_write } }
+      | Some bytes when bytes <= 0 || bytes mod sector_size <> 0 ->
+        Lwt.fail_with (Printf.sprintf "Block_striped.of_devices: the stripe (%d) is not a multiple of the sector size (%d)"
+                         bytes sector_size)
+      | Some bytes ->
+        let unit = Int64.of_int (bytes / sector_size) in
+        let smallest = List.fold_left (fun acc i -> min acc i.Mirage_block.size_sectors) Int64.max_int infos in
+        let per_device = Int64.(mul (div smallest unit) unit) in
+        let size_sectors = Int64.(mul per_device (of_int (List.length infos))) in
+        Lwt.return { devices = Array.of_list devices; layout = Stripe unit;
+                     info = { Mirage_block.sector_size; size_sectors; read_write } }
+
+(* Connect every member with [connect_one] and combine them. If any member
+   or the combination fails, the members which did connect are
+   disconnected again so their descriptors and locks aren't leaked. *)
+let connect_all ?stripe connect_one xs =
+  Lwt_list.map_p (fun x ->
+      Lwt.catch (fun () -> connect_one x >|= fun d -> Ok d) (fun e -> Lwt.return (Error e))
+    ) xs
+  >>= fun results ->
+  let connected = List.fold_right (fun r acc -> match r with Ok d -> d :: acc | Error _ -> acc) results [] in
+  let cleanup e =
+    Lwt_list.iter_p (fun d -> Lwt.catch (fun () -> Block.disconnect d) (fun _ -> Lwt.return_unit)) connected
+    >>= fun () ->
+    Lwt.fail e in
+  match List.fold_left (fun acc r -> match acc, r with None, Error e -> Some e | _, _ -> acc) None results with
+  | Some e -> cleanup e
+  | None -> Lwt.catch (fun () -> of_devices ?stripe connected) cleanup
+
+let connect ?stripe paths = connect_all ?stripe (fun path -> Block.connect path) paths
+
+let stripe_of_string s =
+  let n = String.length s in
+  if n = 0 then failwith "empty stripe size";
+  let number, scale = match s.[n - 1] with
+    | 'k' | 'K' -> String.sub s 0 (n - 1), 1024
+    | 'm' | 'M' -> String.sub s 0 (n - 1), 1024 * 1024
+    | 'g' | 'G' -> String.sub s 0 (n - 1), 1024 * 1024 * 1024
+    | _ -> s, 1 in
+  int_of_string number * scale
+
+let of_string x =
+  let u = Uri.of_string x in
+  let paths = String.split_on_char ',' (Uri.path u) in
+  match (match Uri.get_query_param u "stripe" with
+      | None -> None
+      | Some s -> Some (stripe_of_string s)) with
+  | exception Failure _ -> Lwt.fail_with (Printf.sprintf "Block_striped.of_string %s: bad stripe size" x)
+  | stripe ->
+    connect_all ?stripe (fun path ->
+        match Block.Config.of_string (Uri.to_string (Uri.with_path u path)) with
+        | Error (`Msg m) -> Lwt.fail_with m
+        | Ok config -> Block.of_config config
+      ) paths
+
+let disconnect t = Lwt_list.iter_p Block.disconnect (devices t)
+
+(* The pieces of the [n] sectors starting at [sector] on each device, as
+   (device, device sector, sectors, offset in the request) in the order of
+   the request *)
+let pieces t sector n =
+  let rec loop acc sector n offset =
+    if n = 0L then List.rev acc else begin
+      let device, device_sector, count = match t.layout with
+        | Concat starts ->
+          let i = ref (Array.length starts - 1) in
+          while starts.(!i) > sector do decr i done;
+          let next = if !i = Array.length starts - 1 then t.info.Mirage_block.size_sectors else starts.(!i + 1) in
+          !i, Int64.sub sector starts.(!i), min n (Int64.sub next sector)
+        | Stripe unit ->
+          let width = Int64.of_int (Array.length t.devices) in
+          let chunk = Int64.div sector unit and within = Int64.rem sector unit in
+          Int64.to_int (Int64.rem chunk width),
+          Int64.(add (mul (div chunk width) unit) within),
+          min n (Int64.sub unit within) in
+      loop ((device, device_sector, count, offset) :: acc)
+        (Int64.add sector count) (Int64.sub n count) (Int64.add offset count)
+    end in
+  loop [] sector n 0L
+
+(* One request per device: the pieces on the same device are joined when
+   they are contiguous there, which they are for whole stripes *)
+let requests t sector n =
+  let per_device = Array.make (Array.length t.devices) [] in
+  List.iter (fun (device, device_sector, count, offset) ->
+      per_device.(device) <- match per_device.(device) with
+        | (s, c, pieces) :: rest when Int64.add s c = device_sector ->
+          (s, Int64.add c count, (offset, count) :: pieces) :: rest
+        | requests -> (device_sector, count, [ offset, count ]) :: requests
+    ) (pieces t sector n);
+  Array.to_list (Array.mapi (fun device requests ->
+      List.rev_map (fun (s, c, pieces) -> device, s, c, List.rev pieces) requests
+    ) per_device) |> List.concat
+
+let run t op sector buffers f =
+  match Block_buffers.check op t.info sector buffers with
+  | Error e -> Lwt.return (Error e)
+  | Ok n ->
+    let ss = t.info.Mirage_block.sector_size in
+    Lwt_list.map_p (fun (device, device_sector, _, pieces) ->
+        let buffers = List.concat (List.map (fun (offset, count) ->
+            Block_buffers.sub buffers (Int64.to_int offset * ss) (Int64.to_int count * ss)
+          ) pieces) in
+        f t.devices.(device) device_sector buffers
+      ) (requests t sector n)
+    >|= Block_buffers.first_error
+
+let read t sector buffers = run t "read" sector buffers Block.read
+
+let write t sector buffers = run t "write" sector buffers Block.write
+
+let flush t =
+  Lwt_list.map_p Block.flush (devices t) >|= Block_buffers.first_error
+
+let discard t sector n =
+  if Int64.add sector n > t.info.Mirage_block.size_sectors
+  then Lwt.return (Error (`Msg (Printf.sprintf "discard beyond end of device: sector_start (%Ld) + len (%Ld) > size_sectors (%Ld)"
+                                  sector n t.info.Mirage_block.size_sectors)))
+  else
+    Lwt_list.map_p (fun (device, device_sector, count, _) ->
+        Block.discard t.devices.(device) device_sector count
+      ) (requests t sector n)
+    >|= Block_buffers.first_error
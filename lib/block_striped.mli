@@ -0,0 +1,49 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** A block device made of several {!Block} devices with the same sector
+    size, either concatenated one after the other or striped across them
+    in fixed-size units (RAID-0), so that large requests use every device
+    at once. A request is split into at most one vectored request per
+    underlying device, and these run concurrently. *)
+
+include Mirage_block.S
+
+val of_devices: ?stripe:int -> Block.t list -> t Lwt.t
+(** [of_devices ?stripe devices] combines [devices]. With [stripe] the
+    devices are striped in units of [stripe] bytes, which must be a multiple
+    of the sector size, and each contributes as much as the smallest;
+    otherwise they are concatenated in order. Fails if there are no devices
+    or their sector sizes differ. *)
+
+val connect: ?stripe:int -> string list -> t Lwt.t
+(** [connect ?stripe paths] connects to each of [paths] with
+    {!Block.connect} and combines them as {!of_devices} *)
+
+val of_string: string -> t Lwt.t
+(** [of_string uri] connects to a device described by a URI of the form
+    [file://<path>,<path>,...?stripe=<bytes>&...]. The stripe size may have
+    a [k], [m] or [g] suffix and is optional; the rest of the query is the
+    {!Block.Config} of every device. *)
+
+val devices: t -> Block.t list
+(** The underlying devices, in order *)
+
+val flush: t -> (unit, write_error) result Lwt.t
+(** [flush t] flushes every device concurrently *)
+
+val discard: t -> int64 -> int64 -> (unit, write_error) result Lwt.t
+(** [discard t sector n] discards the sectors on each device they map to *)
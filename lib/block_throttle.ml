@@ -0,0 +1,108 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+type limits = {
+  iops_read: int;
+  iops_write: int;
+  bps_read: int;
+  bps_write: int;
+  burst: int;
+}
+
+let unlimited = { iops_read = 0; iops_write = 0; bps_read = 0; bps_write = 0; burst = 1 }
+
+type bucket = {
+  rate: float; (* per second, 0. if there is no limit *)
+  capacity: float;
+  mutable level: float; (* negative while in debt *)
+  mutable last: int; (* when the bucket was last refilled *)
+}
+
+let bucket ~burst rate =
+  let rate = float_of_int (max 0 rate) in
+  let capacity = rate *. float_of_int (max 1 burst) in
+  { rate; capacity; level = capacity; last = Block_stats.now () }
+
+let refill b now =
+  if b.rate > 0. then begin
+    b.level <- min b.capacity (b.level +. b.rate *. float_of_int (now - b.last) /. 1e9);
+    b.last <- now
+  end
+
+(* Seconds until [b] is out of debt *)
+let debt b = if b.level >= 0. then 0. else -. b.level /. b.rate
+
+type direction = {
+  ops: bucket;
+  bytes: bucket;
+  mutable queue: unit Lwt.t; (* the last request waiting to be admitted *)
+}
+
+type t = {
+  limits: limits;
+  read: direction;
+  write: direction;
+}
+
+let direction ~burst iops bps =
+  { ops = bucket ~burst iops; bytes = bucket ~burst bps; queue = Lwt.return_unit }
+
+let create limits = {
+  limits;
+  read = direction ~burst:limits.burst limits.iops_read limits.bps_read;
+  write = direction ~burst:limits.burst limits.iops_write limits.bps_write;
+}
+
+let groups : (string, t) Hashtbl.t = Hashtbl.create 7
+
+let group name limits =
+  try Hashtbl.find groups name
+  with Not_found ->
+    let t = create limits in
+    Hashtbl.replace groups name t;
+    t
+
+let limits t = t.limits
+
+let rec wait d bytes =
+  let now = Block_stats.now () in
+  refill d.ops now;
+  refill d.bytes now;
+  let delay = max (debt d.ops) (debt d.bytes) in
+  if delay > 0. then begin
+    Lwt_unix.sleep delay
+    >>= fun () ->
+    wait d bytes
+  end else begin
+    if d.ops.rate > 0. then d.ops.level <- d.ops.level -. 1.;
+    if d.bytes.rate > 0. then d.bytes.level <- d.bytes.level -. float_of_int bytes;
+    Lwt.return_unit
+  end
+
+let admit t op bytes =
+  let d = match op with `Read -> t.read | `Write -> t.write in
+  let p =
+    if Lwt.is_sleeping d.queue then begin
+      (* wait behind the requests already waiting, even if one of them is
+         cancelled *)
+      Lwt.catch (fun () -> d.queue) (fun _ -> Lwt.return_unit)
+      >>= fun () ->
+      wait d bytes
+    end else wait d bytes in
+  if Lwt.is_sleeping p then d.queue <- p;
+  p
@@ -0,0 +1,50 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Token bucket rate limits used by {!Block} when configured with any of
+    [iops_read], [iops_write], [bps_read], [bps_write] or [throttle_group].
+    Reads and writes each have a bucket of requests and a bucket of bytes
+    which refill at the configured rate and hold up to [burst] seconds'
+    worth, so a device which has been idle may briefly go faster. A request
+    is admitted whenever neither bucket is in debt and then takes what it
+    costs, so one larger than the bucket is still admitted and the debt
+    delays those which follow. Waiting requests are admitted in order. *)
+
+type limits = {
+  iops_read: int; (** requests per second, or 0 for no limit *)
+  iops_write: int;
+  bps_read: int; (** bytes per second, or 0 for no limit *)
+  bps_write: int;
+  burst: int; (** seconds of each rate which may be used at once *)
+}
+
+val unlimited: limits
+
+type t
+
+val create: limits -> t
+(** [create limits] makes buckets for one device, initially full *)
+
+val group: string -> limits -> t
+(** [group name limits] returns the buckets shared by every device in the
+    group [name], creating them with [limits] if it is new *)
+
+val limits: t -> limits
+
+val admit: t -> [ `Read | `Write ] -> int -> unit Lwt.t
+(** [admit t op bytes] resolves when a request of [bytes] may start. If it
+    may start now the result is already resolved and nothing is
+    allocated. *)
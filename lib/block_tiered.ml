@@ -0,0 +1,632 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+let src =
+  let src = Logs.Src.create "mirage-block-unix.tiered" ~doc:"Write-back cache device for mirage-block-unix" in
+  Logs.Src.set_level src (Some Logs.Info);
+  src
+
+module Log = (val Logs.src_log src : Logs.LOG)
+
+type error = Block.error
+let pp_error = Block.pp_error
+
+type write_error = Block.write_error
+let pp_write_error = Block.pp_write_error
+
+let ( >>|= ) m f = m >>= function
+  | Error e -> Lwt.return (Error e)
+  | Ok x -> f x
+
+(* The cache device starts with a superblock sector followed by a table with
+   one entry per slot: the backing chunk plus one (zero if the slot is free)
+   and the flags, both 64-bit big-endian. The slots themselves start at the
+   next chunk boundary. *)
+let magic = "MBUTIER1"
+let entry_size = 16
+let dirty_flag = 1L
+
+type slot = {
+  index: int;
+  mutable chunk: int64; (* the backing chunk held here, or -1L if free *)
+  mutable filled: bool; (* the chunk's data is in the slot *)
+  mutable ready: bool Lwt.t; (* false if filling the slot failed *)
+  mutable dirty: bool;
+  mutable version: int; (* incremented by every write *)
+  mutable users: int; (* requests and write-back using the slot *)
+  mutable referenced: bool;
+}
+
+type t = {
+  cache: Block.t;
+  backing: Block.t;
+  info: Mirage_block.info;
+  chunk_sectors: int64;
+  data_start: int64; (* the first sector of the first slot *)
+  slots: slot array;
+  table: Cstruct.t; (* what the table on the cache device should contain *)
+  superblock: Cstruct.t;
+  map: (int64, slot) Hashtbl.t;
+  mutable free: slot list;
+  mutable released: slot list;
+  (* free, but the table on the cache device still says otherwise *)
+  changed: (int, unit) Hashtbl.t; (* table sectors to write at the next commit *)
+  mutable hand: int; (* the clock used to pick clean chunks to evict *)
+  mutable dirty_chunks: int;
+  fill_pool: Block_pool.t;
+  writeback_pool: Block_pool.t;
+  batch: int; (* the most consecutive chunks written back in one request *)
+  delay: float;
+  alloc_lock: Lwt_mutex.t;
+  commit_lock: Lwt_mutex.t;
+  writeback_lock: Lwt_mutex.t;
+  cleaned: unit Lwt_condition.t; (* slots may have become free or clean *)
+  dirtied: unit Lwt_condition.t;
+  mutable closed: bool;
+  stop: unit Lwt.t;
+  stop_u: unit Lwt.u;
+  mutable writer: unit Lwt.t;
+}
+
+let get_info t = Lwt.return t.info
+
+let devices t = t.cache, t.backing
+
+let dirty_bytes t =
+  Int64.(mul (of_int t.dirty_chunks) (mul t.chunk_sectors (of_int t.info.Mirage_block.sector_size)))
+
+let sector_size t = t.info.Mirage_block.sector_size
+
+let table_sector t slot = slot.index * entry_size / sector_size t
+
+let mark t slot = Hashtbl.replace t.changed (table_sector t slot) ()
+
+let slot_sector t slot = Int64.(add t.data_start (mul (of_int slot.index) t.chunk_sectors))
+
+let chunk_sector t chunk = Int64.mul chunk t.chunk_sectors
+
+(* The last chunk is short if the backing device isn't a whole number of them *)
+let chunk_length t chunk =
+  min t.chunk_sectors (Int64.sub t.info.Mirage_block.size_sectors (chunk_sector t chunk))
+
+let set_dirty t slot dirty =
+  if slot.dirty <> dirty then begin
+    slot.dirty <- dirty;
+    t.dirty_chunks <- t.dirty_chunks + (if dirty then 1 else -1);
+    mark t slot;
+    if dirty then Lwt_condition.broadcast t.dirtied ()
+  end
+
+let written t slot =
+  slot.version <- slot.version + 1;
+  set_dirty t slot true
+
+let release_user t slot =
+  slot.users <- slot.users - 1;
+  if slot.users = 0 then Lwt_condition.broadcast t.cleaned ()
+
+(* The slot can't be reused until the table on the cache device says it is
+   free, see [commit] *)
+let release t slot =
+  set_dirty t slot false;
+  Hashtbl.remove t.map slot.chunk;
+  slot.chunk <- -1L;
+  slot.filled <- false;
+  mark t slot;
+  t.released <- slot :: t.released
+
+let rec iter_s f = function
+  | [] -> Lwt.return (Ok ())
+  | x :: xs -> f x >>|= fun () -> iter_s f xs
+
+(* {2 Metadata} *)
+
+let encode t sector =
+  let per_sector = sector_size t / entry_size in
+  for i = sector * per_sector to min (Array.length t.slots) ((sector + 1) * per_sector) - 1 do
+    let slot = t.slots.(i) in
+    let e = Cstruct.shift t.table (i * entry_size) in
+    (* a slot appears in the table only once its data is there *)
+    if slot.filled then begin
+      Cstruct.BE.set_uint64 e 0 (Int64.succ slot.chunk);
+      Cstruct.BE.set_uint64 e 8 (if slot.dirty then dirty_flag else 0L)
+    end else begin
+      Cstruct.BE.set_uint64 e 0 0L;
+      Cstruct.BE.set_uint64 e 8 0L
+    end
+  done
+
+(* Consecutive table sectors are written together *)
+let write_table t sectors =
+  let ss = sector_size t in
+  let runs = List.fold_left (fun acc sector -> match acc with
+      | (first, n) :: rest when first + n = sector -> (first, n + 1) :: rest
+      | _ -> (sector, 1) :: acc
+    ) [] sectors in
+  iter_s (fun (first, n) ->
+      Block.write t.cache (Int64.of_int (1 + first)) [ Cstruct.sub t.table (first * ss) (n * ss) ]
+    ) (List.rev runs)
+
+let write_superblock t ~clean =
+  let b = t.superblock in
+  Cstruct.memset b 0;
+  Cstruct.blit_from_string magic 0 b 0 (String.length magic);
+  Cstruct.BE.set_uint64 b 8 (Int64.mul t.chunk_sectors (Int64.of_int (sector_size t)));
+  Cstruct.BE.set_uint64 b 16 (Int64.of_int (Array.length t.slots));
+  Cstruct.BE.set_uint64 b 24 t.info.Mirage_block.size_sectors;
+  Cstruct.BE.set_uint64 b 32 (if clean then 1L else 0L);
+  Block.write t.cache 0L [ b ]
+
+(* Make everything written to the cache device durable, then record the
+   changed slots in the table. The data in a newly filled slot is flushed
+   before the table refers to it, and a slot which has been released is only
+   reused once the table no longer refers to it, so after a crash the table
+   never points at another chunk's data. *)
+let commit ?(clean = false) t =
+  Lwt_mutex.with_lock t.commit_lock
+    (fun () ->
+       let sectors = List.sort compare (Hashtbl.fold (fun s () acc -> s :: acc) t.changed []) in
+       Hashtbl.reset t.changed;
+       List.iter (encode t) sectors;
+       let released = t.released in
+       t.released <- [];
+       ( Block.flush t.cache
+         >>|= fun () ->
+         if sectors = [] && not clean then Lwt.return (Ok ()) else begin
+           write_table t sectors
+           >>|= fun () ->
+           ( if clean then write_superblock t ~clean else Lwt.return (Ok ()) )
+           >>|= fun () ->
+           Block.flush t.cache
+         end )
+       >|= function
+       | Ok () ->
+         t.free <- released @ t.free;
+         if released <> [] then Lwt_condition.broadcast t.cleaned ();
+         Ok ()
+       | Error e ->
+         List.iter (fun s -> Hashtbl.replace t.changed s ()) sectors;
+         t.released <- released @ t.released;
+         Error e
+    )
+
+(* {2 Write-back} *)
+
+(* Write a run of slots holding consecutive chunks to the backing device in
+   one request, returning the versions written *)
+let write_run t run =
+  let ss = sector_size t in
+  List.iter (fun slot -> slot.users <- slot.users + 1) run;
+  let versions = List.map (fun slot -> slot, slot.chunk, slot.version) run in
+  Lwt_list.map_p (fun slot ->
+      Block_pool.alloc t.writeback_pool
+      >>= fun buf ->
+      let data = Cstruct.sub buf 0 (Int64.to_int (chunk_length t slot.chunk) * ss) in
+      Block.read t.cache (slot_sector t slot) [ data ]
+      >|= fun r ->
+      buf, data, Block_buffers.lift r
+    ) run
+  >>= fun reads ->
+  ( match Block_buffers.first_error (List.map (fun (_, _, r) -> r) reads) with
+    | Error e -> Lwt.return (Error e)
+    | Ok () ->
+      Block.write t.backing (chunk_sector t (List.hd run).chunk) (List.map (fun (_, data, _) -> data) reads) )
+  >|= fun r ->
+  List.iter (fun (buf, _, _) -> Block_pool.free t.writeback_pool buf) reads;
+  List.iter (release_user t) run;
+  match r with
+  | Error e -> Error e
+  | Ok () -> Ok versions
+
+let write_back t =
+  Lwt_mutex.with_lock t.writeback_lock
+    (fun () ->
+       let dirty = Array.fold_left (fun acc slot ->
+           if slot.dirty && slot.filled then slot :: acc else acc
+         ) [] t.slots in
+       let dirty = List.sort (fun a b -> compare a.chunk b.chunk) dirty in
+       let runs = List.fold_left (fun acc slot -> match acc with
+           | (last :: _ as run) :: rest when Int64.succ last.chunk = slot.chunk && List.length run < t.batch ->
+             (slot :: run) :: rest
+           | _ -> [ slot ] :: acc
+         ) [] dirty in
+       let rec loop acc = function
+         | [] -> Lwt.return (Ok acc)
+         | run :: runs ->
+           write_run t (List.rev run)
+           >>|= fun versions ->
+           loop (versions @ acc) runs in
+       loop [] (List.rev runs)
+       >>|= function
+       | [] -> Lwt.return (Ok ())
+       | written ->
+         Block.flush t.backing
+         >|= function
+         | Error e -> Error e
+         | Ok () ->
+           (* a chunk written to since it was read stays dirty *)
+           List.iter (fun (slot, chunk, version) ->
+               if slot.chunk = chunk && slot.version = version then set_dirty t slot false
+             ) written;
+           Lwt_condition.broadcast t.cleaned ();
+           Ok ()
+    )
+
+let writeback = write_back
+
+let rec writer t =
+  if t.closed then Lwt.return_unit
+  else if t.dirty_chunks = 0 then begin
+    Lwt.choose [ Lwt_condition.wait t.dirtied; t.stop ]
+    >>= fun () ->
+    writer t
+  end else begin
+    (* wait for more writes to batch up, unless the cache is filling *)
+    ( if t.dirty_chunks >= Array.length t.slots / 2
+      then Lwt.return_unit
+      else Lwt.choose [ Lwt_unix.sleep t.delay; t.stop ] )
+    >>= fun () ->
+    if t.closed then Lwt.return_unit else begin
+      write_back t
+      >>= function
+      | Ok () -> writer t
+      | Error e ->
+        Log.err (fun f -> f "write-back to %s failed: %a"
+                    (Block.to_config t.backing).Block.Config.path pp_write_error e);
+        Lwt.choose [ Lwt_unix.sleep t.delay; t.stop ]
+        >>= fun () ->
+        writer t
+    end
+  end
+
+(* {2 Slots} *)
+
+(* Release up to [n] clean chunks which aren't in use *)
+let evict t n =
+  let slots = Array.length t.slots in
+  let rec loop found scanned =
+    if found = n || scanned = 2 * slots then found else begin
+      let slot = t.slots.(t.hand) in
+      t.hand <- (t.hand + 1) mod slots;
+      if not slot.filled || slot.dirty || slot.users > 0
+      then loop found (scanned + 1)
+      else if slot.referenced then begin
+        slot.referenced <- false;
+        loop found (scanned + 1)
+      end else begin
+        release t slot;
+        loop (found + 1) (scanned + 1)
+      end
+    end in
+  loop 0 0
+
+let rec free_slot t =
+  match t.free with
+  | slot :: rest ->
+    t.free <- rest;
+    Lwt.return (Ok slot)
+  | [] ->
+    if evict t (max 1 (Array.length t.slots / 16)) > 0 || t.released <> [] then begin
+      commit t
+      >>|= fun () ->
+      free_slot t
+    end else if t.dirty_chunks > 0 then begin
+      write_back t
+      >>|= fun () ->
+      free_slot t
+    end else begin
+      (* every chunk is in use *)
+      Lwt_condition.wait t.cleaned
+      >>= fun () ->
+      free_slot t
+    end
+
+(* Call [hit slot] with the slot holding [chunk]. If the chunk isn't cached
+   a slot is assigned and [miss slot] fills it instead, returning true if the
+   contents are now dirty. Other requests for the chunk wait until it is
+   filled. *)
+let rec with_chunk t chunk ~hit ~miss =
+  match Hashtbl.find t.map chunk with
+  | slot ->
+    slot.users <- slot.users + 1;
+    slot.referenced <- true;
+    slot.ready
+    >>= fun ok ->
+    if not ok then begin
+      release_user t slot;
+      with_chunk t chunk ~hit ~miss
+    end else begin
+      hit slot
+      >|= fun r ->
+      release_user t slot;
+      r
+    end
+  | exception Not_found ->
+    Lwt_mutex.with_lock t.alloc_lock
+      (fun () ->
+         if Hashtbl.mem t.map chunk then Lwt.return (Ok None)
+         else free_slot t
+           >|= function
+           | Error e -> Error e
+           | Ok slot ->
+             let ready, u = Lwt.wait () in
+             slot.chunk <- chunk;
+             slot.ready <- ready;
+             slot.users <- slot.users + 1;
+             slot.referenced <- true;
+             Hashtbl.replace t.map chunk slot;
+             Ok (Some (slot, u)))
+    >>= function
+    | Error e -> Lwt.return (Error e)
+    | Ok None -> with_chunk t chunk ~hit ~miss
+    | Ok (Some (slot, u)) ->
+      miss slot
+      >|= function
+      | Ok dirty ->
+        slot.filled <- true;
+        mark t slot;
+        if dirty then written t slot;
+        Lwt.wakeup_later u true;
+        release_user t slot;
+        Ok ()
+      | Error e ->
+        (* the table never referred to the slot so it is free already *)
+        Hashtbl.remove t.map chunk;
+        slot.chunk <- -1L;
+        t.free <- slot :: t.free;
+        Lwt.wakeup_later u false;
+        release_user t slot;
+        Error e
+
+(* Read [chunk] from the backing device, let [f] modify it and write it to
+   [slot] *)
+let fill t slot chunk f =
+  Block_pool.with_buffer t.fill_pool
+    (fun buf ->
+       let buf = Cstruct.sub buf 0 (Int64.to_int (chunk_length t chunk) * sector_size t) in
+       ( Block.read t.backing (chunk_sector t chunk) [ buf ] >|= Block_buffers.lift )
+       >>|= fun () ->
+       f buf;
+       Block.write t.cache (slot_sector t slot) [ buf ])
+
+(* {2 Requests} *)
+
+(* Call [f chunk within count buffers] concurrently for each chunk of the
+   request *)
+let per_chunk t sector n buffers f =
+  Lwt_list.map_p (fun (chunk, within, count, these) -> f chunk within count these)
+    (Block_buffers.chunks ~sector_size:(sector_size t) ~chunk_sectors:t.chunk_sectors sector n buffers)
+  >|= Block_buffers.first_error
+
+let read t sector buffers =
+  match Block_buffers.check "read" t.info sector buffers with
+  | Error e -> Lwt.return (Error e)
+  | Ok n ->
+    let ss = sector_size t in
+    per_chunk t sector n buffers (fun chunk within count buffers ->
+        with_chunk t chunk
+          ~hit:(fun slot ->
+              Block.read t.cache (Int64.add (slot_sector t slot) within) buffers >|= Block_buffers.lift)
+          ~miss:(fun slot ->
+              fill t slot chunk (fun buf -> Block_buffers.blit_to buf (Int64.to_int within * ss) buffers)
+              >|= function
+              | Ok () -> Ok false
+              | Error e -> Error e)
+        >|= function
+        | Ok () -> Ok ()
+        | Error (#Block.error as e) -> Error e
+        | Error `Is_read_only -> Error (`Msg "the cache device is read-only")
+      )
+
+let write t sector buffers =
+  match Block_buffers.check "write" t.info sector buffers with
+  | Error e -> Lwt.return (Error e)
+  | Ok _ when not t.info.Mirage_block.read_write -> Lwt.return (Error `Is_read_only)
+  | Ok n ->
+    let ss = sector_size t in
+    per_chunk t sector n buffers (fun chunk within count buffers ->
+        with_chunk t chunk
+          ~hit:(fun slot ->
+              Block.write t.cache (Int64.add (slot_sector t slot) within) buffers
+              >|= fun r ->
+              ( match r with Ok () -> written t slot | Error _ -> () );
+              r)
+          ~miss:(fun slot ->
+              ( if within = 0L && count = chunk_length t chunk
+                then Block.write t.cache (slot_sector t slot) buffers
+                else fill t slot chunk (fun buf -> Block_buffers.blit_from buf (Int64.to_int within * ss) buffers) )
+              >|= function
+              | Ok () -> Ok true
+              | Error e -> Error e)
+      )
+
+let flush t = commit t
+
+let discard t sector n =
+  if Int64.add sector n > t.info.Mirage_block.size_sectors
+  then Lwt.return (Error (`Msg (Printf.sprintf "discard beyond end of device: sector_start (%Ld) + len (%Ld) > size_sectors (%Ld)"
+                                  sector n t.info.Mirage_block.size_sectors)))
+  else if not t.info.Mirage_block.read_write then Lwt.return (Error `Is_read_only)
+  else begin
+    let ss = sector_size t in
+    (* Whole chunks are dropped from the cache and the rest is zeroed there *)
+    per_chunk t sector n [] (fun chunk within count _ ->
+        match Hashtbl.find t.map chunk with
+        | exception Not_found -> Lwt.return (Ok ())
+        | slot when slot.filled && slot.users = 0 && within = 0L && count = chunk_length t chunk ->
+          release t slot;
+          Lwt.return (Ok ())
+        | _ ->
+          with_chunk t chunk
+            ~hit:(fun slot ->
+                Block.write_zeroes t.cache (Int64.add (slot_sector t slot) within) count
+                >|= fun r ->
+                ( match r with Ok () -> written t slot | Error _ -> () );
+                r)
+            ~miss:(fun slot ->
+                fill t slot chunk (fun buf ->
+                    Cstruct.memset (Cstruct.sub buf (Int64.to_int within * ss) (Int64.to_int count * ss)) 0)
+                >|= function
+                | Ok () -> Ok true
+                | Error e -> Error e)
+      )
+    >>|= fun () ->
+    Block.discard t.backing sector n
+  end
+
+(* {2 Connecting} *)
+
+(* The most slots which fit on the cache device with their table *)
+let layout ~sector_size ~chunk_sectors size_sectors =
+  let per_sector = sector_size / entry_size in
+  let data_start slots =
+    let table = Int64.of_int ((slots + per_sector - 1) / per_sector) in
+    Int64.(mul (div (add (add 1L table) (pred chunk_sectors)) chunk_sectors) chunk_sectors) in
+  let fits slots = Int64.(add (data_start slots) (mul (of_int slots) chunk_sectors)) <= size_sectors in
+  let rec loop slots = if slots <= 0 || fits slots then max 0 slots else loop (slots - 1) in
+  let slots = loop (Int64.to_int (Int64.div size_sectors chunk_sectors)) in
+  slots, data_start slots
+
+(* Rebuild the slots from the table. After a crash any chunk in the cache
+   may have been written to since the table was last written, so they are
+   all treated as dirty. *)
+let load t ~clean =
+  Array.iter (fun slot ->
+      let e = Cstruct.shift t.table (slot.index * entry_size) in
+      let stored = Cstruct.BE.get_uint64 e 0 in
+      let chunk = Int64.pred stored in
+      if stored = 0L then t.free <- slot :: t.free
+      else if chunk < 0L || chunk_sector t chunk >= t.info.Mirage_block.size_sectors || Hashtbl.mem t.map chunk then begin
+        mark t slot;
+        t.released <- slot :: t.released
+      end else begin
+        slot.chunk <- chunk;
+        slot.filled <- true;
+        Hashtbl.replace t.map chunk slot;
+        if Int64.logand (Cstruct.BE.get_uint64 e 8) dirty_flag <> 0L then begin
+          slot.dirty <- true;
+          t.dirty_chunks <- t.dirty_chunks + 1
+        end else if not clean then set_dirty t slot true
+      end
+    ) t.slots;
+  t.free <- List.rev t.free
+
+let of_devices ?(chunk = 65536) ?(batch = 1048576) ?(delay = 1.) ?(reformat = false) ~cache backing =
+  Block.get_info cache
+  >>= fun cache_info ->
+  Block.get_info backing
+  >>= fun backing_info ->
+  let path x = (Block.to_config x).Block.Config.path in
+  let ss = backing_info.Mirage_block.sector_size in
+  let failf fmt = Printf.ksprintf (fun s -> Lwt.fail_with ("Block_tiered.of_devices: " ^ s)) fmt in
+  if cache_info.Mirage_block.sector_size <> ss
+  then failf "%s and %s have different sector sizes" (path cache) (path backing)
+  else if not cache_info.Mirage_block.read_write
+  then failf "%s is read-only" (path cache)
+  else if chunk <= 0 || chunk mod ss <> 0
+  then failf "the chunk size (%d) is not a multiple of the sector size (%d)" chunk ss
+  else begin
+    let chunk_sectors = Int64.of_int (chunk / ss) in
+    let slots, data_start = layout ~sector_size:ss ~chunk_sectors cache_info.Mirage_block.size_sectors in
+    if slots = 0 then failf "%s is too small to hold a chunk" (path cache) else begin
+      let table_sectors = (slots * entry_size + ss - 1) / ss in
+      let metadata = Block_pool.create ~alignment:(max 4096 ss) ~buffer_size:((table_sectors + 1) * ss) 1 in
+      let metadata = match Block_pool.alloc_now metadata with Some b -> b | None -> assert false in
+      Cstruct.memset metadata 0;
+      let stop, stop_u = Lwt.wait () in
+      let t = {
+        cache; backing;
+        info = backing_info;
+        chunk_sectors; data_start;
+        slots = Array.init slots (fun index ->
+            { index; chunk = -1L; filled = false; ready = Lwt.return true; dirty = false;
+              version = 0; users = 0; referenced = false });
+        table = Cstruct.shift metadata ss; superblock = Cstruct.sub metadata 0 ss;
+        map = Hashtbl.create slots; free = []; released = []; changed = Hashtbl.create 16;
+        hand = 0; dirty_chunks = 0;
+        fill_pool = Block_pool.create ~alignment:(max 4096 ss) ~buffer_size:chunk 4;
+        writeback_pool = Block_pool.create ~alignment:(max 4096 ss) ~buffer_size:chunk (max 1 (batch / chunk));
+        batch = max 1 (batch / chunk); delay;
+        alloc_lock = Lwt_mutex.create (); commit_lock = Lwt_mutex.create ();
+        writeback_lock = Lwt_mutex.create ();
+        cleaned = Lwt_condition.create (); dirtied = Lwt_condition.create ();
+        closed = false; stop; stop_u; writer = Lwt.return_unit;
+      } in
+      let or_fail what = function
+        | Ok x -> Lwt.return x
+        | Error e -> failf "%s %s: %s" what (path cache) (Fmt.to_to_string pp_write_error e) in
+      ( Block.read cache 0L [ t.superblock ] >|= Block_buffers.lift )
+      >>= or_fail "reading the superblock of"
+      >>= fun () ->
+      let b = t.superblock in
+      let formatted = Cstruct.to_string (Cstruct.sub b 0 (String.length magic)) = magic in
+      let matches =
+        Cstruct.BE.get_uint64 b 8 = Int64.of_int chunk
+        && Cstruct.BE.get_uint64 b 16 = Int64.of_int slots
+        && Cstruct.BE.get_uint64 b 24 = backing_info.Mirage_block.size_sectors in
+      ( if formatted && matches && not reformat then begin
+          let clean = Cstruct.BE.get_uint64 b 32 = 1L in
+          ( Block.read cache 1L [ t.table ] >|= Block_buffers.lift )
+          >>= or_fail "reading the table of"
+          >|= fun () ->
+          load t ~clean;
+          if not clean && t.dirty_chunks > 0
+          then Log.info (fun f -> f "%s was not disconnected cleanly: writing back all %d cached chunks"
+                            (path cache) t.dirty_chunks)
+        end else if formatted && not reformat then
+          failf "%s was set up for a different chunk size or backing device; use ~reformat:true to discard it"
+            (path cache)
+        else begin
+          Cstruct.memset t.table 0;
+          t.free <- Array.to_list t.slots;
+          write_table t (List.init table_sectors (fun i -> i))
+          >>= or_fail "writing the table of"
+        end )
+      >>= fun () ->
+      (* Until the next clean disconnect the table may be behind the data *)
+      ( write_superblock t ~clean:false >>|= fun () -> Block.flush cache )
+      >>= or_fail "writing the superblock of"
+      >|= fun () ->
+      t.writer <- writer t;
+      t
+    end
+  end
+
+let connect ?chunk ?batch ?delay ?reformat ~cache backing =
+  Block.connect cache
+  >>= fun cache ->
+  Block.connect backing
+  >>= fun backing ->
+  of_devices ?chunk ?batch ?delay ?reformat ~cache backing
+
+let disconnect t =
+  if t.closed then Lwt.return_unit else begin
+    t.closed <- true;
+    Lwt.wakeup_later t.stop_u ();
+    t.writer
+    >>= fun () ->
+    commit ~clean:true t
+    >>= fun r ->
+    ( match r with
+      | Ok () -> ()
+      | Error e ->
+        Log.err (fun f -> f "disconnecting %s: %a" (Block.to_config t.cache).Block.Config.path pp_write_error e) );
+    Block.disconnect t.cache
+    >>= fun () ->
+    Block.disconnect t.backing
+  end
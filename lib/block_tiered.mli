@@ -0,0 +1,72 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** A block device made of a small, fast {!Block} device used as a
+    write-back cache in front of a large, slow one. The backing device is
+    cached in fixed-size chunks: reads and writes go to the cache, fetching
+    the chunk from the backing device first if it isn't there, and dirty
+    chunks are written back in the background, sorted and joined into large
+    sequential requests.
+
+    The cache device holds a table of which chunk is in each slot and
+    whether it is dirty. {!flush} makes every acknowledged write durable on
+    the cache device, as its [Config.sync] requires, before updating the
+    table; chunks are only marked clean once the backing device has been
+    flushed with its own [Config.sync]. A slot is not reused until the
+    table on the cache device says it is free, so after a crash every chunk
+    the table refers to holds that chunk's data. After a crash every cached
+    chunk is written back again, since any of them may have been written to
+    after the table was last updated. *)
+
+include Mirage_block.S
+  with type error = Block.error
+   and type write_error = Block.write_error
+
+val of_devices: ?chunk:int -> ?batch:int -> ?delay:float -> ?reformat:bool ->
+  cache:Block.t -> Block.t -> t Lwt.t
+(** [of_devices ?chunk ?batch ?delay ?reformat ~cache backing] caches
+    [backing] on [cache], which must have the same sector size. The cache
+    is divided into slots of [chunk] bytes (64 KiB by default). Dirty
+    chunks are written back [delay] seconds (1 by default) after they are
+    first written, or at once when half of the cache is dirty, in requests
+    of up to [batch] bytes (1 MiB by default). If [cache] was used for the
+    same backing size and chunk size before, its contents are kept, any
+    dirty chunks included. Fails if [cache] was set up differently, unless
+    [reformat] is set, in which case anything on it is discarded. *)
+
+val connect: ?chunk:int -> ?batch:int -> ?delay:float -> ?reformat:bool ->
+  cache:string -> string -> t Lwt.t
+(** [connect ?chunk ?batch ?delay ?reformat ~cache backing] connects to
+    both paths with {!Block.connect} and combines them as {!of_devices} *)
+
+val devices: t -> Block.t * Block.t
+(** The cache and backing devices *)
+
+val dirty_bytes: t -> int64
+(** The amount of data in the cache which is not yet on the backing device *)
+
+val flush: t -> (unit, write_error) result Lwt.t
+(** [flush t] makes the writes which have completed durable on the cache
+    device *)
+
+val writeback: t -> (unit, write_error) result Lwt.t
+(** [writeback t] writes every dirty chunk back to the backing device and
+    flushes it *)
+
+val discard: t -> int64 -> int64 -> (unit, write_error) result Lwt.t
+(** [discard t sector n] drops the whole chunks from the cache, zeroes the
+    cached parts of the others and discards the sectors from the backing
+    device *)
@@ -0,0 +1,116 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+type phase = [ `Begin | `End ]
+
+type event = {
+  name: string;
+  phase: phase;
+  id: int;
+  ts: int;
+  offset: int64;
+  length: int;
+}
+
+(* Parallel arrays rather than an array of records so that recording an
+   event allocates nothing. The names are the literals used by Block. *)
+type t = {
+  capacity: int;
+  names: string array;
+  ends: Bytes.t; (* '\001' for an end event *)
+  ids: int array;
+  times: int array;
+  offsets: int array;
+  lengths: int array;
+  mutable next: int; (* total number of events ever recorded *)
+  mutable next_id: int;
+}
+
+let create ?(capacity = 65536) () =
+  if capacity <= 0 then invalid_arg "Block_trace.create: capacity must be positive";
+  { capacity; names = Array.make capacity ""; ends = Bytes.make capacity '\000';
+    ids = Array.make capacity 0; times = Array.make capacity 0;
+    offsets = Array.make capacity 0; lengths = Array.make capacity 0;
+    next = 0; next_id = 0 }
+
+let record t name is_end id ts offset length =
+  let i = t.next mod t.capacity in
+  t.names.(i) <- name;
+  Bytes.unsafe_set t.ends i (if is_end then '\001' else '\000');
+  t.ids.(i) <- id;
+  t.times.(i) <- ts;
+  t.offsets.(i) <- offset;
+  t.lengths.(i) <- length;
+  t.next <- t.next + 1
+
+let start t name offset length =
+  let id = t.next_id in
+  t.next_id <- id + 1;
+  record t name false id (Block_stats.now ()) (Int64.to_int offset) length;
+  id
+
+let stop t name id = record t name true id (Block_stats.now ()) 0 0
+
+let span t name id start stop =
+  if start <> 0 then begin
+    record t name false id start 0 0;
+    record t name true id (max start stop) 0 0
+  end
+
+let dropped t = max 0 (t.next - t.capacity)
+
+let clear t = t.next <- 0
+
+let events t =
+  let first = dropped t in
+  let rec loop acc n =
+    if n < first then acc else begin
+      let i = n mod t.capacity in
+      let e = {
+        name = t.names.(i);
+        phase = if Bytes.get t.ends i = '\001' then `End else `Begin;
+        id = t.ids.(i); ts = t.times.(i);
+        offset = Int64.of_int t.offsets.(i); length = t.lengths.(i);
+      } in
+      loop (e :: acc) (n - 1)
+    end in
+  loop [] (t.next - 1)
+
+let pp ppf t =
+  List.iter (fun e ->
+      match e.phase with
+      | `Begin ->
+        Format.fprintf ppf "%d begin %s %d offset=%Ld length=%d@\n" e.ts e.name e.id e.offset e.length
+      | `End ->
+        Format.fprintf ppf "%d end %s %d@\n" e.ts e.name e.id
+    ) (events t)
+
+(* Chrome traces are in microseconds *)
+let micros ns = Printf.sprintf "%d.%03d" (ns / 1000) (ns mod 1000)
+
+let to_chrome_json t =
+  let b = Buffer.create 4096 in
+  Buffer.add_string b "{\"traceEvents\":[";
+  List.iteri (fun i e ->
+      if i > 0 then Buffer.add_char b ',';
+      Printf.bprintf b "{\"name\":\"%s\",\"cat\":\"block\",\"ph\":\"%s\",\"id\":%d,\"ts\":%s,\"pid\":0,\"tid\":0"
+        (String.escaped e.name) (match e.phase with `Begin -> "b" | `End -> "e") e.id (micros e.ts);
+      ( match e.phase with
+        | `Begin -> Printf.bprintf b ",\"args\":{\"offset\":%Ld,\"length\":%d}}" e.offset e.length
+        | `End -> Buffer.add_char b '}' )
+    ) (events t);
+  Buffer.add_string b "],\"displayTimeUnit\":\"ns\"}";
+  Buffer.contents b
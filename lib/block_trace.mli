@@ -0,0 +1,79 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Request traces kept in a ring buffer, see {!Block.set_trace}. Every
+    stage of a request is a span with a begin and an end event:
+
+    - ["read"], ["write"], ["flush"] and ["discard"]: from the call to its
+      completion
+    - ["lock"]: waiting for the device mutex
+    - ["job"]: from handing a system call to the thread pool or a kernel
+      queue until the result is back in OCaml
+    - ["worker"]: inside a ["job"] on the thread pool, from the worker
+      thread starting the system call to it finishing
+
+    Timestamps are from the monotonic clock of {!Block_stats.now}. When the
+    ring is full the oldest events are overwritten, so a long run keeps its
+    most recent history. Devices without a trace pay one test per stage. *)
+
+type t
+
+val create: ?capacity:int -> unit -> t
+(** [create ?capacity ()] is an empty trace which keeps the most recent
+    [capacity] events, by default 65536 *)
+
+type phase = [ `Begin | `End ]
+
+type event = {
+  name: string;
+  phase: phase;
+  id: int; (** shared by the begin and end of a span, unique within [t] *)
+  ts: int; (** nanoseconds *)
+  offset: int64; (** in bytes, where the stage has one *)
+  length: int; (** in bytes, where the stage has one *)
+}
+
+val events: t -> event list
+(** [events t] is every event still in the ring in the order they were
+    recorded. A ["worker"] span is recorded when its ["job"] completes. *)
+
+val dropped: t -> int
+(** [dropped t] is the number of events which have been overwritten *)
+
+val clear: t -> unit
+
+val pp: Format.formatter -> t -> unit
+(** [pp ppf t] prints one event per line *)
+
+val to_chrome_json: t -> string
+(** [to_chrome_json t] formats the events as a Chrome trace (the JSON
+    object format) of async spans, which can be loaded into
+    [chrome://tracing] or Perfetto *)
+
+(** {2 Recording}
+
+    Used by {!Block} *)
+
+val start: t -> string -> int64 -> int -> int
+(** [start t name offset length] records the beginning of a span and
+    returns its id *)
+
+val stop: t -> string -> int -> unit
+(** [stop t name id] records the end of the span [id] *)
+
+val span: t -> string -> int -> int -> int -> unit
+(** [span t name id start stop] records a whole span measured elsewhere.
+    Nothing is recorded if [start] is [0], meaning it never began. *)
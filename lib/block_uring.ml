@@ -0,0 +1,97 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+module Raw = struct
+  type ring
+
+  external create: int -> ring = "mirage_block_unix_uring_create"
+  external entries: ring -> int = "mirage_block_unix_uring_entries"
+  external eventfd: ring -> Unix.file_descr = "mirage_block_unix_uring_eventfd"
+  external close: ring -> unit = "mirage_block_unix_uring_close"
+
+  (* The prep_ functions return false if the submission queue is full. The
+     buffers are read by the C stubs as (buffer, off, len) blocks, see
+     Block.Raw. *)
+  external prep_readv: ring -> Unix.file_descr -> Cstruct.t list -> int64 -> int -> bool = "mirage_block_unix_uring_prep_readv"
+  external prep_writev: ring -> Unix.file_descr -> Cstruct.t list -> int64 -> int -> bool = "mirage_block_unix_uring_prep_writev"
+  external prep_fsync: ring -> Unix.file_descr -> bool -> int -> bool = "mirage_block_unix_uring_prep_fsync"
+  external prep_read_fixed: ring -> Unix.file_descr -> Cstruct.t -> int64 -> int -> bool = "mirage_block_unix_uring_prep_read_fixed"
+  external prep_write_fixed: ring -> Unix.file_descr -> Cstruct.t -> int64 -> int -> bool = "mirage_block_unix_uring_prep_write_fixed"
+  external register_buffer: ring -> Cstruct.buffer -> unit = "mirage_block_unix_uring_register_buffer"
+  external prep_discard: ring -> Unix.file_descr -> int64 -> int64 -> int -> bool = "mirage_block_unix_uring_prep_discard"
+
+  external submit: ring -> int = "mirage_block_unix_uring_submit"
+  external reap: ring -> int array -> int = "mirage_block_unix_uring_reap"
+  external withdraw: ring -> int array -> int = "mirage_block_unix_uring_withdraw"
+end
+
+module Q = Block_ring.Make(struct
+  type ring = Raw.ring
+  let submit = Raw.submit
+  let reap = Raw.reap
+  let withdraw = Raw.withdraw
+  let close = Raw.close
+end)
+
+type t = {
+  q: Q.t;
+  mutable fixed: Cstruct.buffer option; (* kept alive until the ring is closed *)
+}
+
+let create ?(entries = 128) () =
+  let ring = Raw.create entries in
+  let eventfd =
+    try Raw.eventfd ring
+    with e -> Raw.close ring; raise e in
+  (* The completion queue is twice the size of the submission queue so it
+     can never overflow. *)
+  { q = Q.create ~entries:(Raw.entries ring) ring eventfd; fixed = None }
+
+let register_buffer t buffer =
+  Raw.register_buffer (Q.ring t.q) buffer;
+  t.fixed <- Some buffer
+
+let is_fixed t buffers = match t.fixed, buffers with
+  | Some slab, [ b ] -> b.Cstruct.buffer == slab
+  | _, _ -> false
+
+let readv t fd offset buffers =
+  if is_fixed t buffers then begin
+    Q.enqueue t.q "io_uring read_fixed" buffers
+      (Raw.prep_read_fixed (Q.ring t.q) fd (List.hd buffers) offset)
+  end else begin
+    Q.enqueue t.q "io_uring readv" buffers (Raw.prep_readv (Q.ring t.q) fd buffers offset)
+  end
+
+let writev t fd offset buffers =
+  if is_fixed t buffers then begin
+    Q.enqueue t.q "io_uring write_fixed" buffers
+      (Raw.prep_write_fixed (Q.ring t.q) fd (List.hd buffers) offset)
+  end else begin
+    Q.enqueue t.q "io_uring writev" buffers (Raw.prep_writev (Q.ring t.q) fd buffers offset)
+  end
+
+let fsync t fd ~datasync =
+  Q.enqueue t.q "io_uring fsync" [] (Raw.prep_fsync (Q.ring t.q) fd datasync)
+  >|= fun _ -> ()
+
+let discard t fd offset length =
+  Q.enqueue t.q "io_uring fallocate" [] (Raw.prep_discard (Q.ring t.q) fd offset length)
+  >|= fun _ -> ()
+
+let close t = Q.close t.q
@@ -0,0 +1,53 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** Linux io_uring I/O engine used by {!Block} when configured with
+    [engine=uring]. Requests issued during one iteration of the Lwt main loop
+    are submitted to the kernel with a single [io_uring_enter] and completions
+    are delivered through an eventfd watched by the main loop. *)
+
+type t
+(** A submission and completion ring *)
+
+val create: ?entries:int -> unit -> t
+(** [create ?entries ()] creates a ring with room for at least [entries]
+    in-flight requests.
+    @raise Unix.Unix_error if io_uring is not available *)
+
+val register_buffer: t -> Cstruct.buffer -> unit
+(** [register_buffer t buffer] registers [buffer] with the kernel. Afterwards
+    a request for a single buffer inside it uses [READ_FIXED] or
+    [WRITE_FIXED]. Only one buffer can be registered per ring.
+    @raise Unix.Unix_error if the kernel refuses *)
+
+val readv: t -> Unix.file_descr -> int64 -> Cstruct.t list -> int Lwt.t
+(** [readv t fd offset buffers] reads into [buffers] from [offset] and returns
+    the number of bytes read, which may be short *)
+
+val writev: t -> Unix.file_descr -> int64 -> Cstruct.t list -> int Lwt.t
+(** [writev t fd offset buffers] writes [buffers] at [offset] and returns
+    the number of bytes written, which may be short *)
+
+val fsync: t -> Unix.file_descr -> datasync:bool -> unit Lwt.t
+(** [fsync t fd ~datasync] flushes [fd] to the drive, skipping metadata which
+    is not needed to read the data back if [datasync] *)
+
+val discard: t -> Unix.file_descr -> int64 -> int64 -> unit Lwt.t
+(** [discard t fd offset length] punches a hole with [fallocate] *)
+
+val close: t -> unit Lwt.t
+(** [close t] waits for in-flight requests to complete and then releases
+    the ring *)
@@ -0,0 +1,110 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+open Lwt.Infix
+
+module Raw = struct
+  type ctx
+
+  external create: int -> int array -> ctx = "mirage_block_unix_workers_create"
+  external eventfd: ctx -> Unix.file_descr = "mirage_block_unix_workers_eventfd"
+  external close: ctx -> unit = "mirage_block_unix_workers_close"
+
+  (* The buffers are read by the C stubs as (buffer, off, len) blocks, see
+     Block.Raw. The queue is never full, since Block_ring limits the number
+     in flight. *)
+  external prep_readv: ctx -> Unix.file_descr -> Cstruct.t list -> int64 -> int -> bool = "mirage_block_unix_workers_prep_readv"
+  external prep_writev: ctx -> Unix.file_descr -> Cstruct.t list -> int64 -> int -> bool = "mirage_block_unix_workers_prep_writev"
+  external prep_fsync: ctx -> Unix.file_descr -> bool -> int -> int -> bool = "mirage_block_unix_workers_prep_fsync"
+  external prep_discard: ctx -> Unix.file_descr -> int64 -> int64 -> int -> bool = "mirage_block_unix_workers_prep_discard"
+  external prep_ftruncate: ctx -> Unix.file_descr -> int64 -> int -> bool = "mirage_block_unix_workers_prep_ftruncate"
+
+  external submit: ctx -> int = "mirage_block_unix_workers_submit"
+  external reap: ctx -> int array -> int = "mirage_block_unix_workers_reap"
+  external withdraw: ctx -> int array -> int = "mirage_block_unix_workers_withdraw"
+end
+
+module Q = Block_ring.Make(struct
+  type ring = Raw.ctx
+  let submit = Raw.submit
+  let reap = Raw.reap
+  let withdraw = Raw.withdraw
+  let close = Raw.close
+end)
+
+type t = Q.t
+
+(* Requests wait in the C queue for a free thread, so this only bounds the
+   memory used by the queue *)
+let entries = 1024
+
+let create ?(threads = 4) ?(cpus = []) () =
+  let ctx = Raw.create threads (Array.of_list cpus) in
+  let eventfd =
+    try Raw.eventfd ctx
+    with e -> Raw.close ctx; raise e in
+  Q.create ~entries ctx eventfd
+
+let readv t fd offset buffers =
+  Q.enqueue t "worker preadv" buffers (Raw.prep_readv (Q.ring t) fd buffers offset)
+
+let writev t fd offset buffers =
+  Q.enqueue t "worker pwritev" buffers (Raw.prep_writev (Q.ring t) fd buffers offset)
+
+let fsync t fd ~ask_drive_to_flush ~flush_method =
+  let m = match flush_method with `Fsync -> 0 | `Fdatasync -> 1 | `Sync_file_range -> 2 in
+  Q.enqueue t "worker fsync" [] (Raw.prep_fsync (Q.ring t) fd ask_drive_to_flush m)
+  >|= fun _ -> ()
+
+let discard t fd offset length =
+  Q.enqueue t "worker discard" [] (Raw.prep_discard (Q.ring t) fd offset length)
+  >|= fun _ -> ()
+
+let ftruncate t fd size =
+  Q.enqueue t "worker ftruncate" [] (Raw.prep_ftruncate (Q.ring t) fd size)
+  >|= fun _ -> ()
+
+let close = Q.close
+
+let cpus_of_string s =
+  let range r = match String.split_on_char '-' (String.trim r) with
+    | [ "" ] -> []
+    | [ x ] -> [ int_of_string x ]
+    | [ a; b ] ->
+      let a = int_of_string a and b = int_of_string b in
+      if b < a then failwith ("Block_workers.cpus_of_string: " ^ r);
+      List.init (b - a + 1) (fun i -> a + i)
+    | _ -> failwith ("Block_workers.cpus_of_string: " ^ r) in
+  List.sort_uniq compare (List.concat (List.map range (String.split_on_char ',' s)))
+
+let string_of_cpus cpus =
+  (* consecutive CPUs are written as a range *)
+  let rec loop acc = function
+    | [] -> List.rev acc
+    | x :: rest ->
+      let rec last y = function
+        | z :: rest when z = y + 1 -> last z rest
+        | rest -> y, rest in
+      let y, rest = last x rest in
+      loop ((if x = y then string_of_int x else Printf.sprintf "%d-%d" x y) :: acc) rest in
+  String.concat "," (loop [] (List.sort_uniq compare cpus))
+
+let numa_node_cpus node =
+  let path = Printf.sprintf "/sys/devices/system/node/node%d/cpulist" node in
+  let ic = open_in path in
+  match input_line ic with
+  | line -> close_in ic; cpus_of_string line
+  | exception e -> close_in ic; raise e
@@ -0,0 +1,70 @@
+(*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *)
+
+(** A pool of threads owned by one device, used by {!Block} when configured
+    with [engine=workers]. Requests on every other engine, and discards,
+    flushes and resizes on the default one, run on the process-wide
+    Lwt_unix thread pool, where a slow system call on one device (a long
+    [BLKDISCARD], a stalled [F_FULLFSYNC]) delays every other device and
+    every other [Lwt_unix] job. Here requests queue for the device's own
+    threads, which can be pinned to CPUs near the storage. Completions are
+    delivered through an eventfd watched by the main loop, as with
+    {!Block_uring}. *)
+
+type t
+
+val create: ?threads:int -> ?cpus:int list -> unit -> t
+(** [create ?threads ?cpus ()] starts [threads] (by default 4) worker
+    threads, each restricted to [cpus] if it is not empty.
+    @raise Unix.Unix_error if threads are not available or CPU affinity is
+    requested on a platform other than Linux *)
+
+val readv: t -> Unix.file_descr -> int64 -> Cstruct.t list -> int Lwt.t
+(** [readv t fd offset buffers] reads into [buffers] from [offset] and returns
+    the number of bytes read, which is short only at end-of-file *)
+
+val writev: t -> Unix.file_descr -> int64 -> Cstruct.t list -> int Lwt.t
+(** [writev t fd offset buffers] writes [buffers] at [offset] and returns
+    the number of bytes written *)
+
+val fsync: t -> Unix.file_descr -> ask_drive_to_flush:bool ->
+  flush_method:[ `Fsync | `Fdatasync | `Sync_file_range ] -> unit Lwt.t
+(** [fsync t fd ~ask_drive_to_flush ~flush_method] flushes [fd] as the
+    shared pool's flush does, using [F_FULLFSYNC] on macOS if
+    [ask_drive_to_flush] *)
+
+val discard: t -> Unix.file_descr -> int64 -> int64 -> unit Lwt.t
+(** [discard t fd offset length] punches a hole, or issues [BLKDISCARD] on a
+    block device *)
+
+val ftruncate: t -> Unix.file_descr -> int64 -> unit Lwt.t
+
+val close: t -> unit Lwt.t
+(** [close t] waits for in-flight requests to complete and then stops the
+    threads *)
+
+(** {2 CPU lists} *)
+
+val cpus_of_string: string -> int list
+(** [cpus_of_string "0-3,8"] is [[0; 1; 2; 3; 8]], the format of Linux's
+    [cpulist] files.
+    @raise Failure if the list cannot be parsed *)
+
+val string_of_cpus: int list -> string
+
+val numa_node_cpus: int -> int list
+(** [numa_node_cpus n] is the CPUs of NUMA node [n], from sysfs.
+    @raise Sys_error if there is no such node or not on Linux *)
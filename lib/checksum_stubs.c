@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* CRC32C checksums of sectors for Block_checksum. Where the CPU has CRC32C
+   instructions (SSE 4.2 on x86-64, the CRC extension on ARMv8) they are
+   used on three sectors at a time, since each instruction has a latency of
+   several cycles but a new one can start every cycle. Other CPUs use a
+   table. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_CRC32C
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define HAVE_ARM_CRC32C
+#include <arm_acle.h>
+#endif
+
+static uint32_t table[256];
+
+static void init_table(void)
+{
+  uint32_t i, j, c;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++)
+      c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+    table[i] = c;
+  }
+}
+
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len--)
+    crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+/* [n] sectors of [len] bytes, a multiple of 8, at [p] */
+static void sectors_soft(const unsigned char *p, size_t len, size_t n, uint32_t *out)
+{
+  size_t i;
+  for (i = 0; i < n; i++)
+    out[i] = ~crc32c_soft(~0U, p + i * len, len);
+}
+
+#if defined(HAVE_X86_CRC32C)
+__attribute__((target("sse4.2")))
+static void sectors_hw(const unsigned char *p, size_t len, size_t n, uint32_t *out)
+{
+  size_t i = 0, j;
+  uint64_t w0, w1, w2;
+  for (; i + 3 <= n; i += 3) {
+    const unsigned char *a = p + i * len, *b = a + len, *c = b + len;
+    uint64_t c0 = ~0U, c1 = ~0U, c2 = ~0U;
+    for (j = 0; j < len; j += 8) {
+      memcpy(&w0, a + j, 8); memcpy(&w1, b + j, 8); memcpy(&w2, c + j, 8);
+      c0 = _mm_crc32_u64(c0, w0);
+      c1 = _mm_crc32_u64(c1, w1);
+      c2 = _mm_crc32_u64(c2, w2);
+    }
+    out[i] = ~(uint32_t)c0; out[i + 1] = ~(uint32_t)c1; out[i + 2] = ~(uint32_t)c2;
+  }
+  for (; i < n; i++) {
+    const unsigned char *a = p + i * len;
+    uint64_t c0 = ~0U;
+    for (j = 0; j < len; j += 8) {
+      memcpy(&w0, a + j, 8);
+      c0 = _mm_crc32_u64(c0, w0);
+    }
+    out[i] = ~(uint32_t)c0;
+  }
+}
+#elif defined(HAVE_ARM_CRC32C)
+static void sectors_hw(const unsigned char *p, size_t len, size_t n, uint32_t *out)
+{
+  size_t i = 0, j;
+  uint64_t w0, w1, w2;
+  for (; i + 3 <= n; i += 3) {
+    const unsigned char *a = p + i * len, *b = a + len, *c = b + len;
+    uint32_t c0 = ~0U, c1 = ~0U, c2 = ~0U;
+    for (j = 0; j < len; j += 8) {
+      memcpy(&w0, a + j, 8); memcpy(&w1, b + j, 8); memcpy(&w2, c + j, 8);
+      c0 = __crc32cd(c0, w0);
+      c1 = __crc32cd(c1, w1);
+      c2 = __crc32cd(c2, w2);
+    }
+    out[i] = ~c0; out[i + 1] = ~c1; out[i + 2] = ~c2;
+  }
+  for (; i < n; i++) {
+    const unsigned char *a = p + i * len;
+    uint32_t c0 = ~0U;
+    for (j = 0; j < len; j += 8) {
+      memcpy(&w0, a + j, 8);
+      c0 = __crc32cd(c0, w0);
+    }
+    out[i] = ~c0;
+  }
+}
+#endif
+
+static void (*sectors)(const unsigned char *, size_t, size_t, uint32_t *) = NULL;
+
+static void choose(void)
+{
+  init_table();
+  sectors = sectors_soft;
+#if defined(HAVE_X86_CRC32C)
+  if (__builtin_cpu_supports("sse4.2")) sectors = sectors_hw;
+#elif defined(HAVE_ARM_CRC32C)
+  sectors = sectors_hw;
+#endif
+}
+
+/* Store the checksum of each [sector_size] sector of the [len] bytes at
+   [off] in [out] from [out_off] as little-endian 32-bit values. 0 means
+   "unknown" in the table, so a checksum of 0 is stored as 1. */
+CAMLprim value mirage_block_unix_crc32c_sectors(value buf, value off, value len, value sector_size, value out, value out_off)
+{
+  const unsigned char *p = (const unsigned char *)Caml_ba_data_val(buf) + Long_val(off);
+  size_t ss = Long_val(sector_size), n = Long_val(len) / ss, i;
+  unsigned char *o = Bytes_val(out) + Long_val(out_off);
+  uint32_t sums[64];
+  if (sectors == NULL) choose();
+  while (n > 0) {
+    size_t batch = n < 64 ? n : 64;
+    sectors(p, ss, batch, sums);
+    for (i = 0; i < batch; i++) {
+      uint32_t s = sums[i] == 0 ? 1 : sums[i];
+      o[0] = s; o[1] = s >> 8; o[2] = s >> 16; o[3] = s >> 24;
+      o += 4;
+    }
+    p += batch * ss;
+    n -= batch;
+  }
+  return Val_unit;
+}
+
+CAMLprim value mirage_block_unix_crc32c_sectors_byte(value *argv, int argn)
+{
+  (void)argn;
+  return mirage_block_unix_crc32c_sectors(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+/* The index of the first sector from [start] whose checksum in [computed]
+   is different from both its entry in [expected] and the one at
+   [table_off] in [table], unless either is 0, or the number of sectors if
+   there is none */
+CAMLprim value mirage_block_unix_checksum_mismatch(value computed, value expected, value table, value table_off, value start)
+{
+  const uint32_t *c = (const uint32_t *)Bytes_val(computed);
+  const uint32_t *e = (const uint32_t *)Bytes_val(expected);
+  const uint32_t *t = (const uint32_t *)(Bytes_val(table) + Long_val(table_off));
+  intnat n = caml_string_length(computed) / 4, i;
+  for (i = Long_val(start); i < n; i++)
+    if (e[i] != 0 && t[i] != 0 && c[i] != e[i] && c[i] != t[i])
+      return Val_long(i);
+  return Val_long(n);
+}
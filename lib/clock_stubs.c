@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A monotonic clock in nanoseconds for request statistics and traces.
+   Unix.gettimeofday allocates a float and jumps when the system time is
+   changed. */
+
+#include <stdint.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+int64_t mirage_block_unix_clock_ns(void)
+{
+#ifdef _WIN32
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+  if (frequency.QuadPart == 0)
+    QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return counter.QuadPart / frequency.QuadPart * 1000000000LL
+    + counter.QuadPart % frequency.QuadPart * 1000000000LL / frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+CAMLprim value mirage_block_unix_now_ns(value unit)
+{
+  (void)unit;
+  return Val_long((intnat)mirage_block_unix_clock_ns());
+}
+
+/* Jobs record when a worker thread started and finished them in a
+   two-element int64 bigarray if they are traced; an empty one means not. */
+int64_t *mirage_block_unix_trace_times(value times)
+{
+  if (Caml_ba_array_val(times)->dim[0] < 2) return NULL;
+  return (int64_t *)Caml_ba_data_val(times);
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Compressing and decompressing clusters for Block_compressed in the LZ4
+   block format, so that images can be inspected with the lz4 tools and no
+   library is needed. Both run on the Lwt thread without allocating. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+/* The format requires the last match to start at least 12 bytes before the
+   end of the input and the last 5 bytes to be literals */
+#define MF_LIMIT 12
+#define LAST_LITERALS 5
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/* A length of 15 or more in a token continues in bytes of 255 */
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+  len -= 15;
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+/* Greedy compression with a single hash table of recent positions. Returns
+   the compressed length, or 0 if it would not fit in [cap] bytes. */
+static size_t compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+  uint32_t table[1 << HASH_LOG];
+  const uint8_t *ip = src, *anchor = src, *end = src + n;
+  uint8_t *op = dst, *oend = dst + cap;
+  size_t lit;
+
+  memset(table, 0, sizeof table);
+  if (n > MF_LIMIT) {
+    const uint8_t *mflimit = end - MF_LIMIT, *matchlimit = end - LAST_LITERALS;
+    while (ip < mflimit) {
+      uint32_t seq = read32(ip), h = hash4(seq);
+      const uint8_t *ref = src + table[h], *m, *r;
+      size_t mlen;
+      uint8_t *token;
+      table[h] = (uint32_t)(ip - src);
+      if (ref >= ip || ip - ref > 65535 || read32(ref) != seq) {
+        ip++;
+        continue;
+      }
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      m = ip + MIN_MATCH;
+      r = ref + MIN_MATCH;
+      while (m < matchlimit && *m == *r) {
+        m++;
+        r++;
+      }
+      lit = ip - anchor;
+      mlen = m - ip - MIN_MATCH;
+      if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1)
+        return 0;
+      token = op++;
+      *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+      if (lit >= 15) op = put_length(op, lit);
+      memcpy(op, anchor, lit);
+      op += lit;
+      *op++ = (uint8_t)((ip - ref) & 0xff);
+      *op++ = (uint8_t)((ip - ref) >> 8);
+      *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+      if (mlen >= 15) op = put_length(op, mlen);
+      ip = anchor = m;
+    }
+  }
+  lit = end - anchor;
+  if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+    return 0;
+  *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+  if (lit >= 15) op = put_length(op, lit);
+  memcpy(op, anchor, lit);
+  op += lit;
+  return op - dst;
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+  unsigned b;
+  do {
+    if (*ip >= iend) return 0;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 1;
+}
+
+/* Returns the decompressed length, or 0 if the input is corrupt or would
+   not fit in [cap] bytes */
+static size_t decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+  const uint8_t *ip = src, *iend = src + n;
+  uint8_t *op = dst, *oend = dst + cap;
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t lit = token >> 4, off, mlen = token & 15;
+    const uint8_t *m;
+    if (lit == 15 && !get_length(&ip, iend, &lit)) return 0;
+    if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return 0;
+    memcpy(op, ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == iend) break; /* the last sequence has no match */
+    if (iend - ip < 2) return 0;
+    off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (off == 0 || off > (size_t)(op - dst)) return 0;
+    if (mlen == 15 && !get_length(&ip, iend, &mlen)) return 0;
+    mlen += MIN_MATCH;
+    if (mlen > (size_t)(oend - op)) return 0;
+    m = op - off;
+    if (off >= mlen) {
+      memcpy(op, m, mlen);
+      op += mlen;
+    } else {
+      /* the match overlaps the bytes it produces */
+      while (mlen--) *op++ = *m++;
+    }
+  }
+  return op - dst;
+}
+
+CAMLprim value mirage_block_unix_lz4_compress(value src, value src_off, value len,
+                                              value dst, value dst_off, value cap)
+{
+  return Val_long(compress((const uint8_t *)Caml_ba_data_val(src) + Long_val(src_off), Long_val(len),
+                           (uint8_t *)Caml_ba_data_val(dst) + Long_val(dst_off), Long_val(cap)));
+}
+
+CAMLprim value mirage_block_unix_lz4_compress_byte(value *argv, int argn)
+{
+  return mirage_block_unix_lz4_compress(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
+
+CAMLprim value mirage_block_unix_lz4_decompress(value src, value src_off, value len,
+                                                value dst, value dst_off, value cap)
+{
+  return Val_long(decompress((const uint8_t *)Caml_ba_data_val(src) + Long_val(src_off), Long_val(len),
+                             (uint8_t *)Caml_ba_data_val(dst) + Long_val(dst_off), Long_val(cap)));
+}
+
+CAMLprim value mirage_block_unix_lz4_decompress_byte(value *argv, int argn)
+{
+  return mirage_block_unix_lz4_decompress(argv[0], argv[1], argv[2], argv[3], argv[4], argv[5]);
+}
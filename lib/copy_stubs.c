@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Copy a range between two files without moving the data through user
+   space. On Linux a reflink (FICLONERANGE) is tried first, which shares the
+   blocks on copy-on-write filesystems, and then copy_file_range, which the
+   kernel may turn into a reflink or a server-side copy. Elsewhere, and when
+   neither is supported, the job fails with ENOTSUP and Block falls back to
+   reading and writing. macOS can only clone (clonefile) or copy (fcopyfile)
+   whole files, which doesn't fit a copy between two open devices. */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/unixsupport.h>
+
+#include "lwt_unix.h"
+
+struct job_copy_range {
+  struct lwt_unix_job job;
+  int src;
+  int dst;
+  uint64_t src_offset;
+  uint64_t dst_offset;
+  uint64_t length;
+  uint64_t copied;
+  int errno_copy;
+  const char *error_fn;
+};
+
+static void worker_copy_range(struct job_copy_range *job)
+{
+  job->errno_copy = ENOTSUP;
+  job->error_fn = "copy_file_range";
+#if defined(__linux__)
+#if defined(FICLONERANGE)
+  struct file_clone_range range = {
+    .src_fd = job->src,
+    .src_offset = job->src_offset,
+    .src_length = job->length,
+    .dest_offset = job->dst_offset
+  };
+  if (ioctl(job->dst, FICLONERANGE, &range) == 0) {
+    job->copied = job->length;
+    job->errno_copy = 0;
+    return;
+  }
+  /* Not a copy-on-write filesystem, different filesystems or a range which
+     isn't block aligned */
+#endif
+#if defined(__NR_copy_file_range)
+  loff_t src_offset = job->src_offset;
+  loff_t dst_offset = job->dst_offset;
+  ssize_t n;
+  while (job->copied < job->length) {
+    n = syscall(__NR_copy_file_range, job->src, &src_offset, job->dst, &dst_offset,
+                (size_t)(job->length - job->copied), 0);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      /* report what was copied; the caller copies the rest another way */
+      if (job->copied == 0) job->errno_copy = errno;
+      else job->errno_copy = 0;
+      return;
+    }
+    if (n == 0) break; /* end of the source file */
+    job->copied += n;
+  }
+  job->errno_copy = 0;
+#endif
+#endif
+}
+
+static value result_copy_range(struct job_copy_range *job)
+{
+  CAMLparam0();
+  CAMLlocal1(result);
+  int errno_copy = job->errno_copy;
+  const char *error_fn = job->error_fn;
+  uint64_t copied = job->copied;
+  lwt_unix_free_job(&job->job);
+  if (errno_copy != 0) unix_error(errno_copy, (char *)error_fn, Nothing);
+  result = caml_copy_int64(copied);
+  CAMLreturn(result);
+}
+
+CAMLprim value mirage_block_unix_copy_range_job(value src, value dst, value src_offset, value dst_offset, value length)
+{
+  CAMLparam5(src, dst, src_offset, dst_offset, length);
+  LWT_UNIX_INIT_JOB(job, copy_range, 0);
+  job->src = Int_val(src);
+  job->dst = Int_val(dst);
+  job->src_offset = Int64_val(src_offset);
+  job->dst_offset = Int64_val(dst_offset);
+  job->length = Int64_val(length);
+  job->copied = 0;
+  job->errno_copy = 0;
+  job->error_fn = "";
+  CAMLreturn(lwt_unix_alloc_job(&(job->job)));
+}
@@ -19,11 +19,17 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <stdio.h>
 
 #ifndef BLKDISCARD
 # define BLKDISCARD	_IO(0x12,119)
 #endif
 
+#ifndef BLKZEROOUT
+# define BLKZEROOUT	_IO(0x12,127)
+#endif
+
 #endif
 
 #include <stdint.h>
@@ -66,24 +72,22 @@ struct job_discard {
 #define ALIGNDOWN(x, a) (-(a) & (x))
 #endif
 
-static void worker_discard(struct job_discard *job)
-{
-  job->errno_copy = ENOTSUP;
-  job->error_fn = "unknown";
 #if defined(__APPLE__)&&defined(F_PUNCHHOLE)
+/* Returns 0 or an errno, setting [error_fn] */
+static int punch_hole(int fd, uint64_t offset, uint64_t length, const char **error_fn)
+{
   /* When a Block device is backed by a file we currently report the sector size as
      512. The macOS F_PUNCHHOLE API requires arguments to be aligned to the `fstatfs`
      `f_bsize` (typically 4096 bytes). Therefore we must manually zero leading and
      trailing unaligned offsets. */
   struct statfs fsbuf;
-  if (fstatfs(job->fd, &fsbuf) == -1) {
-    job->errno_copy = errno;
-    job->error_fn = "fstatfs";
-    return;
+  if (fstatfs(fd, &fsbuf) == -1) {
+    *error_fn = "fstatfs";
+    return errno;
   }
   size_t delete_alignment = (size_t)fsbuf.f_bsize;
-  off_t fp_offset = job->offset;
-  off_t fp_length = job->length;
+  off_t fp_offset = offset;
+  off_t fp_length = length;
 
   size_t aligned_offset = ALIGNUP(fp_offset, delete_alignment);
   if (aligned_offset != fp_offset) {
@@ -91,12 +95,11 @@ static void worker_discard(struct job_discard *job)
     assert(len_to_zero < delete_alignment);
     void *zero_buf = (void*)malloc(len_to_zero);
     bzero(zero_buf, len_to_zero);
-    ssize_t written = pwrite(job->fd, zero_buf,
+    ssize_t written = pwrite(fd, zero_buf,
       len_to_zero, (off_t)fp_offset);
     if (written == -1) {
-      job->errno_copy = errno;
-      job->error_fn = "pwrite";
-      return;
+      *error_fn = "pwrite";
+      return errno;
     }
     fp_offset += len_to_zero;
     fp_length -= len_to_zero;
@@ -111,11 +114,10 @@ static void worker_discard(struct job_discard *job)
       .fp_offset = (off_t)fp_offset,
       .fp_length = (off_t)aligned_length
     };
-    int punched = fcntl(job->fd, F_PUNCHHOLE, &arg);
+    int punched = fcntl(fd, F_PUNCHHOLE, &arg);
     if (punched == -1) {
-      job->errno_copy = errno;
-      job->error_fn = "fcntl(F_PUNCHHOLE)";
-      return;
+      *error_fn = "fcntl(F_PUNCHHOLE)";
+      return errno;
     }
     fp_offset += aligned_length;
     fp_length -= aligned_length;
@@ -125,18 +127,108 @@ static void worker_discard(struct job_discard *job)
     assert(fp_offset % delete_alignment == 0);
     void *zero_buf = (void*)malloc(fp_length);
     bzero(zero_buf, fp_length);
-    ssize_t written = pwrite(job->fd, zero_buf,
+    ssize_t written = pwrite(fd, zero_buf,
       fp_length, (off_t)fp_offset);
     if (written == -1) {
-      job->errno_copy = errno;
-      job->error_fn = "pwrite";
-      return;
+      *error_fn = "pwrite";
+      return errno;
     }
   }
-  job->errno_copy = 0;
-  return;
+  return 0;
+}
+#endif
+
+/* Returns 0 or an errno, setting [error_fn]. Also used by the per-device
+   worker threads in worker_stubs.c. */
+int mirage_block_unix_discard(int fd, uint64_t offset, uint64_t length, const char **error_fn)
+{
+  *error_fn = "unknown";
+#if defined(__APPLE__)&&defined(F_PUNCHHOLE)
+  return punch_hole(fd, offset, length, error_fn);
 #elif defined(__linux__)
   /* Check if it's a file or a block device */
+  struct stat buf;
+  if (fstat(fd, &buf) == -1) {
+    *error_fn = "fstat";
+    return errno;
+  }
+  if (S_ISBLK(buf.st_mode)) {
+    uint64_t range[2] = { offset, length };
+    if (ioctl(fd, BLKDISCARD, &range)) {
+      *error_fn = "ioctl";
+      return errno;
+    }
+    return 0;
+  }
+#if defined(FALLOC_FL_PUNCH_HOLE)
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == -1){
+    *error_fn = "fallocate";
+    return errno;
+  }
+  return 0;
+#else
+  *error_fn = "fallocate";
+  return ENOSYS;
+#endif
+#else
+  (void)fd;
+  (void)offset;
+  (void)length;
+  return ENOTSUP;
+#endif
+}
+
+static void worker_discard(struct job_discard *job)
+{
+  job->errno_copy = mirage_block_unix_discard(job->fd, job->offset, job->length, &job->error_fn);
+}
+
+static value result_discard(struct job_discard *job)
+{
+  CAMLparam0 ();
+  int errno_copy = job->errno_copy;
+  char *error_fn = (char*)job->error_fn;
+  lwt_unix_free_job(&job->job);
+  if (errno_copy != 0) {
+    unix_error(errno_copy, error_fn, Nothing);
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value mirage_block_unix_discard_job(value handle, value offset, value length)
+{
+  CAMLparam3(handle, offset, length);
+  LWT_UNIX_INIT_JOB(job, discard, 0);
+  job->fd = Int_val(handle);
+  job->offset = Int64_val(offset);
+  job->length = Int64_val(length);
+  job->errno_copy = 0;
+  job->error_fn = "";
+  CAMLreturn(lwt_unix_alloc_job(&(job->job)));
+}
+
+struct job_write_zeroes {
+  struct lwt_unix_job job;
+  uint64_t offset;
+  uint64_t length;
+  int fd;
+  int unmap;
+  int errno_copy;
+  const char *error_fn;
+};
+
+/* Zero a range without writing buffers of zeroes. Unless [unmap] the range
+   stays allocated so later writes don't need to allocate. Fails with ENOTSUP
+   if there is no way to do it. */
+static void worker_write_zeroes(struct job_write_zeroes *job)
+{
+  job->errno_copy = ENOTSUP;
+  job->error_fn = "write_zeroes";
+#if defined(__APPLE__)&&defined(F_PUNCHHOLE)
+  if (job->unmap)
+    job->errno_copy = punch_hole(job->fd, job->offset, job->length, &job->error_fn);
+#elif defined(__linux__)
   struct stat buf;
   if (fstat(job->fd, &buf) == -1) {
     job->errno_copy = errno;
@@ -144,31 +236,93 @@ static void worker_discard(struct job_discard *job)
     return;
   }
   if (S_ISBLK(buf.st_mode)) {
+    /* The device may unmap the range if it can guarantee zeroes */
     uint64_t range[2] = { job->offset, job->length };
-    if (ioctl(job->fd, BLKDISCARD, &range)) {
+    if (ioctl(job->fd, BLKZEROOUT, &range)) {
       job->errno_copy = errno;
-      job->error_fn = "ioctl";
+      job->error_fn = "ioctl BLKZEROOUT";
       return;
     }
     job->errno_copy = 0;
     return;
   }
-#if defined(FALLOC_FL_PUNCH_HOLE)
-  if (fallocate(job->fd, FALLOC_FL_PUNCH_HOLE, job->offset, job->length) == -1){
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_ZERO_RANGE)
+  int mode = FALLOC_FL_KEEP_SIZE | (job->unmap ? FALLOC_FL_PUNCH_HOLE : FALLOC_FL_ZERO_RANGE);
+  if (fallocate(job->fd, mode, job->offset, job->length) == -1) {
     job->errno_copy = errno;
     job->error_fn = "fallocate";
     return;
   }
-#else
-  job->errno_copy = ENOSYS;
-  job->error_fn = "fallocate";
-  return;
+  job->errno_copy = 0;
+#endif
 #endif
+}
+
+static value result_write_zeroes(struct job_write_zeroes *job)
+{
+  CAMLparam0 ();
+  int errno_copy = job->errno_copy;
+  char *error_fn = (char*)job->error_fn;
+  lwt_unix_free_job(&job->job);
+  if (errno_copy != 0) {
+    unix_error(errno_copy, error_fn, Nothing);
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value mirage_block_unix_write_zeroes_job(value handle, value offset, value length, value unmap)
+{
+  CAMLparam4(handle, offset, length, unmap);
+  LWT_UNIX_INIT_JOB(job, write_zeroes, 0);
+  job->fd = Int_val(handle);
+  job->offset = Int64_val(offset);
+  job->length = Int64_val(length);
+  job->unmap = Bool_val(unmap);
+  job->errno_copy = 0;
+  job->error_fn = "";
+  CAMLreturn(lwt_unix_alloc_job(&(job->job)));
+}
+
+struct job_preallocate {
+  struct lwt_unix_job job;
+  uint64_t offset;
+  uint64_t length;
+  int fd;
+  int errno_copy;
+  const char *error_fn;
+};
 
+/* Allocate a range without changing the size of the file, so that it can
+   grow into the range later by changing only its size. Fails with ENOTSUP
+   if there is no way to do it. */
+static void worker_preallocate(struct job_preallocate *job)
+{
+  job->errno_copy = ENOTSUP;
+  job->error_fn = "preallocate";
+#if defined(__APPLE__)&&defined(F_PREALLOCATE)
+  /* from the allocated end of the file, contiguously if possible */
+  fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)job->length, 0 };
+  if (fcntl(job->fd, F_PREALLOCATE, &store) == -1) {
+    store.fst_flags = F_ALLOCATEALL;
+    if (fcntl(job->fd, F_PREALLOCATE, &store) == -1) {
+      job->errno_copy = errno;
+      job->error_fn = "fcntl F_PREALLOCATE";
+      return;
+    }
+  }
+  job->errno_copy = 0;
+#elif defined(__linux__)&&defined(FALLOC_FL_KEEP_SIZE)
+  if (fallocate(job->fd, FALLOC_FL_KEEP_SIZE, job->offset, job->length) == -1) {
+    job->errno_copy = errno;
+    job->error_fn = "fallocate";
+    return;
+  }
+  job->errno_copy = 0;
 #endif
 }
 
-static value result_discard(struct job_discard *job)
+static value result_preallocate(struct job_preallocate *job)
 {
   CAMLparam0 ();
   int errno_copy = job->errno_copy;
@@ -181,10 +335,10 @@ static value result_discard(struct job_discard *job)
 }
 
 CAMLprim
-value mirage_block_unix_discard_job(value handle, value offset, value length)
+value mirage_block_unix_preallocate_job(value handle, value offset, value length)
 {
   CAMLparam3(handle, offset, length);
-  LWT_UNIX_INIT_JOB(job, discard, 0);
+  LWT_UNIX_INIT_JOB(job, preallocate, 0);
   job->fd = Int_val(handle);
   job->offset = Int64_val(offset);
   job->length = Int64_val(length);
@@ -192,3 +346,43 @@ value mirage_block_unix_discard_job(value handle, value offset, value length)
   job->error_fn = "";
   CAMLreturn(lwt_unix_alloc_job(&(job->job)));
 }
+
+#if defined(__linux__)
+static int read_sysfs_uint(const char *fmt, dev_t dev, unsigned int *result)
+{
+  char path[128];
+  FILE *f;
+  int ok;
+  snprintf(path, sizeof(path), fmt, major(dev), minor(dev));
+  f = fopen(path, "r");
+  if (f == NULL) return 0;
+  ok = fscanf(f, "%u", result) == 1;
+  fclose(f);
+  return ok;
+}
+#endif
+
+/* The alignment discards should be split at, or 0 if any range will do.
+   Linux punches holes in files at any offset, zeroing partial blocks
+   itself; block devices advertise a granularity in sysfs, under the parent
+   device for a partition. macOS needs the filesystem block size, see
+   worker_discard. Called by the open job in odirect_stubs.c, so it must
+   not touch the OCaml heap. */
+int mirage_block_unix_discard_granularity(int fd)
+{
+  int granularity = 0;
+#if defined(__APPLE__)&&defined(F_PUNCHHOLE)
+  struct statfs fsbuf;
+  if (fstatfs(fd, &fsbuf) == 0)
+    granularity = (int)fsbuf.f_bsize;
+#elif defined(__linux__)
+  struct stat buf;
+  unsigned int n;
+  if (fstat(fd, &buf) == 0 && S_ISBLK(buf.st_mode)) {
+    if (read_sysfs_uint("/sys/dev/block/%u:%u/queue/discard_granularity", buf.st_rdev, &n)
+     || read_sysfs_uint("/sys/dev/block/%u:%u/../queue/discard_granularity", buf.st_rdev, &n))
+      granularity = (int)n;
+  }
+#endif
+  return granularity;
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Find the data in a range of a file in one Lwt_unix job. On Linux this
+   uses the FIEMAP ioctl, which returns many extents per system call, and
+   falls back to SEEK_DATA/SEEK_HOLE (as in lseekhole_stubs.c) where FIEMAP
+   isn't supported, for example on block devices and some network
+   filesystems. The fallback moves the file offset, which Block only relies
+   on for Win32. */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#define HAVE_FIEMAP
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/unixsupport.h>
+
+#include "lwt_unix.h"
+
+/* extents requested from the kernel per FIEMAP call */
+#define FIEMAP_BATCH 256
+
+struct job_extents {
+  struct lwt_unix_job job;
+  int fd;
+  uint64_t offset;
+  uint64_t length;
+  /* data extents as (offset, length) pairs */
+  uint64_t *extents;
+  size_t nr_extents;
+  size_t max_extents;
+  int errno_copy;
+  const char *error_fn;
+};
+
+/* Append an extent, merging it with the previous one if they touch */
+static int add_extent(struct job_extents *job, uint64_t offset, uint64_t length)
+{
+  uint64_t *e;
+  size_t n = job->nr_extents;
+  if (length == 0) return 0;
+  if (n > 0 && job->extents[2 * n - 2] + job->extents[2 * n - 1] == offset) {
+    job->extents[2 * n - 1] += length;
+    return 0;
+  }
+  if (n == job->max_extents) {
+    size_t max = job->max_extents ? 2 * job->max_extents : 64;
+    e = realloc(job->extents, 2 * max * sizeof(uint64_t));
+    if (e == NULL) {
+      job->errno_copy = ENOMEM;
+      job->error_fn = "realloc";
+      return -1;
+    }
+    job->extents = e;
+    job->max_extents = max;
+  }
+  job->extents[2 * n] = offset;
+  job->extents[2 * n + 1] = length;
+  job->nr_extents++;
+  return 0;
+}
+
+#ifdef HAVE_FIEMAP
+/* Returns 1 if FIEMAP isn't supported and nothing was done */
+static int extents_fiemap(struct job_extents *job)
+{
+  uint64_t start = job->offset;
+  uint64_t end = job->offset + job->length;
+  uint64_t e_start, e_end;
+  unsigned int i;
+  int last = 0;
+  struct fiemap_extent *fe;
+  struct fiemap *fm = malloc(sizeof(struct fiemap) + FIEMAP_BATCH * sizeof(struct fiemap_extent));
+  if (fm == NULL) {
+    job->errno_copy = ENOMEM;
+    job->error_fn = "malloc";
+    return 0;
+  }
+  while (start < end && !last) {
+    memset(fm, 0, sizeof(struct fiemap));
+    /* Write out dirty and delayed allocation pages first, otherwise data
+       which is only in the page cache may be reported as a hole */
+    fm->fm_flags = FIEMAP_FLAG_SYNC;
+    fm->fm_start = start;
+    fm->fm_length = end - start;
+    fm->fm_extent_count = FIEMAP_BATCH;
+    if (ioctl(job->fd, FS_IOC_FIEMAP, fm) == -1) {
+      int unsupported = (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL);
+      if (unsupported && start == job->offset) {
+        free(fm);
+        return 1;
+      }
+      job->errno_copy = errno;
+      job->error_fn = "ioctl FS_IOC_FIEMAP";
+      break;
+    }
+    if (fm->fm_mapped_extents == 0) break;
+    for (i = 0; i < fm->fm_mapped_extents; i++) {
+      fe = &fm->fm_extents[i];
+      /* Unwritten (preallocated) extents read as zeroes but may have dirty
+         data in the page cache, so they are reported as data. */
+      e_start = fe->fe_logical < start ? start : fe->fe_logical;
+      e_end = fe->fe_logical + fe->fe_length;
+      if (e_end > end) e_end = end;
+      if (e_end > e_start && add_extent(job, e_start, e_end - e_start) == -1) {
+        free(fm);
+        return 0;
+      }
+      if (fe->fe_flags & FIEMAP_EXTENT_LAST) last = 1;
+    }
+    fe = &fm->fm_extents[fm->fm_mapped_extents - 1];
+    start = fe->fe_logical + fe->fe_length;
+  }
+  free(fm);
+  return 0;
+}
+#endif
+
+static void extents_lseek(struct job_extents *job)
+{
+  uint64_t end = job->offset + job->length;
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  off_t data, hole;
+  off_t pos = (off_t)job->offset;
+  while ((uint64_t)pos < end) {
+    data = lseek(job->fd, pos, SEEK_DATA);
+    if (data == -1) {
+      /* ENXIO means there is no more data before the end of the file */
+      if (errno == ENXIO) return;
+      if (errno == EINVAL) {
+        /* the filesystem doesn't support sparseness */
+        add_extent(job, pos, end - pos);
+        return;
+      }
+      job->errno_copy = errno;
+      job->error_fn = "lseek SEEK_DATA";
+      return;
+    }
+    if ((uint64_t)data >= end) return;
+    hole = lseek(job->fd, data, SEEK_HOLE);
+    if (hole == -1) {
+      job->errno_copy = errno;
+      job->error_fn = "lseek SEEK_HOLE";
+      return;
+    }
+    if ((uint64_t)hole > end) hole = end;
+    if (add_extent(job, data, hole - data) == -1) return;
+    pos = hole;
+  }
+#else
+  /* Without sparseness everything may be data */
+  add_extent(job, job->offset, end - job->offset);
+#endif
+}
+
+static void worker_extents(struct job_extents *job)
+{
+#ifdef HAVE_FIEMAP
+  if (extents_fiemap(job) == 0) return;
+#endif
+  extents_lseek(job);
+}
+
+static value result_extents(struct job_extents *job)
+{
+  CAMLparam0();
+  CAMLlocal3(list, pair, cell);
+  size_t i;
+  int errno_copy = job->errno_copy;
+  const char *error_fn = job->error_fn;
+  list = Val_emptylist;
+  if (errno_copy == 0) {
+    /* built from the end so the list is in order */
+    for (i = job->nr_extents; i > 0; i--) {
+      pair = caml_alloc_tuple(2);
+      Store_field(pair, 0, caml_copy_int64(job->extents[2 * i - 2]));
+      Store_field(pair, 1, caml_copy_int64(job->extents[2 * i - 1]));
+      cell = caml_alloc(2, 0);
+      Store_field(cell, 0, pair);
+      Store_field(cell, 1, list);
+      list = cell;
+    }
+  }
+  free(job->extents);
+  lwt_unix_free_job(&job->job);
+  if (errno_copy != 0) unix_error(errno_copy, (char *)error_fn, Nothing);
+  CAMLreturn(list);
+}
+
+CAMLprim value mirage_block_unix_extents_job(value fd, value offset, value length)
+{
+  CAMLparam3(fd, offset, length);
+  LWT_UNIX_INIT_JOB(job, extents, 0);
+  job->fd = Int_val(fd);
+  job->offset = Int64_val(offset);
+  job->length = Int64_val(length);
+  job->extents = NULL;
+  job->nr_extents = 0;
+  job->max_extents = 0;
+  job->errno_copy = 0;
+  job->error_fn = "";
+  CAMLreturn(lwt_unix_alloc_job(&(job->job)));
+}
@@ -14,6 +14,10 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
@@ -41,34 +45,71 @@
 
 #include "lwt_unix.h"
 
+extern int64_t mirage_block_unix_clock_ns(void);
+extern int64_t *mirage_block_unix_trace_times(value times);
+
 struct job_flush {
   struct lwt_unix_job job;
   HANDLE fd;
   int ask_drive_to_flush; /* only available on APPLE */
+  int method; /* 0: fsync, 1: fdatasync, 2: sync_file_range */
   DWORD errno_copy;
+  int64_t *times; /* worker start and end if traced, or NULL */
 };
 
-static void worker_flush(struct job_flush *job)
+#ifndef WIN32
+/* Returns 0 or an errno. Also used by the per-device worker threads in
+   worker_stubs.c. */
+int mirage_block_unix_fsync(int fd, int ask_drive_to_flush, int method)
 {
   int result = 0;
-#ifdef WIN32
-  if (!FlushFileBuffers(job->fd)) {
-    job->errno_copy = GetLastError();
-  }
-#else
   #if defined(__APPLE__)
-    if (job->ask_drive_to_flush) {
-      result = fcntl(job->fd, F_FULLFSYNC);
+    /* fdatasync is not part of the public API */
+    (void)method;
+    if (ask_drive_to_flush) {
+      result = fcntl(fd, F_FULLFSYNC);
     } else {
-      result = fsync(job->fd);
+      result = fsync(fd);
+    }
+  #elif defined(__linux__)
+    (void)ask_drive_to_flush;
+    switch (method) {
+    case 2:
+      /* Writes back dirty pages but neither the metadata nor the drive's
+         cache, so only suitable for preallocated files */
+      result = sync_file_range(fd, 0, 0,
+        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+      break;
+    case 1:
+      result = fdatasync(fd);
+      break;
+    default:
+      result = fsync(fd);
     }
   #else
-    result = fsync(job->fd);
+    (void)ask_drive_to_flush;
+    result = (method == 0) ? fsync(fd) : fdatasync(fd);
   #endif
-    if (result == -1) {
-      job->errno_copy = errno;
-    }
+  return (result == -1) ? errno : 0;
+}
 #endif
+
+static void sync_flush(struct job_flush *job)
+{
+#ifdef WIN32
+  if (!FlushFileBuffers(job->fd)) {
+    job->errno_copy = GetLastError();
+  }
+#else
+  job->errno_copy = mirage_block_unix_fsync(job->fd, job->ask_drive_to_flush, job->method);
+#endif
+}
+
+static void worker_flush(struct job_flush *job)
+{
+  if (job->times) job->times[0] = mirage_block_unix_clock_ns();
+  sync_flush(job);
+  if (job->times) job->times[1] = mirage_block_unix_clock_ns();
 }
 
 static value result_flush(struct job_flush *job)
@@ -92,12 +133,14 @@ static value result_flush(struct job_flush *job)
 }
 
 CAMLprim
-value mirage_block_unix_flush_job(value handle, value ask_drive_to_flush)
+value mirage_block_unix_flush_job(value handle, value ask_drive_to_flush, value method, value times)
 {
-  CAMLparam2(handle, ask_drive_to_flush);
+  CAMLparam4(handle, ask_drive_to_flush, method, times);
   LWT_UNIX_INIT_JOB(job, flush, 0);
   job->fd = (HANDLE)Handle_val(handle);
   job->ask_drive_to_flush = Bool_val(ask_drive_to_flush);
+  job->method = Int_val(method);
   job->errno_copy = 0;
+  job->times = mirage_block_unix_trace_times(times);
   CAMLreturn(lwt_unix_alloc_job(&(job->job)));
 }
@@ -15,57 +15,208 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* Opening a file for Block in one Lwt_unix job: the open itself, with
+   O_DIRECT or F_NOCACHE unless buffered, the lock and all of the probing
+   of its size and geometry. Any of these can block for a long time on a
+   stalled network filesystem or a drive which is spinning up, so none of
+   them runs on the Lwt main thread, and many files can be opened at once. */
+
 #define _GNU_SOURCE
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#endif
 
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/disk.h>
+#endif
+
 #include <caml/alloc.h>
 #include <caml/memory.h>
-#include <caml/signals.h>
 #include <caml/fail.h>
-#include <caml/callback.h>
-#include <caml/bigarray.h>
+#include <caml/unixsupport.h>
 
-/* ocaml/ocaml/unixsupport.c */
-extern void uerror(char *cmdname, value cmdarg);
-#define Nothing ((value) 0)
+#include "lwt_unix.h"
 
-CAMLprim value stub_openfile_direct(value filename, value rw, value perm){
-  CAMLparam3(filename, rw, perm);
-  CAMLlocal1(result);
+/* blkgetsize_stubs.c */
+extern int blkgetsize(int fd, uint64_t *psize);
+extern int blkgetsectorsize(int fd, int *size);
+/* discard_stubs.c */
+extern int mirage_block_unix_discard_granularity(int fd);
+
+/* The order of the constructors of Block.Raw.kind */
+#define KIND_FILE 0
+#define KIND_DEVICE 1
+#define KIND_OTHER 2
+
+struct job_open_probe {
+  struct lwt_unix_job job;
+  int buffered;
+  int lock;
   int fd;
-#ifdef _WIN32
-  caml_failwith("O_DIRECT is not supported on Win32");
-#else
-  const char *filename_c = strdup(String_val(filename));
+  int read_write;
+  int kind;
+  uint64_t size;
+  int sector_size;
+  unsigned int physical_block_size;
+  unsigned int optimal_io_size;
+  int discard_granularity;
+  int errno_copy;
+  const char *error_fn;
+  char path[];
+};
 
-  enter_blocking_section();
+#ifndef _WIN32
+static int open_file(struct job_open_probe *job, int rw)
+{
+  int flags = rw ? O_RDWR : O_RDONLY;
 #ifdef O_DIRECT
-  int flags = O_DIRECT;
+  if (!job->buffered) flags |= O_DIRECT;
+#endif
+  return open(job->path, flags);
+}
+
+/* What the drive says about itself. 0 means it doesn't say. */
+static void probe_device(struct job_open_probe *job)
+{
+#if defined(__linux__)
+  unsigned int n;
+#ifdef BLKPBSZGET
+  if (ioctl(job->fd, BLKPBSZGET, &n) == 0) job->physical_block_size = n;
+#endif
+#ifdef BLKIOOPT
+  if (ioctl(job->fd, BLKIOOPT, &n) == 0) job->optimal_io_size = n;
+#endif
+#elif defined(__APPLE__)
+  uint32_t n;
+  if (ioctl(job->fd, DKIOCGETPHYSICALBLOCKSIZE, &n) == 0) job->physical_block_size = n;
+#ifdef DKIOCGETIOMINSATURATIONBYTECOUNT
+  if (ioctl(job->fd, DKIOCGETIOMINSATURATIONBYTECOUNT, &n) == 0) job->optimal_io_size = n;
+#endif
+#elif defined(__FreeBSD__)
+  off_t n;
+  if (ioctl(job->fd, DIOCGSTRIPESIZE, &n) == 0 && n > 0) job->physical_block_size = (unsigned int)n;
+#endif
+}
+
+static void fail(struct job_open_probe *job, const char *fn)
+{
+  job->errno_copy = errno;
+  job->error_fn = fn;
+  if (job->fd != -1) close(job->fd);
+  job->fd = -1;
+}
+#endif
+
+static void worker_open_probe(struct job_open_probe *job)
+{
+#ifdef _WIN32
+  /* Block opens files synchronously on Win32 */
+  job->errno_copy = ENOSYS;
+  job->error_fn = "open";
 #else
-  int flags = 0;
+  struct stat st;
+  /* first try read/write and then fall back to read/only */
+  job->read_write = 1;
+  job->fd = open_file(job, 1);
+  if (job->fd == -1) {
+    job->read_write = 0;
+    job->fd = open_file(job, 0);
+  }
+  if (job->fd == -1) {
+    fail(job, "open");
+    return;
+  }
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+  if (!job->buffered && fcntl(job->fd, F_NOCACHE, 1) == -1) {
+    fail(job, "fcntl F_NOCACHE");
+    return;
+  }
 #endif
-  if (Bool_val(rw)) {
-    flags |= O_RDWR;
+  /* an exclusive lock if in read/write mode, otherwise a shared lock */
+  if (job->lock && flock(job->fd, (job->read_write ? LOCK_EX : LOCK_SH) | LOCK_NB) == -1) {
+    fail(job, "flock");
+    return;
+  }
+  if (fstat(job->fd, &st) == -1) {
+    fail(job, "fstat");
+    return;
+  }
+  if (S_ISREG(st.st_mode)) {
+    job->kind = KIND_FILE;
+    job->size = st.st_size;
+    job->optimal_io_size = st.st_blksize;
+  } else if (S_ISBLK(st.st_mode)) {
+    job->kind = KIND_DEVICE;
+    if (blkgetsize(job->fd, &job->size) == -1) {
+      fail(job, "BLKGETSIZE");
+      return;
+    }
+    if (blkgetsectorsize(job->fd, &job->sector_size) == -1) {
+      fail(job, "blkgetsectorsize");
+      return;
+    }
+    probe_device(job);
   } else {
-    flags |= O_RDONLY;
+    job->kind = KIND_OTHER;
   }
-  fd = open(filename_c, flags, Int_val(perm));
-  int ret = 0;
-#ifndef O_DIRECT
-  ret = fcntl(fd, F_NOCACHE);
+  job->discard_granularity = mirage_block_unix_discard_granularity(job->fd);
 #endif
-  leave_blocking_section();
+}
 
-  free((void*)filename_c);
+/* A Block.Raw.opened record */
+static value result_open_probe(struct job_open_probe *job)
+{
+  CAMLparam0();
+  CAMLlocal2(result, size);
+  int errno_copy = job->errno_copy;
+  const char *error_fn = job->error_fn;
+  if (errno_copy != 0) {
+    lwt_unix_free_job(&job->job);
+    unix_error(errno_copy, (char *)error_fn, Nothing);
+  }
+  size = caml_copy_int64(job->size);
+  result = caml_alloc_tuple(8);
+  Store_field(result, 0, Val_int(job->fd));
+  Store_field(result, 1, Val_bool(job->read_write));
+  Store_field(result, 2, Val_int(job->kind));
+  Store_field(result, 3, size);
+  Store_field(result, 4, Val_int(job->sector_size));
+  Store_field(result, 5, Val_int(job->physical_block_size));
+  Store_field(result, 6, Val_int(job->optimal_io_size));
+  Store_field(result, 7, Val_int(job->discard_granularity));
+  lwt_unix_free_job(&job->job);
+  CAMLreturn(result);
+}
 
-  if (fd == -1) uerror("open", filename);
-  if (ret < 0)  uerror("open", filename);
-  CAMLreturn(Val_int(fd));
-#endif /* _WIN32 */
+CAMLprim value mirage_block_unix_open_job(value path, value buffered, value lock)
+{
+  CAMLparam3(path, buffered, lock);
+  size_t len = caml_string_length(path);
+  LWT_UNIX_INIT_JOB(job, open_probe, len + 1);
+  memcpy(job->path, String_val(path), len + 1);
+  job->buffered = Bool_val(buffered);
+  job->lock = Bool_val(lock);
+  job->fd = -1;
+  job->read_write = 0;
+  job->kind = KIND_OTHER;
+  job->size = 0;
+  job->sector_size = 0;
+  job->physical_block_size = 0;
+  job->optimal_io_size = 0;
+  job->discard_granularity = 0;
+  job->errno_copy = 0;
+  job->error_fn = "";
+  CAMLreturn(lwt_unix_alloc_job(&(job->job)));
 }
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Hint that a range of a buffered file is about to be read so the kernel
+   starts fetching it into the page cache while we process the current
+   request. Errors are reported but callers are free to ignore them: this is
+   only advice. */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/unixsupport.h>
+#include <caml/bigarray.h>
+
+#include "lwt_unix.h"
+
+struct job_fadvise {
+  struct lwt_unix_job job;
+  int fd;
+  off_t offset;
+  off_t length;
+  int errno_copy;
+};
+
+static void worker_fadvise(struct job_fadvise *job)
+{
+#if defined(__linux__)
+  /* posix_fadvise returns the error rather than setting errno */
+  job->errno_copy = posix_fadvise(job->fd, job->offset, job->length, POSIX_FADV_WILLNEED);
+#elif defined(__APPLE__)
+  struct radvisory ra;
+  ra.ra_offset = job->offset;
+  ra.ra_count = (job->length > INT32_MAX) ? INT32_MAX : (int)job->length;
+  if (fcntl(job->fd, F_RDADVISE, &ra) == -1)
+    job->errno_copy = errno;
+#else
+  /* no way to give the hint: the read will simply be slower */
+#endif
+}
+
+static value result_fadvise(struct job_fadvise *job)
+{
+  CAMLparam0 ();
+  int errno_copy = job->errno_copy;
+  lwt_unix_free_job(&job->job);
+  if (errno_copy != 0) {
+#if defined(__APPLE__)
+    unix_error(errno_copy, "fcntl", Nothing);
+#else
+    unix_error(errno_copy, "posix_fadvise", Nothing);
+#endif
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim
+value mirage_block_unix_fadvise_willneed_job(value fd, value offset, value length)
+{
+  CAMLparam3(fd, offset, length);
+  LWT_UNIX_INIT_JOB(job, fadvise, 0);
+  job->fd = Int_val(fd);
+  job->offset = Int64_val(offset);
+  job->length = Int64_val(length);
+  job->errno_copy = 0;
+  CAMLreturn(lwt_unix_alloc_job(&(job->job)));
+}
+
+/* The same for a memory mapping: 0 is normal, 1 sequential, 2 random and 3
+   will need. The range is widened to whole pages. This is only advice so
+   errors are ignored. */
+CAMLprim value mirage_block_unix_madvise(value buf, value ofs, value len, value advice)
+{
+  CAMLparam4(buf, ofs, len, advice);
+#if !defined(_WIN32)
+  static const int advices[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED };
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)Caml_ba_data_val(buf) + Long_val(ofs);
+  uintptr_t end = start + Long_val(len);
+  start -= start % page;
+  if (Long_val(len) > 0 && Int_val(advice) >= 0 && Int_val(advice) <= 3)
+    (void)madvise((void *)start, end - start, advices[Int_val(advice)]);
+#endif
+  CAMLreturn(Val_unit);
+}
@@ -39,62 +39,126 @@
 
 #include "lwt_unix.h"
 
-struct job_readv {
+extern int64_t mirage_block_unix_clock_ns(void);
+extern int64_t *mirage_block_unix_trace_times(value times);
+
+struct job_preadv {
   struct lwt_unix_job job;
   int fd;
-#ifndef _WIN32
-  struct iovec iovec[IOV_MAX];
-#endif
+  off_t offset;
   int length;
-  int ret;
+  ssize_t ret;
   int errno_copy;
+  int64_t *times; /* worker start and end if traced, or NULL */
+#ifndef _WIN32
+  struct iovec iovec[]; /* allocated with the job, one per buffer */
+#endif
 };
 
-static void worker_readv(struct job_readv *job)
+#ifndef _WIN32
+static ssize_t do_preadv(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+#if defined(__APPLE__)
+  /* preadv is only available from macOS 11 onwards so issue one pread */
+  (void)iovcnt;
+  return pread(fd, iov->iov_base, iov->iov_len, offset);
+#else
+  return preadv(fd, iov, (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt, offset);
+#endif
+}
+#endif
+
+#ifndef _WIN32
+/* Transfer the whole request here rather than returning to OCaml after
+   every short read or every IOV_MAX buffers. A return of 0 means
+   end-of-file and the short count is returned to the caller. Also used by the
+   per-device worker threads in worker_stubs.c. Returns the number of bytes
+   transferred, or -1 with [*errno_copy] set if there was an error before
+   any were. */
+ssize_t mirage_block_unix_preadv_all(int fd, struct iovec *iov, int iovcnt, off_t offset, int *errno_copy)
+{
+  ssize_t ret = 0;
+  ssize_t n;
+  *errno_copy = 0;
+  while (iovcnt > 0) {
+    if (iov->iov_len == 0) {
+      iov++;
+      iovcnt--;
+      continue;
+    }
+    n = do_preadv(fd, iov, iovcnt, offset);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      *errno_copy = errno;
+      return (ret == 0) ? -1 : ret;
+    }
+    if (n == 0) return ret;
+    ret += n;
+    offset += n;
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return ret;
+}
+#endif
+
+static void transfer_preadv(struct job_preadv *job)
 {
 #ifndef _WIN32
-  job->ret = readv(job->fd, job->iovec, job->length);
-  job->errno_copy = errno;
+  job->ret = mirage_block_unix_preadv_all(job->fd, job->iovec, job->length, job->offset, &job->errno_copy);
 #else
   job->ret = -1;
   job->errno_copy = ENOTSUP;
 #endif
 }
 
-static value result_readv(struct job_readv *job)
+static void worker_preadv(struct job_preadv *job)
+{
+  if (job->times) job->times[0] = mirage_block_unix_clock_ns();
+  transfer_preadv(job);
+  if (job->times) job->times[1] = mirage_block_unix_clock_ns();
+}
+
+static value result_preadv(struct job_preadv *job)
 {
   CAMLparam0 ();
   int errno_copy = job->errno_copy;
-  int ret = job->ret;
+  ssize_t ret = job->ret;
   lwt_unix_free_job(&job->job);
   if (ret == -1) {
-    unix_error(errno_copy, "readv", Nothing);
+    unix_error(errno_copy, "preadv", Nothing);
   }
-  CAMLreturn(Val_int(ret));
+  CAMLreturn(Val_long(ret));
 }
 
 CAMLprim
-value mirage_block_unix_readv_job(value fd, value val_list)
+value mirage_block_unix_preadv_job(value fd, value val_list, value offset, value times)
 {
-  CAMLparam2(fd, val_list);
+  CAMLparam4(fd, val_list, offset, times);
   CAMLlocal5(next, head, val_buf, val_ofs, val_len);
-  int i;
-  LWT_UNIX_INIT_JOB(job, readv, 0);
 #ifdef _WIN32
-  caml_failwith("readv is not supported on Win32");
+  caml_failwith("preadv is not supported on Win32");
 #else
-  job->fd = Int_val(fd);
-  job->errno_copy = 0;
-  job->ret = 0;
-  next = val_list;
+  int i;
+  int length = 0;
   /* Calculate the length of the val_list */
-  job->length = 0;
   for (next = val_list; next != Val_emptylist; next = Field(next, 1))
-    job->length++;
+    length++;
 
-  /* Only copy up to the iovec array size */
-  if (job->length > IOV_MAX)
-    job->length = IOV_MAX;
+  LWT_UNIX_INIT_JOB(job, preadv, length * sizeof(struct iovec));
+  job->fd = Int_val(fd);
+  job->offset = Int64_val(offset);
+  job->length = length;
+  job->errno_copy = 0;
+  job->ret = 0;
+  job->times = mirage_block_unix_trace_times(times);
 
   next = val_list;
   for (i = 0; i < job->length; i ++) {
@@ -106,6 +170,6 @@ value mirage_block_unix_readv_job(value fd, value val_list)
     job->iovec[i].iov_len = Long_val(val_len);
     next = Field(next, 1);
   }
-#endif
   CAMLreturn(lwt_unix_alloc_job(&(job->job)));
+#endif
 }
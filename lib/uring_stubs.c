@@ -0,0 +1,531 @@
+/*
+ * Copyright (C) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A minimal io_uring binding which talks to the kernel directly rather than
+   via liburing. Requests are queued on the submission ring by the prep_*
+   functions and handed to the kernel in a batch by `submit`. The kernel signals
+   completions on an eventfd which the OCaml side waits on in the Lwt main loop
+   before calling `reap`. */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <limits.h>
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 16 /* never used */
+#endif
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+#include <caml/unixsupport.h>
+
+#ifdef HAVE_IO_URING
+
+/* Every submission carries one of these as its user_data. It keeps the iovec
+   alive until the kernel has finished with it and records the OCaml id. */
+struct uring_req {
+  intnat id;
+  struct iovec iovec[];
+};
+
+struct uring {
+  int ring_fd;
+  unsigned to_submit;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* the buffer registered with IORING_REGISTER_BUFFERS as index 0, if any */
+  char *fixed_base;
+  size_t fixed_len;
+
+  void *sq_ptr;
+  size_t sq_len;
+  void *cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+};
+
+#define Uring_val(v) (*((struct uring **) Data_custom_val(v)))
+
+static void uring_unmap(struct uring *r)
+{
+  if (r->sqes) munmap(r->sqes, r->sqes_len);
+  if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+  if (r->sq_ptr) munmap(r->sq_ptr, r->sq_len);
+  r->sqes = NULL;
+  r->cq_ptr = NULL;
+  r->sq_ptr = NULL;
+  /* closing the ring unregisters the buffer */
+  r->fixed_base = NULL;
+  r->fixed_len = 0;
+  if (r->ring_fd != -1) close(r->ring_fd);
+  r->ring_fd = -1;
+}
+
+static void uring_finalize(value v)
+{
+  struct uring *r = Uring_val(v);
+  if (r) {
+    uring_unmap(r);
+    free(r);
+  }
+}
+
+static struct custom_operations uring_ops = {
+  "org.mirage.block.unix.uring",
+  uring_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+static struct uring *uring_of_value(value v)
+{
+  struct uring *r = Uring_val(v);
+  if (r->ring_fd == -1) unix_error(EBADF, "io_uring", Nothing);
+  return r;
+}
+
+/* Returns the next free submission queue entry or NULL if the ring is full */
+static struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+  unsigned tail = *r->sq_tail;
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  struct io_uring_sqe *sqe;
+  if (tail - head >= r->sq_entries) return NULL;
+  sqe = &r->sqes[tail & r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void uring_push_sqe(struct uring *r)
+{
+  unsigned tail = *r->sq_tail;
+  unsigned index = tail & r->sq_mask;
+  r->sq_array[index] = index;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->to_submit++;
+}
+
+static struct uring_req *uring_req_of_iovec(value id, value val_list, int *length)
+{
+  CAMLparam2(id, val_list);
+  CAMLlocal5(next, head, val_buf, val_ofs, val_len);
+  struct uring_req *req;
+  int i, n = 0;
+  for (next = val_list; next != Val_emptylist; next = Field(next, 1))
+    n++;
+  /* Only copy up to IOV_MAX; the caller resubmits the remainder */
+  if (n > IOV_MAX)
+    n = IOV_MAX;
+  req = malloc(sizeof(struct uring_req) + n * sizeof(struct iovec));
+  if (req == NULL) caml_raise_out_of_memory();
+  req->id = Long_val(id);
+  next = val_list;
+  for (i = 0; i < n; i++) {
+    head = Field(next, 0);
+    val_buf = Field(head, 0);
+    val_ofs = Field(head, 1);
+    val_len = Field(head, 2);
+    req->iovec[i].iov_base = (char*)Caml_ba_data_val(val_buf) + Long_val(val_ofs);
+    req->iovec[i].iov_len = Long_val(val_len);
+    next = Field(next, 1);
+  }
+  *length = n;
+  CAMLreturnT(struct uring_req *, req);
+}
+
+static value uring_prep_rw(int opcode, value ring, value fd, value val_list, value offset, value id)
+{
+  CAMLparam5(ring, fd, val_list, offset, id);
+  struct uring *r = uring_of_value(ring);
+  struct io_uring_sqe *sqe = uring_get_sqe(r);
+  struct uring_req *req;
+  int length;
+  if (sqe == NULL) CAMLreturn(Val_false);
+  req = uring_req_of_iovec(id, val_list, &length);
+  sqe->opcode = opcode;
+  sqe->fd = Int_val(fd);
+  sqe->off = Int64_val(offset);
+  sqe->addr = (uint64_t)(uintptr_t)req->iovec;
+  sqe->len = length;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  uring_push_sqe(r);
+  CAMLreturn(Val_true);
+}
+
+static struct uring_req *uring_req_alloc(value id)
+{
+  struct uring_req *req = malloc(sizeof(struct uring_req));
+  if (req == NULL) caml_raise_out_of_memory();
+  req->id = Long_val(id);
+  return req;
+}
+
+/* A single buffer inside the registered region, so the kernel can skip
+   pinning and mapping the pages on every request */
+static value uring_prep_rw_fixed(int opcode, value ring, value fd, value val_iov, value offset, value id)
+{
+  CAMLparam5(ring, fd, val_iov, offset, id);
+  struct uring *r = uring_of_value(ring);
+  struct io_uring_sqe *sqe;
+  struct uring_req *req;
+  char *base = (char *)Caml_ba_data_val(Field(val_iov, 0)) + Long_val(Field(val_iov, 1));
+  size_t len = Long_val(Field(val_iov, 2));
+  if (r->fixed_base == NULL || base < r->fixed_base || base + len > r->fixed_base + r->fixed_len)
+    caml_invalid_argument("io_uring: buffer is not in the registered region");
+  sqe = uring_get_sqe(r);
+  if (sqe == NULL) CAMLreturn(Val_false);
+  req = uring_req_alloc(id);
+  sqe->opcode = opcode;
+  sqe->fd = Int_val(fd);
+  sqe->off = Int64_val(offset);
+  sqe->addr = (uint64_t)(uintptr_t)base;
+  sqe->len = len;
+  sqe->buf_index = 0;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  uring_push_sqe(r);
+  CAMLreturn(Val_true);
+}
+
+#endif /* HAVE_IO_URING */
+
+CAMLprim value mirage_block_unix_uring_create(value entries)
+{
+  CAMLparam1(entries);
+  CAMLlocal1(result);
+#ifdef HAVE_IO_URING
+  struct io_uring_params p;
+  struct uring *r;
+  int fd;
+
+  memset(&p, 0, sizeof(p));
+  fd = syscall(__NR_io_uring_setup, Int_val(entries), &p);
+  if (fd == -1) uerror("io_uring_setup", Nothing);
+
+  r = calloc(1, sizeof(struct uring));
+  if (r == NULL) {
+    close(fd);
+    caml_raise_out_of_memory();
+  }
+  r->ring_fd = fd;
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+    r->cq_len = r->sq_len;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    r->sq_ptr = NULL;
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ptr = r->sq_ptr;
+  } else {
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) {
+      r->cq_ptr = NULL;
+      goto fail;
+    }
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto fail;
+  }
+  r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+  r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+  r->sq_mask = *(unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+  r->sq_entries = *(unsigned *)((char *)r->sq_ptr + p.sq_off.ring_entries);
+  r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+  r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+  r->cq_mask = *(unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+  result = caml_alloc_custom(&uring_ops, sizeof(struct uring *), 0, 1);
+  Uring_val(result) = r;
+  CAMLreturn(result);
+fail:
+  {
+    int errno_copy = errno;
+    uring_unmap(r);
+    free(r);
+    unix_error(errno_copy, "mmap", Nothing);
+  }
+#else
+  unix_error(ENOSYS, "io_uring_setup", Nothing);
+#endif
+}
+
+CAMLprim value mirage_block_unix_uring_entries(value ring)
+{
+  CAMLparam1(ring);
+#ifdef HAVE_IO_URING
+  CAMLreturn(Val_int(uring_of_value(ring)->sq_entries));
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_uring_eventfd(value ring)
+{
+  CAMLparam1(ring);
+#ifdef HAVE_IO_URING
+  struct uring *r = uring_of_value(ring);
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1) uerror("eventfd", Nothing);
+  if (syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_EVENTFD, &fd, 1) == -1) {
+    int errno_copy = errno;
+    close(fd);
+    unix_error(errno_copy, "io_uring_register", Nothing);
+  }
+  CAMLreturn(Val_int(fd));
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_uring_close(value ring)
+{
+  CAMLparam1(ring);
+#ifdef HAVE_IO_URING
+  uring_unmap(Uring_val(ring));
+#endif
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value mirage_block_unix_uring_prep_readv(value ring, value fd, value val_list, value offset, value id)
+{
+#ifdef HAVE_IO_URING
+  return uring_prep_rw(IORING_OP_READV, ring, fd, val_list, offset, id);
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_uring_prep_writev(value ring, value fd, value val_list, value offset, value id)
+{
+#ifdef HAVE_IO_URING
+  return uring_prep_rw(IORING_OP_WRITEV, ring, fd, val_list, offset, id);
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+/* Register [buf] as the ring's only fixed buffer. The caller must keep it
+   alive until the ring is closed. */
+CAMLprim value mirage_block_unix_uring_register_buffer(value ring, value buf)
+{
+  CAMLparam2(ring, buf);
+#ifdef HAVE_IO_URING
+  struct uring *r = uring_of_value(ring);
+  struct iovec iov;
+  if (r->fixed_base != NULL) unix_error(EBUSY, "io_uring_register", Nothing);
+  iov.iov_base = Caml_ba_data_val(buf);
+  iov.iov_len = Caml_ba_array_val(buf)->dim[0];
+  if (syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1)
+    uerror("io_uring_register", Nothing);
+  r->fixed_base = iov.iov_base;
+  r->fixed_len = iov.iov_len;
+  CAMLreturn(Val_unit);
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_uring_prep_read_fixed(value ring, value fd, value val_iov, value offset, value id)
+{
+#ifdef HAVE_IO_URING
+  return uring_prep_rw_fixed(IORING_OP_READ_FIXED, ring, fd, val_iov, offset, id);
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_uring_prep_write_fixed(value ring, value fd, value val_iov, value offset, value id)
+{
+#ifdef HAVE_IO_URING
+  return uring_prep_rw_fixed(IORING_OP_WRITE_FIXED, ring, fd, val_iov, offset, id);
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_uring_prep_fsync(value ring, value fd, value datasync, value id)
+{
+  CAMLparam4(ring, fd, datasync, id);
+#ifdef HAVE_IO_URING
+  struct uring *r = uring_of_value(ring);
+  struct io_uring_sqe *sqe = uring_get_sqe(r);
+  struct uring_req *req;
+  if (sqe == NULL) CAMLreturn(Val_false);
+  req = uring_req_alloc(id);
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = Int_val(fd);
+  if (Bool_val(datasync)) sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  uring_push_sqe(r);
+  CAMLreturn(Val_true);
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+/* Punch a hole, the equivalent of `discard_job` */
+CAMLprim value mirage_block_unix_uring_prep_discard(value ring, value fd, value offset, value length, value id)
+{
+  CAMLparam5(ring, fd, offset, length, id);
+#ifdef HAVE_IO_URING
+  struct uring *r = uring_of_value(ring);
+  struct io_uring_sqe *sqe = uring_get_sqe(r);
+  struct uring_req *req;
+  if (sqe == NULL) CAMLreturn(Val_false);
+  req = uring_req_alloc(id);
+  sqe->opcode = IORING_OP_FALLOCATE;
+  sqe->fd = Int_val(fd);
+  sqe->off = Int64_val(offset);
+  sqe->addr = Int64_val(length);
+  sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+  sqe->user_data = (uint64_t)(uintptr_t)req;
+  uring_push_sqe(r);
+  CAMLreturn(Val_true);
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+/* Hand every queued submission to the kernel with a single io_uring_enter.
+   This never waits for completions. */
+CAMLprim value mirage_block_unix_uring_submit(value ring)
+{
+  CAMLparam1(ring);
+#ifdef HAVE_IO_URING
+  struct uring *r = uring_of_value(ring);
+  int ret;
+  if (r->to_submit == 0) CAMLreturn(Val_int(0));
+  ret = syscall(__NR_io_uring_enter, r->ring_fd, r->to_submit, 0, 0, NULL, 0);
+  if (ret == -1) uerror("io_uring_enter", Nothing);
+  r->to_submit -= ret;
+  CAMLreturn(Val_int(ret));
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+/* Take back every submission which the kernel hasn't consumed, storing up
+   to (Array.length ids) of their ids in [ids]. Without SQPOLL the kernel
+   only reads the submission queue during io_uring_enter, so the tail can
+   be moved back. */
+CAMLprim value mirage_block_unix_uring_withdraw(value ring, value ids)
+{
+  CAMLparam2(ring, ids);
+#ifdef HAVE_IO_URING
+  struct uring *r = uring_of_value(ring);
+  mlsize_t max = Wosize_val(ids);
+  unsigned tail = *r->sq_tail;
+  unsigned first = tail - r->to_submit;
+  unsigned i;
+  mlsize_t n = 0;
+  for (i = first; i != tail; i++) {
+    struct uring_req *req = (struct uring_req *)(uintptr_t)r->sqes[r->sq_array[i & r->sq_mask]].user_data;
+    if (n < max) Store_field(ids, n++, Val_long(req->id));
+    free(req);
+  }
+  __atomic_store_n(r->sq_tail, first, __ATOMIC_RELEASE);
+  r->to_submit = 0;
+  CAMLreturn(Val_long(n));
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+/* Copy up to (Array.length results / 2) completions into [results] as
+   (id, result) pairs where a negative result is -errno. */
+CAMLprim value mirage_block_unix_uring_reap(value ring, value results)
+{
+  CAMLparam2(ring, results);
+#ifdef HAVE_IO_URING
+  struct uring *r = uring_of_value(ring);
+  mlsize_t max = Wosize_val(results) / 2;
+  unsigned head = *r->cq_head;
+  unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  mlsize_t n = 0;
+  while (head != tail && n < max) {
+    struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+    struct uring_req *req = (struct uring_req *)(uintptr_t)cqe->user_data;
+    Store_field(results, 2 * n, Val_long(req->id));
+    Store_field(results, 2 * n + 1, Val_int(cqe->res));
+    free(req);
+    head++;
+    n++;
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  CAMLreturn(Val_long(n));
+#else
+  caml_failwith("io_uring is not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_raise_errno(value errno_code, value fn)
+{
+  CAMLparam2(errno_code, fn);
+  unix_error(Int_val(errno_code), (char *)String_val(fn), Nothing);
+}
@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* A small pool of threads owned by one device, so that a slow system call
+   on one device (a long BLKDISCARD, a stalled F_FULLFSYNC) does not hold up
+   requests to other devices or other users of the shared Lwt_unix thread
+   pool. The interface is the same as uring_stubs.c and aio_stubs.c: the
+   prep_* functions queue requests, submit hands everything queued to the
+   workers at once and completions are signalled on an eventfd (a pipe where
+   there is none) and collected by reap. */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#define HAVE_WORKERS
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+#include <caml/unixsupport.h>
+
+#ifdef HAVE_WORKERS
+
+extern ssize_t mirage_block_unix_preadv_all(int fd, struct iovec *iov, int iovcnt, off_t offset, int *errno_copy);
+extern ssize_t mirage_block_unix_pwritev_all(int fd, struct iovec *iov, int iovcnt, off_t offset, int *errno_copy);
+extern int mirage_block_unix_fsync(int fd, int ask_drive_to_flush, int method);
+extern int mirage_block_unix_discard(int fd, uint64_t offset, uint64_t length, const char **error_fn);
+
+enum { OP_READV, OP_WRITEV, OP_FSYNC, OP_DISCARD, OP_FTRUNCATE };
+
+struct worker_req {
+  struct worker_req *next;
+  intnat id;
+  int op;
+  int fd;
+  off_t offset;
+  uint64_t length; /* of a discard, or the size for ftruncate */
+  int method; /* of an fsync, as in flush_stubs.c */
+  int ask_drive_to_flush;
+  long result; /* bytes transferred or -errno */
+  int iovcnt;
+  struct iovec iovec[];
+};
+
+struct queue {
+  struct worker_req *head;
+  struct worker_req *tail;
+};
+
+struct workers {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  struct queue queued; /* prepared but not submitted, only used by OCaml */
+  struct queue pending; /* waiting for a worker */
+  struct queue done; /* waiting to be reaped */
+  int event_fd; /* given to OCaml, which closes it */
+  int signal_fd; /* written by the workers: event_fd unless it is a pipe */
+  int nr_threads;
+  pthread_t *threads;
+  int stopping;
+};
+
+#define Workers_val(v) (*((struct workers **) Data_custom_val(v)))
+
+static void queue_push(struct queue *q, struct worker_req *r)
+{
+  r->next = NULL;
+  if (q->tail) q->tail->next = r; else q->head = r;
+  q->tail = r;
+}
+
+static struct worker_req *queue_pop(struct queue *q)
+{
+  struct worker_req *r = q->head;
+  if (r) {
+    q->head = r->next;
+    if (q->head == NULL) q->tail = NULL;
+  }
+  return r;
+}
+
+static void queue_free(struct queue *q)
+{
+  struct worker_req *r;
+  while ((r = queue_pop(q)) != NULL) free(r);
+}
+
+static void perform(struct worker_req *r)
+{
+  int errno_copy = 0;
+  const char *error_fn;
+  ssize_t n;
+  switch (r->op) {
+  case OP_READV:
+    n = mirage_block_unix_preadv_all(r->fd, r->iovec, r->iovcnt, r->offset, &errno_copy);
+    r->result = (n == -1) ? -errno_copy : n;
+    break;
+  case OP_WRITEV:
+    n = mirage_block_unix_pwritev_all(r->fd, r->iovec, r->iovcnt, r->offset, &errno_copy);
+    r->result = (n == -1) ? -errno_copy : n;
+    break;
+  case OP_FSYNC:
+    r->result = -mirage_block_unix_fsync(r->fd, r->ask_drive_to_flush, r->method);
+    break;
+  case OP_DISCARD:
+    r->result = -mirage_block_unix_discard(r->fd, (uint64_t)r->offset, r->length, &error_fn);
+    break;
+  case OP_FTRUNCATE:
+    r->result = (ftruncate(r->fd, (off_t)r->length) == -1) ? -errno : 0;
+    break;
+  default:
+    r->result = -EINVAL;
+  }
+}
+
+static void *worker_main(void *arg)
+{
+  struct workers *w = arg;
+  struct worker_req *r;
+  uint64_t one = 1;
+  int was_empty;
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (w->pending.head == NULL && !w->stopping)
+      pthread_cond_wait(&w->work, &w->lock);
+    r = queue_pop(&w->pending);
+    if (r == NULL) break; /* stopping */
+    pthread_mutex_unlock(&w->lock);
+    perform(r);
+    pthread_mutex_lock(&w->lock);
+    was_empty = (w->done.head == NULL);
+    queue_push(&w->done, r);
+    /* reap empties [done] after every signal, so one per batch is enough */
+    if (was_empty) {
+      if (write(w->signal_fd, &one, w->signal_fd == w->event_fd ? sizeof(one) : 1) == -1) {
+        /* a full pipe is already signalled */
+      }
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+/* Stops and joins the workers. Requests still queued are dropped. */
+static void workers_release(struct workers *w)
+{
+  int i;
+  if (w->threads == NULL) return;
+  pthread_mutex_lock(&w->lock);
+  w->stopping = 1;
+  pthread_cond_broadcast(&w->work);
+  pthread_mutex_unlock(&w->lock);
+  for (i = 0; i < w->nr_threads; i++)
+    pthread_join(w->threads[i], NULL);
+  free(w->threads);
+  w->threads = NULL;
+  queue_free(&w->queued);
+  queue_free(&w->pending);
+  queue_free(&w->done);
+  if (w->signal_fd != w->event_fd) close(w->signal_fd);
+}
+
+static void workers_finalize(value v)
+{
+  struct workers *w = Workers_val(v);
+  if (w) {
+    workers_release(w);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+  }
+}
+
+static struct custom_operations workers_ops = {
+  "org.mirage.block.unix.workers",
+  workers_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+static struct workers *workers_of_value(value v)
+{
+  struct workers *w = Workers_val(v);
+  if (w->threads == NULL) unix_error(EBADF, "workers", Nothing);
+  return w;
+}
+
+static struct worker_req *req_alloc(int op, value fd, value id, int iovcnt)
+{
+  struct worker_req *r = calloc(1, sizeof(struct worker_req) + iovcnt * sizeof(struct iovec));
+  if (r == NULL) caml_raise_out_of_memory();
+  r->op = op;
+  r->fd = Int_val(fd);
+  r->id = Long_val(id);
+  r->iovcnt = iovcnt;
+  return r;
+}
+
+static value workers_prep_rw(int op, value ctx, value fd, value val_list, value offset, value id)
+{
+  CAMLparam5(ctx, fd, val_list, offset, id);
+  CAMLlocal5(next, head, val_buf, val_ofs, val_len);
+  struct workers *w = workers_of_value(ctx);
+  struct worker_req *r;
+  int i, n = 0;
+  for (next = val_list; next != Val_emptylist; next = Field(next, 1))
+    n++;
+  r = req_alloc(op, fd, id, n);
+  r->offset = Int64_val(offset);
+  next = val_list;
+  for (i = 0; i < n; i++) {
+    head = Field(next, 0);
+    val_buf = Field(head, 0);
+    val_ofs = Field(head, 1);
+    val_len = Field(head, 2);
+    r->iovec[i].iov_base = (char*)Caml_ba_data_val(val_buf) + Long_val(val_ofs);
+    r->iovec[i].iov_len = Long_val(val_len);
+    next = Field(next, 1);
+  }
+  queue_push(&w->queued, r);
+  CAMLreturn(Val_true);
+}
+
+#endif /* HAVE_WORKERS */
+
+/* [cpus] is an array of CPU numbers which every worker is restricted to, or
+   empty for no restriction. Affinity is only supported on Linux. */
+CAMLprim value mirage_block_unix_workers_create(value nr_threads, value cpus)
+{
+  CAMLparam2(nr_threads, cpus);
+  CAMLlocal1(result);
+#ifdef HAVE_WORKERS
+  struct workers *w;
+  int n = Int_val(nr_threads);
+  int i, ret, errno_copy;
+  int fds[2];
+  sigset_t all, old;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (i = 0; i < (int)Wosize_val(cpus); i++) {
+    int cpu = Int_val(Field(cpus, i));
+    if (cpu < 0 || cpu >= CPU_SETSIZE) unix_error(EINVAL, "pthread_setaffinity_np", Nothing);
+    CPU_SET(cpu, &set);
+  }
+#else
+  if (Wosize_val(cpus) > 0) unix_error(ENOSYS, "pthread_setaffinity_np", Nothing);
+#endif
+  if (n < 1) unix_error(EINVAL, "pthread_create", Nothing);
+  w = calloc(1, sizeof(struct workers));
+  if (w == NULL) caml_raise_out_of_memory();
+#ifdef HAVE_EVENTFD
+  w->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (w->event_fd == -1) {
+    errno_copy = errno;
+    free(w);
+    unix_error(errno_copy, "eventfd", Nothing);
+  }
+  w->signal_fd = w->event_fd;
+#else
+  if (pipe(fds) == -1) {
+    errno_copy = errno;
+    free(w);
+    unix_error(errno_copy, "pipe", Nothing);
+  }
+  for (i = 0; i < 2; i++) {
+    fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  w->event_fd = fds[0];
+  w->signal_fd = fds[1];
+#endif
+  (void)fds;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->work, NULL);
+  w->threads = calloc(n, sizeof(pthread_t));
+  if (w->threads == NULL) {
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->lock);
+    close(w->event_fd);
+    if (w->signal_fd != w->event_fd) close(w->signal_fd);
+    free(w);
+    caml_raise_out_of_memory();
+  }
+  /* Signals are for the OCaml threads, as in the Lwt_unix pool */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  for (i = 0; i < n; i++) {
+    ret = pthread_create(&w->threads[i], NULL, worker_main, w);
+    if (ret != 0) break;
+#ifdef __linux__
+    /* CPUs which are offline or outside our cpuset are not fatal */
+    if (Wosize_val(cpus) > 0)
+      pthread_setaffinity_np(w->threads[i], sizeof(set), &set);
+#endif
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  w->nr_threads = i;
+  if (i < n) {
+    workers_release(w);
+    close(w->event_fd);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+    unix_error(ret, "pthread_create", Nothing);
+  }
+  result = caml_alloc_custom(&workers_ops, sizeof(struct workers *), 0, 1);
+  Workers_val(result) = w;
+  CAMLreturn(result);
+#else
+  (void)nr_threads;
+  (void)cpus;
+  unix_error(ENOSYS, "pthread_create", Nothing);
+#endif
+}
+
+CAMLprim value mirage_block_unix_workers_eventfd(value ctx)
+{
+  CAMLparam1(ctx);
+#ifdef HAVE_WORKERS
+  CAMLreturn(Val_int(workers_of_value(ctx)->event_fd));
+#else
+  caml_failwith("worker threads are not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_workers_close(value ctx)
+{
+  CAMLparam1(ctx);
+#ifdef HAVE_WORKERS
+  workers_release(Workers_val(ctx));
+#endif
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value mirage_block_unix_workers_prep_readv(value ctx, value fd, value val_list, value offset, value id)
+{
+#ifdef HAVE_WORKERS
+  return workers_prep_rw(OP_READV, ctx, fd, val_list, offset, id);
+#else
+  caml_failwith("worker threads are not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_workers_prep_writev(value ctx, value fd, value val_list, value offset, value id)
+{
+#ifdef HAVE_WORKERS
+  return workers_prep_rw(OP_WRITEV, ctx, fd, val_list, offset, id);
+#else
+  caml_failwith("worker threads are not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_workers_prep_fsync(value ctx, value fd, value ask_drive_to_flush, value method, value id)
+{
+  CAMLparam5(ctx, fd, ask_drive_to_flush, method, id);
+#ifdef HAVE_WORKERS
+  struct workers *w = workers_of_value(ctx);
+  struct worker_req *r = req_alloc(OP_FSYNC, fd, id, 0);
+  r->ask_drive_to_flush = Bool_val(ask_drive_to_flush);
+  r->method = Int_val(method);
+  queue_push(&w->queued, r);
+  CAMLreturn(Val_true);
+#else
+  caml_failwith("worker threads are not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_workers_prep_discard(value ctx, value fd, value offset, value length, value id)
+{
+  CAMLparam5(ctx, fd, offset, length, id);
+#ifdef HAVE_WORKERS
+  struct workers *w = workers_of_value(ctx);
+  struct worker_req *r = req_alloc(OP_DISCARD, fd, id, 0);
+  r->offset = Int64_val(offset);
+  r->length = Int64_val(length);
+  queue_push(&w->queued, r);
+  CAMLreturn(Val_true);
+#else
+  caml_failwith("worker threads are not supported on this platform");
+#endif
+}
+
+CAMLprim value mirage_block_unix_workers_prep_ftruncate(value ctx, value fd, value size, value id)
+{
+  CAMLparam4(ctx, fd, size, id);
+#ifdef HAVE_WORKERS
+  struct workers *w = workers_of_value(ctx);
+  struct worker_req *r = req_alloc(OP_FTRUNCATE, fd, id, 0);
+  r->length = Int64_val(size);
+  queue_push(&w->queued, r);
+  CAMLreturn(Val_true);
+#else
+  caml_failwith("worker threads are not supported on this platform");
+#endif
+}
+
+/* Drop every request which hasn't been handed to the workers, storing up
+   to (Array.length ids) of their ids in [ids] */
+CAMLprim value mirage_block_unix_workers_withdraw(value ctx, value ids)
+{
+  CAMLparam2(ctx, ids);
+#ifdef HAVE_WORKERS
+  struct workers *w = workers_of_value(ctx);
+  struct worker_req *r;
+  mlsize_t max = Wosize_val(ids);
+  mlsize_t n = 0;
+  while ((r = queue_pop(&w->queued)) != NULL) {
+    if (n < max) Store_field(ids, n++, Val_long(r->id));
+    free(r);
+  }
+  CAMLreturn(Val_long(n));
+#else
+  caml_failwith("worker threads are not supported on this platform");
+#endif
+}
+
+/* Hand every queued request to the workers with one wakeup */
+CAMLprim value mirage_block_unix_workers_submit(value ctx)
+{
+  CAMLparam1(ctx);
+#ifdef HAVE_WORKERS
+  struct workers *w = workers_of_value(ctx);
+  struct worker_req *r;
+  int n = 0;
+  if (w->queued.head == NULL) CAMLreturn(Val_int(0));
+  for (r = w->queued.head; r != NULL; r = r->next) n++;
+  pthread_mutex_lock(&w->lock);
+  if (w->pending.tail) w->pending.tail->next = w->queued.head; else w->pending.head = w->queued.head;
+  w->pending.tail = w->queued.tail;
+  if (n == 1) pthread_cond_signal(&w->work); else pthread_cond_broadcast(&w->work);
+  pthread_mutex_unlock(&w->lock);
+  w->queued.head = w->queued.tail = NULL;
+  CAMLreturn(Val_int(n));
+#else
+  caml_failwith("worker threads are not supported on this platform");
+#endif
+}
+
+/* Copy up to (Array.length results / 2) completions into [results] as
+   (id, result) pairs where a negative result is -errno. Never blocks for
+   longer than it takes a worker to add a completion. */
+CAMLprim value mirage_block_unix_workers_reap(value ctx, value results)
+{
+  CAMLparam2(ctx, results);
+#ifdef HAVE_WORKERS
+  struct workers *w = workers_of_value(ctx);
+  long max = Wosize_val(results) / 2;
+  long n = 0;
+  struct queue done = { NULL, NULL };
+  struct worker_req *r;
+  pthread_mutex_lock(&w->lock);
+  while (n < max && (r = queue_pop(&w->done)) != NULL) {
+    queue_push(&done, r);
+    n++;
+  }
+  pthread_mutex_unlock(&w->lock);
+  n = 0;
+  while ((r = queue_pop(&done)) != NULL) {
+    Store_field(results, 2 * n, Val_long(r->id));
+    Store_field(results, 2 * n + 1, Val_long(r->result));
+    free(r);
+    n++;
+  }
+  CAMLreturn(Val_long(n));
+#else
+  caml_failwith("worker threads are not supported on this platform");
+#endif
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2020 Docker Inc
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Scanning write buffers for blocks of zeroes and fingerprinting blocks for
+   the deduplication statistics. Both run on the Lwt thread without
+   allocating. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <caml/mlvalues.h>
+#include <caml/bigarray.h>
+
+/* A block is zero if its first 16 bytes are and every byte equals the one
+   16 bytes before it, which lets the C library's vectorised memcmp do the
+   work. A block with data usually differs in its first 16 bytes. */
+static int is_zero(const unsigned char *p, size_t len)
+{
+  static const unsigned char zeroes[16];
+  if (len < 16) return memcmp(p, zeroes, len) == 0;
+  return memcmp(p, zeroes, 16) == 0 && memcmp(p, p + 16, len - 16) == 0;
+}
+
+/* The length of the run of [granule]-sized blocks at the start of the
+   [len] bytes at [off] which are all zero, if [zero], or which all contain
+   data. [len] is a multiple of [granule]. */
+CAMLprim value mirage_block_unix_zero_run(value buf, value off, value len, value granule, value zero)
+{
+  const unsigned char *p = (const unsigned char *)Caml_ba_data_val(buf) + Long_val(off);
+  size_t n = Long_val(len), g = Long_val(granule), done = 0;
+  int want = Bool_val(zero);
+  while (done < n && is_zero(p + done, g) == want)
+    done += g;
+  return Val_long(done);
+}
+
+/* 64-bit words mixed as in MurmurHash3's finaliser */
+static uint64_t mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t fingerprint(const unsigned char *p, size_t len)
+{
+  uint64_t h = len, w;
+  size_t i;
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&w, p + i, 8);
+    h = mix(h ^ w) + i;
+  }
+  return h == 0 ? 1 : h;
+}
+
+/* Fingerprint each [block]-sized block of the [len] bytes at [off] and look
+   them up in [table], a direct-mapped int64 bigarray of recent fingerprints
+   where 0 is empty. Returns the number of blocks which were found; the
+   others are added. */
+CAMLprim value mirage_block_unix_dedup_scan(value table, value buf, value off, value len, value block)
+{
+  uint64_t *entries = (uint64_t *)Caml_ba_data_val(table);
+  size_t nr_entries = Caml_ba_array_val(table)->dim[0];
+  const unsigned char *p = (const unsigned char *)Caml_ba_data_val(buf) + Long_val(off);
+  size_t n = Long_val(len), b = Long_val(block), i;
+  intnat found = 0;
+  if (nr_entries == 0) return Val_long(0);
+  for (i = 0; i + b <= n; i += b) {
+    uint64_t f = fingerprint(p + i, b);
+    uint64_t *e = &entries[f % nr_entries];
+    if (*e == f)
+      found++;
+    else
+      *e = f;
+  }
+  return Val_long(found);
+}
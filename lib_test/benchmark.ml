@@ -14,102 +14,259 @@
  * PERFORMANCE OF THIS SOFTWARE.
  *)
 
-(* A simple file copy benchmark *)
+(* An fio-like benchmark. Every combination of the swept parameters is run
+   against a freshly connected device and the results, with the latencies
+   from Block.stats, are printed as JSON. *)
 
-let split_into buf into =
-  let rec loop acc remaining =
-    if Cstruct.len remaining = 0 then List.rev acc else begin
-      let to_take = min into (Cstruct.len remaining) in
-      loop (Cstruct.sub remaining 0 to_take :: acc) (Cstruct.shift remaining to_take)
+open Lwt.Infix
+
+type job = {
+  rw: string;
+  random: bool;
+  read_percent: int; (* of requests which are reads, the rest write *)
+  discard_percent: int; (* of writes which are discards instead *)
+  bs: int;
+  iodepth: int;
+  fragments: int; (* buffers per request *)
+  direct: bool;
+  engine: Block.Config.engine;
+  fsync: int; (* flush after every [fsync] writes, 0 for never *)
+}
+
+let engine_of_string = function
+  | "threads" -> `Threads
+  | "uring" -> `Uring
+  | "aio" -> `Aio
+  | "workers" -> `Workers
+  | x -> failwith ("unknown engine: " ^ x)
+
+(* as fio's rw= *)
+let pattern rwmixread = function
+  | "read" -> false, 100, 0
+  | "write" -> false, 0, 0
+  | "randread" -> true, 100, 0
+  | "randwrite" -> true, 0, 0
+  | "rw" | "readwrite" -> false, rwmixread, 0
+  | "randrw" -> true, rwmixread, 0
+  | "trim" -> false, 0, 100
+  | "randtrim" -> true, 0, 100
+  | x -> failwith ("unknown workload: " ^ x)
+
+let json_string s =
+  let b = Buffer.create (String.length s + 2) in
+  Buffer.add_char b '"';
+  String.iter (function
+      | '"' -> Buffer.add_string b "\\\""
+      | '\\' -> Buffer.add_string b "\\\\"
+      | c when Char.code c < 0x20 -> Printf.bprintf b "\\u%04x" (Char.code c)
+      | c -> Buffer.add_char b c
+    ) s;
+  Buffer.add_char b '"';
+  Buffer.contents b
+
+let ok what = function
+  | Ok () -> Lwt.return_unit
+  | Error _ -> Lwt.fail_with (what ^ " failed")
+
+(* [n] buffers of whole sectors covering [buf] *)
+let fragment buf n sector_size =
+  let sectors = Cstruct.len buf / sector_size in
+  let n = max 1 (min n sectors) in
+  let rec loop acc i buf =
+    if i = n - 1 then List.rev (buf :: acc) else begin
+      let len = sectors / n * sector_size in
+      loop (Cstruct.sub buf 0 len :: acc) (i + 1) (Cstruct.shift buf len)
     end in
-  loop [] buf
-
-let copy ~src ~dst ~bs ~split ~buffered ~threads =
-  let open Lwt.Infix in
-  Block.connect ~buffered src
-  >>= fun src ->
-  (* Create the destination if it doesn't exist *)
-  Lwt_unix.openfile dst [ Lwt_unix.O_CREAT; Lwt_unix.O_TRUNC; Lwt_unix.O_WRONLY ] 0o0644
-  >>= fun fd ->
-  Lwt_unix.close fd
-  >>= fun () ->
-  Block.connect ~buffered dst
-  >>= fun dst ->
-  Block.get_info src
+  loop [] 0 buf
+
+let fill state buf =
+  for i = 0 to Cstruct.len buf - 1 do
+    Cstruct.set_uint8 buf i (Random.State.int state 256)
+  done
+
+(* Lay out [size] bytes of non-zero data, as fio does, so that reads are
+   not of holes *)
+let prepare ~file ~size =
+  let exists = try (Unix.LargeFile.stat file).Unix.LargeFile.st_size = size with Unix.Unix_error(_, _, _) -> false in
+  if exists then Lwt.return_unit else begin
+    Lwt_unix.openfile file [ Lwt_unix.O_CREAT; Lwt_unix.O_TRUNC; Lwt_unix.O_WRONLY ] 0o0644
+    >>= fun fd ->
+    Lwt_unix.close fd
+    >>= fun () ->
+    Block.connect file
+    >>= fun device ->
+    Block.get_info device
+    >>= fun info ->
+    let ss = info.Mirage_block.sector_size in
+    let size_sectors = Int64.(div size (of_int ss)) in
+    Block.resize device size_sectors
+    >>= ok "resize"
+    >>= fun () ->
+    let chunk = max 1 (1048576 / ss) in
+    let buf = Io_page.(to_cstruct (get ((chunk * ss + page_size - 1) / page_size))) in
+    fill (Random.State.make [| 0 |]) buf;
+    let rec loop sector =
+      if sector >= size_sectors then Lwt.return_unit else begin
+        let n = min chunk (Int64.to_int (Int64.sub size_sectors sector)) in
+        Block.write device sector [ Cstruct.sub buf 0 (n * ss) ]
+        >>= ok "write"
+        >>= fun () ->
+        loop (Int64.add sector (Int64.of_int n))
+      end in
+    loop 0L
+    >>= fun () ->
+    Block.flush device
+    >>= ok "flush"
+    >>= fun () ->
+    Block.disconnect device
+  end
+
+let run ~file ~runtime ~number ~seed job =
+  Block.connect ~buffered:(not job.direct) ~engine:job.engine file
+  >>= fun device ->
+  Block.get_info device
   >>= fun info ->
-  Block.resize dst 0L
-  >>= function
-  | Error _ -> failwith (Printf.sprintf "Block.resize %Ld failed" 0L)
-  | Ok () ->
-  let m = Lwt_mutex.create () in
-  let resize_to_atleast n =
-    Lwt_mutex.with_lock m
-      (fun () ->
-        Block.get_info dst
-        >>= fun dst_info ->
-        if dst_info.Mirage_block.size_sectors < n then begin
-          Block.resize dst n
-          >>= function
-          | Error _ -> failwith (Printf.sprintf "Block.resize %Ld failed" n)
-          | Ok () -> Lwt.return_unit
-        end else Lwt.return_unit
-      ) in
-  let bs_sectors = bs / info.Mirage_block.sector_size in
-  let sector = ref 0L in
-  let one_thread () =
-    let bs_pages = (bs + 4093) / 4096 in
-    let pages = Io_page.(to_cstruct @@ get bs_pages) in
+  let ss = info.Mirage_block.sector_size in
+  if job.bs mod ss <> 0 then Lwt.fail_with (Printf.sprintf "bs %d is not a multiple of the sector size %d" job.bs ss) else
+  let bs_sectors = job.bs / ss in
+  let blocks = Int64.(div info.Mirage_block.size_sectors (of_int bs_sectors)) in
+  if blocks = 0L then Lwt.fail_with "the file is smaller than bs" else
+  let pool = Block.create_pool ~sectors:bs_sectors device job.iodepth in
+  let state = Random.State.make [| seed |] in
+  let cursor = ref 0L and issued = ref 0 and writes = ref 0 in
+  let next_block () =
+    if job.random then Random.State.int64 state blocks else begin
+      let b = !cursor in
+      cursor := Int64.rem (Int64.succ b) blocks;
+      b
+    end in
+  let start = Unix.gettimeofday () in
+  let finished () =
+    (number > 0 && !issued >= number) || Unix.gettimeofday () -. start >= runtime in
+  let worker () =
+    Block_pool.with_buffer pool @@ fun buf ->
+    fill state buf;
+    let buffers = fragment buf job.fragments ss in
     let rec loop () =
-      let remaining = Int64.sub info.Mirage_block.size_sectors !sector in
-      let this_time = min remaining (Int64.of_int bs_sectors) in
-      if this_time = 0L then Lwt.return_unit else begin
-        let start_sector = !sector in
-        sector := Int64.add !sector this_time;
-        let buf = Cstruct.sub pages 0 (Int64.to_int (this_time) * info.Mirage_block.sector_size) in
-        let bufs = match split with
-          | None -> [ buf ]
-          | Some into -> split_into buf into in
-        Block.read src start_sector bufs
-        >>= function
-        | Error _ -> failwith (Printf.sprintf "Block.read %Ld failed" start_sector)
-        | Ok () ->
-        resize_to_atleast (Int64.add start_sector this_time)
-        >>= fun () ->
-        Block.write dst start_sector bufs
-        >>= function
-        | Error _ -> failwith (Printf.sprintf "Block.write %Ld failed" start_sector)
-        | Ok () ->
-        loop ()
+      if finished () then Lwt.return_unit else begin
+        incr issued;
+        let sector = Int64.(mul (next_block ()) (of_int bs_sectors)) in
+        ( if Random.State.int state 100 < job.read_percent then
+            Block.read device sector buffers >>= ok "read"
+          else if Random.State.int state 100 < job.discard_percent then
+            Block.discard device sector (Int64.of_int bs_sectors) >>= ok "discard"
+          else begin
+            Block.write device sector buffers
+            >>= ok "write"
+            >>= fun () ->
+            incr writes;
+            if job.fsync > 0 && !writes mod job.fsync = 0
+            then Block.flush device >>= ok "flush"
+            else Lwt.return_unit
+          end )
+        >>= loop
       end in
     loop () in
-  let rec units = function
-    | 0 -> []
-    | n -> () :: (units (n - 1)) in
-  let threads = List.map one_thread @@ units threads in
-  Lwt.join threads
+  Lwt.join (List.init job.iodepth (fun _ -> worker ()))
   >>= fun () ->
+  let seconds = Unix.gettimeofday () -. start in
+  let stats = Block.stats device in
+  Block.disconnect device
+  >|= fun () ->
+  seconds, stats
 
-  Block.disconnect dst
-  >>= fun () ->
-  Block.disconnect src
+let json_of_op seconds (o: Block_stats.op_stats) =
+  let h = o.Block_stats.latency in
+  let p = Block_stats.Histogram.percentile h in
+  Printf.sprintf "{\"ops\":%d,\"bytes\":%Ld,\"errors\":%d,\"iops\":%.1f,\"bw_bytes\":%.0f,\
+                  \"lat_ns\":{\"mean\":%.0f,\"p50\":%d,\"p99\":%d,\"p999\":%d,\"max\":%d}}"
+    o.Block_stats.ops o.Block_stats.bytes o.Block_stats.errors
+    (float_of_int o.Block_stats.ops /. seconds) (Int64.to_float o.Block_stats.bytes /. seconds)
+    (Block_stats.Histogram.mean h) (p 50.) (p 99.) (p 99.9) (Block_stats.Histogram.maximum h)
+
+let json_of_job job =
+  Printf.sprintf "\"rw\":%s,\"rwmixread\":%d,\"discard_percent\":%d,\"bs\":%d,\"iodepth\":%d,\
+                  \"fragments\":%d,\"direct\":%b,\"engine\":%s,\"fsync\":%d"
+    (json_string job.rw) job.read_percent job.discard_percent job.bs job.iodepth job.fragments job.direct
+    (json_string (Block.Config.string_of_engine job.engine)) job.fsync
+
+let json_of_result job (seconds, s) =
+  let open Block_stats in
+  let ops = s.read.ops + s.write.ops + s.discard.ops in
+  let bytes = Int64.add s.read.bytes s.write.bytes in
+  Printf.sprintf "{%s,\"seconds\":%.3f,\"ops\":%d,\"iops\":%.1f,\"bw_bytes\":%.0f,\
+                  \"read\":%s,\"write\":%s,\"flush\":%s,\"discard\":%s}"
+    (json_of_job job) seconds ops (float_of_int ops /. seconds) (Int64.to_float bytes /. seconds)
+    (json_of_op seconds s.read) (json_of_op seconds s.write)
+    (json_of_op seconds s.flush) (json_of_op seconds s.discard)
+
+let ints s = List.map int_of_string (String.split_on_char ',' s)
 
 let _ =
-  let src = ref "benchmark.src" in
-  let dst = ref "benchmark.dst" in
-  let bs = ref 512 in
-  let split = ref None in
-  let buffered = ref true in
-  let threads = ref 1 in
+  let file = ref "benchmark.dat" in
+  let size = ref 268435456 in
+  let rw = ref "randread" in
+  let rwmixread = ref 50 in
+  let discard_percent = ref 0 in
+  let bs = ref "4096" in
+  let iodepth = ref "1" in
+  let fragments = ref "1" in
+  let direct = ref "0" in
+  let engine = ref "threads" in
+  let fsync = ref 0 in
+  let runtime = ref 5. in
+  let number = ref 0 in
+  let seed = ref 0 in
   Arg.parse [
-    "-src", Arg.Set_string src, Printf.sprintf "source filename (default %s)" !src;
-    "-dst", Arg.Set_string dst, Printf.sprintf "destination filename (default %s)" !dst;
-    "-bs", Arg.Set_int bs, Printf.sprintf "block size (default %d)" !bs;
-    "-split", Arg.Int (fun x -> split := Some x), "split each block into a list of fragments";
-    "-buffered", Arg.Set buffered, Printf.sprintf "buffered (default %b)" !buffered;
-    "-threads", Arg.Set_int threads, Printf.sprintf "threads (default %d)" !threads;
+    "-file", Arg.Set_string file, Printf.sprintf "file to test, created if it is not -size bytes (default %s)" !file;
+    "-size", Arg.Set_int size, Printf.sprintf "size of the file in bytes (default %d)" !size;
+    "-rw", Arg.Set_string rw, Printf.sprintf "read, write, randread, randwrite, rw, randrw, trim or randtrim, comma-separated to sweep (default %s)" !rw;
+    "-rwmixread", Arg.Set_int rwmixread, Printf.sprintf "percentage of reads in rw and randrw (default %d)" !rwmixread;
+    "-discard-percent", Arg.Set_int discard_percent, Printf.sprintf "percentage of writes which are discards instead (default %d)" !discard_percent;
+    "-bs", Arg.Set_string bs, Printf.sprintf "block sizes to sweep, comma-separated (default %s)" !bs;
+    "-iodepth", Arg.Set_string iodepth, Printf.sprintf "requests in flight to sweep, comma-separated (default %s)" !iodepth;
+    "-fragments", Arg.Set_string fragments, Printf.sprintf "buffers per request to sweep, comma-separated (default %s)" !fragments;
+    "-direct", Arg.Set_string direct, Printf.sprintf "0 (buffered), 1 (O_DIRECT) or 0,1 to sweep (default %s)" !direct;
+    "-engine", Arg.Set_string engine, Printf.sprintf "threads, uring, aio or workers, comma-separated to sweep (default %s)" !engine;
+    "-fsync", Arg.Set_int fsync, Printf.sprintf "flush after every n writes, 0 for never (default %d)" !fsync;
+    "-runtime", Arg.Set_float runtime, Printf.sprintf "seconds per run (default %.0f)" !runtime;
+    "-number", Arg.Set_int number, "stop each run after this many requests";
+    "-seed", Arg.Set_int seed, Printf.sprintf "random seed (default %d)" !seed;
   ] (fun x ->
       Printf.fprintf stderr "Unrecognised argument: %s\nSee -help for usage.\n" x;
       exit 1;
-    ) "A simple file copy benchmark";
+    ) "An fio-like benchmark which prints JSON";
   Logs.set_reporter (Logs_fmt.reporter ());
-  Lwt_main.run @@ copy ~src:(!src) ~dst:(!dst) ~bs:(!bs) ~split:(!split) ~buffered:(!buffered) ~threads:(!threads)
+  let jobs =
+    List.concat @@ List.map (fun rw ->
+      let random, read_percent, discard_percent =
+        match pattern !rwmixread rw with
+        | r, p, 0 -> r, p, !discard_percent
+        | r, p, d -> r, p, d in
+      List.concat @@ List.map (fun engine ->
+        List.concat @@ List.map (fun direct ->
+          List.concat @@ List.map (fun bs ->
+            List.concat @@ List.map (fun iodepth ->
+              List.map (fun fragments ->
+                { rw; random; read_percent; discard_percent; bs; iodepth; fragments;
+                  direct = direct <> 0; engine = engine_of_string engine; fsync = !fsync }
+              ) (ints !fragments)
+            ) (ints !iodepth)
+          ) (ints !bs)
+        ) (ints !direct)
+      ) (String.split_on_char ',' !engine)
+    ) (String.split_on_char ',' !rw) in
+  let results =
+    Lwt_main.run begin
+      prepare ~file:!file ~size:(Int64.of_int !size)
+      >>= fun () ->
+      Lwt_list.map_s (fun job ->
+          (* O_DIRECT and the kernel queue engines are not available
+             everywhere, so a failed run is reported and the sweep goes on *)
+          Lwt.catch
+            (fun () -> run ~file:!file ~runtime:!runtime ~number:!number ~seed:!seed job >|= json_of_result job)
+            (fun e -> Lwt.return (Printf.sprintf "{%s,\"error\":%s}" (json_of_job job) (json_string (Printexc.to_string e))))
+        ) jobs
+    end in
+  Printf.printf "{\"file\":%s,\"size\":%d,\"runtime\":%.3f,\"jobs\":[\n%s\n]}\n"
+    (json_string !file) !size !runtime (String.concat ",\n" results)
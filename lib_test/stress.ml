@@ -215,7 +215,252 @@ module Make(B: DISCARDABLE) = struct
       )
 end
 
+(* A multi-client load generator. Each client owns a disjoint range of
+   sectors, so it knows exactly what every sector should contain, and issues
+   one request at a time with its own access pattern. The clients share the
+   devices, so there is contention within each device. *)
+module Load(B: DISCARDABLE) = struct
+  open Lwt.Infix
+
+  type pattern = [ `Sequential | `Random | `Hot ]
+
+  let string_of_pattern = function
+    | `Sequential -> "sequential"
+    | `Random -> "random"
+    | `Hot -> "hot" (* random within the first sixteenth of the range *)
+
+  (* A 64-bit mixing function, from MurmurHash3 *)
+  let mix x =
+    let open Int64 in
+    let x = mul (logxor x (shift_right_logical x 33)) 0xff51afd7ed558ccdL in
+    let x = mul (logxor x (shift_right_logical x 33)) 0xc4ceb9fe1a85ec53L in
+    logxor x (shift_right_logical x 33)
+
+  (* Every written sector starts with the sector number, the generation of
+     the write and a checksum of everything else. The rest of the sector is
+     derived from the first two, so a sector which is stale, misplaced or
+     torn is detected. *)
+  let header_size = 24
+
+  let checksum buf =
+    let rec loop acc i =
+      if i >= Cstruct.len buf then acc
+      else loop (mix (Int64.logxor acc (Cstruct.BE.get_uint64 buf i))) (i + 8) in
+    loop (mix (Int64.logxor (Cstruct.BE.get_uint64 buf 0) (Cstruct.BE.get_uint64 buf 8))) header_size
+
+  let fill_sector buf sector generation =
+    Cstruct.BE.set_uint64 buf 0 sector;
+    Cstruct.BE.set_uint64 buf 8 (Int64.of_int generation);
+    let seed = mix (Int64.logxor sector (Int64.shift_left (Int64.of_int generation) 40)) in
+    let rec loop i =
+      if i < Cstruct.len buf then begin
+        Cstruct.BE.set_uint64 buf i (mix (Int64.add seed (Int64.of_int i)));
+        loop (i + 8)
+      end in
+    loop header_size;
+    Cstruct.BE.set_uint64 buf 16 (checksum buf)
+
+  (* what a client knows about one of its sectors *)
+  let unknown = -2
+  let zero = -1 (* discarded or never written, otherwise a generation *)
+
+  let verify_sector client buf sector expected =
+    let fail fmt = Printf.ksprintf (fun m -> failwith (Printf.sprintf "client %d sector %Ld: %s" client sector m)) fmt in
+    if expected = zero then begin
+      let rec loop i =
+        if i < Cstruct.len buf then begin
+          if Cstruct.BE.get_uint64 buf i <> 0L then fail "expected zeroes but byte %d is not" i;
+          loop (i + 8)
+        end in
+      loop 0
+    end else if expected >= 0 then begin
+      let actual_sector = Cstruct.BE.get_uint64 buf 0 in
+      let actual_generation = Int64.to_int (Cstruct.BE.get_uint64 buf 8) in
+      if actual_sector <> sector then fail "contains sector %Ld" actual_sector;
+      if actual_generation <> expected then fail "expected generation %d but found %d" expected actual_generation;
+      if Cstruct.BE.get_uint64 buf 16 <> checksum buf then fail "checksum mismatch"
+    end
+
+  (* Latencies in nanoseconds since the last report, and for the whole run *)
+  type totals = {
+    mutable ops: int;
+    mutable bytes: int; (* since the last report *)
+    mutable total_bytes: int;
+    mutable latencies: int list;
+    mutable all: int list;
+    mutable flushes: int;
+    mutable discards: int;
+    mutable verified: int; (* sectors *)
+  }
+
+  let summarise latencies =
+    let sorted = Array.of_list latencies in
+    Array.sort compare sorted;
+    let n = Array.length sorted in
+    let percentile p =
+      if n = 0 then 0 else sorted.(min (n - 1) (int_of_float (float_of_int n *. p /. 100.))) in
+    n, percentile 50., percentile 99., percentile 99.9
+
+  type client = {
+    id: int;
+    device: B.t;
+    sector_size: int;
+    first: int64;
+    state: int array; (* one per sector of the range *)
+    pattern: pattern;
+    buffer: Cstruct.t;
+    rand: Random.State.t;
+    mutable cursor: int;
+    mutable generation: int;
+  }
+
+  let timed totals bytes f =
+    let start = Block_stats.now () in
+    f ()
+    >|= fun r ->
+    let ns = Block_stats.now () - start in
+    totals.ops <- totals.ops + 1;
+    totals.bytes <- totals.bytes + bytes;
+    totals.total_bytes <- totals.total_bytes + bytes;
+    totals.latencies <- ns :: totals.latencies;
+    totals.all <- ns :: totals.all;
+    r
+
+  let read_and_verify ?totals c start n =
+    let buf = Cstruct.sub c.buffer 0 (n * c.sector_size) in
+    let sector = Int64.add c.first (Int64.of_int start) in
+    ( match totals with
+      | None -> B.read c.device sector [ buf ]
+      | Some totals -> timed totals (n * c.sector_size) (fun () -> B.read c.device sector [ buf ]) )
+    >|= function
+    | Error _ -> failwith (Printf.sprintf "client %d: read %Ld failed" c.id sector)
+    | Ok () ->
+      for i = 0 to n - 1 do
+        verify_sector c.id (Cstruct.sub buf (i * c.sector_size) c.sector_size)
+          (Int64.add sector (Int64.of_int i)) c.state.(start + i)
+      done;
+      n
+
+  let choose c n =
+    let sectors = Array.length c.state in
+    match c.pattern with
+    | `Sequential ->
+      let start = c.cursor in
+      let n = min n (sectors - start) in
+      c.cursor <- (start + n) mod sectors;
+      start, n
+    | `Random -> Random.State.int c.rand (sectors - n + 1), n
+    | `Hot ->
+      let hot = max n (sectors / 16) in
+      Random.State.int c.rand (hot - n + 1), n
+
+  let run_client ~stop ~max_sectors ~percent totals c =
+    let flush_percent, discard_percent, read_percent = percent in
+    let rec loop () =
+      if Lwt.is_sleeping stop then begin
+        let n = 1 + Random.State.int c.rand (min max_sectors (Array.length c.state)) in
+        let start, n = choose c n in
+        let sector = Int64.add c.first (Int64.of_int start) in
+        let r = Random.State.int c.rand 100 in
+        ( if r < flush_percent then begin
+            timed totals 0 (fun () -> B.flush c.device)
+            >|= function
+            | Error _ -> failwith (Printf.sprintf "client %d: flush failed" c.id)
+            | Ok () -> totals.flushes <- totals.flushes + 1
+          end else if r < flush_percent + discard_percent then begin
+            timed totals 0 (fun () -> B.discard c.device sector (Int64.of_int n))
+            >|= fun result ->
+            (* a failed discard may have discarded some of the range *)
+            let s = match result with Ok () -> zero | Error _ -> unknown in
+            Array.fill c.state start n s;
+            totals.discards <- totals.discards + 1
+          end else if r < flush_percent + discard_percent + read_percent then begin
+            read_and_verify ~totals c start n
+            >|= fun n ->
+            totals.verified <- totals.verified + n
+          end else begin
+            c.generation <- c.generation + 1;
+            let buf = Cstruct.sub c.buffer 0 (n * c.sector_size) in
+            for i = 0 to n - 1 do
+              fill_sector (Cstruct.sub buf (i * c.sector_size) c.sector_size)
+                (Int64.add sector (Int64.of_int i)) c.generation
+            done;
+            timed totals (n * c.sector_size) (fun () -> B.write c.device sector [ buf ])
+            >|= function
+            | Error _ -> failwith (Printf.sprintf "client %d: write %Ld failed" c.id sector)
+            | Ok () -> Array.fill c.state start n c.generation
+          end )
+        >>= loop
+      end else Lwt.return_unit in
+    loop ()
+
+  (* Reads back a client's whole range *)
+  let verify_all ~max_sectors c =
+    let sectors = Array.length c.state in
+    let rec loop start =
+      if start >= sectors then Lwt.return_unit else begin
+        read_and_verify c start (min max_sectors (sectors - start))
+        >>= fun n ->
+        loop (start + n)
+      end in
+    loop 0
+
+  let report ~elapsed ~interval totals =
+    let n, p50, p99, p999 = summarise totals.latencies in
+    totals.latencies <- [];
+    Printf.printf "%7.1fs %8.0f ops/s %9.2f MiB/s p50 %7d us p99 %7d us p99.9 %7d us\n%!"
+      elapsed (float_of_int n /. interval)
+      (float_of_int totals.bytes /. interval /. 1048576.) (p50 / 1000) (p99 / 1000) (p999 / 1000);
+    totals.bytes <- 0
+
+  let run ~devices ~clients ~is_empty ~duration ~interval ~max_sectors ~percent =
+    Lwt_list.map_s B.get_info devices
+    >>= fun infos ->
+    let info = List.hd infos in
+    let sector_size = info.Mirage_block.sector_size in
+    let size_sectors =
+      List.fold_left (fun acc i -> min acc i.Mirage_block.size_sectors) info.Mirage_block.size_sectors infos in
+    let region = Int64.(to_int (div size_sectors (of_int clients))) in
+    if region = 0 then failwith "there are more clients than sectors";
+    let patterns = [| `Sequential; `Random; `Hot |] in
+    let devices = Array.of_list devices in
+    let clients = Array.init clients (fun id ->
+        let pattern = patterns.(id mod Array.length patterns) in
+        { id; device = devices.(id mod Array.length devices); sector_size;
+          first = Int64.(mul (of_int id) (of_int region));
+          state = Array.make region (if is_empty then zero else unknown);
+          pattern;
+          buffer = Io_page.(to_cstruct (get ((max_sectors * sector_size + page_size - 1) / page_size)));
+          rand = Random.State.make [| id |];
+          cursor = 0; generation = 0 }) in
+    Printf.printf "%d clients on %d devices, %d sectors of %d bytes each\n"
+      (Array.length clients) (Array.length devices) region sector_size;
+    Array.iter (fun c -> Printf.printf "  client %d: %s\n" c.id (string_of_pattern c.pattern)) clients;
+    let totals = { ops = 0; bytes = 0; total_bytes = 0; latencies = []; all = []; flushes = 0; discards = 0; verified = 0 } in
+    let start = Unix.gettimeofday () in
+    let stop = Lwt_unix.sleep duration in
+    let rec reporter () =
+      (* not Lwt.pick, which would cancel [stop] *)
+      Lwt.choose [ (Lwt_unix.sleep interval >|= fun () -> true); (stop >|= fun () -> false) ]
+      >>= fun more ->
+      if more then begin
+        report ~elapsed:(Unix.gettimeofday () -. start) ~interval totals;
+        reporter ()
+      end else Lwt.return_unit in
+    Lwt.join (reporter () :: Array.to_list (Array.map (run_client ~stop ~max_sectors ~percent totals) clients))
+    >>= fun () ->
+    let elapsed = Unix.gettimeofday () -. start in
+    Lwt_list.iter_p (verify_all ~max_sectors) (Array.to_list clients)
+    >|= fun () ->
+    let _, p50, p99, p999 = summarise totals.all in
+    Printf.printf "total: %d requests in %.1fs (%.0f ops/s, %.2f MiB/s), %d flushes, %d discards, %d sectors verified during the run\n"
+      totals.ops elapsed (float_of_int totals.ops /. elapsed)
+      (float_of_int totals.total_bytes /. elapsed /. 1048576.) totals.flushes totals.discards totals.verified;
+    Printf.printf "latency: p50 %d us p99 %d us p99.9 %d us\n%!" (p50 / 1000) (p99 / 1000) (p999 / 1000)
+end
+
 module Test = Make(Block)
+module Load_test = Load(Block)
 
 let create_file path nsectors =
   let open Lwt.Infix in
@@ -225,16 +470,66 @@ let create_file path nsectors =
   >>= fun () ->
   Lwt_unix.close fd
 
+let engine_of_string = function
+  | "threads" -> `Threads
+  | "uring" -> `Uring
+  | "aio" -> `Aio
+  | "workers" -> `Workers
+  | x -> failwith ("unknown engine: " ^ x)
+
+(* [-devices] connections, either all to [path] or each to a fresh file *)
+let load ~path ~sectors ~devices ~clients ~buffered ~engine ~duration ~interval ~max_sectors ~percent =
+  let open Lwt.Infix in
+  let paths = match path with
+    | "" -> List.init devices (fun i -> Printf.sprintf "%Ld.load.%d" sectors i)
+    | x -> List.init devices (fun _ -> x) in
+  let fresh = path = "" in
+  Lwt_list.iter_s (fun p -> if fresh then create_file p sectors else Lwt.return_unit) paths
+  >>= fun () ->
+  Lwt_list.map_s (fun p -> Block.connect ~buffered ~engine p) paths
+  >>= fun blocks ->
+  Lwt.catch
+    (fun () ->
+      Load_test.run ~devices:blocks ~clients ~is_empty:fresh ~duration ~interval ~max_sectors ~percent
+      >>= fun () ->
+      Lwt_list.iter_s Block.disconnect blocks
+      >>= fun () ->
+      if fresh then Lwt_list.iter_s Lwt_unix.unlink paths else Lwt.return_unit
+    ) (fun e ->
+      Printf.fprintf stderr "Block device files are: %s\n%!" (String.concat " " paths);
+      Lwt.fail e
+    )
+
 let _ =
   Logs.set_reporter (Logs_fmt.reporter ());
   let sectors = ref 65536 in
   let stop_after = ref 64 in
   let path = ref "" in
+  let clients = ref 0 in
+  let devices = ref 1 in
+  let buffered = ref true in
+  let engine = ref "threads" in
+  let duration = ref 10. in
+  let interval = ref 1. in
+  let max_sectors = ref 256 in
+  let flush_percent = ref 2 in
+  let discard_percent = ref 8 in
+  let read_percent = ref 40 in
   Arg.parse [
     "-path", Arg.Set_string path, "Path of file or block device (default: create a fresh file)";
     "-sectors", Arg.Set_int sectors, Printf.sprintf "Total number of sectors (default %d)" !sectors;
     "-stop-after", Arg.Set_int stop_after, Printf.sprintf "Number of iterations to stop after (default: 1024, 0 means never)";
     "-debug", Arg.Set debug, "enable debug";
+    "-clients", Arg.Set_int clients, "Run this many concurrent clients, each verifying its own range of sectors, instead of the random write/discard test";
+    "-devices", Arg.Set_int devices, Printf.sprintf "Number of devices the clients are spread over (default %d)" !devices;
+    "-direct", Arg.Clear buffered, "Use O_DIRECT for the clients";
+    "-engine", Arg.Set_string engine, Printf.sprintf "threads, uring, aio or workers for the clients (default %s)" !engine;
+    "-duration", Arg.Set_float duration, Printf.sprintf "Seconds the clients run for (default %.0f)" !duration;
+    "-interval", Arg.Set_float interval, Printf.sprintf "Seconds between throughput reports (default %.0f)" !interval;
+    "-max-sectors", Arg.Set_int max_sectors, Printf.sprintf "Largest request made by a client (default %d)" !max_sectors;
+    "-flush-percent", Arg.Set_int flush_percent, Printf.sprintf "Percentage of client requests which are flushes (default %d)" !flush_percent;
+    "-discard-percent", Arg.Set_int discard_percent, Printf.sprintf "Percentage of client requests which are discards (default %d)" !discard_percent;
+    "-read-percent", Arg.Set_int read_percent, Printf.sprintf "Percentage of client requests which are verified reads, the rest write (default %d)" !read_percent;
   ] (fun x ->
       Printf.fprintf stderr "Unexpected argument: %s\n" x;
       exit 1
@@ -243,6 +538,11 @@ let _ =
   Lwt_main.run begin
     let open Lwt.Infix in
     let sectors = Int64.of_int (!sectors) in
+    if !clients > 0 then
+      load ~path:!path ~sectors ~devices:(max 1 !devices) ~clients:!clients ~buffered:!buffered
+        ~engine:(engine_of_string !engine) ~duration:!duration ~interval:!interval
+        ~max_sectors:(max 1 !max_sectors) ~percent:(!flush_percent, !discard_percent, !read_percent)
+    else
     let path = match !path with
       | "" -> Filename.concat "." (Int64.to_string sectors) ^ ".compact"
       | x -> x in
@@ -60,6 +60,28 @@ let test_open_read () =
 
 open Mirage_block
 
+let test_connect_parallel () =
+  let t =
+    with_temp_file (fun a -> with_temp_file (fun b -> with_temp_file (fun c ->
+        let lock = Sys.os_type <> "Win32" in
+        Lwt_list.map_p (fun path -> Block.connect ~lock path) [ a; b; c ] >>= fun devices ->
+        List.iter (fun device ->
+            let geometry = Block.geometry device in
+            (* a regular file has no geometry of its own *)
+            assert_equal ~printer:string_of_int 512 geometry.Block.physical_block_size;
+            if geometry.Block.optimal_io_size < 0
+            then failwith "test_connect_parallel: negative optimal_io_size"
+          ) devices;
+        ( if not lock then Lwt.return_unit else begin
+            Lwt.catch
+              (fun () -> Block.connect ~lock a >>= fun d -> Block.disconnect d >|= fun () -> true)
+              (fun _ -> Lwt.return false) >|= fun connected ->
+            assert_equal ~printer:string_of_bool false connected
+          end ) >>= fun () ->
+        Lwt_list.iter_p Block.disconnect devices
+      ))) in
+  Lwt_main.run t
+
 let test_open_block () =
   let t =
     with_temp_file
@@ -111,6 +133,1056 @@ let test_write_read () =
       ) in
   Lwt_main.run t
 
+let test_concurrent_write_read ?queue_depth engine () =
+  let t =
+    with_temp_file
+      (fun file ->
+         Block.connect ~engine ?queue_depth file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let nr_sectors = Int64.to_int info1.size_sectors in
+         (* Issue all the writes at once so they are in flight together *)
+         let rec writes acc x =
+           if x = nr_sectors then acc else begin
+             let sector = alloc info1.sector_size in
+             Cstruct.memset sector (x mod 256);
+             let w =
+               Block.write device1 (Int64.of_int x) [ sector ] >>= fun r ->
+               Lwt.return (write_or_failwith r) in
+             writes (w :: acc) (x + 1)
+           end in
+         Lwt.join (writes [] 0) >>= fun () ->
+         (* Read back as a single request with more than IOV_MAX buffers *)
+         let rec buffers acc x =
+           if x = 0 then acc else buffers (alloc info1.sector_size :: acc) (x - 1) in
+         let sectors = buffers [] nr_sectors in
+         Block.read device1 0L sectors >>= fun r ->
+         let () = or_failwith r in
+         List.iteri (fun x sector ->
+           let expected = alloc info1.sector_size in
+           Cstruct.memset expected (x mod 256);
+           if not(Cstruct.equal sector expected)
+           then failwith (Printf.sprintf "test_concurrent_write_read: sector %d not equal" x)
+         ) sectors;
+         Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
+let test_sequential_readahead buffered () =
+  let t =
+    with_temp_file
+      (fun file ->
+         Lwt.catch
+           (fun () -> Block.connect ~buffered ~readahead:(Some 65536) file >>= fun d -> Lwt.return (Some d))
+           (fun _ -> Lwt.return None)
+         >>= function
+         | None ->
+           skip_if true "O_DIRECT is not supported in the temporary directory";
+           Lwt.return_unit
+         | Some device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let nr_sectors = Int64.to_int info1.size_sectors in
+         let expected = Array.init nr_sectors (fun x -> x mod 256) in
+         let sectors first n =
+           Array.to_list (Array.init n (fun i ->
+             let sector = alloc info1.sector_size in
+             Cstruct.memset sector expected.(first + i);
+             sector)) in
+         let rec write_all x =
+           if x = nr_sectors then Lwt.return_unit else begin
+             Block.write device1 (Int64.of_int x) (sectors x 16) >>= fun r ->
+             write_or_failwith r;
+             write_all (x + 16)
+           end in
+         write_all 0 >>= fun () ->
+         (* Read in small sequential chunks, overwriting a sector just ahead of
+            the reader part way through, which must not be served stale *)
+         let rec read_all x =
+           if x = nr_sectors then Lwt.return_unit else begin
+             ( if x = 256 then begin
+                 expected.(300) <- 0xaa;
+                 Block.write device1 300L (sectors 300 1) >>= fun r ->
+                 Lwt.return (write_or_failwith r)
+               end else Lwt.return_unit )
+             >>= fun () ->
+             let buffers = Array.to_list (Array.init 8 (fun _ -> alloc info1.sector_size)) in
+             Block.read device1 (Int64.of_int x) buffers >>= fun r ->
+             or_failwith r;
+             List.iteri (fun i sector ->
+               let e = alloc info1.sector_size in
+               Cstruct.memset e expected.(x + i);
+               if not(Cstruct.equal sector e)
+               then failwith (Printf.sprintf "test_sequential_readahead: sector %d not equal" (x + i))
+             ) buffers;
+             read_all (x + 8)
+           end in
+         read_all 0 >>= fun () ->
+         Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
+let test_cache cache_writeback () =
+  let t =
+    with_temp_file
+      (fun file ->
+         (* 16 sectors, so most of the writes below cause an eviction *)
+         Block.connect ~sync:None ~cache:(Some 8192) ~cache_writeback file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let sector x =
+           let s = alloc info1.sector_size in
+           Cstruct.memset s (x mod 256);
+           s in
+         let check device x =
+           let buf = alloc info1.sector_size in
+           Block.read device (Int64.of_int x) [ buf ] >>= fun r ->
+           or_failwith r;
+           if not(Cstruct.equal buf (sector x))
+           then failwith (Printf.sprintf "test_cache: sector %d not equal" x);
+           Lwt.return_unit in
+         let xs = Array.to_list (Array.init 64 (fun x -> x)) in
+         Lwt_list.iter_s (fun x ->
+           Block.write device1 (Int64.of_int x) [ sector x ] >>= fun r ->
+           Lwt.return (write_or_failwith r)
+         ) xs >>= fun () ->
+         (* Read a few sectors repeatedly so they are protected, then scan *)
+         Lwt_list.iter_s (check device1) [ 60; 61; 62; 60; 61; 62 ] >>= fun () ->
+         Lwt_list.iter_s (check device1) xs >>= fun () ->
+         Block.discard device1 10L 2L >>= fun r ->
+         write_or_failwith r;
+         Block.flush device1 >>= fun r ->
+         write_or_failwith r;
+         Block.disconnect device1 >>= fun () ->
+         (* Everything except the discarded sectors must be on the disk *)
+         Block.connect file >>= fun device2 ->
+         Lwt_list.iter_s (check device2) (List.filter (fun x -> x <> 10 && x <> 11) xs) >>= fun () ->
+         Block.disconnect device2
+      ) in
+  Lwt_main.run t
+
+let test_extents extent_map () =
+  let t =
+    with_temp_file
+      (fun file ->
+         Block.connect ~extent_map file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let n = Int64.of_int (4096 / info1.sector_size) in
+         Block.resize device1 Int64.(mul 256L n) >>= fun r ->
+         write_or_failwith r;
+         let buf = alloc 4096 in
+         Cstruct.memset buf 1;
+         Block.write device1 Int64.(mul 100L n) [ buf ] >>= fun r ->
+         write_or_failwith r;
+         let find extents x =
+           List.find (fun (o, l, _) -> o <= x && x < Int64.add o l) extents in
+         let check extents =
+           (* The extents are in order, without gaps, and cover the range *)
+           let last = List.fold_left (fun next (o, l, _) ->
+               assert_equal ~printer:Int64.to_string next o;
+               assert (l > 0L);
+               Int64.add o l
+             ) (Int64.mul 64L n) extents in
+           assert_equal ~printer:Int64.to_string (Int64.mul 192L n) last in
+         Block.extents device1 ~from:(Int64.mul 64L n) ~len:(Int64.mul 128L n) >>= fun r ->
+         let extents = or_failwith r in
+         check extents;
+         let _, _, kind = find extents Int64.(mul 100L n) in
+         assert (kind = `Data);
+         Block.discard device1 Int64.(mul 100L n) n >>= fun r ->
+         write_or_failwith r;
+         Block.extents device1 ~from:(Int64.mul 64L n) ~len:(Int64.mul 128L n) >>= fun r ->
+         let extents = or_failwith r in
+         check extents;
+         (* The map knows the discarded chunk is a hole; the filesystem
+            may not have punched one *)
+         if extent_map <> None then begin
+           let _, _, kind = find extents Int64.(mul 100L n) in
+           assert (kind = `Hole)
+         end;
+         (* Beyond the end is clipped off *)
+         Block.extents device1 ~from:Int64.(mul 255L n) ~len:Int64.(mul 10L n) >>= fun r ->
+         let extents = or_failwith r in
+         assert_equal ~printer:Int64.to_string n
+           (List.fold_left (fun acc (_, l, _) -> Int64.add acc l) 0L extents);
+         Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
+let test_discard_merging () =
+  let t =
+    let q = Block_discard.create ~granularity:4096 in
+    let punched = ref [] and zeroed = ref [] in
+    let punch o l = punched := (o, l) :: !punched; Lwt.return_unit in
+    let zero o l = zeroed := (o, l) :: !zeroed; Lwt.return_unit in
+    (* adjacent, overlapping and out of order, covering [512, 12800) *)
+    let ranges = [ 4096L, 4096L; 512L, 3584L; 6144L, 4096L; 10240L, 2560L ] in
+    Lwt.join (List.map (fun (o, l) -> Block_discard.discard q ~punch ~zero o l) ranges)
+    >>= fun () ->
+    let printer xs = String.concat "; " (List.map (fun (o, l) -> Printf.sprintf "%Ld+%Ld" o l) xs) in
+    assert_equal ~printer [ 4096L, 8192L ] !punched;
+    assert_equal ~printer [ 512L, 3584L; 12288L, 512L ] (List.sort compare !zeroed);
+    assert (Block_discard.idle q);
+    Lwt.return_unit in
+  Lwt_main.run t
+
+let test_discard_then_write () =
+  let t =
+    with_temp_file
+      (fun file ->
+         Block.connect file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let buf = alloc info1.sector_size in
+         Cstruct.memset buf 7;
+         (* the write must not be overtaken by the discard queued before it *)
+         let d = Block.discard device1 0L 8L in
+         Block.write device1 4L [ buf ] >>= fun r ->
+         write_or_failwith r;
+         d >>= fun r ->
+         write_or_failwith r;
+         let buf' = alloc info1.sector_size in
+         Block.read device1 4L [ buf' ] >>= fun r ->
+         or_failwith r;
+         if not(Cstruct.equal buf buf')
+         then failwith "test_discard_then_write: the write was discarded";
+         Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
+let test_write_zeroes unmap () =
+  let t =
+    with_temp_file
+      (fun file ->
+         Block.connect file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let sector x =
+           let s = alloc info1.sector_size in
+           Cstruct.memset s x;
+           s in
+         let xs = Array.to_list (Array.init 16 (fun x -> x)) in
+         Lwt_list.iter_s (fun x ->
+           Block.write device1 (Int64.of_int x) [ sector (x + 1) ] >>= fun r ->
+           Lwt.return (write_or_failwith r)
+         ) xs >>= fun () ->
+         Block.write_zeroes ~unmap device1 3L 10L >>= fun r ->
+         write_or_failwith r;
+         Lwt_list.iter_s (fun x ->
+           let buf = alloc info1.sector_size in
+           Block.read device1 (Int64.of_int x) [ buf ] >>= fun r ->
+           or_failwith r;
+           let expected = if x >= 3 && x < 13 then 0 else x + 1 in
+           if not(Cstruct.equal buf (sector expected))
+           then failwith (Printf.sprintf "test_write_zeroes: sector %d not equal" x);
+           Lwt.return_unit
+         ) xs >>= fun () ->
+         Block.write_zeroes device1 (Int64.pred info1.size_sectors) 2L >>= function
+         | Ok () -> failwith "test_write_zeroes: zeroed beyond the end"
+         | Error _ -> Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
+let test_detect_zeroes detect_zeroes () =
+  let t =
+    with_temp_file
+      (fun file ->
+         Block.connect ~detect_zeroes ~dedup_stats:(Some 65536) file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let ss = info1.sector_size in
+         let n = 262144 / ss in
+         let data = alloc (n * ss) in
+         Cstruct.memset data 1;
+         Block.write device1 0L [ data ] >>= fun r ->
+         write_or_failwith r;
+         (* Zeroes between two sectors of data, split over two buffers *)
+         let buf = alloc (n * ss) in
+         Cstruct.memset buf 0;
+         Cstruct.memset (Cstruct.sub buf 0 ss) 2;
+         Cstruct.memset (Cstruct.shift buf ((n - 1) * ss)) 3;
+         Block.write device1 0L [ Cstruct.sub buf 0 (n / 2 * ss); Cstruct.shift buf (n / 2 * ss) ] >>= fun r ->
+         write_or_failwith r;
+         let back = alloc (n * ss) in
+         Block.read device1 0L [ back ] >>= fun r ->
+         or_failwith r;
+         if not (Cstruct.equal back buf) then failwith "test_detect_zeroes: contents not equal";
+         let stats = Block.stats device1 in
+         (* unless the filesystem can't zero ranges, and zeroes were written *)
+         let zeroed = stats.Block_stats.zero_bytes in
+         if zeroed <> 0L
+         then assert_equal ~printer:Int64.to_string (Int64.of_int ((n - 2) * ss)) zeroed;
+         (* Every sector of the first write after the first is a duplicate *)
+         assert_equal ~printer:string_of_int (2 * n) stats.Block_stats.hashed_blocks;
+         assert_bool "duplicate sectors are counted" (stats.Block_stats.duplicate_blocks >= n - 1);
+         Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
+let test_checksums () =
+  let t =
+    with_temp_file
+      (fun file ->
+         let checksums = find_unused_file () in
+         (* a checksum per sector *)
+         let checksum_block = Some 512 in
+         Lwt.finalize (fun () ->
+           Block.connect ~checksums:(Some checksums) ~checksum_block file >>= fun device1 ->
+           Block.get_info device1 >>= fun info1 ->
+           let ss = info1.sector_size in
+           let sectors x =
+             let buf = alloc (16 * ss) in
+             for i = 0 to 15 do Cstruct.memset (Cstruct.sub buf (i * ss) ss) (x + i) done;
+             buf in
+           Block.write device1 0L [ sectors 1 ] >>= fun r ->
+           write_or_failwith r;
+           let buf = alloc (16 * ss) in
+           Block.read device1 0L [ buf ] >>= fun r ->
+           or_failwith r;
+           Block.disconnect device1 >>= fun () ->
+           (* Change sector 3 behind the checksums' back *)
+           Block.connect file >>= fun device2 ->
+           let bad = alloc ss in
+           Cstruct.memset bad 0xff;
+           Block.write device2 3L [ bad ] >>= fun r ->
+           write_or_failwith r;
+           Block.disconnect device2 >>= fun () ->
+           Block.connect ~checksums:(Some checksums) ~checksum_block file >>= fun device1 ->
+           Block.read device1 0L [ buf ] >>= fun r ->
+           ( match r with
+             | Ok () -> failwith "test_checksums: the corrupt sector was read"
+             | Error _ -> () );
+           Block.scrub device1 >>= fun r ->
+           assert_equal ~printer:(fun l -> String.concat ", " (List.map Int64.to_string l)) [ 3L ] (or_failwith r);
+           (* Discarded sectors are no longer checked *)
+           ( if Sys.os_type = "Win32" then Lwt.return_unit else begin
+               Block.discard device1 0L 4L >>= fun r ->
+               write_or_failwith r;
+               Block.read device1 0L [ buf ] >|= or_failwith
+             end ) >>= fun () ->
+           Block.resize device1 (Int64.add info1.size_sectors 8L) >>= fun r ->
+           write_or_failwith r;
+           Block.read device1 info1.size_sectors [ Cstruct.sub buf 0 (8 * ss) ] >>= fun r ->
+           or_failwith r;
+           Block.disconnect device1
+         ) (fun () -> rm_f checksums; Lwt.return_unit)
+      ) in
+  Lwt_main.run t
+
+let test_checksum_blocks () =
+  let t =
+    with_temp_file
+      (fun file ->
+         let checksums = find_unused_file () in
+         let checksum_block = Some 4096 in
+         Lwt.finalize (fun () ->
+           Block.connect ~checksums:(Some checksums) ~checksum_block file >>= fun device1 ->
+           Block.get_info device1 >>= fun info1 ->
+           let ss = info1.sector_size in
+           let spb = max 1 (4096 / ss) in
+           let buf = alloc (4 * spb * ss) in
+           for i = 0 to 4 * spb - 1 do Cstruct.memset (Cstruct.sub buf (i * ss) ss) i done;
+           (* The first block straddles the two buffers *)
+           let split = if spb > 1 then spb / 2 else 1 in
+           Block.write device1 0L [ Cstruct.sub buf 0 (split * ss); Cstruct.shift buf (split * ss) ] >>= fun r ->
+           write_or_failwith r;
+           Block.read device1 0L [ alloc (4 * spb * ss) ] >>= fun r ->
+           or_failwith r;
+           Block.disconnect device1 >>= fun () ->
+           (* Change a sector of the second block behind the checksums' back *)
+           Block.connect file >>= fun device2 ->
+           let bad = alloc ss in
+           Cstruct.memset bad 0xff;
+           Block.write device2 (Int64.of_int (spb + spb / 2)) [ bad ] >>= fun r ->
+           write_or_failwith r;
+           Block.disconnect device2 >>= fun () ->
+           Block.connect ~checksums:(Some checksums) ~checksum_block file >>= fun device1 ->
+           Block.scrub device1 >>= fun r ->
+           assert_equal ~printer:(fun l -> String.concat ", " (List.map Int64.to_string l))
+             [ Int64.of_int spb ] (or_failwith r);
+           (* Writing part of a block forgets its checksum *)
+           if spb = 1 then Block.disconnect device1 else begin
+             Block.write device1 (Int64.of_int (2 * spb + 1)) [ bad ] >>= fun r ->
+             write_or_failwith r;
+             Block.disconnect device1 >>= fun () ->
+             Block.connect file >>= fun device2 ->
+             Block.write device2 (Int64.of_int (2 * spb)) [ bad ] >>= fun r ->
+             write_or_failwith r;
+             Block.disconnect device2 >>= fun () ->
+             Block.connect ~checksums:(Some checksums) ~checksum_block file >>= fun device1 ->
+             Block.read device1 (Int64.of_int (2 * spb)) [ alloc (spb * ss) ] >>= fun r ->
+             or_failwith r;
+             Block.disconnect device1
+           end
+         ) (fun () -> rm_f checksums; Lwt.return_unit)
+      ) in
+  Lwt_main.run t
+
+let test_checksums_in_flight () =
+  let t =
+    with_temp_file
+      (fun file ->
+         let checksums = find_unused_file () in
+         Lwt.finalize (fun () ->
+           Block.connect ~checksums:(Some checksums) file >>= fun device1 ->
+           Block.get_info device1 >>= fun info1 ->
+           let ss = info1.sector_size in
+           let buf x = let b = alloc (64 * ss) in Cstruct.memset b x; b in
+           (* Reads overlapping writes may see the new data before the
+              writes complete *)
+           Lwt_list.iter_p (fun i ->
+               Lwt.join [ Block.write device1 0L [ buf i ] >|= write_or_failwith;
+                          Block.read device1 0L [ alloc (64 * ss) ] >|= or_failwith ])
+             [ 1; 2; 3; 4; 5; 6; 7; 8 ]
+           >>= fun () ->
+           Block.scrub device1 >>= fun r ->
+           assert_equal ~printer:(fun l -> String.concat ", " (List.map Int64.to_string l)) [] (or_failwith r);
+           Block.disconnect device1
+         ) (fun () -> rm_f checksums; Lwt.return_unit)
+      ) in
+  Lwt_main.run t
+
+let test_online_resize () =
+  let t =
+    with_temp_file
+      (fun file ->
+         (* a second descriptor, since the file is unlinked once connected *)
+         let fd = Unix.openfile file [ Unix.O_RDWR ] 0 in
+         Block.connect ~preallocate:(Some 1048576) file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let ss = info1.sector_size in
+         let size = info1.size_sectors in
+         let data = alloc (16 * ss) in
+         Cstruct.memset data 7;
+         (* Writes continue while the device grows *)
+         let writes = Lwt_list.iter_p (fun i ->
+             Block.write device1 (Int64.of_int (16 * i)) [ data ] >|= write_or_failwith)
+             [ 0; 1; 2; 3 ] in
+         Block.resize device1 (Int64.add size 16L) >>= fun r ->
+         write_or_failwith r;
+         writes >>= fun () ->
+         Block.write device1 size [ data ] >>= fun r ->
+         write_or_failwith r;
+         let buf = alloc (16 * ss) in
+         Block.read device1 size [ buf ] >>= fun r ->
+         or_failwith r;
+         if not (Cstruct.equal buf data) then failwith "test_online_resize: contents not equal";
+         (* Preallocation doesn't change the size *)
+         let st = Unix.LargeFile.fstat fd in
+         assert_equal ~printer:Int64.to_string
+           (Int64.mul (Int64.add size 16L) (Int64.of_int ss)) st.Unix.LargeFile.st_size;
+         (* Someone else grows the file *)
+         Unix.LargeFile.ftruncate fd (Int64.mul (Int64.add size 32L) (Int64.of_int ss));
+         Block.refresh_size device1 >>= fun r ->
+         assert_equal ~printer:Int64.to_string (Int64.add size 32L) (or_failwith r);
+         Block.get_info device1 >>= fun info1 ->
+         assert_equal ~printer:Int64.to_string (Int64.add size 32L) info1.size_sectors;
+         Block.read device1 (Int64.add size 16L) [ buf ] >>= fun r ->
+         or_failwith r;
+         Unix.close fd;
+         Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
+let test_shrink_while_writing () =
+  let t =
+    with_temp_file
+      (fun file ->
+         let fd = Unix.openfile file [ Unix.O_RDWR ] 0 in
+         Block.connect file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let ss = info1.sector_size in
+         Block.resize device1 64L >>= fun r ->
+         write_or_failwith r;
+         let data = alloc (8 * ss) in
+         Cstruct.memset data 7;
+         let write i = Block.write device1 (Int64.of_int (8 * i)) [ data ] in
+         let below r = write_or_failwith r in
+         (* Writes beyond the new size may have started before the shrink *)
+         let beyond _ = () in
+         let in_flight = List.map (fun i ->
+             write i >|= if i < 4 then below else beyond) [ 0; 1; 2; 3; 4; 5; 6; 7 ] in
+         let shrink = Block.resize device1 32L in
+         let held_back = List.map (fun i ->
+             write i >|= if i < 4 then below else beyond) [ 0; 3; 4; 7 ] in
+         shrink >>= fun r ->
+         write_or_failwith r;
+         Lwt.join (in_flight @ held_back) >>= fun () ->
+         Block.get_info device1 >>= fun info1 ->
+         assert_equal ~printer:Int64.to_string 32L info1.size_sectors;
+         (* None of the writes landed after the file was truncated *)
+         let st = Unix.LargeFile.fstat fd in
+         assert_equal ~printer:Int64.to_string (Int64.mul 32L (Int64.of_int ss)) st.Unix.LargeFile.st_size;
+         let buf = alloc (8 * ss) in
+         Lwt_list.iter_s (fun i ->
+             Block.read device1 (Int64.of_int (8 * i)) [ buf ] >|= fun r ->
+             or_failwith r;
+             if not (Cstruct.equal buf data) then failwith "test_shrink_while_writing: contents not equal")
+           [ 0; 1; 2; 3 ] >>= fun () ->
+         write 4 >>= fun r ->
+         ( match r with
+           | Ok () -> failwith "test_shrink_while_writing: wrote beyond the end"
+           | Error _ -> () );
+         Unix.close fd;
+         Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
+let test_throttle () =
+  let t =
+    with_temp_file
+      (fun file1 ->
+         with_temp_file
+           (fun file2 ->
+              (* The two devices share 20 writes per second, a second's worth
+                 of which are allowed at once *)
+              let group = Some "test_throttle" in
+              Block.connect ~iops_write:(Some 20) ~throttle_group:group file1 >>= fun device1 ->
+              Block.connect ~throttle_group:group file2 >>= fun device2 ->
+              Block.get_info device1 >>= fun info1 ->
+              let buf = alloc info1.sector_size in
+              let writes device = Lwt_list.iter_s (fun i ->
+                  Block.write device (Int64.of_int i) [ buf ] >|= write_or_failwith)
+                  (List.init 24 (fun i -> i)) in
+              let start = Unix.gettimeofday () in
+              Lwt.join [ writes device1; writes device2 ] >>= fun () ->
+              let elapsed = Unix.gettimeofday () -. start in
+              assert_bool (Printf.sprintf "48 writes took %.3fs" elapsed) (elapsed >= 1.0);
+              let waits device = Block_stats.Histogram.count (Block.stats device).Block_stats.throttle_wait in
+              assert_bool "writes were held back" (waits device1 > 0 && waits device2 > 0);
+              (* Reads have no limit *)
+              let before = waits device1 in
+              Block.read device1 0L [ buf ] >>= fun r ->
+              or_failwith r;
+              assert_equal ~printer:string_of_int before (waits device1);
+              Block.disconnect device1 >>= fun () ->
+              Block.disconnect device2
+           )
+      ) in
+  Lwt_main.run t
+
+let test_copy () =
+  let t =
+    with_temp_file
+      (fun src ->
+         with_temp_file
+           (fun dst ->
+              Block.connect src >>= fun device1 ->
+              Block.connect dst >>= fun device2 ->
+              Block.get_info device1 >>= fun info1 ->
+              let sector x =
+                let s = alloc info1.sector_size in
+                Cstruct.memset s x;
+                s in
+              (* Data at the start and the end of the source with a hole in
+                 between, which the destination has data in *)
+              Block.write device1 0L [ sector 1; sector 2 ] >>= fun r ->
+              write_or_failwith r;
+              Block.write device1 (Int64.pred info1.size_sectors) [ sector 3 ] >>= fun r ->
+              write_or_failwith r;
+              Block.write device2 100L [ sector 4 ] >>= fun r ->
+              write_or_failwith r;
+              Block.copy ~src:device1 ~dst:device2 >>= fun r ->
+              write_or_failwith r;
+              let check x expected =
+                let buf = alloc info1.sector_size in
+                Block.read device2 x [ buf ] >>= fun r ->
+                or_failwith r;
+                if not(Cstruct.equal buf (sector expected))
+                then failwith (Printf.sprintf "test_copy: sector %Ld not equal" x);
+                Lwt.return_unit in
+              check 0L 1 >>= fun () ->
+              check 1L 2 >>= fun () ->
+              check 100L 0 >>= fun () ->
+              check (Int64.pred info1.size_sectors) 3 >>= fun () ->
+              Block.disconnect device1 >>= fun () ->
+              Block.disconnect device2
+           )
+      ) in
+  Lwt_main.run t
+
+(* Data which is only in the page cache must not be reported as a hole *)
+let test_copy_unflushed () =
+  let t =
+    with_temp_file
+      (fun src ->
+         with_temp_file
+           (fun dst ->
+              Block.connect src >>= fun device1 ->
+              Block.connect dst >>= fun device2 ->
+              Block.get_info device1 >>= fun info1 ->
+              let ss = info1.sector_size in
+              let data = alloc (8 * ss) in
+              Cstruct.memset data 5;
+              Lwt_list.iter_s (fun sector ->
+                  Block.write device1 sector [ data ] >|= write_or_failwith)
+                [ 8L; 500L; 1000L ]
+              >>= fun () ->
+              Block.copy ~src:device1 ~dst:device2 >>= fun r ->
+              write_or_failwith r;
+              let size = Int64.to_int info1.size_sectors * ss in
+              let a = alloc size and b = alloc size in
+              Block.read device1 0L [ a ] >>= fun r ->
+              or_failwith r;
+              Block.read device2 0L [ b ] >>= fun r ->
+              or_failwith r;
+              if not (Cstruct.equal a b) then failwith "test_copy_unflushed: contents not equal";
+              Block.disconnect device1 >>= fun () ->
+              Block.disconnect device2
+           )
+      ) in
+  Lwt_main.run t
+
+let test_buffer_lists () =
+  let buf = Cstruct.create 100 in
+  for i = 0 to 99 do Cstruct.set_uint8 buf i i done;
+  let buffers = [ Cstruct.sub buf 0 30; Cstruct.sub buf 30 50; Cstruct.sub buf 80 20 ] in
+  let flat bs = Cstruct.to_string (Cstruct.concat bs) in
+  let these, rest = Block_buffers.split buffers 40 in
+  assert_equal ~printer:(fun x -> x) (Cstruct.to_string (Cstruct.sub buf 0 40)) (flat these);
+  assert_equal ~printer:(fun x -> x) (Cstruct.to_string (Cstruct.shift buf 40)) (flat rest);
+  assert_equal ~printer:(fun x -> x) (Cstruct.to_string (Cstruct.sub buf 25 60))
+    (flat (Block_buffers.sub buffers 25 60));
+  let copy = Cstruct.create 100 in
+  Block_buffers.blit_from copy 0 buffers;
+  assert_bool "blit_from" (Cstruct.equal buf copy);
+  let dst = [ Cstruct.create 10; Cstruct.create 90 ] in
+  Block_buffers.blit_to buf 0 dst;
+  assert_bool "blit_to" (Cstruct.equal buf (Cstruct.concat dst));
+  let chunks = Block_buffers.chunks ~sector_size:10 ~chunk_sectors:4L 2L 10L buffers in
+  assert_equal ~printer:(fun l -> String.concat "; " (List.map (fun (c, w, n, _) ->
+      Printf.sprintf "%Ld %Ld %Ld" c w n) l))
+    [ 0L, 2L, 2L, []; 1L, 0L, 4L, []; 2L, 0L, 4L, [] ]
+    (List.map (fun (c, w, n, _) -> c, w, n, []) chunks);
+  let info = { Mirage_block.sector_size = 10; size_sectors = 10L; read_write = true } in
+  assert_equal (Ok 10L) (Block_buffers.check "read" info 0L buffers);
+  ( match Block_buffers.check "read" info 1L buffers with
+    | Ok _ -> failwith "test_buffer_lists: request beyond the end"
+    | Error (`Msg _) -> () );
+  ( match Block_buffers.check "read" info 0L [ Cstruct.sub buf 0 15 ] with
+    | Ok _ -> failwith "test_buffer_lists: partial sector"
+    | Error (`Msg _) -> () )
+
+let test_striped stripe () =
+  let t =
+    with_temp_file (fun a -> with_temp_file (fun b -> with_temp_file (fun c ->
+        Block_striped.connect ?stripe [ a; b; c ] >>= fun device ->
+        Block_striped.get_info device >>= fun info ->
+        let ss = info.sector_size in
+        (* Each sector is filled with its number; a request of several
+           sectors crosses devices *)
+        let sectors n = Int64.to_int n in
+        let pattern sector n =
+          let buf = alloc (sectors n * ss) in
+          for i = 0 to sectors n - 1 do
+            Cstruct.memset (Cstruct.sub buf (i * ss) ss) ((Int64.to_int sector + i) mod 256)
+          done;
+          buf in
+        let rec write_all sector =
+          if sector >= info.size_sectors then Lwt.return_unit else begin
+            let n = min 13L (Int64.sub info.size_sectors sector) in
+            Block_striped.write device sector [ pattern sector n ] >>= fun r ->
+            write_or_failwith r;
+            write_all (Int64.add sector n)
+          end in
+        write_all 0L >>= fun () ->
+        let read_back sector n =
+          let buf = alloc (sectors n * ss) in
+          Block_striped.read device sector [ Cstruct.sub buf 0 ss; Cstruct.shift buf ss ] >>= fun r ->
+          or_failwith r;
+          if not(Cstruct.equal buf (pattern sector n))
+          then failwith (Printf.sprintf "test_striped: %Ld+%Ld not equal" sector n);
+          Lwt.return_unit in
+        read_back 0L 64L >>= fun () ->
+        read_back 5L 40L >>= fun () ->
+        read_back (Int64.sub info.size_sectors 20L) 20L >>= fun () ->
+        (* Check where the second unit, or the second device, landed *)
+        let device2 = List.nth (Block_striped.devices device) 1 in
+        let second = match stripe with
+          | Some bytes -> Int64.of_int (bytes / ss)
+          | None -> Int64.of_int (1048576 / ss) in
+        let buf = alloc ss in
+        Block.read device2 0L [ buf ] >>= fun r ->
+        or_failwith r;
+        assert_equal ~printer:string_of_int (Int64.to_int second mod 256) (Cstruct.get_uint8 buf 0);
+        Block_striped.read device info.size_sectors [ buf ] >>= function
+        | Ok () -> failwith "test_striped: read beyond the end"
+        | Error _ -> Block_striped.disconnect device
+      ))) in
+  Lwt_main.run t
+
+let test_striped_cleanup () =
+  let t =
+    let a = find_unused_file () in
+    Lwt.finalize
+      (fun () ->
+        let fd = Unix.openfile a [ Unix.O_CREAT; Unix.O_WRONLY ] 0o0644 in
+        Unix.ftruncate fd 1048576;
+        Unix.close fd;
+        (* The second member doesn't exist *)
+        let missing = a ^ ".missing" in
+        Lwt.catch
+          (fun () ->
+            Block_striped.of_string (Printf.sprintf "file://%s,%s?lock=1" a missing) >>= fun _ ->
+            failwith "test_striped_cleanup: connected to a missing file")
+          (function
+            | Failure m when m = "test_striped_cleanup: connected to a missing file" -> Lwt.fail_with m
+            | _ -> Lwt.return_unit)
+        >>= fun () ->
+        (* The first member was disconnected, so it isn't still locked *)
+        Block.connect ~lock:true a >>= fun device ->
+        Block.disconnect device
+      ) (fun () -> rm_f a; Lwt.return_unit) in
+  Lwt_main.run t
+
+let test_mmap () =
+  let t =
+    let file = find_unused_file () in
+    Lwt.finalize
+      (fun () ->
+        (* A read-only file of 1000 bytes: one sector and a partial one *)
+        Lwt_unix.openfile file [ Lwt_unix.O_CREAT; Lwt_unix.O_WRONLY ] 0o0644 >>= fun fd ->
+        let contents = Cstruct.create 1000 in
+        for i = 0 to 999 do Cstruct.set_uint8 contents i (i mod 251) done;
+        Lwt_cstruct.(complete (write fd) contents) >>= fun () ->
+        Lwt_unix.close fd >>= fun () ->
+        Lwt_unix.chmod file 0o0444 >>= fun () ->
+        Block.connect ~buffered:true ~mmap:true file >>= fun device ->
+        Block.get_info device >>= fun info ->
+        assert_equal ~printer:Int64.to_string 2L info.size_sectors;
+        let buf = alloc 1024 in
+        Block.read device 0L [ Cstruct.sub buf 0 512; Cstruct.shift buf 512 ] >>= fun r ->
+        or_failwith r;
+        let expected = Cstruct.create 1024 in
+        Cstruct.blit contents 0 expected 0 1000;
+        if not(Cstruct.equal buf expected) then failwith "test_mmap: read not equal";
+        Block.read_view device 0L 2 >>= function
+        | Error `Unimplemented ->
+          (* root can open the file for writing, so it isn't mapped *)
+          skip_if info.read_write "file opened for writing";
+          failwith "test_mmap: read-only file not mapped"
+        | Error _ -> failwith "test_mmap: read_view failed"
+        | Ok view ->
+          if not(Cstruct.equal view expected) then failwith "test_mmap: view not equal";
+          Block.read_view device 0L 1 >>= fun r ->
+          assert_equal ~printer:Cstruct.to_string (Cstruct.sub expected 0 512) (or_failwith r);
+          Block.disconnect device
+      )
+    (fun () ->
+      Lwt_unix.unlink file
+    ) in
+  Lwt_main.run t
+
+let test_stats () =
+  let t =
+    with_temp_file
+      (fun file ->
+         Block.connect file >>= fun device ->
+         let buf = alloc 4096 in
+         Block.write device 0L [ buf ] >>= fun r ->
+         write_or_failwith r;
+         Block.read device 0L [ Cstruct.sub buf 0 1024; Cstruct.shift buf 1024 ] >>= fun r ->
+         or_failwith r;
+         Block.read device 0L [ Cstruct.sub buf 0 1000 ] >>= fun _ ->
+         Block.flush device >>= fun r ->
+         write_or_failwith r;
+         let s = Block.stats device in
+         assert_equal ~printer:string_of_int 1 s.Block_stats.write.Block_stats.ops;
+         assert_equal ~printer:Int64.to_string 4096L s.Block_stats.write.Block_stats.bytes;
+         assert_equal ~printer:string_of_int 1 s.Block_stats.read.Block_stats.ops;
+         assert_equal ~printer:Int64.to_string 4096L s.Block_stats.read.Block_stats.bytes;
+         assert_equal ~printer:string_of_int 1 s.Block_stats.flush.Block_stats.ops;
+         assert_equal ~printer:string_of_int 0 s.Block_stats.in_flight;
+         let latency = s.Block_stats.read.Block_stats.latency in
+         assert_equal ~printer:string_of_int 1 (Block_stats.Histogram.count latency);
+         assert_bool "p99 is at least p50"
+           (Block_stats.Histogram.percentile latency 99. >= Block_stats.Histogram.percentile latency 50.);
+         let text = Block_stats.to_prometheus ~labels:[ "device", file ] s in
+         let expected = Printf.sprintf "mirage_block_requests_total{device=%S,op=\"write\"} 1\n" file in
+         let rec contains i =
+           i + String.length expected <= String.length text
+           && (String.sub text i (String.length expected) = expected || contains (i + 1)) in
+         assert_bool "prometheus output has the write count" (contains 0);
+         Block.disconnect device
+      ) in
+  Lwt_main.run t
+
+let test_trace () =
+  (* Win32 reads and writes with seek and read on the main thread *)
+  skip_if (Sys.os_type = "Win32") "no thread pool jobs on Win32";
+  let t =
+    with_temp_file
+      (fun file ->
+         Block.connect file >>= fun device ->
+         Block.get_info device >>= fun info ->
+         let trace = Block_trace.create () in
+         Block.set_trace device (Some trace);
+         let buf = alloc 4096 in
+         Block.write device 1L [ buf ] >>= fun r ->
+         write_or_failwith r;
+         Block.read device 1L [ buf ] >>= fun r ->
+         or_failwith r;
+         Block.set_trace device None;
+         Block.read device 1L [ buf ] >>= fun r ->
+         or_failwith r;
+         let events = Block_trace.events trace in
+         let count name phase =
+           List.length (List.filter (fun e -> e.Block_trace.name = name && e.Block_trace.phase = phase) events) in
+         assert_equal ~printer:string_of_int 1 (count "read" `Begin);
+         assert_equal ~printer:string_of_int 1 (count "read" `End);
+         assert_equal ~printer:string_of_int 1 (count "write" `End);
+         assert_equal ~printer:string_of_int (count "job" `Begin) (count "job" `End);
+         assert_bool "a job per request" (count "job" `Begin >= 2);
+         assert_equal ~printer:string_of_int (count "job" `Begin) (count "worker" `Begin);
+         let read = List.find (fun e -> e.Block_trace.name = "read") events in
+         assert_equal ~printer:Int64.to_string (Int64.of_int info.sector_size) read.Block_trace.offset;
+         assert_equal ~printer:string_of_int 4096 read.Block_trace.length;
+         let json = Block_trace.to_chrome_json trace in
+         assert_bool "chrome trace" (String.sub json 0 15 = "{\"traceEvents\":");
+         (* the ring keeps the most recent events *)
+         let small = Block_trace.create ~capacity:4 () in
+         Block.set_trace device (Some small);
+         Block.read device 1L [ buf ] >>= fun r ->
+         or_failwith r;
+         Block.read device 1L [ buf ] >>= fun r ->
+         or_failwith r;
+         assert_equal ~printer:string_of_int 4 (List.length (Block_trace.events small));
+         assert_bool "events were dropped" (Block_trace.dropped small > 0);
+         ( match List.rev (Block_trace.events small) with
+           | last :: _ -> assert_equal ~printer:(fun x -> x) "read" last.Block_trace.name
+           | [] -> assert_failure "no events" );
+         Block.disconnect device
+      ) in
+  Lwt_main.run t
+
+let test_tiered () =
+  let t =
+    with_temp_file (fun cache -> with_temp_file (fun backing ->
+        (* Each sector starts with its number. The backing device is four
+           times the size of the cache, so chunks are evicted and written
+           back while the data is written. *)
+        let pattern ss sector n =
+          let buf = alloc (Int64.to_int n * ss) in
+          for i = 0 to Int64.to_int n - 1 do
+            let s = Cstruct.sub buf (i * ss) ss in
+            Cstruct.memset s ((Int64.to_int sector + i) mod 256);
+            Cstruct.BE.set_uint64 s 0 (Int64.add sector (Int64.of_int i))
+          done;
+          buf in
+        let check_all read ss size =
+          let rec loop sector =
+            if sector >= size then Lwt.return_unit else begin
+              let n = min 100L (Int64.sub size sector) in
+              let buf = alloc (Int64.to_int n * ss) in
+              read sector [ buf ] >>= fun () ->
+              if not(Cstruct.equal buf (pattern ss sector n))
+              then failwith (Printf.sprintf "test_tiered: %Ld+%Ld not equal" sector n);
+              loop (Int64.add sector n)
+            end in
+          loop 0L in
+        Block.connect backing >>= fun b ->
+        Block.resize b 8192L >>= fun r ->
+        write_or_failwith r;
+        Block.connect cache >>= fun c ->
+        Block_tiered.of_devices ~chunk:16384 ~delay:0.01 ~cache:c b >>= fun device ->
+        Block_tiered.get_info device >>= fun info ->
+        let ss = info.sector_size in
+        assert_equal ~printer:Int64.to_string 8192L info.size_sectors;
+        let rec write_all sector =
+          if sector >= info.size_sectors then Lwt.return_unit else begin
+            let n = min 13L (Int64.sub info.size_sectors sector) in
+            Block_tiered.write device sector [ pattern ss sector n ] >>= fun r ->
+            write_or_failwith r;
+            write_all (Int64.add sector n)
+          end in
+        write_all 0L >>= fun () ->
+        let read device sector buffers = Block_tiered.read device sector buffers >|= or_failwith in
+        check_all (read device) ss info.size_sectors >>= fun () ->
+        Block_tiered.flush device >>= fun r ->
+        write_or_failwith r;
+        Block_tiered.disconnect device >>= fun () ->
+        (* The cache keeps its contents, dirty chunks included *)
+        Block_tiered.connect ~chunk:16384 ~cache backing >>= fun device ->
+        check_all (read device) ss info.size_sectors >>= fun () ->
+        Block_tiered.writeback device >>= fun r ->
+        write_or_failwith r;
+        assert_equal ~printer:Int64.to_string 0L (Block_tiered.dirty_bytes device);
+        Block_tiered.disconnect device >>= fun () ->
+        Block.connect backing >>= fun b ->
+        check_all (fun sector buffers -> Block.read b sector buffers >|= or_failwith) ss info.size_sectors >>= fun () ->
+        Block.disconnect b
+      )) in
+  Lwt_main.run t
+
+let test_overlay () =
+  let t =
+    with_temp_file (fun base -> with_temp_file (fun delta ->
+        Block.connect base >>= fun b ->
+        Block.get_info b >>= fun info ->
+        let ss = info.sector_size in
+        let size = Int64.to_int info.size_sectors * ss in
+        let chunk_sectors = 16384 / ss in
+        let original = alloc size in
+        for i = 0 to size / 8 - 1 do
+          Cstruct.BE.set_uint64 original (i * 8) (Int64.of_int i)
+        done;
+        Block.write b 0L [ original ] >>= fun r ->
+        write_or_failwith r;
+        (* [expected] is what the overlay should contain *)
+        let expected = alloc size in
+        Cstruct.blit original 0 expected 0 size;
+        let check read what =
+          let buf = alloc size in
+          (* two buffers, so the reads are split in the middle of a chunk *)
+          read 0L [ Cstruct.sub buf 0 (3 * ss); Cstruct.shift buf (3 * ss) ] >>= fun () ->
+          if not (Cstruct.equal buf what) then failwith "test_overlay: contents not equal";
+          Lwt.return_unit in
+        let read device sector buffers = Block_overlay.read device sector buffers >|= or_failwith in
+        let write device sector n value =
+          let buf = alloc (n * ss) in
+          Cstruct.memset buf value;
+          Cstruct.blit buf 0 expected (Int64.to_int sector * ss) (n * ss);
+          Block_overlay.write device sector [ buf ] >|= write_or_failwith in
+        (* [delta] was not set up as a delta and isn't empty *)
+        Block.connect delta >>= fun d ->
+        Lwt.catch
+          (fun () -> Block_overlay.of_devices ~chunk:16384 ~base:b d >|= fun _ -> true)
+          (function Failure _ -> Lwt.return false | e -> Lwt.fail e) >>= fun accepted ->
+        assert_equal ~printer:string_of_bool false accepted;
+        Block_overlay.of_devices ~chunk:16384 ~reformat:true ~base:b d >>= fun device ->
+        (* part of a chunk, a whole chunk and a piece spanning two chunks *)
+        write device 5L 13 1 >>= fun () ->
+        write device (Int64.of_int (4 * chunk_sectors)) chunk_sectors 2 >>= fun () ->
+        write device (Int64.of_int (8 * chunk_sectors - 2)) 4 3 >>= fun () ->
+        Block_overlay.discard device 20L 4L >>= fun r ->
+        write_or_failwith r;
+        Cstruct.memset (Cstruct.sub expected (20 * ss) (4 * ss)) 0;
+        check (read device) expected >>= fun () ->
+        assert_equal ~printer:Int64.to_string (Int64.of_int (4 * 16384)) (Block_overlay.written_bytes device);
+        check (fun sector buffers -> Block.read b sector buffers >|= or_failwith) original >>= fun () ->
+        Block_overlay.disconnect device >>= fun () ->
+        (* The delta keeps its contents *)
+        Block_overlay.connect ~chunk:16384 ~base delta >>= fun device ->
+        check (read device) expected >>= fun () ->
+        Block_overlay.rollback device >>= fun r ->
+        write_or_failwith r;
+        assert_equal ~printer:Int64.to_string 0L (Block_overlay.written_bytes device);
+        Cstruct.blit original 0 expected 0 size;
+        check (read device) original >>= fun () ->
+        write device 7L 3 4 >>= fun () ->
+        Block_overlay.commit device >>= fun r ->
+        write_or_failwith r;
+        assert_equal ~printer:Int64.to_string 0L (Block_overlay.written_bytes device);
+        check (read device) expected >>= fun () ->
+        Block_overlay.disconnect device >>= fun () ->
+        Block.connect base >>= fun b ->
+        check (fun sector buffers -> Block.read b sector buffers >|= or_failwith) expected >>= fun () ->
+        Block.disconnect b
+      )) in
+  Lwt_main.run t
+
+let test_compressed () =
+  let t =
+    with_temp_file (fun raw -> with_temp_file (fun image ->
+        (* a file with data in it isn't taken for an image *)
+        Block.connect raw >>= fun r ->
+        Lwt.catch
+          (fun () -> Block_compressed.of_device ~size:1048576L r >|= fun _ -> true)
+          (function Failure _ -> Lwt.return false | e -> Lwt.fail e) >>= fun accepted ->
+        assert_equal ~printer:string_of_bool false accepted;
+        Block.disconnect r >>= fun () ->
+        Unix.truncate image 0;
+        Block_compressed.connect ~cluster:16384 ~cache:2 ~size:1048576L image >>= fun device ->
+        Block_compressed.get_info device >>= fun info ->
+        let ss = info.sector_size in
+        let size = Int64.to_int info.size_sectors * ss in
+        assert_equal ~printer:string_of_int 1048576 size;
+        (* [expected] is what the device should contain *)
+        let expected = alloc size in
+        for i = 0 to size / 8 - 1 do
+          Cstruct.BE.set_uint64 expected (i * 8) (Int64.of_int (i / 64))
+        done;
+        let check device =
+          let buf = alloc size in
+          (* two buffers, so the reads are split in the middle of a cluster *)
+          Block_compressed.read device 0L [ Cstruct.sub buf 0 (3 * ss); Cstruct.shift buf (3 * ss) ] >|= fun r ->
+          or_failwith r;
+          if not (Cstruct.equal buf expected) then failwith "test_compressed: contents not equal" in
+        let write device sector n value =
+          let buf = alloc (n * ss) in
+          Cstruct.memset buf value;
+          Cstruct.blit buf 0 expected (Int64.to_int sector * ss) (n * ss);
+          Block_compressed.write device sector [ buf ] >|= write_or_failwith in
+        Block_compressed.write device 0L [ Cstruct.sub expected 0 size ] >>= fun r ->
+        write_or_failwith r;
+        (* part of a cluster, and a piece spanning two clusters *)
+        write device 5L 13 1 >>= fun () ->
+        write device (Int64.of_int (16384 / ss * 8 - 2)) 4 3 >>= fun () ->
+        Block_compressed.discard device 0L (Int64.of_int (16384 / ss)) >>= fun r ->
+        write_or_failwith r;
+        Cstruct.memset (Cstruct.sub expected 0 16384) 0;
+        check device >>= fun () ->
+        Block_compressed.flush device >>= fun r ->
+        write_or_failwith r;
+        let stored = Block_compressed.stored_bytes device in
+        if stored > Int64.of_int (size / 4)
+        then failwith (Printf.sprintf "test_compressed: %Ld bytes stored" stored);
+        Block_compressed.disconnect device >>= fun () ->
+        (* The image keeps its contents *)
+        Block_compressed.of_string ("file://" ^ image ^ "?cluster=16k") >>= fun device ->
+        check device >>= fun () ->
+        (* Rewriting every cluster leaves garbage which compaction frees *)
+        let rec rewrite n =
+          if n = 0 then Lwt.return_unit else begin
+            Block_compressed.write device 0L [ Cstruct.sub expected 0 size ] >>= fun r ->
+            write_or_failwith r;
+            Block_compressed.flush device >>= fun r ->
+            write_or_failwith r;
+            rewrite (n - 1)
+          end in
+        rewrite 3 >>= fun () ->
+        Block_compressed.compact device >>= fun r ->
+        write_or_failwith r;
+        check device >>= fun () ->
+        let image_size = (Unix.stat image).Unix.st_size in
+        if image_size > 2 * Int64.to_int (Block_compressed.stored_bytes device) + 65536
+        then failwith (Printf.sprintf "test_compressed: %d byte image after compaction" image_size);
+        Block_compressed.disconnect device >>= fun () ->
+        Block_compressed.connect image >>= fun device ->
+        check device >>= fun () ->
+        Block_compressed.disconnect device
+      )) in
+  Lwt_main.run t
+
+let test_pool engine () =
+  let t =
+    with_temp_file
+      (fun file ->
+         Block.connect ~engine file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let pool = Block.create_pool ~sectors:2 device1 4 in
+         assert_equal ~printer:string_of_int (2 * info1.sector_size) (Block_pool.buffer_size pool);
+         (* Every buffer is written and read back through the pool *)
+         Lwt_list.map_p (fun _ -> Block_pool.alloc pool) [ 0; 1; 2; 3 ] >>= fun bufs ->
+         assert_equal ~printer:string_of_int 0 (Block_pool.available pool);
+         assert_equal None (Block_pool.alloc_now pool);
+         Lwt_list.iteri_p (fun i buf ->
+           Cstruct.memset buf i;
+           Block.write device1 (Int64.of_int (2 * i)) [ buf ] >>= fun r ->
+           Lwt.return (write_or_failwith r)
+         ) bufs >>= fun () ->
+         List.iter (Block_pool.free pool) bufs;
+         assert_raises (Invalid_argument "Block_pool.free: buffer is already free")
+           (fun () -> Block_pool.free pool (List.hd bufs));
+         Lwt_list.iter_p (fun i ->
+           Block_pool.with_buffer pool (fun buf ->
+             Block.read device1 (Int64.of_int (2 * i)) [ buf ] >>= fun r ->
+             or_failwith r;
+             let expected = alloc (2 * info1.sector_size) in
+             Cstruct.memset expected i;
+             if not(Cstruct.equal buf expected)
+             then failwith (Printf.sprintf "test_pool: buffer %d not equal" i);
+             Lwt.return_unit)
+         ) [ 0; 1; 2; 3; 4; 5; 6; 7 ] >>= fun () ->
+         assert_equal ~printer:string_of_int 4 (Block_pool.available pool);
+         Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
 let test_buffer_wrong_length () =
   let t =
     with_temp_file
@@ -163,10 +1235,37 @@ let test_resize () =
       return () in
   Lwt_main.run t
 
-let test_flush () =
+let test_workers () =
+  skip_if (Sys.os_type = "Win32") "no worker threads on Win32";
+  assert_equal ~printer:(fun x -> x) "0-3,8" (Block_workers.string_of_cpus (Block_workers.cpus_of_string "8,0-2,3"));
+  let t file =
+    Block.connect ~engine:`Workers ~workers:2 file >>= fun device ->
+    Block.get_info device >>= fun info ->
+    let buf = alloc (4 * info.sector_size) in
+    Cstruct.memset buf 7;
+    Block.write device 0L [ buf ] >>= fun r ->
+    write_or_failwith r;
+    Block.flush device >>= fun r ->
+    write_or_failwith r;
+    Block.discard device 0L 2L >>= fun r ->
+    write_or_failwith r;
+    let buf' = alloc (4 * info.sector_size) in
+    Block.read device 0L [ buf' ] >>= fun r ->
+    or_failwith r;
+    let half = 2 * info.sector_size in
+    assert_bool "discarded sectors are zero" (Cstruct.equal (Cstruct.sub buf' 0 half) (Cstruct.create half));
+    assert_bool "the rest are unchanged" (Cstruct.equal (Cstruct.shift buf' half) (Cstruct.shift buf half));
+    Block.resize device (Int64.add info.size_sectors 8L) >>= fun r ->
+    write_or_failwith r;
+    Block.get_info device >>= fun info' ->
+    assert_equal ~printer:Int64.to_string (Int64.add info.size_sectors 8L) info'.size_sectors;
+    Block.disconnect device in
+  with_temp_file (fun file -> Lwt_main.run (t file))
+
+let test_flush flush_method () =
   let t file =
     let do_flush sync =
-       Block.connect ~sync file >>= fun device1 ->
+       Block.connect ~sync ~flush_method file >>= fun device1 ->
        Block.flush device1 >>= function
        | Error _ -> failwith (Printf.sprintf "Block.flush %s failed" file)
        | Ok () -> Block.disconnect device1 in
@@ -177,6 +1276,26 @@ let test_flush () =
      do_flush None in
   with_temp_file (fun file -> Lwt_main.run (t file))
 
+let test_concurrent_flush () =
+  let t file =
+    Block.connect ~sync:(Some `ToOS) file >>= fun device1 ->
+    Block.get_info device1 >>= fun info1 ->
+    (* Each write is followed by a flush; the flushes overlap *)
+    let rec requests acc x =
+      if x = 16 then acc else begin
+        let sector = alloc info1.sector_size in
+        Cstruct.memset sector x;
+        let r =
+          Block.write device1 (Int64.of_int x) [ sector ] >>= fun r ->
+          write_or_failwith r;
+          Block.flush device1 >>= fun r ->
+          Lwt.return (write_or_failwith r) in
+        requests (r :: acc) (x + 1)
+      end in
+    Lwt.join (requests [] 0) >>= fun () ->
+    Block.disconnect device1 in
+  with_temp_file (fun file -> Lwt_main.run (t file))
+
 let test_parse_print_config config =
   let open Block.Config in
   let s = to_string config in
@@ -188,8 +1307,126 @@ let test_parse_print_config config =
       assert_equal ~printer:string_of_bool        config.buffered config'.buffered;
       assert_equal ~printer:Config.string_of_sync config.sync     config'.sync;
       assert_equal ~printer:(fun x -> x)          config.path     config'.path;
+      assert_equal ~printer:string_of_engine      config.engine   config'.engine;
+      assert_equal ~printer:string_of_bool        config.merge    config'.merge;
+      assert_equal ~printer:(function None -> "None" | Some n -> string_of_int n)
+        config.readahead config'.readahead;
+      assert_equal ~printer:(function None -> "None" | Some n -> string_of_int n)
+        config.cache config'.cache;
+      assert_equal ~printer:string_of_bool        config.cache_writeback config'.cache_writeback;
+      assert_equal ~printer:string_of_flush_method config.flush_method config'.flush_method;
+      assert_equal ~printer:(function None -> "None" | Some n -> string_of_int n)
+        config.queue_depth config'.queue_depth;
+      assert_equal ~printer:(function None -> "None" | Some n -> string_of_int n)
+        config.extent_map config'.extent_map;
+      assert_equal ~printer:string_of_bool        config.mmap     config'.mmap;
+      assert_equal ~printer:string_of_int         config.workers  config'.workers;
+      assert_equal ~printer:Block_workers.string_of_cpus config.cpus config'.cpus;
+      assert_equal ~printer:(function None -> "None" | Some n -> string_of_int n)
+        config.numa_node config'.numa_node;
+      assert_equal ~printer:string_of_detect_zeroes config.detect_zeroes config'.detect_zeroes;
+      assert_equal ~printer:(function None -> "None" | Some n -> string_of_int n)
+        config.dedup_stats config'.dedup_stats;
+      assert_equal ~printer:(function None -> "None" | Some p -> p) config.checksums config'.checksums;
+      assert_equal ~printer:string_of_int         config.checksum_verify config'.checksum_verify;
+      assert_equal ~printer:(function None -> "None" | Some n -> string_of_int n)
+        config.checksum_block config'.checksum_block;
+      assert_equal ~printer:(function None -> "None" | Some n -> string_of_int n)
+        config.preallocate config'.preallocate;
+      let limit = function None -> "None" | Some n -> string_of_int n in
+      assert_equal ~printer:limit config.iops_read config'.iops_read;
+      assert_equal ~printer:limit config.iops_write config'.iops_write;
+      assert_equal ~printer:limit config.bps_read config'.bps_read;
+      assert_equal ~printer:limit config.bps_write config'.bps_write;
+      assert_equal ~printer:string_of_int config.throttle_burst config'.throttle_burst;
+      assert_equal ~printer:(function None -> "None" | Some g -> g) config.throttle_group config'.throttle_group;
   )
 
+(* The stubs read a Cstruct.t as a (buffer, off, len) block, so requests
+   made of views at odd offsets into larger buffers must land where the
+   views are *)
+let test_sub_buffers engine () =
+  let view = Cstruct.sub (Cstruct.create 16) 3 5 in
+  let r = Obj.repr view in
+  assert_equal ~printer:string_of_int 0 (Obj.tag r);
+  assert_equal ~printer:string_of_int 3 (Obj.size r);
+  assert_equal ~printer:string_of_int 3 (Obj.obj (Obj.field r 1));
+  assert_equal ~printer:string_of_int 5 (Obj.obj (Obj.field r 2));
+  let t =
+    with_temp_file
+      (fun file ->
+         Block.connect ~engine file >>= fun device1 ->
+         Block.get_info device1 >>= fun info1 ->
+         let ss = info1.sector_size in
+         (* Three sectors at offsets 7, 3 and 1 beyond the start of three
+            larger buffers *)
+         let views = List.map (fun (off, fill) ->
+             let b = Cstruct.create (ss + 8) in
+             Cstruct.memset b 0xee;
+             let v = Cstruct.sub b off ss in
+             Cstruct.memset v fill;
+             b, v) [ 7, 1; 3, 2; 1, 3 ] in
+         Block.write device1 4L (List.map snd views) >>= fun r ->
+         write_or_failwith r;
+         let back = Cstruct.create (3 * ss + 16) in
+         Cstruct.memset back 0xdd;
+         let into = [ Cstruct.sub back 5 ss; Cstruct.sub back (5 + ss) (2 * ss) ] in
+         Block.read device1 4L into >>= fun r ->
+         or_failwith r;
+         List.iteri (fun i fill ->
+             let expected = Cstruct.create ss in
+             Cstruct.memset expected fill;
+             if not (Cstruct.equal (Cstruct.sub back (5 + i * ss) ss) expected)
+             then failwith (Printf.sprintf "test_sub_buffers: sector %d not equal" (4 + i))
+           ) [ 1; 2; 3 ];
+         (* Nothing outside the views was touched *)
+         assert_equal ~printer:string_of_int 0xdd (Cstruct.get_uint8 back 4);
+         assert_equal ~printer:string_of_int 0xdd (Cstruct.get_uint8 back (5 + 3 * ss));
+         List.iter (fun (b, _) ->
+             assert_equal ~printer:string_of_int 0xee (Cstruct.get_uint8 b 0);
+             assert_equal ~printer:string_of_int 0xee (Cstruct.get_uint8 b (ss + 7))) views;
+         (* A view which isn't whole sectors is refused *)
+         Block.write device1 0L [ Cstruct.sub back 1 (ss - 1) ] >>= fun r ->
+         ( match r with
+           | Ok () -> failwith "test_sub_buffers: a partial sector was written"
+           | Error _ -> () );
+         Block.disconnect device1
+      ) in
+  Lwt_main.run t
+
+(* One write and one read of more than IOV_MAX buffers each, over a file
+   whose last sector is partial *)
+let test_long_buffer_lists () =
+  let t =
+    let file = find_unused_file () in
+    Lwt.finalize
+      (fun () ->
+        let fd = Unix.openfile file [ Unix.O_CREAT; Unix.O_WRONLY ] 0o0644 in
+        Unix.ftruncate fd (2048 * 512 + 100);
+        Unix.close fd;
+        Block.connect file >>= fun device1 ->
+        Block.get_info device1 >>= fun info1 ->
+        let ss = info1.sector_size in
+        let nr_sectors = Int64.to_int info1.size_sectors in
+        let whole = alloc (nr_sectors * ss) in
+        for x = 0 to nr_sectors - 1 do
+          Cstruct.memset (Cstruct.sub whole (x * ss) ss) (x mod 256)
+        done;
+        let split buf = List.init nr_sectors (fun x -> Cstruct.sub buf (x * ss) ss) in
+        (* all but the partial sector *)
+        Block.write device1 0L (List.rev (List.tl (List.rev (split whole)))) >>= fun r ->
+        write_or_failwith r;
+        let back = alloc (nr_sectors * ss) in
+        Cstruct.memset back 0xff;
+        Block.read device1 0L (split back) >>= fun r ->
+        or_failwith r;
+        (* the partial sector reads as zeroes *)
+        Cstruct.memset (Cstruct.shift whole ((nr_sectors - 1) * ss)) 0;
+        if not (Cstruct.equal whole back) then failwith "test_long_buffer_lists: contents not equal";
+        Block.disconnect device1
+      ) (fun () -> rm_f file; Lwt.return_unit) in
+  Lwt_main.run t
+
 let test_not_multiple_of_sectors () =
   let t =
     let file = find_unused_file () in
@@ -243,21 +1480,228 @@ let test_not_multiple_of_sectors () =
     ) in
   Lwt_main.run t
 
+(* A kernel ring for Block_ring which the tests drive by hand *)
+module Fake_ring = struct
+  type ring = {
+    mutable queued: int list; (* prepared but not submitted, newest first *)
+    mutable accepted: int list;
+    mutable completions: (int * int) list; (* to be reaped, oldest first *)
+    mutable refuse: exn option; (* raised by the next submit *)
+  }
+
+  let submit r = match r.refuse with
+    | Some e -> r.refuse <- None; raise e
+    | None ->
+      let n = List.length r.queued in
+      r.accepted <- r.queued @ r.accepted;
+      r.queued <- [];
+      n
+
+  let reap r results =
+    let rec loop n = function
+      | (id, res) :: rest when 2 * n < Array.length results ->
+        results.(2 * n) <- id;
+        results.(2 * n + 1) <- res;
+        loop (n + 1) rest
+      | rest -> r.completions <- rest; n in
+    loop 0 r.completions
+
+  let withdraw r ids =
+    let n = List.length r.queued in
+    List.iteri (fun i id -> ids.(i) <- id) (List.rev r.queued);
+    r.queued <- [];
+    n
+
+  let close _ = ()
+end
+
+module Fake_queue = Block_ring.Make(Fake_ring)
+
+(* [f ring queue prep complete] with a queue of [entries] slots over a fake
+   ring, where [prep] queues a request on the ring and [complete id result]
+   delivers a completion *)
+let with_fake_ring entries f =
+  let eventfd, signal = Unix.pipe () in
+  let ring = { Fake_ring.queued = []; accepted = []; completions = []; refuse = None } in
+  let q = Fake_queue.create ~entries ring eventfd in
+  let prep id = ring.Fake_ring.queued <- id :: ring.Fake_ring.queued; true in
+  let complete id res =
+    ring.Fake_ring.accepted <- List.filter (fun id' -> id' <> id) ring.Fake_ring.accepted;
+    ring.Fake_ring.completions <- ring.Fake_ring.completions @ [ id, res ];
+    ignore (Unix.write signal (Bytes.make 8 '\001') 0 8) in
+  Lwt.finalize
+    (fun () -> f ring q prep complete)
+    (fun () -> Fake_queue.close q >|= fun () -> Unix.close signal)
+
+(* Long enough for queued requests to be submitted and completions reaped *)
+let settle () = Lwt_unix.sleep 0.05
+
+let test_ring_refused_submit () =
+  let t =
+    with_fake_ring 4 (fun ring q prep complete ->
+        let a = Fake_queue.enqueue q "a" [] prep in
+        settle () >>= fun () ->
+        let id_a = List.hd ring.Fake_ring.accepted in
+        (* The kernel accepted [a] but refuses to take [b] *)
+        ring.Fake_ring.refuse <- Some (Unix.Unix_error(Unix.EIO, "submit", ""));
+        let b = Fake_queue.enqueue q "b" [] prep in
+        settle () >>= fun () ->
+        assert_bool "the refused request failed"
+          (match Lwt.state b with Lwt.Fail (Unix.Unix_error(Unix.EIO, _, _)) -> true | _ -> false);
+        assert_equal ~printer:(fun l -> String.concat ", " (List.map string_of_int l)) [] ring.Fake_ring.queued;
+        assert_bool "the accepted request is still in flight" (Lwt.state a = Lwt.Sleep);
+        complete id_a 42;
+        a >|= fun res ->
+        assert_equal ~printer:string_of_int 42 res
+      ) in
+  Lwt_main.run t
+
+let test_ring_stale_completions () =
+  let t =
+    with_fake_ring 4 (fun ring q prep complete ->
+        let a = Fake_queue.enqueue q "a" [] prep in
+        settle () >>= fun () ->
+        let id_a = List.hd ring.Fake_ring.accepted in
+        complete id_a 1;
+        a >>= fun res ->
+        assert_equal ~printer:string_of_int 1 res;
+        (* [c] reuses the slot of [a] under a new id *)
+        let c = Fake_queue.enqueue q "c" [] prep in
+        settle () >>= fun () ->
+        let id_c = List.hd ring.Fake_ring.accepted in
+        assert_equal ~printer:string_of_int (id_a mod 4) (id_c mod 4);
+        assert_bool "the id changes when a slot is reused" (id_c <> id_a);
+        (* A late completion for [a] doesn't complete [c] *)
+        complete id_a 99;
+        settle () >>= fun () ->
+        assert_bool "a stale completion was ignored" (Lwt.state c = Lwt.Sleep);
+        complete id_c 2;
+        c >>= fun res ->
+        assert_equal ~printer:string_of_int 2 res;
+        (* nor does one for a slot which is now free *)
+        complete id_c 98;
+        settle ()
+      ) in
+  Lwt_main.run t
+
+let test_ring_full () =
+  let t =
+    with_fake_ring 2 (fun ring q prep complete ->
+        let x = Fake_queue.enqueue q "x" [] prep in
+        let y = Fake_queue.enqueue q "y" [] prep in
+        let z = Fake_queue.enqueue q "z" [] prep in
+        settle () >>= fun () ->
+        (* [z] waits for a slot rather than overfilling the ring *)
+        assert_equal ~printer:string_of_int 2 (List.length ring.Fake_ring.accepted);
+        assert_bool "the third request waits" (Lwt.state z = Lwt.Sleep);
+        let id_x = List.nth ring.Fake_ring.accepted 1 and id_y = List.hd ring.Fake_ring.accepted in
+        complete id_x 1;
+        settle () >>= fun () ->
+        let id_z = List.hd ring.Fake_ring.accepted in
+        assert_equal ~printer:string_of_int (id_x mod 2) (id_z mod 2);
+        assert_bool "the reused slot has a new id" (id_z <> id_x);
+        complete id_y 2;
+        complete id_z 3;
+        Lwt_list.map_s (fun p -> p) [ x; y; z ] >|= fun results ->
+        assert_equal ~printer:(fun l -> String.concat ", " (List.map string_of_int l)) [ 1; 2; 3 ] results
+      ) in
+  Lwt_main.run t
+
+let test_ring_id_wrap () =
+  List.iter (fun entries ->
+      let last = max_int / entries - 1 in
+      assert_equal ~printer:string_of_int 1 (Block_ring.next_generation ~entries 0);
+      assert_equal ~printer:string_of_int last (Block_ring.next_generation ~entries (last - 1));
+      assert_equal ~printer:string_of_int 0 (Block_ring.next_generation ~entries last);
+      (* the largest id of the last generation doesn't overflow *)
+      assert_bool "ids stay positive" (last * entries + entries - 1 > 0)
+    ) [ 1; 2; 128; 1000; 65536 ]
+
 let tests = [
   "test ENOENT" >:: test_enoent;
+  "test connecting in parallel" >:: test_connect_parallel;
   "test open read" >:: test_open_read;
   (* Doesn't work on travis
      "test opening a block device" >:: test_open_block;
   *)
   "test read/write after last sector" >:: test_eof;
-  "test flush" >:: test_flush;
-  test_parse_print_config { Block.Config.buffered = true; sync = None; path = "C:\\cygwin"; lock = false; prefered_sector_size = None };
-  test_parse_print_config { Block.Config.buffered = false; sync = Some `ToOS; path = "/var/tmp/foo.qcow2"; lock = false; prefered_sector_size = Some 4096 };
-  test_parse_print_config { Block.Config.buffered = false; sync = Some `ToDrive; path = "/var/tmp/foo.qcow2"; lock = true; prefered_sector_size = None };
+  "test flush" >:: test_flush `Fsync;
+  "test flush with fdatasync" >:: test_flush `Fdatasync;
+  "test flush with sync_file_range" >:: test_flush `Sync_file_range;
+  "test concurrent flushes" >:: test_concurrent_flush;
+  "test a ring which refuses a submission" >:: test_ring_refused_submit;
+  "test late completions for reused ring slots" >:: test_ring_stale_completions;
+  "test a full ring" >:: test_ring_full;
+  "test ring request ids wrap" >:: test_ring_id_wrap;
+  test_parse_print_config { (Block.Config.create "C:\\cygwin") with Block.Config.buffered = true; sync = None };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.buffered = false; sync = Some `ToOS; prefered_sector_size = Some 4096 };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.buffered = false; sync = Some `ToDrive; lock = true };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.engine = `Uring };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.buffered = false; engine = `Aio };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.queue_depth = Some 32; merge = false };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.readahead = Some 1048576 };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.cache = Some 4194304; cache_writeback = true };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.flush_method = `Fdatasync };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.extent_map = Some 1048576 };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.mmap = true };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with
+                            Block.Config.engine = `Workers; workers = 2; cpus = [ 0; 1; 2; 3; 8 ]; numa_node = Some 1 };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with
+                            Block.Config.detect_zeroes = `Unmap; dedup_stats = Some 65536 };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with
+                            Block.Config.checksums = Some "/var/tmp/foo sums"; checksum_verify = 10;
+                            checksum_block = Some 65536 };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with Block.Config.preallocate = Some 16777216 };
+  test_parse_print_config { (Block.Config.create "/var/tmp/foo.qcow2") with
+                            Block.Config.iops_read = Some 100; iops_write = Some 50; bps_read = Some 1048576;
+                            bps_write = Some 524288; throttle_burst = 5; throttle_group = Some "tenant 1" };
   "test write then read" >:: test_write_read;
+  "test requests with more than IOV_MAX buffers" >:: test_long_buffer_lists;
+  "test requests of views into larger buffers" >:: test_sub_buffers `Threads;
+  "test requests of views into larger buffers with io_uring" >:: test_sub_buffers `Uring;
+  "test requests of views into larger buffers with per-device workers" >:: test_sub_buffers `Workers;
+  "test concurrent writes then vectored read" >:: test_concurrent_write_read `Threads;
+  "test concurrent writes then vectored read with io_uring" >:: test_concurrent_write_read `Uring;
+  "test concurrent writes then vectored read with Linux AIO" >:: test_concurrent_write_read `Aio;
+  "test concurrent writes then vectored read with per-device workers" >:: test_concurrent_write_read `Workers;
+  "test concurrent writes then vectored read with a queue depth of 1" >:: test_concurrent_write_read ~queue_depth:(Some 1) `Threads;
+  "test concurrent writes then vectored read with a queue depth of 8" >:: test_concurrent_write_read ~queue_depth:(Some 8) `Threads;
+  "test sequential reads with read-ahead hints" >:: test_sequential_readahead true;
+  "test sequential reads with a read-ahead window" >:: test_sequential_readahead false;
+  "test a write-through sector cache" >:: test_cache false;
+  "test a write-back sector cache" >:: test_cache true;
+  "test the extent map" >:: test_extents None;
+  "test the extent map with a cached allocation bitmap" >:: test_extents (Some 4096);
+  "test merging and aligning discards" >:: test_discard_merging;
+  "test a discard followed by a write" >:: test_discard_then_write;
+  "test write_zeroes" >:: test_write_zeroes false;
+  "test write_zeroes with unmap" >:: test_write_zeroes true;
+  "test detecting zeroes in writes" >:: test_detect_zeroes `On;
+  "test unmapping zeroes in writes" >:: test_detect_zeroes `Unmap;
+  "test sector checksums" >:: test_checksums;
+  "test block checksums" >:: test_checksum_blocks;
+  "test checksums of writes in flight" >:: test_checksums_in_flight;
+  "test growing a device online" >:: test_online_resize;
+  "test shrinking a device while writes are in flight" >:: test_shrink_while_writing;
+  "test rate limits shared by a group" >:: test_throttle;
+  "test copying a sparse device" >:: test_copy;
+  "test copying data which hasn't been flushed" >:: test_copy_unflushed;
+  "test splitting buffer lists" >:: test_buffer_lists;
+  "test concatenated devices" >:: test_striped None;
+  "test striped devices" >:: test_striped (Some 4096);
+  "test a striped device which fails to connect" >:: test_striped_cleanup;
+  "test reading a memory-mapped read-only file" >:: test_mmap;
+  "test request statistics" >:: test_stats;
+  "test request tracing" >:: test_trace;
+  "test a write-back cache device" >:: test_tiered;
+  "test a copy-on-write overlay device" >:: test_overlay;
+  "test a compressed image" >:: test_compressed;
+  "test the buffer pool" >:: test_pool `Threads;
+  "test the buffer pool with io_uring fixed buffers" >:: test_pool `Uring;
   "test that writes fail if the buffer has a bad length" >:: test_buffer_wrong_length;
   "files which aren't a whole number of sectors" >:: test_not_multiple_of_sectors;
   "test resize" >:: test_resize;
+  "test per-device worker threads" >:: test_workers;
 ]
 
 let _ =